@@ -0,0 +1,150 @@
+#include "Framebuffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+QuantizeSettings::QuantizeSettings(double _gamma, bool _dither)
+	: gamma(_gamma), dither(_dither)
+{
+	if (gamma == 1.0 || gamma <= 0.0) return;
+	table.resize(GAMMA_TABLE_SIZE + 1);
+	for (int k = 0; k <= GAMMA_TABLE_SIZE; k++)
+		table[k] = (float)pow(double(k) / GAMMA_TABLE_SIZE, 1.0 / gamma);
+}
+
+void Framebuffer::resize(int w, int h, int _rows)
+{
+	width = w;
+	height = h;
+	rows = max(1, _rows > 0 ? min(_rows, h) : h);
+	size_t n = (size_t)w * rows;
+	rgb.reset(new float[n * 3]);
+	weights.reset(new float[n]);
+	counts.reset(new unsigned[n]);
+}
+
+void Framebuffer::clearRows(int y0, int y1)
+{
+	for (int j = y0; j < y1; j++)
+	{
+		size_t first = index(0, j);
+		memset(&rgb[first * 3], 0, width * 3 * sizeof(float));
+		memset(&weights[first], 0, width * sizeof(float));
+		memset(&counts[first], 0, width * sizeof(unsigned));
+	}
+}
+
+void Framebuffer::set(int i, int j, const Vec3d& col, int samples)
+{
+	size_t k = index(i, j);
+	float w = (float)samples;
+	float* p = &rgb[k * 3];
+	p[0] = (float)col[0] * w;
+	p[1] = (float)col[1] * w;
+	p[2] = (float)col[2] * w;
+	weights[k] = w;
+	counts[k] = samples;
+}
+
+void Framebuffer::add(int i, int j, const Vec3d& col, float w)
+{
+	size_t k = index(i, j);
+	float* p = &rgb[k * 3];
+	p[0] += (float)col[0] * w;
+	p[1] += (float)col[1] * w;
+	p[2] += (float)col[2] * w;
+	weights[k] += w;
+	counts[k]++;
+}
+
+Vec3d Framebuffer::get(int i, int j) const
+{
+	size_t k = index(i, j);
+	if (weights[k] <= 0.0f) return Vec3d(0.0, 0.0, 0.0);
+	const float* p = &rgb[k * 3];
+	double inv = 1.0 / weights[k];
+	return Vec3d(p[0] * inv, p[1] * inv, p[2] * inv);
+}
+
+void Framebuffer::getRows(float* out, int y0, int y1) const
+{
+	for (int j = y0; j < y1; j++)
+	{
+		for (size_t k = index(0, j), end = k + width; k < end; k++, out += 3)
+		{
+			float inv = weights[k] > 0.0f ? 1.0f / weights[k] : 0.0f;
+			out[0] = rgb[k * 3] * inv;
+			out[1] = rgb[k * 3 + 1] * inv;
+			out[2] = rgb[k * 3 + 2] * inv;
+		}
+	}
+}
+
+// Thresholds added before truncating to a level: 1/2 rounds, a 4x4 Bayer
+// matrix dithers.
+static const float ditherMatrix[4][4] = {
+	{  0.5f / 16,  8.5f / 16,  2.5f / 16, 10.5f / 16 },
+	{ 12.5f / 16,  4.5f / 16, 14.5f / 16,  6.5f / 16 },
+	{  3.5f / 16, 11.5f / 16,  1.5f / 16,  9.5f / 16 },
+	{ 15.5f / 16,  7.5f / 16, 13.5f / 16,  5.5f / 16 },
+};
+static const float roundRow[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+
+// Each row goes through in separate passes over a scratch row (normalize
+// and clamp, gamma, then convert), so that the passes without a table
+// lookup are plain loops over floats the compiler can vectorize.
+void Framebuffer::quantize(unsigned char* out, int x0, int y0, int x1, int y1,
+	const QuantizeSettings& settings) const
+{
+	int n = x1 - x0;
+	if (n <= 0) return;
+	vector<float> level(n * 3);
+	vector<float> threshold(n * 3);
+
+	for (int j = y0; j < y1; j++)
+	{
+		const float* p = &rgb[index(x0, j) * 3];
+		const float* w = &weights[index(x0, j)];
+		unsigned char* o = out + index(x0, j) * 3;
+
+		for (int i = 0; i < n; i++)
+		{
+			float inv = w[i] > 0.0f ? 1.0f / w[i] : 0.0f;
+			for (int c = 0; c < 3; c++)
+				level[i * 3 + c] = min(max(p[i * 3 + c] * inv, 0.0f), 1.0f);
+		}
+
+		if (settings.encodes())
+			for (int k = 0; k < n * 3; k++)
+				level[k] = settings.encode(level[k]);
+
+		const float* t = settings.dither ? ditherMatrix[j & 3] : roundRow;
+		for (int i = 0; i < n; i++)
+			threshold[i * 3] = threshold[i * 3 + 1] = threshold[i * 3 + 2] = t[(x0 + i) & 3];
+		for (int k = 0; k < n * 3; k++)
+			o[k] = (unsigned char)(level[k] * 255.0f + threshold[k]);
+	}
+}
+
+void Framebuffer::quantize(unsigned char* out, int y0, int y1, const QuantizeSettings& settings,
+	int nThreads) const
+{
+	int n = y1 - y0;
+	nThreads = max(1, min(nThreads, n));
+	vector<thread> threads;
+	for (int t = 1; t < nThreads; t++)
+	{
+		int b0 = y0 + n * t / nThreads;
+		int b1 = y0 + n * (t + 1) / nThreads;
+		threads.push_back(thread([this, out, &settings, b0, b1] {
+			quantize(out, 0, b0, width, b1, settings);
+		}));
+	}
+	quantize(out, 0, y0, width, y0 + n / nThreads, settings);
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
@@ -0,0 +1,97 @@
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+// The image a render works on, in floating point.  Each pixel keeps the
+// weighted sum of its samples' RGB, their total weight and how many there
+// were, so passes can keep adding samples without losing precision.  The
+// 8-bit image that is shown and written out is made from it by a separate
+// quantization step: clamp, gamma encode, then round or dither to 8 bits.
+//
+// For images too big to keep whole, only a window of rows can be
+// resident: row j is stored where row j % rows would be, so a renderer
+// that has written a row out can reuse its memory for a later one.
+
+#include "vecmath/vec.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// How quantize() turns linear colors into 8-bit levels.
+class QuantizeSettings
+{
+public:
+	// Levels are linear^(1/gamma); gamma 1 keeps colors as they are.
+	// Dithering uses a 4x4 ordered pattern instead of rounding, which
+	// hides banding in smooth gradients.
+	explicit QuantizeSettings(double gamma = 1.0, bool dither = false);
+
+	double gamma;
+	bool dither;
+
+	// Gamma encodes v, which is in [0,1].
+	float encode(float v) const
+	{
+		float x = v * GAMMA_TABLE_SIZE;
+		int k = std::min((int)x, GAMMA_TABLE_SIZE - 1);
+		return table[k] + (x - k) * (table[k + 1] - table[k]);
+	}
+	bool encodes() const { return !table.empty(); }
+
+private:
+	// Fine enough that interpolating it is exact to well under one 8-bit
+	// level, even in the steep part of the curve near black.
+	static const int GAMMA_TABLE_SIZE = 1 << 14;
+	std::vector<float> table;	// empty for gamma 1
+};
+
+class Framebuffer
+{
+public:
+	Framebuffer() : width(0), height(0), rows(1) {}
+
+	// Drops the contents.  The pixels are left unwritten until clearRows(),
+	// so with NUMA placement each band's pages land on the node that
+	// clears them.  rows > 0 keeps only that many rows resident.
+	void resize(int w, int h, int rows = 0);
+	void clearRows(int y0, int y1);
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int residentRows() const { return rows; }
+	// Bytes each resident pixel takes.
+	static const int BYTES_PER_PIXEL = 3 * sizeof(float) + sizeof(float) + sizeof(unsigned);
+
+	// Where row j starts, in pixels; quantize()'s output is laid out the
+	// same way.
+	size_t rowStart(int j) const { return index(0, j); }
+
+	// Replaces pixel (i,j) with col, the mean of samples samples.
+	void set(int i, int j, const Vec3d& col, int samples = 1);
+	// Adds one more sample, of weight w, to what pixel (i,j) has.
+	void add(int i, int j, const Vec3d& col, float w = 1.0f);
+	// The weighted mean; black for a pixel with no samples.
+	Vec3d get(int i, int j) const;
+	float weight(int i, int j) const { return weights[index(i, j)]; }
+	unsigned samples(int i, int j) const { return counts[index(i, j)]; }
+	// get() for every pixel of rows y0..y1-1, into out as 3 floats each.
+	void getRows(float* out, int y0, int y1) const;
+
+	// Writes columns x0..x1-1 of rows y0..y1-1 into out, an RGB image
+	// with as many resident rows.
+	void quantize(unsigned char* out, int x0, int y0, int x1, int y1,
+		const QuantizeSettings& settings) const;
+	// Whole rows y0..y1-1, in bands on nThreads threads.
+	void quantize(unsigned char* out, int y0, int y1, const QuantizeSettings& settings,
+		int nThreads) const;
+
+private:
+	size_t index(int i, int j) const { return (size_t)(j % rows) * width + i; }
+
+	int width, height;
+	int rows;						// resident
+	std::unique_ptr<float[]> rgb;		// weighted sums, 3 per pixel
+	std::unique_ptr<float[]> weights;
+	std::unique_ptr<unsigned[]> counts;
+};
+
+#endif // __FRAMEBUFFER_H__
@@ -3,16 +3,25 @@
 #pragma warning (disable: 4786)
 
 #include "RayTracer.h"
+#include "WavefrontRenderer.h"
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
+#include "parser/BinaryScene.h"
+#include "scene/sceneLoader.h"
+#include "SceneObjects/trimesh.h"
+#include "fileio/imagefile.h"
 
 #include "ui/TraceUI.h"
+#include "threading/Numa.h"
+#include "threading/CancelToken.h"
 #include <cmath>
 #include <algorithm>
+#include <thread>
+#include <vector>
 
 extern TraceUI* traceUI;
 
@@ -31,15 +40,72 @@ bool debugMode = false;
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
 
-Vec3d RayTracer::trace(double x, double y)
+Vec3d RayTracer::trace(double x, double y, SampleHit* hit)
 {
   // Clear out the ray cache in the scene for debugging purposes,
   if (TraceUI::m_debug) scene->intersectCache.clear();
   ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
-  scene->getCamera().rayThrough(x,y,r);
-  Vec3d ret = traceRay(r, traceUI->getDepth());
-  ret.clamp();
-  return ret;
+  camera().rayThrough(x,y,r);
+  // Not clamped: the framebuffer keeps what is over 1 for PFM output, and
+  // quantize() clamps the rest.
+  return traceRay(r, traceUI->getDepth(), hit);
+}
+
+void RayTracer::setPixel(int i, int j, const Vec3d& col, int samples)
+{
+	frame.set(i, j, col, samples);
+}
+
+void RayTracer::quantize(int nThreads)
+{
+	quantizeRows(0, buffer_height, nThreads);
+}
+
+void RayTracer::quantizeRows(int y0, int y1, int nThreads)
+{
+	if (!buffer) return;
+	if (quantizeSettings.gamma != traceUI->gamma() || quantizeSettings.dither != traceUI->dither())
+		quantizeSettings = QuantizeSettings(traceUI->gamma(), traceUI->dither());
+	frame.quantize(buffer, y0, y1, quantizeSettings, nThreads);
+}
+
+bool RayTracer::writeImage(const char* name, int nThreads)
+{
+	if (!buffer || frame.residentRows() < buffer_height) return false;
+	ImageWriter out;
+	if (!out.open(name, buffer_width, buffer_height, nThreads)) return false;
+	writeRows(out, 0, buffer_height, nThreads);
+	return out.close();
+}
+
+void RayTracer::writeRows(ImageWriter& out, int y0, int y1, int nThreads)
+{
+	int n = y1 - y0;
+	if (n <= 0) return;
+	if (out.floatRows())
+	{
+		vector<float> rgb((size_t)n * buffer_width * 3);
+		vector<const float*> rows(n);
+		for (int k = 0; k < n; k++)
+		{
+			int j = out.topRowFirst() ? y1 - 1 - k : y0 + k;
+			float* row = &rgb[(size_t)k * buffer_width * 3];
+			frame.getRows(row, j, j + 1);
+			rows[k] = row;
+		}
+		out.writeRows(&rows[0], n);
+	}
+	else
+	{
+		quantizeRows(y0, y1, nThreads);
+		vector<const unsigned char*> rows(n);
+		for (int k = 0; k < n; k++)
+		{
+			int j = out.topRowFirst() ? y1 - 1 - k : y0 + k;
+			rows[k] = buffer + frame.rowStart(j) * 3;
+		}
+		out.writeRows(&rows[0], n);
+	}
 }
 
 Vec3d RayTracer::tracePixel(int i, int j)
@@ -51,16 +117,470 @@ Vec3d RayTracer::tracePixel(int i, int j)
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
-
 	col = trace(x, y);
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+	setPixel(i, j, col);
 	return col;
 }
 
+// Cheap hash-based jitter in [0,1).  Unlike rand() it is thread-safe and
+// gives the same image every time the same pixel is refined.
+static inline double sampleJitter(unsigned int i, unsigned int j, unsigned int s)
+{
+	unsigned int h = (i * 73856093u) ^ (j * 19349663u) ^ (s * 83492791u);
+	h ^= h >> 13;
+	h *= 0x5bd1e995u;
+	h ^= h >> 15;
+	return (h & 0xffffff) / double(0x1000000);
+}
+
+static inline double luminance(const Vec3d& c)
+{
+	return 0.299 * c[0] + 0.587 * c[1] + 0.114 * c[2];
+}
+
+int RayTracer::numTiles() const
+{
+	int tilesX = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (buffer_height + TILE_SIZE - 1) / TILE_SIZE;
+	return tilesX * tilesY;
+}
+
+void RayTracer::tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const
+{
+	int tilesX = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+	x0 = (tile % tilesX) * TILE_SIZE;
+	y0 = (tile / tilesX) * TILE_SIZE;
+	x1 = min(x0 + TILE_SIZE, buffer_width);
+	y1 = min(y0 + TILE_SIZE, buffer_height);
+}
+
+void RayTracer::traceTile(int tile)
+{
+	if( ! sceneLoaded() ) return;
+
+	int x0, y0, x1, y1;
+	tileBounds(tile, x0, y0, x1, y1);
+
+	if (traceUI->antiAliasing())
+	{
+		traceTileAdaptive(x0, y0, x1, y1);
+		return;
+	}
+	if (traceUI->wavefront())
+	{
+		WavefrontRenderer wavefront(this);
+		wavefront.traceTile(x0, y0, x1, y1);
+		return;
+	}
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+			tracePixel(i, j);
+}
+
+// Sorted wavefront rendering sorts the rays of all the tiles together.
+void RayTracer::traceTiles(int first, int last)
+{
+	if( ! sceneLoaded() ) return;
+
+	if (traceUI->wavefront() && traceUI->sortRays() && !traceUI->antiAliasing())
+	{
+		WavefrontRenderer wavefront(this);
+		wavefront.traceTiles(first, last);
+		return;
+	}
+	for (int tile = first; tile < last; tile++)
+		traceTile(tile);
+}
+
+// Claim the next untraced tiles and render them, preferring the band that
+// belongs to the calling thread's NUMA node.  Returns false once every
+// tile of the current image has been handed out.
+bool RayTracer::traceNextTile()
+{
+	bool batched = traceUI->wavefront() && traceUI->sortRays() && !traceUI->antiAliasing();
+	int batch = batched ? WavefrontRenderer::SORT_BATCH : 1;
+	int home = NumaTopology::currentNode() % nBands;
+	for (int k = 0; k < nBands; k++)
+	{
+		int b = (home + k) % nBands;
+		if (bandNext[b] >= bandStart[b + 1]) continue;
+		int tile = bandNext[b].fetch_add(batch);
+		if (tile < bandStart[b + 1])
+		{
+			traceTiles(tile, min(tile + batch, bandStart[b + 1]));
+			return true;
+		}
+	}
+	return false;
+}
+
+void RayTracer::resetTiles()
+{
+	for (int b = 0; b < nBands; b++)
+		bandNext[b] = bandStart[b];
+}
+
+// Split the image into n bands of whole tile rows.
+void RayTracer::placeBands(int n)
+{
+	int tilesX = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (buffer_height + TILE_SIZE - 1) / TILE_SIZE;
+	nBands = max(1, min(n, min(tilesY, (int)MAX_BANDS)));
+	for (int b = 0; b <= nBands; b++)
+		bandStart[b] = (tilesY * b / nBands) * tilesX;
+}
+
+void RayTracer::firstTouchBand(int band)
+{
+	int tilesX = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+	int y0 = (bandStart[band] / tilesX) * TILE_SIZE;
+	int y1 = min(buffer_height, (bandStart[band + 1] / tilesX) * TILE_SIZE);
+	if (y1 > y0)
+	{
+		memset(buffer + y0 * buffer_width * 3, 0, (y1 - y0) * buffer_width * 3);
+		frame.clearRows(y0, y1);
+	}
+}
+
+bool RayTracer::bindRenderThread(int index, int nThreads)
+{
+	if (!traceUI->numaPlacement()) return false;
+	std::vector<ThreadPlacement> placement = NumaTopology::get().place(nThreads);
+	if (index < 0 || index >= (int)placement.size()) return false;
+	return NumaTopology::bind(placement[index]);
+}
+
+// Whether pixel (i,j) of a w x h block of first samples should be refined:
+// the luminance of its 3x3 neighbourhood varies by more than the
+// supersample threshold, or a neighbour saw a different object or a
+// noticeably different normal.
+bool RayTracer::needsRefinement(const Vec3d* col, const SampleHit* hits, int stride,
+	int i, int j, int w, int h) const
+{
+	const double normalCosThreshold = 0.95;
+	double threshold = traceUI->m_nSupersampleThreshold / 255.0;
+
+	const SampleHit& hit = hits[j * stride + i];
+	double sum = 0.0, sumSq = 0.0;
+	int count = 0;
+	for (int nj = max(j - 1, 0); nj <= min(j + 1, h - 1); nj++)
+	{
+		for (int ni = max(i - 1, 0); ni <= min(i + 1, w - 1); ni++)
+		{
+			Vec3d c = col[nj * stride + ni];
+			c.clamp();
+			double l = luminance(c);
+			sum += l;
+			sumSq += l * l;
+			count++;
+			const SampleHit& nh = hits[nj * stride + ni];
+			if (nh.obj != hit.obj || (hit.obj && nh.N * hit.N < normalCosThreshold))
+				return true;
+		}
+	}
+	double mean = sum / count;
+	double variance = sumSq / count - mean * mean;
+	return variance > threshold * threshold;
+}
+
+// Adds the remaining cells of an n x n jittered grid over pixel (px,py)
+// to the framebuffer; the corner sample already there fills the first.
+void RayTracer::refinePixel(int px, int py, int n)
+{
+	double x = double(px)/double(buffer_width);
+	double y = double(py)/double(buffer_height);
+	double deltaX = (1.0/double(buffer_width))/n;
+	double deltaY = (1.0/double(buffer_height))/n;
+	for (int sy = 0; sy < n; sy++)
+	{
+		for (int sx = 0; sx < n; sx++)
+		{
+			if (sx == 0 && sy == 0) continue;
+			int s = sy * n + sx;
+			double xTemp = x + (sx + sampleJitter(px, py, 2 * s)) * deltaX;
+			double yTemp = y + (sy + sampleJitter(px, py, 2 * s + 1)) * deltaY;
+			frame.add(px, py, trace(xTemp, yTemp));
+		}
+	}
+}
+
+// Allocated only for adaptive anti-aliasing.  A streamed image keeps two
+// more rows of tiles' seams than it has resident, so no slot is taken
+// over while a tile beside its previous row can still be reading it.
+void RayTracer::resetEdges()
+{
+	if (!traceUI->antiAliasing())
+	{
+		edgeRows.reset();
+		edgeColumns.reset();
+		return;
+	}
+	int rows = frame.residentRows();
+	int tilesX = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (buffer_height + TILE_SIZE - 1) / TILE_SIZE;
+	int slots = min(tilesY, (rows + TILE_SIZE - 1) / TILE_SIZE + 2);
+	if (!edgeRows || slots != edgeRowSlots || buffer_width != edgeRowsWidth || rows != edgeColumnsHeight)
+	{
+		edgeRowSlots = slots;
+		edgeRowsWidth = buffer_width;
+		edgeColumnsHeight = rows;
+		edgeRows.reset(new EdgeSample[(size_t)slots * 2 * buffer_width]);
+		edgeColumns.reset(new EdgeSample[(size_t)tilesX * 2 * rows]);
+	}
+	for (size_t k = 0, n = (size_t)slots * 2 * buffer_width; k < n; k++)
+		edgeRows[k].tag.store(0, std::memory_order_relaxed);
+	for (size_t k = 0, n = (size_t)tilesX * 2 * rows; k < n; k++)
+		edgeColumns[k].tag.store(0, std::memory_order_relaxed);
+}
+
+// The seam slot for pixel (i,j), or 0 if no other tile ever needs it.
+// Rows along seams take the corners; tag tells the slot's users apart.
+RayTracer::EdgeSample* RayTracer::edgeSlot(int i, int j, int& tag)
+{
+	if (!edgeRows) return 0;
+	const int T = TILE_SIZE;
+	int rx = i % T, ry = j % T;
+	if (ry == 0 || ry == T - 1)
+	{
+		int ty = j / T;
+		tag = ty + 1;
+		return &edgeRows[((size_t)(ty % edgeRowSlots) * 2 + (ry != 0)) * edgeRowsWidth + i];
+	}
+	if (rx == 0 || rx == T - 1)
+	{
+		tag = j + 1;
+		return &edgeColumns[((size_t)(i / T) * 2 + (rx != 0)) * edgeColumnsHeight + j % edgeColumnsHeight];
+	}
+	return 0;
+}
+
+// Pixel (i,j)'s first sample, taken from the seam slot when the tile on
+// the other side has already traced it.  Every sample goes through the
+// slot's floats, so both tiles see the same values whichever traced it.
+Vec3d RayTracer::firstSample(int i, int j, SampleHit& hit)
+{
+	int tag = 0;
+	EdgeSample* e = edgeSlot(i, j, tag);
+	float col[3], N[3];
+	if (e && e->tag.load(std::memory_order_acquire) == tag)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			col[c] = e->col[c];
+			N[c] = e->N[c];
+		}
+		hit.obj = e->obj;
+	}
+	else
+	{
+		Vec3d traced = trace(double(i)/double(buffer_width), double(j)/double(buffer_height), &hit);
+		for (int c = 0; c < 3; c++)
+		{
+			col[c] = (float)traced[c];
+			N[c] = (float)hit.N[c];
+		}
+		// Whoever claims the slot first fills it; anyone else keeps theirs.
+		int old = e ? e->tag.load(std::memory_order_relaxed) : -1;
+		if (old >= 0 && old != tag && e->tag.compare_exchange_strong(old, -tag))
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				e->col[c] = col[c];
+				e->N[c] = N[c];
+			}
+			e->obj = hit.obj;
+			e->tag.store(tag, std::memory_order_release);
+		}
+	}
+	hit.N = Vec3d(N[0], N[1], N[2]);
+	return Vec3d(col[0], col[1], col[2]);
+}
+
+// Adaptive supersampling, done in the same pass as the image itself.
+// Every pixel first gets one sample at its corner (what tracePixel would
+// trace), then flagged pixels are refined.  The first samples include a
+// one-pixel apron around the tile, so pixels on its edges see the same
+// neighbours planRefinement gives them and edges along tile seams are
+// caught; the apron comes from the seam slots, so a first sample is
+// traced once whichever of the two tiles gets to it first.
+void RayTracer::traceTileAdaptive(int x0, int y0, int x1, int y1)
+{
+	int ax0 = max(x0 - 1, 0), ay0 = max(y0 - 1, 0);
+	int ax1 = min(x1 + 1, buffer_width), ay1 = min(y1 + 1, buffer_height);
+	int aw = ax1 - ax0;
+	int ah = ay1 - ay0;
+
+	const int APRON_SIZE = TILE_SIZE + 2;
+	Vec3d col[APRON_SIZE * APRON_SIZE];
+	SampleHit hits[APRON_SIZE * APRON_SIZE];
+	for (int j = 0; j < ah; j++)
+	{
+		for (int i = 0; i < aw; i++)
+			col[j * aw + i] = firstSample(ax0 + i, ay0 + j, hits[j * aw + i]);
+	}
+
+	int n = traceUI->m_nPixelSamples;
+	for (int j = y0 - ay0; j < y1 - ay0; j++)
+	{
+		for (int i = x0 - ax0; i < x1 - ax0; i++)
+		{
+			bool refine = needsRefinement(col, hits, aw, i, j, aw, ah);
+			if (refine && traceUI->antiAliasingWhite())
+			{
+				setPixel(ax0 + i, ay0 + j, Vec3d(1.0, 1.0, 1.0));
+				continue;
+			}
+			setPixel(ax0 + i, ay0 + j, col[j * aw + i]);
+			if (refine && n > 1)
+				refinePixel(ax0 + i, ay0 + j, n);
+		}
+	}
+}
+
+void RayTracer::beginBudgetedRender(CancelToken* token)
+{
+	budgetToken = token;
+	budgetNext = 0;
+	budgetRefined = 0;
+	for (int p = 0; p < NUM_PASSES; p++)
+	{
+		budgetFinished[p] = 0;
+		budgetReady[p] = false;
+	}
+	firstColor.assign(buffer_width * buffer_height, Vec3d(0.0, 0.0, 0.0));
+	firstHit.assign(buffer_width * buffer_height, SampleHit());
+	refineFlag.assign(buffer_width * buffer_height, 0);
+	refineOrder.clear();
+}
+
+// One sample per 4x4 block, copied over the whole block.
+void RayTracer::previewTile(int tile)
+{
+	const int step = 4;
+	int x0, y0, x1, y1;
+	tileBounds(tile, x0, y0, x1, y1);
+	for (int j = y0; j < y1; j += step)
+	{
+		if (budgetToken->cancelled()) return;
+		for (int i = x0; i < x1; i += step)
+		{
+			Vec3d c = trace(double(i)/double(buffer_width), double(j)/double(buffer_height));
+			for (int bj = j; bj < min(j + step, y1); bj++)
+				for (int bi = i; bi < min(i + step, x1); bi++)
+					setPixel(bi, bj, c);
+		}
+	}
+}
+
+// The same first sample traceTileAdaptive takes, kept for refinement.
+void RayTracer::sampleTile(int tile)
+{
+	int x0, y0, x1, y1;
+	tileBounds(tile, x0, y0, x1, y1);
+	for (int j = y0; j < y1; j++)
+	{
+		if (budgetToken->cancelled()) return;
+		for (int i = x0; i < x1; i++)
+		{
+			int k = j * buffer_width + i;
+			firstColor[k] = trace(double(i)/double(buffer_width), double(j)/double(buffer_height), &firstHit[k]);
+			setPixel(i, j, firstColor[k]);
+		}
+	}
+}
+
+// Runs once, on whichever thread finishes the last sample tile.
+void RayTracer::planRefinement()
+{
+	int tiles = numTiles();
+	std::vector<std::pair<int, int> > counts(tiles);
+	for (int t = 0; t < tiles; t++)
+	{
+		int x0, y0, x1, y1;
+		tileBounds(t, x0, y0, x1, y1);
+		int flagged = 0;
+		for (int j = y0; j < y1; j++)
+			for (int i = x0; i < x1; i++)
+			{
+				bool refine = needsRefinement(&firstColor[0], &firstHit[0], buffer_width,
+					i, j, buffer_width, buffer_height);
+				refineFlag[j * buffer_width + i] = refine;
+				flagged += refine;
+			}
+		counts[t] = std::make_pair(-flagged, t);
+	}
+	std::sort(counts.begin(), counts.end());
+	refineOrder.clear();
+	for (int t = 0; t < tiles && counts[t].first < 0; t++)
+		refineOrder.push_back(counts[t].second);
+}
+
+void RayTracer::refineTile(int tile)
+{
+	int n = max(2, traceUI->m_nPixelSamples);
+	int x0, y0, x1, y1;
+	tileBounds(tile, x0, y0, x1, y1);
+	for (int j = y0; j < y1; j++)
+		for (int i = x0; i < x1; i++)
+		{
+			int k = j * buffer_width + i;
+			if (!refineFlag[k]) continue;
+			if (budgetToken->cancelled()) return;
+			refinePixel(i, j, n);
+		}
+	budgetRefined++;
+}
+
+bool RayTracer::traceNextBudgetedTile()
+{
+	if( ! sceneLoaded() ) return false;
+
+	int tiles = numTiles();
+	int k = budgetNext++;
+	if (k >= NUM_PASSES * tiles) return false;
+	int pass = k / tiles;
+	int item = k % tiles;
+
+	// Every pass builds on the whole of the one before it.
+	while (pass > 0 && !budgetReady[pass - 1])
+	{
+		if (budgetToken->cancelled()) return false;
+		std::this_thread::yield();
+	}
+	if (budgetToken->cancelled()) return false;
+
+	switch (pass)
+	{
+	case PASS_PREVIEW:
+		previewTile(item);
+		break;
+	case PASS_SAMPLE:
+		sampleTile(item);
+		break;
+	case PASS_REFINE:
+		if (item < (int)refineOrder.size())
+			refineTile(refineOrder[item]);
+		break;
+	}
+
+	if (budgetToken->cancelled()) return false;
+	if (++budgetFinished[pass] == tiles)
+	{
+		if (pass == PASS_SAMPLE) planRefinement();
+		budgetReady[pass] = true;
+	}
+	return true;
+}
+
+int RayTracer::budgetPassesDone() const
+{
+	int p = 0;
+	while (p < NUM_PASSES && budgetReady[p])
+		p++;
+	return p;
+}
+
 Vec3d RayTracer::tracePixelAntiAlias(int i, int j)
 {
 	Vec3d col(0,0,0);
@@ -71,13 +591,9 @@ Vec3d RayTracer::tracePixelAntiAlias(int i, int j)
 	double x = double(i)/double(buffer_width);
 	double y = double(j)/double(buffer_height);
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
-
 	if (traceUI->antiAliasingWhite())
 	{
-		pixel[0] = (int)( 255.0 * 1);
-		pixel[1] = (int)( 255.0 * 1);
-		pixel[2] = (int)( 255.0 * 1);
+		setPixel(i, j, Vec3d(1.0, 1.0, 1.0));
 		return col;
 	}
 
@@ -96,9 +612,7 @@ Vec3d RayTracer::tracePixelAntiAlias(int i, int j)
 	}
 
 	col = col/double(traceUI->m_nPixelSamples*traceUI->m_nPixelSamples);
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+	setPixel(i, j, col, traceUI->m_nPixelSamples*traceUI->m_nPixelSamples);
 	return col;
 }
 
@@ -110,6 +624,12 @@ void RayTracer::setUseKdTree(bool kdTree)
     }
 }
 
+void RayTracer::installKdTrees(KdTreeSet& trees)
+{
+	if (scene != nullptr)
+		scene->installKdTrees(trees);
+}
+
 void RayTracer::setBackFaceCulling(bool _backFace)
 {
     if (this->scene != nullptr)
@@ -127,15 +647,82 @@ void RayTracer::setSmoothShading(bool _smoothShade)
 }
 
 
+// Mirror direction of r about the normal at i.
+ray RayTracer::reflectRay(const ray& r, const isect& i)
+{
+	Vec3d Qpoint = r.at(i.t);
+	Vec3d minusD = -1 * r.d;
+	Vec3d cosVector = i.N * (minusD * i.N);
+	Vec3d sinVector = cosVector + r.d;
+	Vec3d reflectedDirection = cosVector + sinVector;
+	reflectedDirection.normalize();
+	return ray(Qpoint, reflectedDirection, ray::REFLECTION);
+}
+
+// Refracted continuation of r through the surface at i; false if there is
+// none.
+bool RayTracer::refractRay(const ray& r, const isect& i, const Material& material, ray& out)
+{
+	Vec3d Qpoint = r.at(i.t);
+	Vec3d minusD = -1 * r.d;
+	Vec3d cosVector = i.N * (minusD * i.N);
+	Vec3d sinVector = cosVector + r.d;
+	double cosineAngle = acos(i.N * r.d) * 180/M_PI;
+	double n_i, n_r;
+	double criticalAngle = 360;
+	int iDirection;
+	// bool goingIn = true;
+	// double cosThetaI = 0;
+	if (cosineAngle > 90) // Coming into an object from air
+	{
+		n_i = 1;
+		n_r = material.index(i);
+		iDirection = 1;
+		// cosThetaI = i.N * -1 * r.d;
+	}
+	else // Going out from object to air
+	{
+		n_i = material.index(i);
+		n_r = 1;
+		// goingIn = false;
+		// cosThetaI = i.N * r.d;
+		iDirection = -1;
+	}
+	Vec3d sinT = (n_i/n_r) * sinVector;
+	Vec3d cosT = (-1 * i.N) * sqrt(1 - sinT*sinT);
+	if (cosineAngle < criticalAngle)
+	{
+		Vec3d refractedDirection = cosT + iDirection*sinT;
+		refractedDirection.normalize();
+		out = ray(Qpoint, iDirection * refractedDirection, ray::REFRACTION);
+		return true;
+	}
+	// double sqrtTerm = 1 - (n*n)*(1 - cosThetaI*cosThetaI);
+	// if (sqrtTerm > 0)
+	// {
+	// 	double cosThetaT = sqrt(sqrtTerm);
+	// 	Vec3d refractedDirection = (n*cosThetaI - cosThetaT)*i.N - n*-1*r.d;
+	// 	refractedDirection.normalize();
+	// 	out = ray(Qpoint, refractedDirection, ray::REFRACTION);
+	// 	return true;
+	// }
+	return false;
+}
+
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
-Vec3d RayTracer::traceRay(ray& r, int depth)
+Vec3d RayTracer::traceRay(ray& r, int depth, SampleHit* hit)
 {
 	isect i;
 	Vec3d colorC;
 	//scene->useKdTree = traceUI->m_kdTree;
 	// cout<<scene->useKdTree<<endl;
 	if(scene->intersect(r, i)) {
+		if (hit)
+		{
+			hit->obj = i.obj;
+			hit->N = i.N;
+		}
 		// YOUR CODE HERE
 
 		// An intersection occurred!  We've got work to do.  For now,
@@ -148,66 +735,23 @@ Vec3d RayTracer::traceRay(ray& r, int depth)
 		// rays.
 		const Material& material = i.getMaterial();
 		// Light Ray
-		Vec3d intensity = material.shade(scene, r, i);
+		Vec3d intensity = material.shade(scene, r, i, camera().getEye());
 		if (depth == 0)
 		{
 			return intensity;
 		}
-		Vec3d Qpoint = r.at(i.t);
-		Vec3d minusD = -1 * r.d;
-		Vec3d cosVector = i.N * (minusD * i.N);
-		Vec3d sinVector = cosVector + r.d;
 		// Reflected Ray
 		if (!material.kr(i).iszero())
 		{
-			Vec3d reflectedDirection = cosVector + sinVector;
-			reflectedDirection.normalize();
-			ray reflectedRay(Qpoint, reflectedDirection, ray::REFLECTION);
+			ray reflectedRay = reflectRay(r, i);
 			intensity = intensity + prod(material.kr(i), traceRay(reflectedRay, depth - 1));
 		}
 		//Refracted Ray
 		if (!material.kt(i).iszero())
 		{
-			double cosineAngle = acos(i.N * r.d) * 180/M_PI;
-			double n_i, n_r;
-			double criticalAngle = 360;
-			int iDirection;
-			// bool goingIn = true;
-			// double cosThetaI = 0;
-			if (cosineAngle > 90) // Coming into an object from air
-			{
-				n_i = 1;
-				n_r = material.index(i);
-				iDirection = 1;
-				// cosThetaI = i.N * -1 * r.d;
-			}
-			else // Going out from object to air
-			{
-				n_i = material.index(i);
-				n_r = 1;
-				// goingIn = false;
-				// cosThetaI = i.N * r.d;
-				iDirection = -1;
-			}
-			double n = n_i/n_r;
-			Vec3d sinT = (n_i/n_r) * sinVector;
-			Vec3d cosT = (-1 * i.N) * sqrt(1 - sinT*sinT);
-			if (cosineAngle < criticalAngle)
-			{
-				Vec3d refractedDirection = cosT + iDirection*sinT;
-				refractedDirection.normalize();
-				ray refractedRay(Qpoint, iDirection * refractedDirection, ray::REFRACTION);
+			ray refractedRay(r);
+			if (refractRay(r, i, material, refractedRay))
 				intensity = intensity + prod(material.kt(i), traceRay(refractedRay, depth -1));
-			}
-			// double sqrtTerm = 1 - (n*n)*(1 - cosThetaI*cosThetaI);
-			// if (sqrtTerm > 0)
-			// {
-			// 	double cosThetaT = sqrt(sqrtTerm);
-			// 	Vec3d refractedDirection = (n*cosThetaI - cosThetaT)*i.N - n*-1*r.d;
-			// 	refractedDirection.normalize();
-			// 	ray refractedRay(Qpoint, refractedDirection, ray::REFRACTION);
-			// 	intensity = intensity + prod(material.kt(i), traceRay(refractedRay, depth -1));
-			// }
 		}
 	  	colorC = intensity;
 	} else {
@@ -226,12 +770,17 @@ Vec3d RayTracer::traceRay(ray& r, int depth)
 }
 
 RayTracer::RayTracer()
-	: scene(0), buffer(0), buffer_width(256), buffer_height(256), m_bBufferReady(false)
-{}
+	: scene(0), ownsScene(false), viewCamera(0), buffer(0), buffer_width(256), buffer_height(256), m_bBufferReady(false),
+	  cubemap(0), nBands(1), budgetToken(0), edgeRowSlots(0), edgeRowsWidth(0),
+	  edgeColumnsHeight(0)
+{
+	bandStart[0] = bandStart[1] = 0;
+	bandNext[0] = 0;
+}
 
 RayTracer::~RayTracer()
 {
-	delete scene;
+	if (ownsScene) delete scene;
 	delete [] buffer;
 }
 
@@ -260,77 +809,177 @@ void RayTracer::setBuffer ()
 	// }
 }
 
+Camera& RayTracer::camera() const
+{
+	return viewCamera ? *viewCamera : scene->getCamera();
+}
+
 double RayTracer::aspectRatio()
 {
-	return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
+	return sceneLoaded() ? camera().getAspectRatio() : 1;
 }
 
 bool RayTracer::loadScene( char* fn ) {
-	ifstream ifs( fn );
-	if( !ifs ) {
+	Scene* loaded = parseScene( fn );
+	if( !loaded ) return false;
+	adoptScene( loaded );
+	return true;
+}
+
+void RayTracer::adoptScene( Scene* s ) {
+	if( ownsScene && s != scene ) delete scene;
+	scene = s;
+	ownsScene = true;
+}
+
+void RayTracer::useScene( Scene* s ) {
+	if( ownsScene && s != scene ) delete scene;
+	scene = s;
+	ownsScene = false;
+}
+
+// The directory fn is in, which file names in the scene are relative to.
+static string scenePath( const char* fn )
+{
+	string path( fn );
+	if( path.find_last_of( "\\/" ) == string::npos ) return ".";
+	return path.substr(0, path.find_last_of( "\\/" ));
+}
+
+Scene* RayTracer::readScene( const char* fn, TextureCache* textures, SceneLoader* loader ) {
+	if( !ifstream( fn ) ) {
 		string msg( "Error: couldn't read scene file " );
 		msg.append( fn );
 		traceUI->alert( msg );
-		return false;
+		return 0;
 	}
 	
 	// Strip off filename, leaving only the path:
-	string path( fn );
-	if( path.find_last_of( "\\/" ) == string::npos ) path = ".";
-	else path = path.substr(0, path.find_last_of( "\\/" ));
+	string path = scenePath( fn );
+
+	TileCache::instance().setBudget( (size_t)traceUI->textureBudget() << 20 );
+
+	// Compiled scenes are recognized by their first bytes, whatever the
+	// file is called.
+	bool binary = BinaryScene::isBinary( fn );
 
-	// Call this with 'true' for debug output from the tokenizer
-	Tokenizer tokenizer( ifs, false );
-    Parser parser( tokenizer, path );
 	try {
-		delete scene;
-		scene = 0;
-		scene = parser.parseScene();
+		if( binary )
+			return BinaryScene::read( fn, path, textures, loader );
+		// Call this with 'true' for debug output from the tokenizer
+		Tokenizer tokenizer( string( fn ), false );
+		Parser parser( tokenizer, path, textures, loader );
+		return parser.parseScene();
 	} 
 	catch( SyntaxErrorException& pe ) {
 		traceUI->alert( pe.formattedMessage() );
-		return false;
 	}
 	catch( ParserException& pe ) {
 		string msg( "Parser: fatal exception " );
 		msg.append( pe.message() );
 		traceUI->alert( msg );
-		return false;
 	}
 	catch( TextureMapException e ) {
 		string msg( "Texture mapping exception: " );
 		msg.append( e.message() );
 		traceUI->alert( msg );
-		return false;
 	}
-	if (traceUI->m_kdTree)
-	{
-		string temp( fn );
-		size_t found = temp.find("turtle.ray");
-  		if (found==std::string::npos)
-  		{
-  			scene->buildKdTree(traceUI->getKdMaxDepth(), traceUI->getKdLeafSize());
-			scene->useKdTree = traceUI->m_kdTree;
-  		}
+	return 0;
+}
+
+bool RayTracer::compileScene( const char* fn, const char* out ) {
+	Scene* parsed = readScene( fn );
+	if( !parsed ) return false;
+	bool written = true;
+	try {
+		BinaryScene::write( *parsed, scenePath( fn ), out );
+	}
+	catch( ParserException& pe ) {
+		traceUI->alert( pe.message() );
+		written = false;
 	}
-	this->setBackFaceCulling(traceUI->bfCulling());
-	this->setSmoothShading(traceUI->smShadSw());
-	if( !sceneLoaded() ) return false;
+	delete parsed;
+	return written;
+}
 
-	return true;
+Scene* RayTracer::parseScene( const char* fn, TextureCache* textures, LoadProgress* progress ) {
+	string temp( fn );
+	bool kdTree = traceUI->m_kdTree && temp.find("turtle.ray") == std::string::npos;
+
+	// Textures decode, and meshes are compacted and get their trees, on
+	// the loader's threads while the file is still being read.
+	SceneLoader loader( traceUI->getThreads(), traceUI->meshPrecision(), kdTree,
+		traceUI->getKdMaxDepth(), traceUI->getKdLeafSize(), progress );
+	Scene* parsed = readScene( fn, textures, &loader );
+	if( !parsed ) return 0;
+
+	try {
+		loader.finish( parsed );
+	}
+	catch( TextureMapException e ) {
+		string msg( "Texture mapping exception: " );
+		msg.append( e.message() );
+		traceUI->alert( msg );
+		delete parsed;
+		return 0;
+	}
+	if (kdTree)
+		parsed->useKdTree = traceUI->m_kdTree;
+	parsed->backFaceCulling = traceUI->bfCulling();
+	parsed->smoothShading = traceUI->smShadSw();
+	return parsed;
 }
 
-void RayTracer::traceSetup(int w, int h)
+void RayTracer::traceSetup(int w, int h, int rows)
 {
-	if (buffer_width != w || buffer_height != h)
+	rows = max(1, rows > 0 ? min(rows, h) : h);
+	// NUMA bands are placed over the whole image.
+	bool numa = traceUI->numaPlacement() && rows == h;
+	// With NUMA placement the buffer is always reallocated, so that its
+	// pages are fresh and land wherever they are first touched.
+	if (buffer_width != w || buffer_height != h || frame.residentRows() != rows || numa)
 	{
 		buffer_width = w;
 		buffer_height = h;
-		bufferSize = buffer_width * buffer_height * 3;
+		bufferSize = (size_t)buffer_width * rows * 3;
 		delete[] buffer;
 		buffer = new unsigned char[bufferSize];
+		frame.resize(w, h, rows);
+	}
+
+	// Rebuilds the prefiltered faces only if the filter width changed.
+	if (cubemap && traceUI->m_usingCubeMap)
+		cubemap->setFilterWidth(traceUI->getFilterWidth(), traceUI->getThreads());
+
+	if (numa)
+	{
+		const NumaTopology& topology = NumaTopology::get();
+		placeBands(topology.nodeCount());
+		bool replicate = scene && scene->kdtreeRoot && nBands > 1;
+		if (replicate) scene->prepareKdReplicas(nBands);
+
+		// One thread per node clears that node's rows and copies the
+		// kd-trees, so both are allocated in the node's own memory.
+		std::vector<std::thread> touch;
+		for (int b = 0; b < nBands; b++)
+		{
+			touch.push_back(std::thread([this, b, replicate]() {
+				NumaTopology::bind(ThreadPlacement(b, -1));
+				firstTouchBand(b);
+				if (replicate) scene->replicateKdTree(b);
+			}));
+		}
+		for (size_t b = 0; b < touch.size(); b++)
+			touch[b].join();
+	}
+	else
+	{
+		placeBands(1);
+		memset(buffer, 0, bufferSize);
+		frame.clearRows(0, rows);
 	}
-	memset(buffer, 0, w*h*3);
+	resetEdges();
+	resetTiles();
 	m_bBufferReady = true;
 }
 
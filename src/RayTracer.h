@@ -5,10 +5,32 @@
 
 #include "scene/ray.h"
 #include "scene/cubeMap.h"
+#include "Framebuffer.h"
 #include <time.h>
 #include <queue>
+#include <atomic>
+#include <vector>
 
 class Scene;
+class SceneObject;
+class CancelToken;
+class TextureCache;
+class SceneLoader;
+struct LoadProgress;
+struct KdTreeSet;
+class ImageWriter;
+class Camera;
+
+// What a camera sample hit first.  The adaptive sampler compares these
+// between neighbouring pixels to find silhouettes and creases that a
+// color comparison alone would miss.
+struct SampleHit
+{
+	const SceneObject* obj;
+	Vec3d N;
+
+	SampleHit() : obj(0) {}
+};
 
 class RayTracer
 {
@@ -18,27 +40,128 @@ public:
 
 	Vec3d tracePixel(int i, int j);
     Vec3d tracePixelAntiAlias(int i, int j);
-	Vec3d trace(double x, double y);
-	Vec3d traceRay(ray& r, int depth);
+	Vec3d trace(double x, double y, SampleHit* hit = 0);
+	Vec3d traceRay(ray& r, int depth, SampleHit* hit = 0);
+
+	// Secondary rays spawned at a hit; shared by traceRay and the
+	// wavefront renderer.
+	static ray reflectRay(const ray& r, const isect& i);
+	static bool refractRay(const ray& r, const isect& i, const Material& m, ray& out);
+	// Pixels go into the float framebuffer; quantize() then makes the
+	// 8-bit image getBuffer() returns, with the UI's gamma and dithering.
+	void setPixel(int i, int j, const Vec3d& col, int samples = 1);
+	void quantize(int nThreads);
+	// Writes the image to name as PNG, PFM or BMP, by its extension.  PFM
+	// gets the framebuffer's float colors; the others are quantized first.
+	bool writeImage(const char* name, int nThreads);
+	// Rows y0..y1-1, which must be resident, in the order out takes them.
+	void writeRows(ImageWriter& out, int y0, int y1, int nThreads);
+
+	// Tiled rendering.  The image is cut into TILE_SIZE x TILE_SIZE tiles
+	// that render threads claim one at a time until none are left (sorted
+	// wavefront rendering claims a batch at a time).
+	static const int TILE_SIZE = 16;
+	int numTiles() const;
+	void tileBounds(int tile, int& x0, int& y0, int& x1, int& y1) const;
+	void traceTile(int tile);
+	void traceTiles(int first, int last);
+	bool traceNextTile();
+	void resetTiles();
+
+	// NUMA placement (TraceUI::numaPlacement()).  Each node gets a band of
+	// tile rows whose framebuffer memory it touches first and which its
+	// threads render before helping other bands, plus its own copy of the
+	// kd-trees.  Render threads call bindRenderThread() before their first
+	// tile; it does nothing when placement is off.
+	static const int MAX_BANDS = 8;
+	bool bindRenderThread(int index, int nThreads);
+
+	// Time-budgeted rendering.  Work is done in passes, each over the
+	// whole image: a 1-in-16 preview, one sample per pixel, then adaptive
+	// refinement of the tiles with the most flagged pixels first.  Each
+	// pass starts once the previous one is complete, so the buffer always
+	// holds a whole image.  After beginBudgetedRender() (and traceSetup()),
+	// render threads call traceNextBudgetedTile() until it returns false,
+	// which happens when the work is done or the token is cancelled.
+	enum BudgetPass { PASS_PREVIEW, PASS_SAMPLE, PASS_REFINE, NUM_PASSES };
+	void beginBudgetedRender(CancelToken* token);
+	bool traceNextBudgetedTile();
+	int budgetPassesDone() const;
+	int budgetTilesRefined() const { return budgetRefined; }
 
 	void getBuffer(unsigned char *&buf, int &w, int &h);
     void setBuffer();
 	double aspectRatio();
 
-	void traceSetup( int w, int h );
+	// rows > 0 keeps only that many rows of the image resident, for
+	// rendering it a window at a time, as StreamRenderer does.
+	void traceSetup( int w, int h, int rows = 0 );
 
 	bool loadScene(char* fn);
+	// Parses (and builds the kd-tree for) a scene without touching the
+	// current one; the caller owns the result.  useScene() renders a
+	// scene someone else owns, such as a batch job's scene cache, and
+	// adoptScene() one parsed earlier, which the tracer then owns.
+	// progress, if given, follows the parse from another thread.
+	Scene* parseScene(const char* fn, TextureCache* textures = 0, LoadProgress* progress = 0);
+	// Reads fn, a .ray file or one compiled by compileScene(), and writes
+	// it to out as a binary scene.  Alerts and returns false on errors.
+	bool compileScene(const char* fn, const char* out);
+	void useScene(Scene* s);
+	void adoptScene(Scene* s);
+
+	// The camera frames are rendered from.  It is the scene's own unless
+	// setCamera() overrides it, which lets several tracers render
+	// different views of one scene at the same time.
+	void setCamera(Camera* c) { viewCamera = c; }
+	Camera& camera() const;
 	bool sceneLoaded() { return scene != 0; }
 
 	void setReady(bool ready) { m_bBufferReady = ready; }
 	bool isReady() const { return m_bBufferReady; }
 
     void setUseKdTree(bool kdTree);
+	// Swaps in trees from Scene::buildKdTrees(); nothing may be tracing.
+	void installKdTrees(KdTreeSet& trees);
     void setBackFaceCulling(bool _backFace);
     void setSmoothShading(bool _smoothShade);
 
 	const Scene& getScene() { return *scene; }
 
+private:
+	// parseScene() without the kd-tree and compaction, unless a loader
+	// is given to do them.
+	Scene* readScene(const char* fn, TextureCache* textures = 0, SceneLoader* loader = 0);
+	void quantizeRows(int y0, int y1, int nThreads);
+
+	void traceTileAdaptive(int x0, int y0, int x1, int y1);
+	Vec3d firstSample(int i, int j, SampleHit& hit);
+	bool needsRefinement(const Vec3d* col, const SampleHit* hits, int stride,
+		int i, int j, int w, int h) const;
+	void refinePixel(int px, int py, int n);
+	void previewTile(int tile);
+	void sampleTile(int tile);
+	void refineTile(int tile);
+	void planRefinement();
+	void placeBands(int n);
+	void firstTouchBand(int band);
+
+	// First samples of the rows and columns along tile seams, kept so that
+	// the tile on the other side of a seam can see them without tracing
+	// them again.  Each slot notes which pixel it holds, so a slot reused
+	// for a later row of a streamed image is simply a miss.
+	struct EdgeSample
+	{
+		std::atomic<int> tag;		// 0 empty, -tag while being written
+		float col[3];
+		float N[3];
+		const SceneObject* obj;
+	};
+	EdgeSample* edgeSlot(int i, int j, int& tag);
+	void resetEdges();
+
+public:
+
     void setCubeMap(CubeMap* m) {
         if (cubemap) delete cubemap;
         cubemap = m;
@@ -47,14 +170,34 @@ public:
     bool haveCubeMap() { return cubemap != nullptr; }
 
 public:
-        unsigned char *buffer;
-        unsigned char *filteredBuf;
+        Framebuffer frame;
+        QuantizeSettings quantizeSettings;
+        unsigned char *buffer;			// frame, quantized
         int buffer_width, buffer_height;
-        int bufferSize;
+        size_t bufferSize;
         Scene* scene;
+        bool ownsScene;
+        Camera* viewCamera;
         CubeMap* cubemap;
 
         bool m_bBufferReady;
+        int nBands;
+        int bandStart[MAX_BANDS + 1];
+        std::atomic<int> bandNext[MAX_BANDS];
+
+        CancelToken* budgetToken;
+        std::atomic<int> budgetNext;
+        std::atomic<int> budgetFinished[NUM_PASSES];
+        std::atomic<bool> budgetReady[NUM_PASSES];
+        std::atomic<int> budgetRefined;
+        std::vector<Vec3d> firstColor;		// the one-sample image
+        std::vector<SampleHit> firstHit;
+        std::vector<char> refineFlag;
+        std::vector<int> refineOrder;		// tiles, most flagged pixels first
+
+        std::unique_ptr<EdgeSample[]> edgeRows;		// 2 per tile row slot
+        std::unique_ptr<EdgeSample[]> edgeColumns;	// 2 per tile column
+        int edgeRowSlots, edgeRowsWidth, edgeColumnsHeight;
 };
 
 #endif // __RAYTRACER_H__
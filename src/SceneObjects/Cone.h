@@ -53,6 +53,8 @@ public:
 	bool intersectCaps( const ray& r, isect& i ) const;
 
 protected:
+	friend class BinaryScene;
+
 	bool isGoodRoot(Vec3d root) const;
 	double radiusAt(double h) const;
     
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include "trimesh.h"
 #include "../ui/TraceUI.h"
+#include "../threading/Numa.h"
 extern TraceUI* traceUI;
 
 using namespace std;
@@ -14,10 +15,18 @@ Trimesh::~Trimesh()
 		delete *i;
 }
 
+KdTree<int>* Trimesh::localKdTree() const
+{
+	size_t node = NumaTopology::currentNode();
+	if( node < kdReplicas.size() && kdReplicas[node] ) return kdReplicas[node];
+	return kdtreeRoot;
+}
+
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
     vertices.push_back( v );
+    vertexCount++;
 }
 
 void Trimesh::addMaterial( Material *m )
@@ -37,16 +46,118 @@ bool Trimesh::addFace( int a, int b, int c )
 
     if( a >= vcnt || b >= vcnt || c >= vcnt ) return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    if (!newFace->degen) faces.push_back( newFace );
+	// Compute the face normal here, not on the fly
+	const Vec3d& a_coords = vertices[a];
+	const Vec3d& b_coords = vertices[b];
+	const Vec3d& c_coords = vertices[c];
 
+	Vec3d vab = (b_coords - a_coords);
+	Vec3d vac = (c_coords - a_coords);
+	Vec3d vcb = (b_coords - c_coords);
 
-    // Don't add faces to the scene's object list so we can cull by bounding box
-    // scene->add(newFace);
+	// Degenerate faces are dropped; nothing can hit them.
+	if (vab.iszero() || vac.iszero() || vcb.iszero()) return true;
+
+	Vec3d normal = vab ^ vac;
+	normal.normalize();
+	faceIds.push_back( a );
+	faceIds.push_back( b );
+	faceIds.push_back( c );
+	faceNormals.push_back( normal );
     return true;
 }
 
+bool Trimesh::addMesh( Vertices& v, Normals& n, const std::vector<int>& faces )
+{
+    int base = (int)vertices.size();
+    int count = (int)v.size();
+    for (size_t f = 0; f < faces.size(); ++f)
+        if (faces[f] < 0 || faces[f] >= count) return false;
+
+    if (vertices.empty()) vertices.swap( v );
+    else vertices.insert( vertices.end(), v.begin(), v.end() );
+    if (!n.empty())
+    {
+        if (normals.empty()) normals.swap( n );
+        else normals.insert( normals.end(), n.begin(), n.end() );
+        // Normals that come with a mesh are meant to be shaded with.
+        vertNorms = true;
+    }
+    vertexCount += count;
+
+    faceIds.reserve( faceIds.size() + faces.size() );
+    faceNormals.reserve( faceNormals.size() + faces.size() / 3 );
+    for (size_t f = 0; f + 2 < faces.size(); f += 3)
+        addFace( base + faces[f], base + faces[f+1], base + faces[f+2] );
+    return true;
+}
+
+void Trimesh::addVertices( Vertices& v )
+{
+    vertexCount += (int)v.size();
+    if (vertices.empty()) vertices.swap( v );
+    else vertices.insert( vertices.end(), v.begin(), v.end() );
+}
+
+void Trimesh::addNormals( Normals& n )
+{
+    if (normals.empty()) normals.swap( n );
+    else normals.insert( normals.end(), n.begin(), n.end() );
+}
+
+unsigned int Trimesh::encodeOctahedral( const Vec3d& n )
+{
+	double l1 = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	if (l1 == 0) return 0;
+	double x = n[0] / l1;
+	double y = n[1] / l1;
+	if (n[2] < 0)
+	{
+		double ox = x;
+		x = (1.0 - fabs(y)) * (ox >= 0 ? 1.0 : -1.0);
+		y = (1.0 - fabs(ox)) * (y >= 0 ? 1.0 : -1.0);
+	}
+	unsigned short ex = (unsigned short)(short)floor(x * 32767.0 + 0.5);
+	unsigned short ey = (unsigned short)(short)floor(y * 32767.0 + 0.5);
+	return (unsigned int)ex | ((unsigned int)ey << 16);
+}
+
+void Trimesh::compact( Precision p )
+{
+	if (p == DOUBLE || precision != DOUBLE) return;
+
+	if (p == FLOAT)
+	{
+		floatVertices.resize( vertexCount );
+		for (int v = 0; v < vertexCount; ++v)
+			floatVertices[v] = Vec3f( (float)vertices[v][0], (float)vertices[v][1], (float)vertices[v][2] );
+	}
+	else
+	{
+		BoundingBox box = ComputeLocalBoundingBox();
+		quantOrigin = box.getMin();
+		quantScale = (box.getMax() - box.getMin()) / 65535.0;
+		quantVertices.resize( 3 * vertexCount );
+		for (int v = 0; v < vertexCount; ++v)
+			for (int k = 0; k < 3; ++k)
+			{
+				double q = quantScale[k] > 0 ? (vertices[v][k] - quantOrigin[k]) / quantScale[k] : 0.0;
+				quantVertices[3*v+k] = (unsigned short)min( 65535.0, max( 0.0, floor( q + 0.5 ) ) );
+			}
+	}
+
+	if (!normals.empty())
+	{
+		octNormals.resize( normals.size() );
+		for (size_t v = 0; v < normals.size(); ++v)
+			octNormals[v] = encodeOctahedral( normals[v] );
+		Normals().swap( normals );
+	}
+	Vertices().swap( vertices );
+	precision = p;
+	ComputeLocalBoundingBox();
+}
+
 char* Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
 // they are the right number.
@@ -59,65 +170,77 @@ char* Trimesh::doubleCheck()
     return 0;
 }
 
-bool Trimesh::intersectLocal(ray& r, isect& i) const
+// Keeps the closest of the mesh triangles in the leaves visited.  Of
+// triangles hit at the same t, such as those meeting at a pole, the first
+// face wins, whatever order the leaves are visited in.
+struct ClosestTriangle
 {
-	double tmin = 0.0;
-	double tmax = 0.0;
-	typedef Faces::const_iterator iter;
-	bool have_one = false;
-	for( iter j = faces.begin(); j != faces.end(); ++j )
-	  {
-	    isect cur;
-	    if( (*j)->intersectLocal( r, cur ) )
-	      {
-		if( !have_one || (cur.t < i.t) )
-		  {
-		    i = cur;
-		    have_one = true;
-		  }
-	      }
-	  }
-	if( !have_one ) i.setT(1000.0);
-	return have_one;
-}
+	const Trimesh* mesh;
+	const ray& r;
+	isect& i;
+	bool have_one;
+	int face;
+
+	ClosestTriangle(const Trimesh* m, const ray& _r, isect& _i) : mesh(m), r(_r), i(_i), have_one(false), face(0) {}
 
-bool TrimeshFace::intersect(ray& r, isect& i) const {
-  return intersectLocal(r, i);
+	void operator()(int f)
+	{
+		isect cur;
+		if( mesh->intersectTriangle( f, r, cur ) )
+		{
+			if( !have_one || (cur.t < i.t) || (cur.t == i.t && f < face) )
+			{
+				i = cur;
+				have_one = true;
+				face = f;
+			}
+		}
+	}
+
+	bool hitBy( double t ) const { return have_one && i.t <= t; }
+};
+
+bool Trimesh::intersectLocal(ray& r, isect& i) const
+{
+	ClosestTriangle closest(this, r, i);
+	if( kdtreeRoot != nullptr && scene->useKdTree )
+	{
+		double tMin = 0.0;
+		double tMax = 0.0;
+		const KdTree<int>* root = localKdTree();
+		if( root->bb.intersect( r, tMin, tMax ) )
+			traverseKdTree( root, r, tMin, tMax, closest );
+	}
+	else
+	{
+		for( int f = 0; f < numFaces(); ++f )
+			closest( f );
+	}
+	if( !closest.have_one ) i.setT(1000.0);
+	return closest.have_one;
 }
 
 // Intersect ray r with the triangle abc.  If it hits returns true,
 // and put the parameter in t and the barycentric coordinates of the
 // intersection in u (alpha) and v (beta).
-bool TrimeshFace::intersectLocal(ray& r, isect& i) const
+bool Trimesh::intersectTriangle(int f, const ray& r, isect& i) const
 {
-    if (this->getScene()->backFaceCulling)
+    const Vec3d& normal = faceNormals[f];
+    const int* ids = &faceIds[3*f];
+    if (scene->backFaceCulling)
     {
-        // cout<<"backFaceCulling"<<endl;
         if (r.type() != ray::REFRACTION)
         {
             double cosineAngle = normal * r.d;
-            // double cosineAngle = acos(normal * r.d) * 180/M_PI;
             if (cosineAngle > 0) // Coming into an object from air
             {
                 return false;
             }
         }
-        // else if (r.type() == ray::REFRACTION)
-        // {
-        //     double cosineAngle = acos(normal * r.d) * 180/M_PI;
-        //     if (TraceUI::m_debug)
-        //     {
-        //         cout<<"Culling Refraction : "<<r.type()<<endl;
-        //     }
-        //     if (cosineAngle > 90)
-        //     {
-        //         return false;
-        //     }
-        // }
     }
-    const Vec3d& a = parent->vertices[ids[0]];
-    const Vec3d& b = parent->vertices[ids[1]];
-    const Vec3d& c = parent->vertices[ids[2]];
+    Vec3d a = vertex(ids[0]);
+    Vec3d b = vertex(ids[1]);
+    Vec3d c = vertex(ids[2]);
 
     double dConstant = -(a*normal);
     if (normal*r.d == 0)
@@ -171,11 +294,11 @@ bool TrimeshFace::intersectLocal(ray& r, isect& i) const
     if (total<=(1+RAY_EPSILON) && total>=(1-RAY_EPSILON))
     {
         i.t = rayT;
-        if (this->scene->smoothShading && parent->vertNorms)
+        if (scene->smoothShading && vertNorms)
         {
-            Vec3d normalA = parent->normals[ids[0]];
-            Vec3d normalB = parent->normals[ids[1]];
-            Vec3d normalC = parent->normals[ids[2]];
+            Vec3d normalA = vertexNormal(ids[0]);
+            Vec3d normalB = vertexNormal(ids[1]);
+            Vec3d normalC = vertexNormal(ids[2]);
             Vec3d normalIntersect = (baryCoord[0]*normalA) + (baryCoord[1]*normalB) + (baryCoord[2]*normalC);
             i.setN(normalIntersect);
         }
@@ -186,20 +309,16 @@ bool TrimeshFace::intersectLocal(ray& r, isect& i) const
         i.N.normalize();
         i.setBary(baryCoord);
         i.setUVCoordinates(Vec2d(baryCoord));
-        if(this->scene->smoothShading && parent->materials.size()>0)
+        if(scene->smoothShading && materials.size()>0)
         {
-            Material aMaterial = *(parent->materials[ids[0]]);
-            Material bMaterial = *(parent->materials[ids[1]]);
-            Material cMaterial = *(parent->materials[ids[2]]);
-            Material pMaterial;
-            pMaterial += (baryCoord[0]*aMaterial);
-            pMaterial += (baryCoord[1]*bMaterial);
-            pMaterial += (baryCoord[2]*cMaterial);
-            i.setMaterial(pMaterial);
+            Material& pMaterial = i.ownMaterial();
+            pMaterial += (baryCoord[0]*(*materials[ids[0]]));
+            pMaterial += (baryCoord[1]*(*materials[ids[1]]));
+            pMaterial += (baryCoord[2]*(*materials[ids[2]]));
         }
         else
         {
-            i.setMaterial(parent->getMaterial());
+            i.setMaterial(getMaterial());
         }
         i.setObject(this);
         return true;
@@ -216,14 +335,14 @@ void Trimesh::generateNormals()
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    for( int f = 0; f < this->numFaces(); ++f )
     {
-		Vec3d faceNormal = (**fi).getNormal();
+		const Vec3d& faceNormal = faceNormals[f];
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[faceIds[3*f+i]] += faceNormal;
+            ++numFaces[faceIds[3*f+i]];
         }
     }
 
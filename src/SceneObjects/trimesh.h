@@ -3,19 +3,19 @@
 
 #include <list>
 #include <vector>
+#include <cmath>
 
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
 
-class TrimeshFace;
-
+// A triangle mesh.  Triangles are not objects of their own: face f is the
+// three vertex indices faceIds[3f..3f+2] plus its precomputed normal, and
+// the mesh's kd-tree holds face indices.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
     typedef std::vector<Vec3d> Normals;
     typedef std::vector<Vec3d> Vertices;
-    typedef std::vector<TrimeshFace*> Faces;
     typedef std::vector<Material*> Materials;
 
     Vertices vertices;
@@ -23,8 +23,21 @@ class Trimesh : public MaterialSceneObject
     Materials materials;
 	BoundingBox localBounds;
 
+	friend class BinaryScene;
+
 public:
-    Faces faces;
+    // How vertex positions and normals are stored.  Parsing always fills
+    // the double precision arrays; compact() converts them afterwards.
+    enum Precision
+    {
+        DOUBLE,         // Vec3d positions and normals
+        FLOAT,          // float32 positions, octahedral normals
+        QUANTIZED       // 16 bits per axis against the mesh bounds, octahedral normals
+    };
+
+    std::vector<int> faceIds;
+    Normals faceNormals;
+
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat), 
 			displayListWithMaterials(0),
@@ -33,14 +46,23 @@ public:
       this->transform = transform;
       vertNorms = false;
       kdtreeRoot = nullptr;
+      precision = DOUBLE;
+      vertexCount = 0;
     }
 
     bool vertNorms;
-    KdTree<Geometry>* kdtreeRoot;
+    KdTree<int>* kdtreeRoot;		// in the Scene's kd-tree arena
+
+    // Per-NUMA-node copies of kdtreeRoot, in the Scene's replica arenas.
+    std::vector<KdTree<int>*> kdReplicas;
+    KdTree<int>* localKdTree() const;
 
     bool kdTreeBuilt() {return kdtreeRoot != nullptr;}
     bool intersectLocal(ray& r, isect& i) const;
 
+    // Intersect r, in the mesh's local space, with face f.
+    bool intersectTriangle(int f, const ray& r, isect& i) const;
+
     virtual bool isTrimesh() {return true;}
 
     ~Trimesh();
@@ -51,101 +73,113 @@ public:
     void addNormal( const Vec3d & );
     bool addFace( int a, int b, int c );
 
-    char *doubleCheck();
-    
-    void generateNormals();
+    // Appends a whole mesh at once: its vertices, their normals (or none)
+    // and three indices into vertices per face.  The arrays are taken
+    // over, not copied, when the trimesh is still empty.  Returns false if
+    // a face refers to a vertex that doesn't exist.
+    bool addMesh( Vertices& v, Normals& n, const std::vector<int>& faces );
 
-    bool hasBoundingBoxCapability() const { return true; }
-      
-    BoundingBox ComputeLocalBoundingBox()
+    // Append whole lists of vertices or normals, taking them over when
+    // there are none yet, as addMesh() does.
+    void addVertices( Vertices& v );
+    void addNormals( Normals& n );
+
+    int numFaces() const { return (int)faceNormals.size(); }
+    BoundingBox faceBounds( int f ) const
     {
-        BoundingBox localbounds;
-		if (vertices.size() == 0) return localbounds;
-		localbounds.setMax(vertices[0]);
-		localbounds.setMin(vertices[0]);
-		Vertices::const_iterator viter;
-		for (viter = vertices.begin(); viter != vertices.end(); ++viter)
-	  {
-	    localbounds.setMax(maximum( localbounds.getMax(), *viter));
-	    localbounds.setMin(minimum( localbounds.getMin(), *viter));
-	  }
-		localBounds = localbounds;
-        return localbounds;
+        Vec3d a = vertex(faceIds[3*f]);
+        Vec3d b = vertex(faceIds[3*f+1]);
+        Vec3d c = vertex(faceIds[3*f+2]);
+        return BoundingBox(minimum(minimum(a, b), c), maximum(maximum(a, b), c));
     }
 
-protected:
-	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
-	mutable int displayListWithMaterials;
-	mutable int displayListWithoutMaterials;
-};
+    // Re-stores the vertices and their normals at precision p and frees
+    // the double precision copies.  Call once the mesh is complete.
+    void compact( Precision p );
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-    Vec3d normal;
-    double dist;
+    int numVertices() const { return vertexCount; }
+    bool hasVertexNormals() const { return !normals.empty() || !octNormals.empty(); }
 
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
+    Vec3d vertex( int v ) const
     {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-
-		// Compute the face normal here, not on the fly
-		Vec3d a_coords = parent->vertices[a];
-		Vec3d b_coords = parent->vertices[b];
-		Vec3d c_coords = parent->vertices[c];
-
-		Vec3d vab = (b_coords - a_coords);
-		Vec3d vac = (c_coords - a_coords);
-		Vec3d vcb = (b_coords - c_coords);
-        
-		if (vab.iszero() || vac.iszero() || vcb.iszero()) degen = true;
-		else {
-			degen = false;
-			normal = ((b_coords - a_coords) ^ (c_coords - a_coords));
-			normal.normalize();
-			dist = normal * a_coords;
-		}
-		localbounds = ComputeLocalBoundingBox();
-		bounds = localbounds;
+        switch( precision )
+        {
+        case FLOAT:
+        {
+            const Vec3f& p = floatVertices[v];
+            return Vec3d( p[0], p[1], p[2] );
+        }
+        case QUANTIZED:
+        {
+            const unsigned short* q = &quantVertices[3*v];
+            return Vec3d( quantOrigin[0] + q[0]*quantScale[0],
+                          quantOrigin[1] + q[1]*quantScale[1],
+                          quantOrigin[2] + q[2]*quantScale[2] );
+        }
+        default:
+            return vertices[v];
+        }
     }
 
-	BoundingBox localbounds;
-	bool degen;
-
-    int operator[]( int i ) const
+    // Unit length when decoded from the octahedral encoding, whatever
+    // length the normal was given with.
+    Vec3d vertexNormal( int v ) const
     {
-        return ids[i];
+        return octNormals.empty() ? normals[v] : decodeOctahedral( octNormals[v] );
     }
 
-	Vec3d getNormal()
-	{
-		return normal;
-	}
-
-    bool intersect(ray& r, isect& i ) const;
-    bool intersectLocal(ray& r, isect& i ) const;
+    char *doubleCheck();
+    
+    void generateNormals();
 
     bool hasBoundingBoxCapability() const { return true; }
       
     BoundingBox ComputeLocalBoundingBox()
     {
         BoundingBox localbounds;
-        localbounds.setMax(maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-		localbounds.setMin(minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]));
-        
-        localbounds.setMax(maximum( parent->vertices[ids[2]], localbounds.getMax()));
-		localbounds.setMin(minimum( parent->vertices[ids[2]], localbounds.getMin()));
+		if (vertexCount == 0) return localbounds;
+		localbounds.setMax(vertex(0));
+		localbounds.setMin(vertex(0));
+		for (int v = 0; v < vertexCount; ++v)
+	  {
+	    Vec3d p = vertex(v);
+	    localbounds.setMax(maximum( localbounds.getMax(), p));
+	    localbounds.setMin(minimum( localbounds.getMin(), p));
+	  }
+		localBounds = localbounds;
         return localbounds;
     }
 
-    const BoundingBox& getBoundingBox() const { return localbounds; }
+protected:
+	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
 
- };
+	// Unit vector <-> two 16-bit snorms of its octahedral projection.
+	static unsigned int encodeOctahedral( const Vec3d& n );
+	static Vec3d decodeOctahedral( unsigned int e )
+	{
+		double x = (short)(e & 0xffff) / 32767.0;
+		double y = (short)(e >> 16) / 32767.0;
+		double z = 1.0 - std::fabs(x) - std::fabs(y);
+		if (z < 0)
+		{
+			double ox = x;
+			x = (1.0 - std::fabs(y)) * (ox >= 0 ? 1.0 : -1.0);
+			y = (1.0 - std::fabs(ox)) * (y >= 0 ? 1.0 : -1.0);
+		}
+		Vec3d n(x, y, z);
+		n.normalize();
+		return n;
+	}
+
+	int vertexCount;
+	Precision precision;
+	std::vector<Vec3f> floatVertices;
+	std::vector<unsigned short> quantVertices;	// three per vertex
+	Vec3d quantOrigin, quantScale;
+	std::vector<unsigned int> octNormals;
+
+	mutable int displayListWithMaterials;
+	mutable int displayListWithoutMaterials;
+};
 
 #endif // TRIMESH_H__
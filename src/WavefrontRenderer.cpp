@@ -0,0 +1,267 @@
+#include "WavefrontRenderer.h"
+#include "RayTracer.h"
+#include "scene/scene.h"
+#include "scene/light.h"
+#include "scene/material.h"
+#include "ui/TraceUI.h"
+
+#include <algorithm>
+#include <cassert>
+
+extern TraceUI* traceUI;
+
+using namespace std;
+
+void WavefrontRenderer::RayQueue::clear()
+{
+	px.clear(); py.clear(); pz.clear();
+	dx.clear(); dy.clear(); dz.clear();
+	wr.clear(); wg.clear(); wb.clear();
+	pixel.clear(); source.clear(); light.clear(); type.clear();
+}
+
+void WavefrontRenderer::RayQueue::reserve(size_t n)
+{
+	px.reserve(n); py.reserve(n); pz.reserve(n);
+	dx.reserve(n); dy.reserve(n); dz.reserve(n);
+	wr.reserve(n); wg.reserve(n); wb.reserve(n);
+	pixel.reserve(n); source.reserve(n); light.reserve(n); type.reserve(n);
+}
+
+void WavefrontRenderer::RayQueue::push(const ray& r, const Vec3d& w, int pix, int src, int lt)
+{
+	px.push_back(r.p[0]); py.push_back(r.p[1]); pz.push_back(r.p[2]);
+	dx.push_back(r.d[0]); dy.push_back(r.d[1]); dz.push_back(r.d[2]);
+	wr.push_back(w[0]); wg.push_back(w[1]); wb.push_back(w[2]);
+	pixel.push_back(pix);
+	source.push_back(src);
+	light.push_back(lt);
+	type.push_back((unsigned char)r.t);
+}
+
+template <typename T>
+static void gatherArray(vector<T>& to, const vector<T>& from, const vector<int>& order)
+{
+	to.resize(order.size());
+	for (size_t k = 0; k < order.size(); k++)
+		to[k] = from[order[k]];
+}
+
+void WavefrontRenderer::RayQueue::gather(const RayQueue& from, const vector<int>& order)
+{
+	gatherArray(px, from.px, order); gatherArray(py, from.py, order); gatherArray(pz, from.pz, order);
+	gatherArray(dx, from.dx, order); gatherArray(dy, from.dy, order); gatherArray(dz, from.dz, order);
+	gatherArray(wr, from.wr, order); gatherArray(wg, from.wg, order); gatherArray(wb, from.wb, order);
+	gatherArray(pixel, from.pixel, order);
+	gatherArray(source, from.source, order);
+	gatherArray(light, from.light, order);
+	gatherArray(type, from.type, order);
+}
+
+ray WavefrontRenderer::RayQueue::get(size_t k) const
+{
+	return ray(Vec3d(px[k], py[k], pz[k]), Vec3d(dx[k], dy[k], dz[k]), (ray::RayType)type[k]);
+}
+
+WavefrontRenderer::WavefrontRenderer(RayTracer* tracer)
+	: raytracer(tracer), scene(tracer->scene),
+	  lights(tracer->scene->beginLights(), tracer->scene->endLights())
+{
+	useCubeMap = traceUI->m_usingCubeMap && tracer->haveCubeMap();
+	sortRays = traceUI->sortRays();
+
+	const BoundingBox& bb = scene->bounds();
+	boundsMin = bb.getMin();
+	Vec3d extent = bb.getMax() - bb.getMin();
+	for (int a = 0; a < 3; a++)
+		boundsScale[a] = extent[a] > 0 ? 1024.0 / extent[a] : 0.0;
+}
+
+// Spreads the low 10 bits of v out to every third bit.
+static inline unsigned long long spreadBits(unsigned int v)
+{
+	unsigned long long x = v & 0x3ff;
+	x = (x | (x << 16)) & 0x030000ffull;
+	x = (x | (x << 8)) & 0x0300f00full;
+	x = (x | (x << 4)) & 0x030c30c3ull;
+	x = (x | (x << 2)) & 0x09249249ull;
+	return x;
+}
+
+void WavefrontRenderer::sortStage(RayQueue& q)
+{
+	size_t n = q.size();
+	if (n < 2) return;
+	assert(n <= 0x7fffffffu);
+
+	keys.resize(n);
+	for (size_t k = 0; k < n; k++)
+	{
+		unsigned int cell[3];
+		double p[3] = { q.px[k], q.py[k], q.pz[k] };
+		for (int a = 0; a < 3; a++)
+		{
+			double c = (p[a] - boundsMin[a]) * boundsScale[a];
+			cell[a] = c <= 0 ? 0 : (c >= 1023 ? 1023 : (unsigned int)c);
+		}
+		unsigned long long octant = (q.dx[k] < 0 ? 1 : 0) | (q.dy[k] < 0 ? 2 : 0) | (q.dz[k] < 0 ? 4 : 0);
+		unsigned long long morton = spreadBits(cell[0]) | (spreadBits(cell[1]) << 1) | (spreadBits(cell[2]) << 2);
+		// Octant in the top 3 bits, the 30-bit Morton code below it and
+		// the ray's index in the low 31, so plain integers sort.
+		keys[k] = (octant << 61) | (morton << 31) | k;
+	}
+	sort(keys.begin(), keys.end());
+
+	order.resize(n);
+	for (size_t k = 0; k < n; k++)
+		order[k] = (int)(keys[k] & 0x7fffffffu);
+	sorted.gather(q, order);
+	swap(q, sorted);
+}
+
+// Camera rays through the corner of every pixel, exactly as tracePixel
+// would shoot them.
+void WavefrontRenderer::generateStage()
+{
+	int w = raytracer->buffer_width, h = raytracer->buffer_height;
+	Vec3d one(1.0, 1.0, 1.0);
+	int k = 0;
+	for (size_t t = 0; t < rects.size(); t++)
+		for (int j = rects[t].y0; j < rects[t].y1; j++)
+			for (int i = rects[t].x0; i < rects[t].x1; i++, k++)
+			{
+				ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+				raytracer->camera().rayThrough(double(i)/double(w), double(j)/double(h), r);
+				wave.push(r, one, k);
+			}
+}
+
+void WavefrontRenderer::intersectStage(RayQueue& q, vector<isect>& out, vector<char>& found)
+{
+	size_t n = q.size();
+	out.resize(n);
+	found.resize(n);
+	for (size_t k = 0; k < n; k++)
+	{
+		ray r = q.get(k);
+		found[k] = scene->intersect(r, out[k]);
+	}
+}
+
+// Emissive/ambient terms for the hits and the background for the misses;
+// every light that matters queues a shadow ray.
+void WavefrontRenderer::shadeStage()
+{
+	shadows.clear();
+	for (size_t k = 0; k < wave.size(); k++)
+	{
+		ray r = wave.get(k);
+		Vec3d w = wave.weight(k);
+		if (!hitFound[k])
+		{
+			if (useCubeMap)
+				accum[wave.pixel[k]] += prod(w, raytracer->getCubeMap()->getColor(r));
+			continue;
+		}
+
+		const isect& i = hits[k];
+		const Material& material = i.getMaterial();
+		accum[wave.pixel[k]] += prod(w, material.shadeEmissive(scene, i));
+		if (!material.litByLights(i)) continue;
+
+		Vec3d Qpoint = r.at(i.t);
+		for (size_t l = 0; l < lights.size(); l++)
+			shadows.push(lights[l]->shadowRay(Qpoint), w, wave.pixel[k], (int)k, (int)l);
+	}
+}
+
+void WavefrontRenderer::shadowStage()
+{
+	if (sortRays) sortStage(shadows);
+	intersectStage(shadows, shadowHits, shadowFound);
+	for (size_t k = 0; k < shadows.size(); k++)
+	{
+		int src = shadows.source[k];
+		const Light* pLight = lights[shadows.light[k]];
+		ray shadow = shadows.get(k);
+		ray r = wave.get(src);
+		const isect& i = hits[src];
+
+		Vec3d lightIntensity = pLight->distanceAttenuation(shadow.p)
+			* pLight->shadowFromHit(shadow, shadowFound[k] ? &shadowHits[k] : 0);
+		Vec3d c = i.getMaterial().shadeLight(scene, r, i, pLight, lightIntensity, raytracer->camera().getEye());
+		accum[shadows.pixel[k]] += prod(shadows.weight(k), c);
+	}
+}
+
+// Reflected and refracted continuations, weighted by kr and kt, make up
+// the next wave.
+void WavefrontRenderer::spawnStage(int depth)
+{
+	nextWave.clear();
+	if (depth == 0) return;
+	for (size_t k = 0; k < wave.size(); k++)
+	{
+		if (!hitFound[k]) continue;
+		ray r = wave.get(k);
+		const isect& i = hits[k];
+		const Material& material = i.getMaterial();
+		Vec3d w = wave.weight(k);
+
+		if (!material.kr(i).iszero())
+			nextWave.push(RayTracer::reflectRay(r, i), prod(w, material.kr(i)), wave.pixel[k]);
+		if (!material.kt(i).iszero())
+		{
+			ray refracted(r);
+			if (RayTracer::refractRay(r, i, material, refracted))
+				nextWave.push(refracted, prod(w, material.kt(i)), wave.pixel[k]);
+		}
+	}
+}
+
+void WavefrontRenderer::traceTile(int x0, int y0, int x1, int y1)
+{
+	Rect r = { x0, y0, x1, y1 };
+	rects.assign(1, r);
+	render();
+}
+
+void WavefrontRenderer::traceTiles(int first, int last)
+{
+	rects.resize(last - first);
+	for (int t = first; t < last; t++)
+	{
+		Rect& r = rects[t - first];
+		raytracer->tileBounds(t, r.x0, r.y0, r.x1, r.y1);
+	}
+	render();
+}
+
+void WavefrontRenderer::render()
+{
+	int n = 0;
+	for (size_t t = 0; t < rects.size(); t++)
+		n += (rects[t].x1 - rects[t].x0) * (rects[t].y1 - rects[t].y0);
+	accum.assign(n, Vec3d(0.0, 0.0, 0.0));
+	wave.clear();
+	wave.reserve(n);
+	shadows.reserve(n * max((size_t)1, lights.size()));
+
+	generateStage();
+	for (int depth = traceUI->getDepth(); wave.size() > 0; depth--)
+	{
+		// Camera rays are coherent already; only later waves are sorted.
+		if (sortRays && depth < traceUI->getDepth()) sortStage(wave);
+		intersectStage(wave, hits, hitFound);
+		shadeStage();
+		shadowStage();
+		spawnStage(depth);
+		swap(wave, nextWave);
+	}
+
+	int k = 0;
+	for (size_t t = 0; t < rects.size(); t++)
+		for (int j = rects[t].y0; j < rects[t].y1; j++)
+			for (int i = rects[t].x0; i < rects[t].x1; i++, k++)
+				raytracer->setPixel(i, j, accum[k]);
+}
@@ -0,0 +1,84 @@
+#ifndef __WAVEFRONTRENDERER_H__
+#define __WAVEFRONTRENDERER_H__
+
+// Breadth-first alternative to RayTracer::traceRay.  A tile's camera rays
+// are traced as one wave: the whole wave is intersected, then shaded, its
+// shadow rays are gathered and intersected as a batch, and the reflected
+// and refracted rays it spawns become the next wave.  Rays live in
+// structure-of-arrays queues and carry the weight their contribution gets
+// in the final pixel, so nothing has to unwind a recursion.
+
+#include "scene/ray.h"
+#include <vector>
+
+class RayTracer;
+class Scene;
+class Light;
+
+class WavefrontRenderer
+{
+public:
+	explicit WavefrontRenderer(RayTracer* tracer);
+
+	void traceTile(int x0, int y0, int x1, int y1);
+	// Tiles first..last-1 of the raytracer's image as one wave.  One
+	// tile's rays are too few and too alike for sorting to reorder much,
+	// so sorted rendering hands out tiles SORT_BATCH at a time.
+	void traceTiles(int first, int last);
+	static const int SORT_BATCH = 16;
+
+private:
+	// One queue per stage; ray k is (p[k], d[k]) with weight w[k] and
+	// lands in accumulator slot pixel[k].
+	struct RayQueue
+	{
+		std::vector<double> px, py, pz;
+		std::vector<double> dx, dy, dz;
+		std::vector<double> wr, wg, wb;
+		std::vector<int> pixel;
+		std::vector<int> source;	// shadow rays: index of the hit being lit
+		std::vector<int> light;		// shadow rays: index into lights
+		std::vector<unsigned char> type;
+
+		size_t size() const { return pixel.size(); }
+		void clear();
+		void reserve(size_t n);
+		void push(const ray& r, const Vec3d& w, int pix, int src = -1, int lt = -1);
+		ray get(size_t k) const;
+		Vec3d weight(size_t k) const { return Vec3d(wr[k], wg[k], wb[k]); }
+		void gather(const RayQueue& from, const std::vector<int>& order);
+	};
+
+	// Reorders a queue by direction octant, then by the Morton code of
+	// the ray origin within the scene bounds, so that rays that are
+	// intersected one after another walk the same parts of the kd-tree.
+	void sortStage(RayQueue& q);
+
+	struct Rect { int x0, y0, x1, y1; };
+	void render();
+
+	void generateStage();
+	void intersectStage(RayQueue& q, std::vector<isect>& hits, std::vector<char>& found);
+	void shadeStage();
+	void shadowStage();
+	void spawnStage(int depth);
+
+	RayTracer* raytracer;
+	Scene* scene;
+	std::vector<Light*> lights;
+	bool useCubeMap;
+
+	std::vector<Rect> rects;		// the tiles in this wave
+	std::vector<Vec3d> accum;		// one per pixel of rects, in order
+
+	bool sortRays;
+	Vec3d boundsMin, boundsScale;	// maps scene bounds onto the Morton grid
+	std::vector<unsigned long long> keys;
+	std::vector<int> order;
+
+	RayQueue wave, nextWave, shadows, sorted;
+	std::vector<isect> hits, shadowHits;
+	std::vector<char> hitFound, shadowFound;
+};
+
+#endif // __WAVEFRONTRENDERER_H__
@@ -0,0 +1,345 @@
+#include "Coordinator.h"
+#include "../RayTracer.h"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+using namespace std;
+
+// A worker holding tiles that says nothing for this long, not even a
+// heartbeat, is treated as dead.
+static const double WORKER_TIMEOUT = 6.0 * HEARTBEAT_INTERVAL;
+// A tile is only considered slow once it is this many times the average
+// tile time old, and never before MIN_SLOW_TILE seconds.
+static const double SLOW_TILE_FACTOR = 4.0;
+static const double MIN_SLOW_TILE = 1.0;
+
+static double now()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Coordinator::Coordinator(RayTracer* tracer, const RenderSettings& s)
+	: raytracer(tracer), settings(s), listenFd(-1), listenPort(0),
+	  acceptRemote(false), nDone(0), tileTimeSum(0), tileTimeCount(0),
+	  nReissued(0), nLost(0)
+{
+}
+
+Coordinator::~Coordinator()
+{
+	for (size_t i = 0; i < workers.size(); i++)
+		closeSocket(workers[i].fd);
+	closeSocket(listenFd);
+	for (size_t i = 0; i < children.size(); i++)
+	{
+		kill(children[i], SIGTERM);
+		waitpid(children[i], 0, 0);
+	}
+}
+
+bool Coordinator::listen(const char* host, int port)
+{
+	listenPort = port;
+	listenFd = listenSocket(host, listenPort);
+	acceptRemote = !host || !*host;
+	return listenFd >= 0;
+}
+
+bool Coordinator::spawnLocalWorkers(const char* exe, int n, int threadsEach)
+{
+	char addr[64], threads[16];
+	snprintf(addr, sizeof(addr), "127.0.0.1:%d", listenPort);
+	snprintf(threads, sizeof(threads), "%d", threadsEach);
+
+	for (int i = 0; i < n; i++)
+	{
+		pid_t pid = fork();
+		if (pid < 0) return false;
+		if (pid == 0)
+		{
+#ifdef __linux__
+			// Don't leave orphaned workers behind if we are killed.
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+			close(listenFd);
+			execl(exe, exe, "-W", addr, "-j", threads, (char*)0);
+			_exit(127);
+		}
+		children.push_back(pid);
+	}
+	return true;
+}
+
+int Coordinator::reapChildren()
+{
+	for (size_t i = 0; i < children.size(); )
+	{
+		if (waitpid(children[i], 0, WNOHANG) == children[i])
+			children.erase(children.begin() + i);
+		else
+			i++;
+	}
+	return (int)children.size();
+}
+
+void Coordinator::acceptWorker()
+{
+	int fd = accept(listenFd, 0, 0);
+	if (fd < 0) return;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	Connection c;
+	c.fd = fd;
+	c.slots = 0;
+	c.ready = false;
+	c.lastHeard = now();
+	workers.push_back(c);
+}
+
+// r holds the tile's pixels, already checked to be all there.
+void Coordinator::storeTile(int tile, MessageReader& r)
+{
+	int x0, y0, x1, y1;
+	raytracer->tileBounds(tile, x0, y0, x1, y1);
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+		{
+			float red, green, blue;
+			int samples;
+			r.getFloat(red);
+			r.getFloat(green);
+			r.getFloat(blue);
+			r.getInt(samples);
+			raytracer->setPixel(x, y, Vec3d(red, green, blue), samples);
+		}
+	done[tile] = true;
+	nDone++;
+}
+
+bool Coordinator::handleMessages(Connection& c)
+{
+	unsigned type;
+	vector<unsigned char> payload;
+	while (c.in.next(type, payload))
+	{
+		c.lastHeard = now();
+		MessageReader r(payload.data(), payload.size());
+
+		switch (type)
+		{
+		case MSG_HELLO:
+		{
+			int threads;
+			if (!r.getInt(threads)) return false;
+			// Keep two tiles per thread queued so workers never wait on us.
+			c.slots = 2 * max(threads, 1);
+			MessageWriter setup(MSG_SETUP);
+			encodeSettings(setup, settings);
+			if (!setup.send(c.fd)) return false;
+			break;
+		}
+		case MSG_READY:
+			c.ready = true;
+			break;
+		case MSG_HEARTBEAT:
+			break;
+		case MSG_RESULT:
+		{
+			int tile, x0, y0, x1, y1;
+			if (!r.getInt(tile) || tile < 0 || tile >= (int)done.size()) return false;
+			raytracer->tileBounds(tile, x0, y0, x1, y1);
+			MessageReader pixels = r;
+			if (!pixels.getBytes((x1 - x0) * (y1 - y0) * PIXEL_BYTES)) return false;
+
+			if (c.inflight.erase(tile)) copies[tile]--;
+			if (!done[tile])
+			{
+				storeTile(tile, r);
+				tileTimeSum += c.lastHeard - issued[tile];
+				tileTimeCount++;
+			}
+			break;
+		}
+		case MSG_FAILED:
+		{
+			string why;
+			r.getString(why);
+			cerr << "worker failed: " << why << endl;
+			return false;
+		}
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+void Coordinator::dropWorker(size_t idx)
+{
+	Connection& c = workers[idx];
+	for (set<int>::iterator it = c.inflight.begin(); it != c.inflight.end(); ++it)
+	{
+		int tile = *it;
+		if (--copies[tile] == 0 && !done[tile])
+		{
+			pending.push_front(tile);
+			nReissued++;
+		}
+	}
+	if (c.ready) nLost++;
+	closeSocket(c.fd);
+	workers.erase(workers.begin() + idx);
+}
+
+int Coordinator::nextTileFor(const Connection& c)
+{
+	while (!pending.empty())
+	{
+		int tile = pending.front();
+		pending.pop_front();
+		if (!done[tile]) return tile;
+	}
+
+	// Nothing left to hand out: duplicate the oldest straggler, if any.
+	double avg = tileTimeCount ? tileTimeSum / tileTimeCount : 0.0;
+	double cutoff = now() - max(MIN_SLOW_TILE, SLOW_TILE_FACTOR * avg);
+	int best = -1;
+	for (int t = 0; t < (int)done.size(); t++)
+	{
+		if (done[t] || copies[t] != 1 || issued[t] > cutoff || c.inflight.count(t)) continue;
+		if (best < 0 || issued[t] < issued[best]) best = t;
+	}
+	if (best >= 0) nReissued++;
+	return best;
+}
+
+void Coordinator::assignTiles(Connection& c)
+{
+	while (c.ready && (int)c.inflight.size() < c.slots)
+	{
+		int tile = nextTileFor(c);
+		if (tile < 0) return;
+
+		c.inflight.insert(tile);
+		copies[tile]++;
+		issued[tile] = now();
+
+		MessageWriter msg(MSG_TILE);
+		msg.putInt(tile);
+		// A failed send shows up as a hangup on the next poll.
+		if (!msg.send(c.fd)) return;
+	}
+}
+
+void Coordinator::renderRemaining(int nThreads)
+{
+	vector<int> left;
+	for (int t = 0; t < (int)done.size(); t++)
+		if (!done[t]) left.push_back(t);
+
+	atomic<int> next(0);
+	auto work = [&]() {
+		for (int i; (i = next++) < (int)left.size(); )
+			raytracer->traceTile(left[i]);
+	};
+	vector<thread> threads;
+	for (int i = 1; i < nThreads; i++)
+		threads.push_back(thread(work));
+	work();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	for (size_t i = 0; i < left.size(); i++)
+		done[left[i]] = true;
+	nDone = (int)done.size();
+}
+
+bool Coordinator::run(int nThreads)
+{
+	int total = raytracer->numTiles();
+	done.assign(total, false);
+	copies.assign(total, 0);
+	issued.assign(total, 0.0);
+	pending.clear();
+	for (int t = 0; t < total; t++)
+		pending.push_back(t);
+	nDone = 0;
+
+	vector<pollfd> fds;
+	while (nDone < total)
+	{
+		fds.clear();
+		pollfd p;
+		p.fd = listenFd;
+		p.events = POLLIN;
+		p.revents = 0;
+		fds.push_back(p);
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			p.fd = workers[i].fd;
+			fds.push_back(p);
+		}
+
+		if (poll(&fds[0], fds.size(), 100) < 0 && errno != EINTR)
+			return false;
+
+		// Walk backwards so dropping a worker doesn't disturb the indices
+		// still to be visited.
+		double t = now();
+		for (size_t i = workers.size(); i-- > 0; )
+		{
+			Connection& c = workers[i];
+			bool alive = true;
+			if (fds[i + 1].revents)
+				alive = c.in.fill(c.fd);
+			// Results that arrived before a hangup are still good.
+			if (!handleMessages(c) || !alive)
+				dropWorker(i);
+			else if (!c.inflight.empty() && t - c.lastHeard > WORKER_TIMEOUT)
+			{
+				cerr << "worker timed out, re-issuing " << c.inflight.size() << " tiles" << endl;
+				dropWorker(i);
+			}
+		}
+		if (fds[0].revents & POLLIN)
+			acceptWorker();
+
+		for (size_t i = 0; i < workers.size(); i++)
+			assignTiles(workers[i]);
+
+		if (workers.empty() && reapChildren() == 0 && !acceptRemote)
+		{
+			cerr << "no workers left, rendering " << (total - nDone) << " tiles locally" << endl;
+			renderRemaining(nThreads);
+		}
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		MessageWriter(MSG_DONE).send(workers[i].fd);
+		closeSocket(workers[i].fd);
+	}
+	workers.clear();
+	for (size_t i = 0; i < children.size(); i++)
+		waitpid(children[i], 0, 0);
+	children.clear();
+	return true;
+}
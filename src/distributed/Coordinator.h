@@ -0,0 +1,85 @@
+//
+// Coordinator.h
+//
+// The coordinator side of distributed rendering.  It owns the output
+// buffer, hands tiles to worker processes over TCP and copies the returned
+// pixels into place.  Tiles held by a worker that dies are put back in the
+// queue, and once the queue runs dry tiles that are taking much longer
+// than average are speculatively issued to an idle worker as well.
+//
+
+#ifndef __COORDINATOR_H__
+#define __COORDINATOR_H__
+
+#include "Message.h"
+
+#include <deque>
+#include <set>
+#include <vector>
+#include <sys/types.h>
+
+class RayTracer;
+
+class Coordinator
+{
+public:
+	Coordinator(RayTracer* tracer, const RenderSettings& settings);
+	~Coordinator();
+
+	// Listens for workers on host:port.  An empty host accepts connections
+	// from other machines; port 0 picks a free port.
+	bool listen(const char* host, int port);
+	int port() const { return listenPort; }
+
+	// Forks and execs n copies of exe in worker mode, connected back to
+	// this coordinator over localhost.
+	bool spawnLocalWorkers(const char* exe, int n, int threadsEach);
+
+	// Runs until every tile is in the buffer.  With no workers left (and
+	// none that could still connect) the remaining tiles are rendered
+	// locally on nThreads threads.
+	bool run(int nThreads);
+
+	int tilesReissued() const { return nReissued; }
+	int workersLost() const { return nLost; }
+
+private:
+	struct Connection
+	{
+		int fd;
+		MessageStream in;
+		std::set<int> inflight;
+		int slots;
+		bool ready;
+		double lastHeard;
+	};
+
+	void acceptWorker();
+	bool handleMessages(Connection& c);
+	void dropWorker(size_t idx);
+	void assignTiles(Connection& c);
+	int nextTileFor(const Connection& c);
+	void storeTile(int tile, MessageReader& r);
+	int reapChildren();
+	void renderRemaining(int nThreads);
+
+	RayTracer* raytracer;
+	RenderSettings settings;
+	int listenFd, listenPort;
+	bool acceptRemote;
+
+	std::vector<Connection> workers;
+	std::vector<pid_t> children;
+
+	std::deque<int> pending;
+	std::vector<bool> done;
+	std::vector<int> copies;		// how many workers currently hold each tile
+	std::vector<double> issued;		// when each tile was last handed out
+	int nDone;
+
+	double tileTimeSum;
+	int tileTimeCount;
+	int nReissued, nLost;
+};
+
+#endif // __COORDINATOR_H__
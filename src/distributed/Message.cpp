@@ -0,0 +1,245 @@
+#include "Message.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static const size_t HEADER_SIZE = 8;
+
+MessageWriter::MessageWriter(unsigned type)
+	: data(HEADER_SIZE)
+{
+	unsigned t = htonl(type);
+	memcpy(&data[0], &t, 4);
+}
+
+void MessageWriter::putInt(int v)
+{
+	unsigned n = htonl((unsigned)v);
+	const unsigned char* p = (const unsigned char*)&n;
+	data.insert(data.end(), p, p + 4);
+}
+
+// Sent as the bits of an int, so it is byte-order safe like one.
+void MessageWriter::putFloat(float v)
+{
+	unsigned bits;
+	memcpy(&bits, &v, 4);
+	putInt((int)bits);
+}
+
+void MessageWriter::putString(const string& s)
+{
+	putInt((int)s.size());
+	data.insert(data.end(), s.begin(), s.end());
+}
+
+void MessageWriter::putBytes(const unsigned char* p, size_t n)
+{
+	data.insert(data.end(), p, p + n);
+}
+
+bool MessageWriter::send(int fd)
+{
+	unsigned len = htonl((unsigned)(data.size() - HEADER_SIZE));
+	memcpy(&data[4], &len, 4);
+
+	size_t sent = 0;
+	while (sent < data.size())
+	{
+		ssize_t n = ::send(fd, &data[sent], data.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		sent += n;
+	}
+	return true;
+}
+
+bool MessageReader::getInt(int& v)
+{
+	if (pos + 4 > size) return false;
+	unsigned n;
+	memcpy(&n, data + pos, 4);
+	pos += 4;
+	v = (int)ntohl(n);
+	return true;
+}
+
+bool MessageReader::getFloat(float& v)
+{
+	int bits;
+	if (!getInt(bits)) return false;
+	memcpy(&v, &bits, 4);
+	return true;
+}
+
+bool MessageReader::getString(string& s)
+{
+	int n;
+	if (!getInt(n) || n < 0 || pos + n > size) return false;
+	s.assign((const char*)data + pos, n);
+	pos += n;
+	return true;
+}
+
+const unsigned char* MessageReader::getBytes(size_t n)
+{
+	if (pos + n > size) return 0;
+	const unsigned char* p = data + pos;
+	pos += n;
+	return p;
+}
+
+bool MessageStream::fill(int fd)
+{
+	unsigned char tmp[65536];
+	for (;;)
+	{
+		ssize_t n = recv(fd, tmp, sizeof(tmp), MSG_DONTWAIT);
+		if (n > 0)
+		{
+			buf.insert(buf.end(), tmp, tmp + n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+		return false;
+	}
+}
+
+bool MessageStream::fillBlocking(int fd)
+{
+	unsigned char tmp[65536];
+	ssize_t n;
+	do {
+		n = recv(fd, tmp, sizeof(tmp), 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0) return false;
+	buf.insert(buf.end(), tmp, tmp + n);
+	return true;
+}
+
+bool MessageStream::next(unsigned& type, vector<unsigned char>& payload)
+{
+	if (buf.size() < HEADER_SIZE) return false;
+	unsigned t, len;
+	memcpy(&t, &buf[0], 4);
+	memcpy(&len, &buf[4], 4);
+	len = ntohl(len);
+	if (buf.size() < HEADER_SIZE + len) return false;
+
+	type = ntohl(t);
+	payload.assign(buf.begin() + HEADER_SIZE, buf.begin() + HEADER_SIZE + len);
+	buf.erase(buf.begin(), buf.begin() + HEADER_SIZE + len);
+	return true;
+}
+
+void encodeSettings(MessageWriter& w, const RenderSettings& s)
+{
+	w.putString(s.scenePath);
+	w.putInt(s.width);
+	w.putInt(s.height);
+	w.putInt(s.depth);
+	w.putInt(s.antiAlias);
+	w.putInt(s.pixelSamples);
+	w.putInt(s.supersampleThreshold);
+	w.putInt(s.kdTree);
+	w.putInt(s.kdMaxDepth);
+	w.putInt(s.kdLeafSize);
+	w.putInt(s.wavefront);
+	w.putInt(s.sortRays);
+	w.putInt(s.meshPrecision);
+	w.putInt(s.textureBudget);
+}
+
+bool decodeSettings(MessageReader& r, RenderSettings& s)
+{
+	int aa, kd, wf, sorted;
+	bool ok = r.getString(s.scenePath)
+		&& r.getInt(s.width) && r.getInt(s.height) && r.getInt(s.depth)
+		&& r.getInt(aa) && r.getInt(s.pixelSamples)
+		&& r.getInt(s.supersampleThreshold)
+		&& r.getInt(kd) && r.getInt(s.kdMaxDepth) && r.getInt(s.kdLeafSize)
+		&& r.getInt(wf) && r.getInt(sorted)
+		&& r.getInt(s.meshPrecision) && r.getInt(s.textureBudget);
+	// A short payload leaves the flags unread.
+	if (!ok) return false;
+	s.antiAlias = aa != 0;
+	s.kdTree = kd != 0;
+	s.wavefront = wf != 0;
+	s.sortRays = sorted != 0;
+	return true;
+}
+
+static bool resolve(const char* host, int port, sockaddr_in& addr)
+{
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (!host || !*host)
+	{
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		return true;
+	}
+	if (inet_pton(AF_INET, host, &addr.sin_addr) == 1) return true;
+
+	addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, 0, &hints, &res) != 0) return false;
+	addr.sin_addr = ((sockaddr_in*)res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
+	return true;
+}
+
+int listenSocket(const char* host, int& port)
+{
+	sockaddr_in addr;
+	if (!resolve(host, port, addr)) return -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	socklen_t len = sizeof(addr);
+	getsockname(fd, (sockaddr*)&addr, &len);
+	port = ntohs(addr.sin_port);
+	return fd;
+}
+
+int connectSocket(const char* host, int port)
+{
+	sockaddr_in addr;
+	if (!resolve(host, port, addr)) return -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	// Tile requests are tiny; don't let Nagle sit on them.
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+void closeSocket(int fd)
+{
+	if (fd >= 0) close(fd);
+}
@@ -0,0 +1,114 @@
+//
+// Message.h
+//
+// Framing and socket helpers shared by the render coordinator and its
+// workers.  Every message is an 8 byte header (type, payload length, both
+// in network byte order) followed by the payload.
+//
+
+#ifndef __MESSAGE_H__
+#define __MESSAGE_H__
+
+#include <string>
+#include <vector>
+
+enum MessageType
+{
+	MSG_HELLO = 1,		// worker -> coordinator, payload: thread count
+	MSG_SETUP,			// coordinator -> worker, payload: RenderSettings
+	MSG_READY,			// worker -> coordinator, scene loaded
+	MSG_TILE,			// coordinator -> worker, payload: tile index
+	MSG_RESULT,			// worker -> coordinator, payload: tile index + per pixel
+						// float rgb and sample count (PIXEL_BYTES)
+	MSG_DONE,			// coordinator -> worker, no more tiles
+	MSG_FAILED,			// worker -> coordinator, payload: error text
+	MSG_HEARTBEAT		// worker -> coordinator, still alive while rendering
+};
+
+const int PIXEL_BYTES = 16;		// per pixel of a MSG_RESULT
+// Seconds between a serving worker's heartbeats, so a tile that takes
+// longer than the coordinator's timeout doesn't get its worker dropped.
+const int HEARTBEAT_INTERVAL = 5;
+
+// Everything a worker needs to reproduce the coordinator's image.  The
+// scene is referenced by path, so remote workers need to see the same
+// file system layout (e.g. a shared home directory).
+struct RenderSettings
+{
+	std::string scenePath;
+	int width, height;
+	int depth;
+	bool antiAlias;
+	int pixelSamples;
+	int supersampleThreshold;
+	bool kdTree;
+	int kdMaxDepth;
+	int kdLeafSize;
+	bool wavefront;
+	bool sortRays;
+	int meshPrecision;			// Trimesh::Precision
+	int textureBudget;			// MB
+
+	RenderSettings() : width(0), height(0), depth(0), antiAlias(false),
+		pixelSamples(1), supersampleThreshold(0), kdTree(false),
+		kdMaxDepth(0), kdLeafSize(0), wavefront(false), sortRays(false),
+		meshPrecision(0), textureBudget(256) {}
+};
+
+class MessageWriter
+{
+public:
+	explicit MessageWriter(unsigned type);
+
+	void putInt(int v);
+	void putFloat(float v);
+	void putString(const std::string& s);
+	void putBytes(const unsigned char* data, size_t n);
+
+	// Writes the whole message; false if the peer has gone away.
+	bool send(int fd);
+
+private:
+	std::vector<unsigned char> data;
+};
+
+class MessageReader
+{
+public:
+	MessageReader(const unsigned char* data, size_t n) : data(data), size(n), pos(0) {}
+
+	bool getInt(int& v);
+	bool getFloat(float& v);
+	bool getString(std::string& s);
+	const unsigned char* getBytes(size_t n);
+
+private:
+	const unsigned char* data;
+	size_t size, pos;
+};
+
+// Accumulates whatever bytes are available on a socket and splits them
+// into complete messages, so a stalled peer never blocks the reader.
+class MessageStream
+{
+public:
+	// Reads what is available without blocking; false on EOF or error.
+	bool fill(int fd);
+	// Blocks until at least one more message is buffered.
+	bool fillBlocking(int fd);
+	bool next(unsigned& type, std::vector<unsigned char>& payload);
+
+private:
+	std::vector<unsigned char> buf;
+};
+
+void encodeSettings(MessageWriter& w, const RenderSettings& s);
+bool decodeSettings(MessageReader& r, RenderSettings& s);
+
+// Returns a listening socket bound to host:port (port 0 picks a free
+// one, reported back through port), or -1.
+int listenSocket(const char* host, int& port);
+int connectSocket(const char* host, int port);
+void closeSocket(int fd);
+
+#endif // __MESSAGE_H__
@@ -0,0 +1,154 @@
+#include "Worker.h"
+#include "../RayTracer.h"
+
+#include <thread>
+#include <chrono>
+#include <vector>
+
+using namespace std;
+
+RenderWorker::RenderWorker(RayTracer* tracer, int threads)
+	: raytracer(tracer), nThreads(threads < 1 ? 1 : threads), fd(-1),
+	  finished(false), sendFailed(false)
+{
+}
+
+RenderWorker::~RenderWorker()
+{
+	closeSocket(fd);
+}
+
+bool RenderWorker::connect(const char* host, int port, RenderSettings& settings)
+{
+	fd = connectSocket(host, port);
+	if (fd < 0) return false;
+
+	MessageWriter hello(MSG_HELLO);
+	hello.putInt(nThreads);
+	if (!hello.send(fd)) return false;
+
+	unsigned type;
+	vector<unsigned char> payload;
+	while (!in.next(type, payload))
+		if (!in.fillBlocking(fd)) return false;
+	if (type != MSG_SETUP) return false;
+
+	MessageReader r(payload.data(), payload.size());
+	return decodeSettings(r, settings);
+}
+
+void RenderWorker::fail(const string& why)
+{
+	MessageWriter msg(MSG_FAILED);
+	msg.putString(why);
+	msg.send(fd);
+}
+
+bool RenderWorker::sendTile(int tile)
+{
+	int x0, y0, x1, y1;
+	raytracer->tileBounds(tile, x0, y0, x1, y1);
+
+	// The framebuffer's own values, so the coordinator's HDR image is
+	// the same as if it had rendered the tile itself.
+	MessageWriter msg(MSG_RESULT);
+	msg.putInt(tile);
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++)
+		{
+			Vec3d c = raytracer->frame.get(x, y);
+			msg.putFloat((float)c[0]);
+			msg.putFloat((float)c[1]);
+			msg.putFloat((float)c[2]);
+			msg.putInt((int)raytracer->frame.samples(x, y));
+		}
+
+	lock_guard<mutex> guard(sendLock);
+	if (!sendFailed && !msg.send(fd)) sendFailed = true;
+	return !sendFailed;
+}
+
+void RenderWorker::renderThread(RenderWorker* worker, int index)
+{
+	worker->raytracer->bindRenderThread(index, worker->nThreads);
+	for (;;)
+	{
+		int tile;
+		{
+			unique_lock<mutex> guard(worker->queueLock);
+			worker->queueCond.wait(guard, [worker] { return worker->finished || !worker->tiles.empty(); });
+			if (worker->tiles.empty()) return;
+			tile = worker->tiles.front();
+			worker->tiles.pop_front();
+		}
+		worker->raytracer->traceTile(tile);
+		if (!worker->sendTile(tile)) return;
+	}
+}
+
+// Tiles can take longer than the coordinator waits to hear from a worker,
+// so the worker says it is alive between results too.
+void RenderWorker::heartbeatThread(RenderWorker* worker)
+{
+	unique_lock<mutex> guard(worker->queueLock);
+	while (!worker->finishedCond.wait_for(guard, chrono::seconds(HEARTBEAT_INTERVAL),
+		[worker] { return worker->finished; }))
+	{
+		guard.unlock();
+		{
+			lock_guard<mutex> sending(worker->sendLock);
+			if (!worker->sendFailed && !MessageWriter(MSG_HEARTBEAT).send(worker->fd))
+				worker->sendFailed = true;
+		}
+		guard.lock();
+	}
+}
+
+bool RenderWorker::serve()
+{
+	if (!MessageWriter(MSG_READY).send(fd)) return false;
+
+	vector<thread> threads;
+	for (int i = 0; i < nThreads; i++)
+		threads.push_back(thread(renderThread, this, i));
+	thread heartbeat(heartbeatThread, this);
+
+	bool ok = true;
+	unsigned type;
+	vector<unsigned char> payload;
+	while (ok)
+	{
+		if (!in.next(type, payload))
+		{
+			ok = in.fillBlocking(fd);
+			continue;
+		}
+		if (type == MSG_DONE) break;
+		if (type == MSG_TILE)
+		{
+			MessageReader r(payload.data(), payload.size());
+			int tile;
+			if (r.getInt(tile) && tile >= 0 && tile < raytracer->numTiles())
+			{
+				lock_guard<mutex> guard(queueLock);
+				tiles.push_back(tile);
+				queueCond.notify_one();
+			}
+		}
+	}
+
+	{
+		// On DONE every tile we still hold is a duplicate someone else
+		// already finished; on a lost connection nobody wants it.
+		lock_guard<mutex> guard(queueLock);
+		tiles.clear();
+		finished = true;
+		queueCond.notify_all();
+		finishedCond.notify_all();
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	heartbeat.join();
+
+	return ok;
+}
@@ -0,0 +1,53 @@
+//
+// Worker.h
+//
+// The worker side of distributed rendering.  A worker connects to a
+// coordinator, receives the render settings, loads the same scene and then
+// renders whatever tiles it is handed until told to stop.
+//
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include "Message.h"
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+class RayTracer;
+
+class RenderWorker
+{
+public:
+	RenderWorker(RayTracer* tracer, int threads);
+	~RenderWorker();
+
+	// Connects and waits for the coordinator's settings.
+	bool connect(const char* host, int port, RenderSettings& settings);
+	// Tells the coordinator the scene could not be loaded.
+	void fail(const std::string& why);
+	// Renders tiles until the coordinator says DONE or goes away.
+	bool serve();
+
+private:
+	static void renderThread(RenderWorker* worker, int index);
+	static void heartbeatThread(RenderWorker* worker);
+	bool sendTile(int tile);
+
+	RayTracer* raytracer;
+	int nThreads;
+	int fd;
+	MessageStream in;
+
+	std::mutex queueLock;
+	std::condition_variable queueCond;
+	std::deque<int> tiles;
+	bool finished;
+	std::condition_variable finishedCond;	// for the heartbeat
+
+	std::mutex sendLock;
+	bool sendFailed;
+};
+
+#endif // __WORKER_H__
@@ -11,8 +11,9 @@
 
 #include "bitmap.h"
  
-BMP_BITMAPFILEHEADER bmfh; 
-BMP_BITMAPINFOHEADER bmih; 
+// Per thread, so that several bitmaps can be read or written at once
+thread_local BMP_BITMAPFILEHEADER bmfh; 
+thread_local BMP_BITMAPINFOHEADER bmih; 
 
 unsigned char *readBMP(const char *fname, int& width, int& height)
 { 
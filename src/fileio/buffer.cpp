@@ -1,7 +1,7 @@
 /*
-  The Buffer class is essentially a wrapper for an istream.
-  It is here mainly to keep track of the current file location
-  (line number, column number) to print intelligent error messages.
+  The Buffer class holds the whole text of a scene file in one
+  contiguous block, so that the tokenizer can scan it with plain
+  pointers.
 
 
   If you find yourself changing stuff in this file, you're probably
@@ -9,94 +9,82 @@
 */
 
 #include <string>
+#include <fstream>
+#include <sstream>
 #include "buffer.h"
 
-#include "../parser/Parser.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Buffer::Buffer(FILE*,...) constructor
+// Buffer::Buffer(istream&) constructor
 //
-//   This constructor sets up the initial state that we need in order
-// to read files.
+//   Reads everything that is left in the stream.
 //
 
-Buffer::Buffer(istream& is, bool printChars, bool printLines)
-  : inStream( is )
-{ 
-    PositionInCurrentLine = Line.begin();
-    LineNumber            = 0;
-    ColNumber             = 0;
-    LastPrintedLine       = 0;
-    
-    _printChars = printChars;
-    _printLines = printLines;
+Buffer::Buffer(istream& is)
+  : text( 0 ), length( 0 ), mapping( 0 )
+{
+    std::ostringstream all;
+    all << is.rdbuf();
+    contents = all.str();
+    text = contents.data();
+    length = contents.size();
 }
 
 
 //////////////////////////////////////////////////////////////////////////
 //
-// char Buffer::GetCh() private method
+// Buffer::Buffer(const string&) constructor
 //
-//   GetCh() gets a new character from the buffer and returns it
+//   Maps the file read-only; the pages are only read as the tokenizer
+// gets to them.  Empty files, which can't be mapped, and systems without
+// mmap() get the file read into memory instead.  isOpen() is false if the
+// file can't be opened at all.
 //
 
-char Buffer::GetCh() {
-  if (!inStream) {
-    return '\0';
-  }
-
-  // advance position
-  if(!Line.empty() && PositionInCurrentLine != Line.end()) {
-	  PositionInCurrentLine++;
-	  ColNumber++;
-  }
-
-  while (PositionInCurrentLine == Line.end() || Line.empty()) {
-    // need to read another line of input from the file
-
-    GetLine();
-    if (!inStream) {
-      return '\0';
+Buffer::Buffer(const string& filename)
+  : text( 0 ), length( 0 ), mapping( 0 )
+{
+#ifndef _WIN32
+    int fd = open( filename.c_str(), O_RDONLY );
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0) {
+      void* p = mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+      if (p != MAP_FAILED) {
+        // Scanned front to back exactly once
+        madvise( p, (size_t)st.st_size, MADV_SEQUENTIAL );
+        mapping = p;
+        text = (const char*)p;
+        length = (size_t)st.st_size;
+      }
     }
-  }
-
-
-  // extract character from line buffer
-  char CurrentCh = *PositionInCurrentLine;
-
-  if (_printChars) {
-    std::cout << "Read character `" << CurrentCh << "'" << std::endl;
-  }
-
-  return CurrentCh;
+    close( fd );
+    if (mapping) return;
+#endif
+
+    std::ifstream ifs( filename.c_str(), std::ios::binary );
+    if (!ifs) return;
+    std::ostringstream all;
+    all << ifs.rdbuf();
+    contents = all.str();
+    text = contents.data();
+    length = contents.size();
 }
 
-
-//////////////////////////////////////////////////////////////////////////
-//
-// void Buffer::GetLine() private method
-//
-//   GetLine() reads a new line from the file into the Line buffer
-// variable.  It also handles listings, if necessary.  Returns are false
-// for EOF or true for got a new buffer.
-//
-// This function is weak, in that it can't handle arbitrarily long lines
-// in a file.  Ideally it would be rewritten so that it can do this fine.
-// The real difficulty is in being able to print out, on demand, the whole
-// line of input, of arbitrary length.
-//
-
-void Buffer::GetLine() {
-  std::getline(inStream, Line);
-  Line.append( "\n" ); // because iostreams strip out the end-of-line char
-  PositionInCurrentLine = Line.begin();
-
-  ColNumber = 0;
-  LineNumber ++;
-
-  if (_printLines) PrintLine( std::cout );
+Buffer::~Buffer()
+{
+#ifndef _WIN32
+    if (mapping) munmap( mapping, length );
+#endif
 }
 
 
@@ -104,12 +92,14 @@ void Buffer::GetLine() {
 //
 // void Buffer::PrintLine() method
 //
-//   This method displays the current line on the screen.
+//   This method displays the line starting at lineStart on the screen.
 //
 
-void Buffer::PrintLine( ostream& out ) const {
-  if (LineNumber > LastPrintedLine) {
-    out << "# " << Line << std::endl;
-    LastPrintedLine = LineNumber;
-  }
+void Buffer::PrintLine( ostream& out, const char* lineStart ) const {
+  const char* lineEnd = lineStart;
+  while (lineEnd != end() && '\n' != *lineEnd && '\r' != *lineEnd)
+    lineEnd++;
+  out << "# ";
+  out.write( lineStart, lineEnd - lineStart );
+  out << std::endl;
 }
@@ -6,21 +6,25 @@
 
 
 /*
-  The Buffer class is essentially a wrapper for an istream.
-  It is here mainly to keep track of the current file location
-  (line number, column number) to print intelligent error messages.
+  The Buffer class holds the whole text of a scene file in one
+  contiguous block, so that the tokenizer can scan it with plain
+  pointers instead of reading it a character at a time.  Files are
+  memory-mapped where the system allows it; streams are read in once.
 
+  It also prints source lines for intelligent error messages; the
+  tokenizer keeps track of where lines start.
 
   If you find yourself changing stuff in this file, you're probably
   doing something wrong.
 
   This class was borrowed from the stock PL0 source code used for
-  CSE401, because I didn't feel like rewriting it. 
+  CSE401, because I didn't feel like rewriting it.
   ( see http://www.cs.washington.edu/401 for details )
 */
 
 #include <iostream>
 #include <string>
+#include <cstddef>
 
 
 using std::istream;
@@ -29,29 +33,28 @@ using std::string;
 
 class Buffer {
  public:
-  Buffer(std::istream& file, bool printChars, bool printLines);
+  Buffer(std::istream& file);			// Read all of file
+  Buffer(const std::string& filename);	// Map filename; see isOpen()
+  ~Buffer();
 
-  char GetCh();			// Read and return next character
-  bool isEOF() { return !(inStream); }	// Return whether is end of file
+  bool isOpen() const { return text != 0; }
 
-  void PrintLine(std::ostream& out) const;		// Print current line
+  // The text, which is not NUL-terminated.
+  const char* begin() const { return text; }
+  const char* end() const { return text + length; }
 
-  int  CurColumn() const { return ColNumber; }
-  int  CurLine() const { return LineNumber; }	// Return current line #
-  
-protected:
-  void  GetLine();		// Read next line from file
+  // Print the line that starts at lineStart
+  void PrintLine(std::ostream& out, const char* lineStart) const;
 
-  std::istream& inStream;            // The file pointer to the source file
+ protected:
+  Buffer(const Buffer&);
+  Buffer& operator=(const Buffer&);
 
-  std::string Line;                  // The line buffer
-  std::string::const_iterator PositionInCurrentLine;
+  const char* text;
+  size_t length;
 
-  int   ColNumber;		// The number of the current column
-  int   LineNumber;             // The number of the line in the file
-  mutable int   LastPrintedLine;        // The line number of the last printed line
-
-  bool _printLines, _printChars; // printing flags
+  std::string contents;		// what was read, when not mapped
+  void* mapping;			// the mapped file, if it was
 };
 
 #endif
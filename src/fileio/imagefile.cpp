@@ -0,0 +1,351 @@
+#include "imagefile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+// Raw bytes per deflate band.  Big enough that the bands' seams cost
+// next to nothing, small enough that a 4K image has plenty of them.
+static const size_t BAND_BYTES = 256 * 1024;
+static const size_t WINDOW_BYTES = 32 * 1024;
+
+ImageFormat imageFormat(const char* name)
+{
+	const char* dot = strrchr(name, '.');
+	if (!dot) return IMAGE_BMP;
+	string ext(dot + 1);
+	for (size_t k = 0; k < ext.size(); k++)
+		ext[k] = (char)tolower((unsigned char)ext[k]);
+	if (ext == "png") return IMAGE_PNG;
+	if (ext == "pfm") return IMAGE_PFM;
+	return IMAGE_BMP;
+}
+
+// Calls f(k) for k in [0,n) on up to nThreads threads.
+template <class F>
+static void parallelFor(int n, int nThreads, const F& f)
+{
+	atomic<int> next(0);
+	auto work = [&] {
+		for (int k; (k = next++) < n; )
+			f(k);
+	};
+	nThreads = max(1, min(nThreads, n));
+	vector<thread> threads;
+	for (int t = 1; t < nThreads; t++)
+		threads.push_back(thread(work));
+	work();
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+static inline unsigned char paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return (unsigned char)a;
+	return (unsigned char)(pb <= pc ? b : c);
+}
+
+// Filter type ft applied to byte k of row, with prev the row above.
+static inline unsigned char filterByte(int ft, const unsigned char* row,
+	const unsigned char* prev, int k)
+{
+	int a = k >= 3 ? row[k - 3] : 0;
+	int b = prev[k];
+	int c = k >= 3 ? prev[k - 3] : 0;
+	switch (ft)
+	{
+	case 1:  return (unsigned char)(row[k] - a);
+	case 2:  return (unsigned char)(row[k] - b);
+	case 3:  return (unsigned char)(row[k] - ((a + b) >> 1));
+	case 4:  return (unsigned char)(row[k] - paeth(a, b, c));
+	default: return row[k];
+	}
+}
+
+// Writes the filter byte and the filtered row to out, using the filter
+// whose output has the smallest sum of magnitudes, as libpng does.
+static void filterRow(const unsigned char* row, const unsigned char* prev,
+	int bytes, unsigned char* out)
+{
+	int best = 0;
+	unsigned long bestSum = ~0UL;
+	for (int ft = 0; ft < 5; ft++)
+	{
+		unsigned long sum = 0;
+		for (int k = 0; k < bytes && sum < bestSum; k++)
+			sum += abs((signed char)filterByte(ft, row, prev, k));
+		if (sum < bestSum)
+		{
+			bestSum = sum;
+			best = ft;
+		}
+	}
+	out[0] = (unsigned char)best;
+	for (int k = 0; k < bytes; k++)
+		out[k + 1] = filterByte(best, row, prev, k);
+}
+
+// A raw deflate stream for in, ending on a byte boundary so the next
+// band's can follow it, or ending the stream if last.
+static void deflateBand(const unsigned char* dict, size_t dictLen,
+	const unsigned char* in, size_t n, bool last, vector<unsigned char>& out)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	if (dictLen) deflateSetDictionary(&z, dict, (uInt)dictLen);
+	out.resize(deflateBound(&z, (uLong)n) + 16);
+	z.next_in = (Bytef*)in;
+	z.avail_in = (uInt)n;
+	z.next_out = &out[0];
+	z.avail_out = (uInt)out.size();
+	deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+	out.resize(out.size() - z.avail_out);
+	deflateEnd(&z);
+}
+
+static void putBigEndian(unsigned char* p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+PngWriter::PngWriter()
+	: file(NULL), width(0), height(0), nThreads(1), rowsWritten(0), ok(false),
+	  history(0), adler(1)
+{
+}
+
+PngWriter::~PngWriter()
+{
+	if (file) fclose(file);
+}
+
+bool PngWriter::open(const char* name, int _width, int _height, int _nThreads)
+{
+	file = fopen(name, "wb");
+	if (!file) return false;
+	width = _width;
+	height = _height;
+	nThreads = max(1, _nThreads);
+	rowsWritten = 0;
+	ok = true;
+	prevRow.assign((size_t)width * 3, 0);
+	filtered.clear();
+	history = 0;
+	adler = adler32(0, Z_NULL, 0);
+
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	ok = fwrite(signature, 8, 1, file) == 1;
+
+	unsigned char ihdr[13];
+	putBigEndian(ihdr, width);
+	putBigEndian(ihdr + 4, height);
+	ihdr[8] = 8;		// bits per sample
+	ihdr[9] = 2;		// RGB
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	writeChunk("IHDR", ihdr, 13);
+	return true;
+}
+
+void PngWriter::writeRows(const unsigned char* const* rows, int n)
+{
+	if (!file || n <= 0) return;
+	int bytes = width * 3;
+	size_t start = filtered.size();
+	filtered.resize(start + (size_t)n * (bytes + 1));
+	unsigned char* out = &filtered[start];
+	const unsigned char* above = &prevRow[0];
+	parallelFor(n, nThreads, [&](int k) {
+		filterRow(rows[k], k ? rows[k - 1] : above, bytes, out + (size_t)k * (bytes + 1));
+	});
+	memcpy(&prevRow[0], rows[n - 1], bytes);
+	rowsWritten += n;
+
+	deflateBands(false);
+}
+
+// Compresses the complete bands after the history, or everything left if
+// last, side by side; then writes them in order, one IDAT chunk each.
+void PngWriter::deflateBands(bool last)
+{
+	size_t pending = filtered.size() - history;
+	int nBands = (int)(last ? max<size_t>(1, (pending + BAND_BYTES - 1) / BAND_BYTES)
+		: pending / BAND_BYTES);
+	if (nBands == 0) return;
+
+	vector<vector<unsigned char> > out(nBands);
+	vector<uLong> adlers(nBands);
+	const unsigned char* base = filtered.empty() ? NULL : &filtered[0];
+	parallelFor(nBands, nThreads, [&](int b) {
+		size_t offset = history + b * BAND_BYTES;
+		size_t n = min(BAND_BYTES, filtered.size() - offset);
+		size_t dictLen = min(WINDOW_BYTES, offset);
+		deflateBand(base + offset - dictLen, dictLen, base + offset, n,
+			last && b == nBands - 1, out[b]);
+		adlers[b] = adler32(adler32(0, Z_NULL, 0), base + offset, (uInt)n);
+	});
+
+	size_t consumed = history;
+	for (int b = 0; b < nBands; b++)
+	{
+		size_t n = min(BAND_BYTES, filtered.size() - consumed);
+		adler = adler32_combine(adler, adlers[b], (z_off_t)n);
+		consumed += n;
+		vector<unsigned char>& data = out[b];
+		if (b == 0 && history == 0)
+		{
+			static const unsigned char zlibHeader[2] = { 0x78, 0x9c };
+			data.insert(data.begin(), zlibHeader, zlibHeader + 2);
+		}
+		if (last && b == nBands - 1)
+		{
+			data.resize(data.size() + 4);
+			putBigEndian(&data[data.size() - 4], (uint32_t)adler);
+		}
+		writeChunk("IDAT", data.empty() ? NULL : &data[0], data.size());
+	}
+
+	size_t keep = min(WINDOW_BYTES, consumed);
+	filtered.erase(filtered.begin(), filtered.begin() + (consumed - keep));
+	history = keep;
+}
+
+void PngWriter::writeChunk(const char* type, const unsigned char* data, size_t n)
+{
+	unsigned char head[8];
+	putBigEndian(head, (uint32_t)n);
+	memcpy(head + 4, type, 4);
+	uLong crc = crc32(0, head + 4, 4);
+	if (n) crc = crc32(crc, data, (uInt)n);
+	unsigned char tail[4];
+	putBigEndian(tail, (uint32_t)crc);
+
+	ok = ok && fwrite(head, 8, 1, file) == 1;
+	if (n) ok = ok && fwrite(data, n, 1, file) == 1;
+	ok = ok && fwrite(tail, 4, 1, file) == 1;
+}
+
+bool PngWriter::close()
+{
+	if (!file) return false;
+	if (rowsWritten != height) ok = false;
+	deflateBands(true);
+	writeChunk("IEND", NULL, 0);
+	ok = fclose(file) == 0 && ok;
+	file = NULL;
+	filtered.clear();
+	return ok;
+}
+
+static void putLittleEndian(unsigned char* p, uint32_t v, int bytes)
+{
+	for (int k = 0; k < bytes; k++)
+		p[k] = (unsigned char)(v >> (8 * k));
+}
+
+ImageWriter::ImageWriter()
+	: format(IMAGE_BMP), file(NULL), width(0), height(0), rowsWritten(0), ok(false)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+	if (file) fclose(file);
+}
+
+bool ImageWriter::open(const char* name, int _width, int _height, int nThreads)
+{
+	format = imageFormat(name);
+	width = _width;
+	height = _height;
+	rowsWritten = 0;
+	if (format == IMAGE_PNG) return png.open(name, width, height, nThreads);
+
+	file = fopen(name, "wb");
+	if (!file) return false;
+	if (format == IMAGE_PFM)
+	{
+		// A negative scale marks little-endian floats.
+		const uint16_t one = 1;
+		bool little = *(const unsigned char*)&one == 1;
+		ok = fprintf(file, "PF\n%d %d\n%s\n", width, height, little ? "-1.0" : "1.0") > 0;
+		return true;
+	}
+
+	// Rows are padded to a multiple of 4 bytes.
+	int rowBytes = (width * 3 + 3) & ~3;
+	scanline.assign(rowBytes, 0);
+	uint32_t imageBytes = (uint32_t)rowBytes * height;
+	unsigned char header[54] = { 'B', 'M' };
+	putLittleEndian(header + 2, 54 + imageBytes, 4);	// file size
+	putLittleEndian(header + 10, 54, 4);				// offset of the pixels
+	putLittleEndian(header + 14, 40, 4);				// info header size
+	putLittleEndian(header + 18, width, 4);
+	putLittleEndian(header + 22, height, 4);
+	putLittleEndian(header + 26, 1, 2);					// planes
+	putLittleEndian(header + 28, 24, 2);				// bits per pixel
+	putLittleEndian(header + 38, (uint32_t)(100 / 2.54 * 72), 4);
+	putLittleEndian(header + 42, (uint32_t)(100 / 2.54 * 72), 4);
+	ok = fwrite(header, sizeof(header), 1, file) == 1;
+	return true;
+}
+
+void ImageWriter::writeRows(const unsigned char* const* rows, int n)
+{
+	if (format == IMAGE_PNG)
+	{
+		png.writeRows(rows, n);
+		return;
+	}
+	if (!file || format != IMAGE_BMP)
+	{
+		ok = false;
+		return;
+	}
+	for (int k = 0; k < n; k++)
+	{
+		const unsigned char* row = rows[k];
+		for (int i = 0; i < width; i++)
+		{
+			scanline[i * 3] = row[i * 3 + 2];
+			scanline[i * 3 + 1] = row[i * 3 + 1];
+			scanline[i * 3 + 2] = row[i * 3];
+		}
+		ok = ok && fwrite(&scanline[0], scanline.size(), 1, file) == 1;
+	}
+	rowsWritten += n;
+}
+
+void ImageWriter::writeRows(const float* const* rows, int n)
+{
+	if (!file || format != IMAGE_PFM)
+	{
+		ok = false;
+		return;
+	}
+	for (int k = 0; k < n; k++)
+		ok = ok && (width == 0 || fwrite(rows[k], sizeof(float) * 3 * width, 1, file) == 1);
+	rowsWritten += n;
+}
+
+bool ImageWriter::close()
+{
+	if (format == IMAGE_PNG) return png.close();
+	if (!file) return false;
+	if (rowsWritten != height) ok = false;
+	ok = fclose(file) == 0 && ok;
+	file = NULL;
+	return ok;
+}
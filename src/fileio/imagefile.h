@@ -0,0 +1,98 @@
+//
+// imagefile.h
+//
+// Writes rendered images as BMP, PNG or PFM, a batch of rows at a time so
+// they can be written while they render.  PNG rows are filtered and
+// deflated in bands on several threads; each band is its own deflate
+// stream, primed with the 32K before it so little is lost to the split,
+// and the streams are joined into one zlib stream.  PFM keeps the float
+// framebuffer's colors as they are.
+//
+
+#ifndef __IMAGEFILE_H__
+#define __IMAGEFILE_H__
+
+#include <stdio.h>
+#include <vector>
+
+#include "zlib.h"
+
+enum ImageFormat { IMAGE_BMP, IMAGE_PNG, IMAGE_PFM };
+
+// By name's extension, ignoring case; anything but .png and .pfm is BMP.
+ImageFormat imageFormat(const char* name);
+
+// Writes an 8-bit RGB PNG a batch of rows at a time, top row first.
+class PngWriter
+{
+public:
+	PngWriter();
+	~PngWriter();
+
+	// Writes the header.  False if the file can't be opened.
+	bool open(const char* name, int width, int height, int nThreads = 1);
+	// Adds the next n rows, rows[k] being width RGB pixels.  They are
+	// filtered right away; full bands are compressed and written, and the
+	// rest waits for more rows.
+	void writeRows(const unsigned char* const* rows, int n);
+	// After the last row: writes what is left and closes the file.  False
+	// if any write failed.
+	bool close();
+
+private:
+	PngWriter(const PngWriter&);
+	PngWriter& operator=(const PngWriter&);
+
+	void deflateBands(bool last);
+	void writeChunk(const char* type, const unsigned char* data, size_t n);
+
+	FILE* file;
+	int width, height;
+	int nThreads;
+	int rowsWritten;
+	bool ok;
+
+	std::vector<unsigned char> prevRow;		// unfiltered, for the next batch
+	std::vector<unsigned char> filtered;	// history, then rows not yet compressed
+	size_t history;							// bytes at its start already compressed
+	uLong adler;							// of everything compressed so far
+};
+
+// Writes an image in the format its name's extension picks, a batch of
+// rows at a time, so that the whole image never has to be in memory.
+// Rows go in the order the format stores them, topRowFirst() or else
+// bottom row first: PNG is top down, BMP and PFM bottom up.
+class ImageWriter
+{
+public:
+	ImageWriter();
+	~ImageWriter();
+
+	// Writes the header.  False if the file can't be opened.
+	bool open(const char* name, int width, int height, int nThreads = 1);
+
+	ImageFormat getFormat() const { return format; }
+	bool topRowFirst() const { return format == IMAGE_PNG; }
+	// PFM takes float rows, the others 8-bit ones.
+	bool floatRows() const { return format == IMAGE_PFM; }
+
+	// The next n rows, each width RGB pixels.
+	void writeRows(const unsigned char* const* rows, int n);
+	void writeRows(const float* const* rows, int n);
+	// After the last row.  False if any write failed or rows are missing.
+	bool close();
+
+private:
+	ImageWriter(const ImageWriter&);
+	ImageWriter& operator=(const ImageWriter&);
+
+	ImageFormat format;
+	FILE* file;					// BMP and PFM; PNG has its own
+	PngWriter png;
+	int width, height;
+	int rowsWritten;
+	bool ok;
+	std::vector<unsigned char> scanline;	// a padded BGR row, for BMP
+};
+
+#endif // __IMAGEFILE_H__
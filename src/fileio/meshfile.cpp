@@ -0,0 +1,610 @@
+#include "meshfile.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include "buffer.h"
+#include "../parser/ParserException.h"
+#include "../parser/Tokenizer.h"
+
+using namespace std;
+
+//
+// Numbers in text files
+//
+
+static inline bool isDigit( char c ) { return c >= '0' && c <= '9'; }
+static inline bool isBlank( char c ) { return ' ' == c || '\t' == c || '\r' == c; }
+
+// Reads the number at p, moving p past it, with the scene tokenizer's
+// conversion so that a number reads the same in either kind of file.
+static bool parseDouble( const char*& p, const char* end, double& value )
+{
+	const char* q = p;
+	if( q != end && ('-' == *q || '+' == *q) ) q++;
+	if( q != end && '.' == *q ) q++;
+	if( q == end || !isDigit( *q ) ) return false;
+	value = Tokenizer::ScanScalar( p, end, p );
+	return true;
+}
+
+static bool parseInt( const char*& p, const char* end, long long& value )
+{
+	const char* q = p;
+	bool negative = false;
+	if( q != end && ('-' == *q || '+' == *q) ) negative = ( '-' == *q++ );
+	if( q == end || !isDigit( *q ) ) return false;
+	long long n = 0;
+	for( ; q != end && isDigit( *q ); q++ )
+		if( n < INT_MAX ) n = n * 10 + (*q - '0');
+	value = negative ? -n : n;
+	p = q;
+	return true;
+}
+
+// The 1-based line that p is on, for error messages.
+static int lineOf( const Buffer& buffer, const char* p )
+{
+	int line = 1;
+	for( const char* c = buffer.begin(); c != p; c++ )
+		if( '\n' == *c ) line++;
+	return line;
+}
+
+static void fail( const string& filename, const string& why )
+{
+	throw ParserException( "Mesh file '" + filename + "' " + why + "." );
+}
+
+//
+// Wavefront OBJ
+//
+
+// What one thread makes of its share of the lines.  Corners are (vertex,
+// normal) index pairs, three corners per triangle.  Positive OBJ indices
+// count from the start of the file and are stored 0-based; negative ones
+// count back from the chunk's own vertices and need the number of
+// vertices in earlier chunks added, which is what relative lists.
+static const int NO_NORMAL = INT_MIN;
+
+struct ObjChunk
+{
+	const char* begin;
+	const char* end;
+	vector<Vec3d> vertices, normals;
+	vector<int> corners;
+	vector<size_t> relative;
+	const char* errorAt;
+	string error;
+
+	ObjChunk() : begin( 0 ), end( 0 ), errorAt( 0 ) {}
+};
+
+static void parseObjChunk( ObjChunk* chunk )
+{
+	const char* p = chunk->begin;
+	const char* end = chunk->end;
+	vector<int> polygon;
+	while( p != end )
+	{
+		const char* line = p;
+		const char* eol = (const char*)memchr( p, '\n', end - p );
+		if( !eol ) eol = end;
+		p = eol == end ? end : eol + 1;
+
+		const char* c = line;
+		while( c != eol && isBlank( *c ) ) c++;
+		if( c == eol || '#' == *c ) continue;
+
+		bool vertex = 'v' == c[0] && c + 1 != eol && isBlank( c[1] );
+		bool normal = 'v' == c[0] && c + 2 < eol && 'n' == c[1] && isBlank( c[2] );
+		if( vertex || normal )
+		{
+			c += vertex ? 1 : 2;
+			double xyz[3];
+			for( int k = 0; k < 3; k++ )
+			{
+				while( c != eol && isBlank( *c ) ) c++;
+				if( !parseDouble( c, eol, xyz[k] ) )
+				{
+					chunk->errorAt = line;
+					chunk->error = "has a bad vertex";
+					return;
+				}
+			}
+			( vertex ? chunk->vertices : chunk->normals ).push_back( Vec3d( xyz[0], xyz[1], xyz[2] ) );
+		}
+		else if( 'f' == c[0] && c + 1 != eol && isBlank( c[1] ) )
+		{
+			// Each corner is v, v/vt, v/vt/vn or v//vn.
+			polygon.clear();
+			for( c++; ; )
+			{
+				while( c != eol && isBlank( *c ) ) c++;
+				if( c == eol ) break;
+				long long v, n = 0;
+				bool ok = parseInt( c, eol, v ) && v != 0;
+				if( ok && c != eol && '/' == *c )
+				{
+					c++;
+					long long t;
+					if( c != eol && '/' != *c ) ok = parseInt( c, eol, t );
+					if( ok && c != eol && '/' == *c )
+					{
+						c++;
+						ok = parseInt( c, eol, n ) && n != 0;
+					}
+				}
+				if( !ok || (c != eol && !isBlank( *c )) )
+				{
+					chunk->errorAt = line;
+					chunk->error = "has a bad face";
+					return;
+				}
+				polygon.push_back( v > 0 ? (int)(v - 1) : (int)(chunk->vertices.size() + v) );
+				polygon.push_back( v > 0 ? 0 : 1 );
+				polygon.push_back( n > 0 ? (int)(n - 1) : n < 0 ? (int)(chunk->normals.size() + n) : NO_NORMAL );
+				polygon.push_back( n >= 0 ? 0 : 1 );
+			}
+			if( polygon.size() < 3 * 4 )
+			{
+				chunk->errorAt = line;
+				chunk->error = "has a face with fewer than 3 vertices";
+				return;
+			}
+			// A fan, as the .ray parser triangulates faces
+			for( size_t k = 2; 4 * k < polygon.size(); k++ )
+			{
+				size_t fan[3] = { 0, k - 1, k };
+				for( int j = 0; j < 3; j++ )
+				{
+					const int* corner = &polygon[4 * fan[j]];
+					if( corner[1] ) chunk->relative.push_back( chunk->corners.size() );
+					chunk->corners.push_back( corner[0] );
+					if( corner[3] ) chunk->relative.push_back( chunk->corners.size() );
+					chunk->corners.push_back( corner[2] );
+				}
+			}
+		}
+		// Texture coordinates, groups, smoothing groups and materials
+		// are of no use to a trimesh.
+	}
+}
+
+static void readObj( const string& filename, const Buffer& buffer, MeshData& mesh, int nThreads )
+{
+	// Chunks of at least a megabyte, split just after a newline
+	size_t size = buffer.end() - buffer.begin();
+	int nChunks = (int)min( (size_t)nThreads, max( (size_t)1, size >> 20 ) );
+	vector<ObjChunk> chunks( nChunks );
+	const char* p = buffer.begin();
+	for( int i = 0; i < nChunks; i++ )
+	{
+		chunks[i].begin = p;
+		const char* split = i == nChunks - 1 ? buffer.end() : buffer.begin() + size * (i + 1) / nChunks;
+		if( split < p ) split = p;
+		const char* eol = (const char*)memchr( split, '\n', buffer.end() - split );
+		p = eol ? eol + 1 : buffer.end();
+		chunks[i].end = p;
+	}
+
+	vector<thread> threads;
+	for( int i = 1; i < nChunks; i++ )
+		threads.push_back( thread( parseObjChunk, &chunks[i] ) );
+	parseObjChunk( &chunks[0] );
+	for( size_t i = 0; i < threads.size(); i++ )
+		threads[i].join();
+
+	size_t nVertices = 0, nNormals = 0, nCorners = 0;
+	for( int i = 0; i < nChunks; i++ )
+	{
+		if( chunks[i].errorAt )
+		{
+			ostringstream oss;
+			oss << chunks[i].error << " on line " << lineOf( buffer, chunks[i].errorAt );
+			fail( filename, oss.str() );
+		}
+		nVertices += chunks[i].vertices.size();
+		nNormals += chunks[i].normals.size();
+		nCorners += chunks[i].corners.size();
+	}
+	if( nVertices > INT_MAX || nCorners / 2 > INT_MAX ) fail( filename, "is too big" );
+
+	mesh.vertices.clear();
+	mesh.vertices.reserve( nVertices );
+	vector<Vec3d> normals;
+	normals.reserve( nNormals );
+	vector<int> corners;
+	corners.reserve( nCorners );
+	for( int i = 0; i < nChunks; i++ )
+	{
+		ObjChunk& chunk = chunks[i];
+		int vertexBase = (int)mesh.vertices.size();
+		int normalBase = (int)normals.size();
+		for( size_t k = 0; k < chunk.relative.size(); k++ )
+		{
+			size_t c = chunk.relative[k];
+			chunk.corners[c] += c % 2 ? normalBase : vertexBase;
+		}
+		mesh.vertices.insert( mesh.vertices.end(), chunk.vertices.begin(), chunk.vertices.end() );
+		normals.insert( normals.end(), chunk.normals.begin(), chunk.normals.end() );
+		corners.insert( corners.end(), chunk.corners.begin(), chunk.corners.end() );
+		vector<Vec3d>().swap( chunk.vertices );
+		vector<Vec3d>().swap( chunk.normals );
+		vector<int>().swap( chunk.corners );
+	}
+
+	// Normals are only kept if every corner has one.
+	bool withNormals = !corners.empty();
+	bool shared = true;
+	for( size_t c = 0; c < corners.size(); c += 2 )
+	{
+		if( corners[c] < 0 || corners[c] >= (int)nVertices )
+			fail( filename, "has a face with a missing vertex" );
+		if( NO_NORMAL == corners[c + 1] )
+			withNormals = false;
+		else if( corners[c + 1] < 0 || corners[c + 1] >= (int)nNormals )
+			fail( filename, "has a face with a missing normal" );
+		else if( corners[c + 1] != corners[c] )
+			shared = false;
+	}
+
+	mesh.faces.resize( corners.size() / 2 );
+	mesh.normals.clear();
+	if( !withNormals )
+	{
+		for( size_t c = 0; c < mesh.faces.size(); c++ )
+			mesh.faces[c] = corners[2 * c];
+	}
+	else if( shared && nNormals == nVertices )
+	{
+		for( size_t c = 0; c < mesh.faces.size(); c++ )
+			mesh.faces[c] = corners[2 * c];
+		mesh.normals.swap( normals );
+	}
+	else
+	{
+		// A vertex for every distinct position and normal pair
+		vector<Vec3d> positions;
+		positions.swap( mesh.vertices );
+		unordered_map<long long, int> split;
+		for( size_t c = 0; c < mesh.faces.size(); c++ )
+		{
+			long long key = (long long)corners[2 * c] << 32 | (unsigned)corners[2 * c + 1];
+			unordered_map<long long, int>::iterator i = split.find( key );
+			if( i == split.end() )
+			{
+				i = split.insert( make_pair( key, (int)mesh.vertices.size() ) ).first;
+				mesh.vertices.push_back( positions[corners[2 * c]] );
+				mesh.normals.push_back( normals[corners[2 * c + 1]] );
+			}
+			mesh.faces[c] = i->second;
+		}
+	}
+}
+
+//
+// PLY
+//
+
+namespace {
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_NONE };
+
+struct PlyProperty
+{
+	string name;
+	PlyType type;
+	PlyType countType;			// PLY_NONE unless a list
+};
+
+struct PlyElement
+{
+	string name;
+	size_t count;
+	vector<PlyProperty> properties;
+};
+
+PlyType plyType( const string& name )
+{
+	static const char* names[][2] = {
+		{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+	};
+	for( int t = 0; t < PLY_NONE; t++ )
+		if( name == names[t][0] || name == names[t][1] ) return (PlyType)t;
+	return PLY_NONE;
+}
+
+const int plySizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+bool littleEndianHost()
+{
+	const unsigned one = 1;
+	return *(const unsigned char*)&one == 1;
+}
+
+// A face's list of vertex indices, as against any other list it carries
+bool isIndexList( const PlyElement& element, const PlyProperty& prop )
+{
+	return element.name == "face" && prop.countType != PLY_NONE &&
+	       (prop.name == "vertex_indices" || prop.name == "vertex_index");
+}
+
+// Reads the values of one element after another, from either kind of
+// body.  Binary values are swapped into the host's byte order.
+class PlyBody
+{
+public:
+	PlyBody( const string& filename, const Buffer& buffer, const char* body, bool ascii, bool swap )
+		: filename( filename ), buffer( buffer ), p( body ), end( buffer.end() ), ascii( ascii ), swap( swap ) {}
+
+	double read( PlyType type )
+	{
+		if( ascii )
+		{
+			while( p != end && (isBlank( *p ) || '\n' == *p) ) p++;
+			double value;
+			if( !parseDouble( p, end, value ) )
+			{
+				ostringstream oss;
+				oss << "has a bad value on line " << lineOf( buffer, p );
+				fail( filename, oss.str() );
+			}
+			return value;
+		}
+		unsigned char bytes[8];
+		take( bytes, plySizes[type] );
+		if( swap )
+			for( int i = 0, j = plySizes[type] - 1; i < j; i++, j-- )
+				std::swap( bytes[i], bytes[j] );
+		switch( type )
+		{
+		case PLY_INT8: return *(signed char*)bytes;
+		case PLY_UINT8: return *bytes;
+		case PLY_INT16: { short v; memcpy( &v, bytes, 2 ); return v; }
+		case PLY_UINT16: { unsigned short v; memcpy( &v, bytes, 2 ); return v; }
+		case PLY_INT32: { int v; memcpy( &v, bytes, 4 ); return v; }
+		case PLY_UINT32: { unsigned v; memcpy( &v, bytes, 4 ); return v; }
+		case PLY_FLOAT32: { float v; memcpy( &v, bytes, 4 ); return v; }
+		default: { double v; memcpy( &v, bytes, 8 ); return v; }
+		}
+	}
+
+	// The next n bytes of a binary body
+	void take( void* out, size_t n )
+	{
+		if( (size_t)(end - p) < n ) fail( filename, "is cut short" );
+		memcpy( out, p, n );
+		p += n;
+	}
+
+	// The fewest bytes a value can take: a digit and a separator in text
+	size_t valueSize( PlyType type ) const { return ascii ? 2 : plySizes[type]; }
+
+	// The fewest bytes one of an element's records can take; a face's
+	// index list has at least three entries.
+	size_t recordSize( const PlyElement& element ) const
+	{
+		size_t size = 0;
+		for( size_t k = 0; k < element.properties.size(); k++ )
+		{
+			const PlyProperty& prop = element.properties[k];
+			if( prop.countType == PLY_NONE )
+				size += valueSize( prop.type );
+			else
+				size += valueSize( prop.countType ) + (isIndexList( element, prop ) ? 3 * valueSize( prop.type ) : 0);
+		}
+		return size;
+	}
+
+	// Fails unless n items of at least size bytes each could still follow,
+	// so a bad count is caught before anything is allocated for it.  The
+	// last value in a text body may have no separator after it.
+	void expect( size_t n, size_t size )
+	{
+		size_t left = (size_t)(end - p) + (ascii ? 1 : 0);
+		if( size && n > left / size ) fail( filename, "is cut short" );
+	}
+
+	bool isAscii() const { return ascii; }
+	bool isSwapped() const { return swap; }
+
+private:
+	const string& filename;
+	const Buffer& buffer;
+	const char* p;
+	const char* end;
+	bool ascii, swap;
+};
+
+}
+
+static void readPly( const string& filename, const Buffer& buffer, MeshData& mesh )
+{
+	// The header is text, one keyword per line, up to end_header.
+	const char* p = buffer.begin();
+	const char* end = buffer.end();
+	vector<PlyElement> elements;
+	string format;
+	bool ended = false;
+	while( p != end && !ended )
+	{
+		const char* eol = (const char*)memchr( p, '\n', end - p );
+		if( !eol ) fail( filename, "has no end_header" );
+		istringstream line( string( p, eol ) );
+		p = eol + 1;
+
+		string keyword;
+		line >> keyword;
+		if( keyword == "format" )
+			line >> format;
+		else if( keyword == "element" )
+		{
+			PlyElement e;
+			line >> e.name >> e.count;
+			if( !line ) fail( filename, "has a bad element" );
+			elements.push_back( e );
+		}
+		else if( keyword == "property" )
+		{
+			if( elements.empty() ) fail( filename, "has a property outside any element" );
+			PlyProperty prop;
+			string type;
+			line >> type;
+			prop.countType = PLY_NONE;
+			if( type == "list" )
+			{
+				string countType;
+				line >> countType >> type;
+				prop.countType = plyType( countType );
+				if( prop.countType == PLY_NONE || prop.countType == PLY_FLOAT32 || prop.countType == PLY_FLOAT64 )
+					fail( filename, "has a list with a bad count type" );
+			}
+			prop.type = plyType( type );
+			line >> prop.name;
+			if( prop.type == PLY_NONE || !line ) fail( filename, "has a bad property" );
+			elements.back().properties.push_back( prop );
+		}
+		else if( keyword == "end_header" )
+			ended = true;
+		// ply, comment and obj_info lines say nothing we need
+	}
+	if( !ended ) fail( filename, "has no end_header" );
+
+	bool ascii = format == "ascii";
+	if( !ascii && format != "binary_little_endian" && format != "binary_big_endian" )
+		fail( filename, "is in an unknown PLY format" );
+	PlyBody body( filename, buffer, p, ascii, !ascii && (format == "binary_little_endian") != littleEndianHost() );
+
+	mesh.vertices.clear();
+	mesh.normals.clear();
+	mesh.faces.clear();
+	for( size_t e = 0; e < elements.size(); e++ )
+	{
+		const PlyElement& element = elements[e];
+		const vector<PlyProperty>& props = element.properties;
+		body.expect( element.count, body.recordSize( element ) );
+
+		if( element.name == "vertex" )
+		{
+			int x = -1, y = -1, z = -1, nx = -1, ny = -1, nz = -1;
+			bool allFloat = !ascii && !body.isSwapped();
+			for( size_t k = 0; k < props.size(); k++ )
+			{
+				if( props[k].countType != PLY_NONE ) fail( filename, "has lists in its vertices" );
+				if( props[k].type != PLY_FLOAT32 ) allFloat = false;
+				const string& n = props[k].name;
+				int* slot = n == "x" ? &x : n == "y" ? &y : n == "z" ? &z :
+				            n == "nx" ? &nx : n == "ny" ? &ny : n == "nz" ? &nz : 0;
+				if( slot ) *slot = (int)k;
+			}
+			if( x < 0 || y < 0 || z < 0 ) fail( filename, "has vertices without x, y and z" );
+			bool withNormals = nx >= 0 && ny >= 0 && nz >= 0;
+			mesh.vertices.resize( element.count );
+			if( withNormals ) mesh.normals.resize( element.count );
+
+			if( allFloat )
+			{
+				// The usual layout: copy the whole block out at once and
+				// pick the coordinates from it.
+				size_t stride = props.size();
+				vector<float> block( element.count * stride );
+				body.take( block.data(), block.size() * sizeof(float) );
+				for( size_t v = 0; v < element.count; v++ )
+				{
+					const float* f = &block[v * stride];
+					mesh.vertices[v] = Vec3d( f[x], f[y], f[z] );
+					if( withNormals ) mesh.normals[v] = Vec3d( f[nx], f[ny], f[nz] );
+				}
+			}
+			else
+			{
+				vector<double> record( props.size() );
+				for( size_t v = 0; v < element.count; v++ )
+				{
+					for( size_t k = 0; k < props.size(); k++ )
+						record[k] = body.read( props[k].type );
+					mesh.vertices[v] = Vec3d( record[x], record[y], record[z] );
+					if( withNormals ) mesh.normals[v] = Vec3d( record[nx], record[ny], record[nz] );
+				}
+			}
+		}
+		else if( element.name == "face" )
+		{
+			mesh.faces.reserve( 3 * element.count );
+			vector<int> polygon;
+			for( size_t f = 0; f < element.count; f++ )
+			{
+				for( size_t k = 0; k < props.size(); k++ )
+				{
+					const PlyProperty& prop = props[k];
+					bool indices = isIndexList( element, prop );
+					if( prop.countType == PLY_NONE )
+					{
+						body.read( prop.type );
+						continue;
+					}
+					size_t n = (size_t)body.read( prop.countType );
+					if( !indices )
+					{
+						for( size_t i = 0; i < n; i++ ) body.read( prop.type );
+						continue;
+					}
+					if( n < 3 ) fail( filename, "has a face with fewer than 3 vertices" );
+					body.expect( n, body.valueSize( prop.type ) );
+					polygon.resize( n );
+					if( !ascii && !body.isSwapped() && (prop.type == PLY_INT32 || prop.type == PLY_UINT32) )
+						body.take( polygon.data(), n * sizeof(int) );
+					else
+						for( size_t i = 0; i < n; i++ ) polygon[i] = (int)body.read( prop.type );
+					for( size_t i = 2; i < n; i++ )
+					{
+						mesh.faces.push_back( polygon[0] );
+						mesh.faces.push_back( polygon[i - 1] );
+						mesh.faces.push_back( polygon[i] );
+					}
+				}
+			}
+		}
+		else
+		{
+			// Edges, materials and whatever else are skipped over.
+			for( size_t i = 0; i < element.count; i++ )
+				for( size_t k = 0; k < props.size(); k++ )
+				{
+					size_t n = props[k].countType == PLY_NONE ? 1 : (size_t)body.read( props[k].countType );
+					for( size_t j = 0; j < n; j++ ) body.read( props[k].type );
+				}
+		}
+	}
+
+	for( size_t c = 0; c < mesh.faces.size(); c++ )
+		if( mesh.faces[c] < 0 || mesh.faces[c] >= (int)mesh.vertices.size() )
+			fail( filename, "has a face with a missing vertex" );
+}
+
+void readMeshFile( const string& filename, MeshData& mesh, int nThreads )
+{
+	Buffer buffer( filename );
+	if( !buffer.isOpen() ) fail( filename, "can't be opened" );
+	if( nThreads <= 0 ) nThreads = max( 1, (int)thread::hardware_concurrency() );
+
+	size_t size = buffer.end() - buffer.begin();
+	size_t dot = filename.find_last_of( '.' );
+	string extension = dot == string::npos ? "" : filename.substr( dot + 1 );
+	for( size_t i = 0; i < extension.size(); i++ )
+		extension[i] = (char)tolower( extension[i] );
+
+	if( size >= 4 && memcmp( buffer.begin(), "ply", 3 ) == 0 && ('\n' == buffer.begin()[3] || '\r' == buffer.begin()[3]) )
+		readPly( filename, buffer, mesh );
+	else if( extension == "obj" )
+		readObj( filename, buffer, mesh, nThreads );
+	else
+		fail( filename, "is neither OBJ nor PLY" );
+}
@@ -0,0 +1,32 @@
+//
+// meshfile.h
+//
+// Loads triangle meshes from Wavefront OBJ and PLY files, for trimeshes
+// that name a file instead of listing their points and faces.  OBJ files
+// are parsed in parallel, in chunks split at line boundaries; binary PLY
+// vertex data is copied out in bulk.
+//
+
+#ifndef __MESHFILE_H__
+#define __MESHFILE_H__
+
+#include <string>
+#include <vector>
+
+#include "../vecmath/vec.h"
+
+struct MeshData
+{
+	std::vector<Vec3d> vertices;
+	std::vector<Vec3d> normals;		// one per vertex, or none
+	std::vector<int> faces;			// three vertex indices per triangle
+};
+
+// Reads filename into mesh, picking the format by the file's contents
+// (PLY files start with "ply") or else by an .obj extension.  Polygons are
+// split into fans of triangles.  OBJ normals are shared by a vertex only
+// where every face gives it the same one; otherwise the vertex is split.
+// nThreads <= 0 uses every core.  Throws ParserException.
+void readMeshFile( const std::string& filename, MeshData& mesh, int nThreads = 0 );
+
+#endif // __MESHFILE_H__
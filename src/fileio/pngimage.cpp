@@ -5,12 +5,13 @@
 #  define png_jmpbuf(png_ptr)   ((png_ptr)->jmpbuf)
 #endif
 
-static png_structp png_ptr = NULL;
-static png_infop info_ptr = NULL;
+/* one image at a time per thread, so textures can be decoded side by side */
+static thread_local png_structp png_ptr = NULL;
+static thread_local png_infop info_ptr = NULL;
 
-png_uint_32  width, height;
-int  bit_depth, color_type;
-uch  *image_data = NULL;
+thread_local png_uint_32  width, height;
+thread_local int  bit_depth, color_type;
+thread_local uch  *image_data = NULL;
 
 void png_version_info(void) {
 
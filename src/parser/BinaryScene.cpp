@@ -0,0 +1,719 @@
+#include "BinaryScene.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include "../scene/scene.h"
+#include "../scene/light.h"
+#include "../SceneObjects/Box.h"
+#include "../SceneObjects/Cone.h"
+#include "../SceneObjects/Cylinder.h"
+#include "../SceneObjects/Sphere.h"
+#include "../SceneObjects/Square.h"
+#include "../SceneObjects/trimesh.h"
+
+using namespace std;
+
+const char BINARY_SCENE_MAGIC[8] = { 'S', 'B', 'T', 'S', 'C', 'E', 'N', 'E' };
+
+// Written as a native integer; a reader on a machine of the other byte
+// order sees it reversed and refuses the file.
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+static uint32_t blockTag( const char* s )
+{
+	return (uint32_t)s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 | (uint32_t)s[3] << 24;
+}
+
+static const uint32_t TAG_CAMERA = blockTag( "CAMR" );
+static const uint32_t TAG_AMBIENT = blockTag( "AMBT" );
+static const uint32_t TAG_TEXTURES = blockTag( "TEXT" );
+static const uint32_t TAG_TRANSFORMS = blockTag( "XFRM" );
+static const uint32_t TAG_MATERIALS = blockTag( "MATL" );
+static const uint32_t TAG_LIGHTS = blockTag( "LGHT" );
+static const uint32_t TAG_OBJECTS = blockTag( "OBJS" );
+static const uint32_t TAG_MESH = blockTag( "MESH" );
+
+// The records every block is an array of.  All are multiples of eight
+// bytes, so the arrays after them stay aligned.
+struct FileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t blocks;
+	uint32_t reserved;
+};
+
+struct BlockHeader
+{
+	uint32_t tag;
+	uint32_t count;				// records, or the mesh number for MESH
+	uint64_t bytes;				// of the payload that follows
+};
+
+struct CameraRecord
+{
+	double rotation[9];
+	double normalizedHeight, aspectRatio;
+	double eye[3], look[3], u[3], v[3];
+};
+
+struct ParameterRecord
+{
+	double value[3];
+	int32_t texture;			// into the TEXT block, -1 for none
+	int32_t reserved;
+};
+
+struct MaterialRecord
+{
+	ParameterRecord ke, ka, ks, kd, kr, kt, shininess, index;
+	uint8_t refl, trans, recur, spec, both;
+	uint8_t reserved[3];
+};
+
+// Transforms are stored composed with their parents', and parents come
+// before their children; node 0 is the root.
+struct TransformRecord
+{
+	int32_t parent;
+	int32_t reserved;
+	double xform[16];
+};
+
+enum { POINT_LIGHT_RECORD, DIRECTIONAL_LIGHT_RECORD, SPOT_LIGHT_RECORD };
+
+struct LightRecord
+{
+	uint32_t type;
+	uint32_t reserved;
+	double color[3], orientation[3], position[3];
+	double angle, fallRate;
+	float constantTerm, linearTerm, quadraticTerm, reserved2;
+};
+
+enum { SPHERE_RECORD, BOX_RECORD, SQUARE_RECORD, CYLINDER_RECORD, CONE_RECORD, TRIMESH_RECORD };
+
+struct ObjectRecord
+{
+	uint32_t type;
+	int32_t transform;
+	int32_t material;
+	int32_t mesh;				// MESH block number for trimeshes
+	double height, bottomRadius, topRadius;
+	uint32_t capped;
+	uint32_t reserved;
+};
+
+// Followed by 3 * vertices doubles, 3 * normals doubles, 3 * faces vertex
+// indices and then materials material table indices, each array padded
+// to eight bytes.
+struct MeshRecord
+{
+	uint32_t vertices, normals, faces, materials;
+	uint32_t vertexNormals;
+	uint32_t reserved;
+};
+
+static_assert( sizeof(Vec3d) == 3 * sizeof(double), "mesh arrays are read straight into Vec3d vectors" );
+
+static size_t padded( size_t bytes )
+{
+	return (bytes + 7) & ~(size_t)7;
+}
+
+//
+// Writing
+//
+
+namespace {
+
+class SceneFile
+{
+public:
+	SceneFile( const string& name ) : name( name ), f( fopen( name.c_str(), "wb" ) )
+	{
+		if( !f ) throw ParserException( "Unable to write binary scene '" + name + "'." );
+	}
+	~SceneFile() { if( f ) fclose( f ); }
+
+	void put( const void* data, size_t bytes )
+	{
+		if( bytes && fwrite( data, bytes, 1, f ) != 1 ) fail();
+	}
+	void pad( size_t bytes )
+	{
+		static const char zeros[8] = { 0 };
+		put( zeros, padded( bytes ) - bytes );
+	}
+	void block( uint32_t tag, uint32_t count, size_t bytes )
+	{
+		BlockHeader h;
+		h.tag = tag;
+		h.count = count;
+		h.bytes = bytes;
+		put( &h, sizeof(h) );
+	}
+	void close()
+	{
+		if( fclose( f ) != 0 ) { f = 0; fail(); }
+		f = 0;
+	}
+
+private:
+	void fail() { throw ParserException( "Error writing binary scene '" + name + "'." ); }
+
+	string name;
+	FILE* f;
+};
+
+}
+
+static void putVec( double* out, const Vec3d& v )
+{
+	out[0] = v[0];
+	out[1] = v[1];
+	out[2] = v[2];
+}
+
+void BinaryScene::write( const Scene& scene, const string& basePath, const string& filename )
+{
+	// Textures, materials and transforms are numbered as they are found.
+	vector<string> textureNames;
+	map<const TextureMap*, int> textureIds;
+	vector<MaterialRecord> materials;
+	map<string, int> materialIds;		// by their record's bytes
+	vector<TransformRecord> transforms;
+	map<const TransformNode*, int> transformIds;
+
+	auto textureId = [&]( const TextureMap* t ) -> int
+	{
+		if( !t ) return -1;
+		map<const TextureMap*, int>::iterator i = textureIds.find( t );
+		if( i != textureIds.end() ) return i->second;
+		textureIds[t] = (int)textureNames.size();
+		textureNames.push_back( t->name() );
+		return (int)textureNames.size() - 1;
+	};
+	auto param = [&]( const MaterialParameter& p ) -> ParameterRecord
+	{
+		ParameterRecord r;
+		memset( &r, 0, sizeof(r) );
+		putVec( r.value, p._value );
+		r.texture = textureId( p._textureMap );
+		return r;
+	};
+
+	// Material m's number in the table, adding it if no equal one is there.
+	auto materialId = [&]( const Material& m ) -> int
+	{
+		MaterialRecord r;
+		memset( &r, 0, sizeof(r) );
+		r.ke = param( m._ke );
+		r.ka = param( m._ka );
+		r.ks = param( m._ks );
+		r.kd = param( m._kd );
+		r.kr = param( m._kr );
+		r.kt = param( m._kt );
+		r.shininess = param( m._shininess );
+		r.index = param( m._index );
+		r.refl = m._refl;
+		r.trans = m._trans;
+		r.recur = m._recur;
+		r.spec = m._spec;
+		r.both = m._both;
+		string key( (const char*)&r, sizeof(r) );
+		map<string, int>::iterator i = materialIds.find( key );
+		if( i != materialIds.end() ) return i->second;
+		materialIds[key] = (int)materials.size();
+		materials.push_back( r );
+		return (int)materials.size() - 1;
+	};
+
+	// The whole transform tree, parents first.
+	vector<const TransformNode*> pending( 1, &scene.transformRoot );
+	while( !pending.empty() )
+	{
+		const TransformNode* node = pending.back();
+		pending.pop_back();
+		TransformRecord r;
+		memset( &r, 0, sizeof(r) );
+		r.parent = node->parent ? transformIds[node->parent] : -1;
+		for( int k = 0; k < 16; k++ )
+			r.xform[k] = node->xform.n[k];
+		transformIds[node] = (int)transforms.size();
+		transforms.push_back( r );
+		for( TransformNode::child_citer c = node->children.end(); c != node->children.begin(); )
+			pending.push_back( *--c );
+	}
+
+	vector<ObjectRecord> objects;
+	vector<const Trimesh*> meshes;
+	for( Scene::cgiter g = scene.beginObjects(); g != scene.endObjects(); ++g )
+	{
+		ObjectRecord r;
+		memset( &r, 0, sizeof(r) );
+		r.mesh = -1;
+		r.transform = transformIds[(*g)->getTransform()];
+		if( const Cone* cone = dynamic_cast<const Cone*>( *g ) )
+		{
+			r.type = CONE_RECORD;
+			r.height = cone->height;
+			r.bottomRadius = cone->b_radius;
+			r.topRadius = cone->t_radius;
+			r.capped = cone->capped;
+		}
+		else if( dynamic_cast<const Sphere*>( *g ) ) r.type = SPHERE_RECORD;
+		else if( dynamic_cast<const Box*>( *g ) ) r.type = BOX_RECORD;
+		else if( dynamic_cast<const Square*>( *g ) ) r.type = SQUARE_RECORD;
+		else if( dynamic_cast<const Cylinder*>( *g ) ) r.type = CYLINDER_RECORD;
+		else if( const Trimesh* mesh = dynamic_cast<const Trimesh*>( *g ) )
+		{
+			r.type = TRIMESH_RECORD;
+			r.mesh = (int)meshes.size();
+			meshes.push_back( mesh );
+			for( size_t m = 0; m < mesh->materials.size(); m++ )
+				materialId( *mesh->materials[m] );
+		}
+		else
+			throw ParserException( "Binary scenes can't hold this kind of object." );
+		r.material = materialId( ((const SceneObject*)*g)->getMaterial() );
+		objects.push_back( r );
+	}
+
+	vector<LightRecord> lights;
+	for( Scene::cliter l = scene.beginLights(); l != scene.endLights(); ++l )
+	{
+		LightRecord r;
+		memset( &r, 0, sizeof(r) );
+		putVec( r.color, (*l)->color );
+		if( const PointLight* p = dynamic_cast<const PointLight*>( *l ) )
+		{
+			r.type = POINT_LIGHT_RECORD;
+			putVec( r.position, p->position );
+			r.constantTerm = p->constantTerm;
+			r.linearTerm = p->linearTerm;
+			r.quadraticTerm = p->quadraticTerm;
+		}
+		else if( const DirectionalLight* d = dynamic_cast<const DirectionalLight*>( *l ) )
+		{
+			r.type = DIRECTIONAL_LIGHT_RECORD;
+			putVec( r.orientation, d->orientation );
+		}
+		else if( const SpotLight* s = dynamic_cast<const SpotLight*>( *l ) )
+		{
+			r.type = SPOT_LIGHT_RECORD;
+			putVec( r.orientation, s->orientation );
+			putVec( r.position, s->position );
+			r.angle = s->atten_angle;
+			r.fallRate = s->fallRate;
+		}
+		else
+			throw ParserException( "Binary scenes can't hold this kind of light." );
+		lights.push_back( r );
+	}
+
+	const Camera& camera = const_cast<Scene&>( scene ).getCamera();
+	CameraRecord cam;
+	for( int k = 0; k < 9; k++ )
+		cam.rotation[k] = camera.m.n[k];
+	cam.normalizedHeight = camera.normalizedHeight;
+	cam.aspectRatio = camera.aspectRatio;
+	putVec( cam.eye, camera.eye );
+	putVec( cam.look, camera.look );
+	putVec( cam.u, camera.u );
+	putVec( cam.v, camera.v );
+
+	// Texture names under the scene's directory are kept relative to it,
+	// so the compiled scene can move together with its textures.
+	string prefix = basePath + "/";
+	vector<string> names( textureNames.size() );
+	vector<uint32_t> relative( textureNames.size() );
+	size_t textureBytes = 0;
+	for( size_t t = 0; t < textureNames.size(); t++ )
+	{
+		relative[t] = textureNames[t].compare( 0, prefix.size(), prefix ) == 0;
+		names[t] = relative[t] ? textureNames[t].substr( prefix.size() ) : textureNames[t];
+		textureBytes += 8 + padded( names[t].size() );
+	}
+
+	SceneFile out( filename );
+	FileHeader header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic) );
+	header.version = BINARY_SCENE_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.blocks = 7 + (uint32_t)meshes.size();
+	out.put( &header, sizeof(header) );
+
+	out.block( TAG_CAMERA, 1, sizeof(cam) );
+	out.put( &cam, sizeof(cam) );
+
+	double ambient[3];
+	putVec( ambient, scene.ambient() );
+	out.block( TAG_AMBIENT, 1, sizeof(ambient) );
+	out.put( ambient, sizeof(ambient) );
+
+	out.block( TAG_TEXTURES, (uint32_t)names.size(), textureBytes );
+	for( size_t t = 0; t < names.size(); t++ )
+	{
+		uint32_t entry[2] = { (uint32_t)names[t].size(), relative[t] };
+		out.put( entry, sizeof(entry) );
+		out.put( names[t].data(), names[t].size() );
+		out.pad( names[t].size() );
+	}
+
+	out.block( TAG_TRANSFORMS, (uint32_t)transforms.size(), transforms.size() * sizeof(TransformRecord) );
+	out.put( transforms.data(), transforms.size() * sizeof(TransformRecord) );
+	out.block( TAG_MATERIALS, (uint32_t)materials.size(), materials.size() * sizeof(MaterialRecord) );
+	out.put( materials.data(), materials.size() * sizeof(MaterialRecord) );
+	out.block( TAG_LIGHTS, (uint32_t)lights.size(), lights.size() * sizeof(LightRecord) );
+	out.put( lights.data(), lights.size() * sizeof(LightRecord) );
+	out.block( TAG_OBJECTS, (uint32_t)objects.size(), objects.size() * sizeof(ObjectRecord) );
+	out.put( objects.data(), objects.size() * sizeof(ObjectRecord) );
+
+	for( size_t n = 0; n < meshes.size(); n++ )
+	{
+		const Trimesh* mesh = meshes[n];
+		MeshRecord r;
+		memset( &r, 0, sizeof(r) );
+		r.vertices = (uint32_t)mesh->vertices.size();
+		r.normals = (uint32_t)mesh->normals.size();
+		r.faces = (uint32_t)mesh->numFaces();
+		r.materials = (uint32_t)mesh->materials.size();
+		r.vertexNormals = mesh->vertNorms;
+		vector<int32_t> materialIndices( r.materials );
+		for( uint32_t m = 0; m < r.materials; m++ )
+			materialIndices[m] = materialId( *mesh->materials[m] );
+
+		size_t faceBytes = 3 * sizeof(int32_t) * (size_t)r.faces;
+		size_t materialBytes = sizeof(int32_t) * (size_t)r.materials;
+		out.block( TAG_MESH, (uint32_t)n, sizeof(r) + sizeof(Vec3d) * ((size_t)r.vertices + r.normals) +
+		                                  padded( faceBytes ) + padded( materialBytes ) );
+		out.put( &r, sizeof(r) );
+		out.put( mesh->vertices.data(), sizeof(Vec3d) * r.vertices );
+		out.put( mesh->normals.data(), sizeof(Vec3d) * r.normals );
+		out.put( mesh->faceIds.data(), faceBytes );
+		out.pad( faceBytes );
+		out.put( materialIndices.data(), materialBytes );
+		out.pad( materialBytes );
+	}
+	out.close();
+}
+
+//
+// Reading
+//
+
+namespace {
+
+class SceneSource
+{
+public:
+	SceneSource( const string& name ) : name( name ), f( fopen( name.c_str(), "rb" ) ), buffer( 1 << 20 )
+	{
+		if( !f ) throw ParserException( "Unable to read binary scene '" + name + "'." );
+		setvbuf( f, &buffer[0], _IOFBF, buffer.size() );
+	}
+	~SceneSource() { fclose( f ); }
+
+	void get( void* data, size_t bytes )
+	{
+		if( bytes && fread( data, bytes, 1, f ) != 1 ) fail( "is cut short" );
+	}
+	void skip( size_t bytes )
+	{
+		if( fseek( f, (long)bytes, SEEK_CUR ) != 0 ) fail( "is cut short" );
+	}
+	void fail( const string& why ) const
+	{
+		throw ParserException( "Binary scene '" + name + "' " + why + "." );
+	}
+
+private:
+	string name;
+	FILE* f;
+	vector<char> buffer;
+};
+
+template <typename Record>
+void readRecords( SceneSource& in, const BlockHeader& h, vector<Record>& records )
+{
+	if( h.bytes != (uint64_t)h.count * sizeof(Record) ) in.fail( "has a malformed block" );
+	records.resize( h.count );
+	in.get( records.data(), h.bytes );
+}
+
+}
+
+static Vec3d getVec( const double* in )
+{
+	return Vec3d( in[0], in[1], in[2] );
+}
+
+bool BinaryScene::isBinary( const string& filename )
+{
+	FILE* f = fopen( filename.c_str(), "rb" );
+	if( !f ) return false;
+	char magic[sizeof(BINARY_SCENE_MAGIC)];
+	bool binary = fread( magic, sizeof(magic), 1, f ) == 1 &&
+	              memcmp( magic, BINARY_SCENE_MAGIC, sizeof(magic) ) == 0;
+	fclose( f );
+	return binary;
+}
+
+Scene* BinaryScene::read( const string& filename, const string& basePath, TextureCache* textures, SceneLoader* loader )
+{
+	SceneSource in( filename );
+	FileHeader header;
+	in.get( &header, sizeof(header) );
+	if( memcmp( header.magic, BINARY_SCENE_MAGIC, sizeof(header.magic) ) != 0 )
+		in.fail( "is not a binary scene" );
+	if( header.byteOrder != BYTE_ORDER_MARK )
+		in.fail( "was written on a machine of the other byte order" );
+	if( header.version != BINARY_SCENE_VERSION )
+		in.fail( "is of an unsupported version" );
+
+	Scene* scene = new Scene;
+	if( textures ) scene->setTextureCache( textures );
+	scene->setLoader( loader );
+
+	// Objects are only added once their meshes are complete, so that
+	// Scene::add() sees their final bounds.
+	vector<Geometry*> objects;
+	vector<Trimesh*> meshes;
+	vector<bool> meshRead;
+	try
+	{
+		vector<TextureMap*> maps;
+		vector<MaterialRecord> materials;
+		vector<TransformNode*> nodes;
+		vector<ObjectRecord> objectRecords;
+
+		auto texture = [&]( int32_t t ) -> TextureMap*
+		{
+			if( t < 0 ) return 0;
+			if( t >= (int32_t)maps.size() ) in.fail( "refers to a missing texture" );
+			return maps[t];
+		};
+		auto param = [&]( const ParameterRecord& r ) -> MaterialParameter
+		{
+			MaterialParameter p( getVec( r.value ) );
+			p._textureMap = texture( r.texture );
+			return p;
+		};
+		// Held until its owner takes it, since any param() may fail.
+		auto material = [&]( int32_t m ) -> unique_ptr<Material>
+		{
+			if( m < 0 || m >= (int32_t)materials.size() ) in.fail( "refers to a missing material" );
+			const MaterialRecord& r = materials[m];
+			unique_ptr<Material> mat( new Material );
+			mat->_ke = param( r.ke );
+			mat->_ka = param( r.ka );
+			mat->_ks = param( r.ks );
+			mat->_kd = param( r.kd );
+			mat->_kr = param( r.kr );
+			mat->_kt = param( r.kt );
+			mat->_shininess = param( r.shininess );
+			mat->_index = param( r.index );
+			mat->_refl = r.refl != 0;
+			mat->_trans = r.trans != 0;
+			mat->_recur = r.recur != 0;
+			mat->_spec = r.spec != 0;
+			mat->_both = r.both != 0;
+			return mat;
+		};
+
+		for( uint32_t b = 0; b < header.blocks; b++ )
+		{
+			BlockHeader h;
+			in.get( &h, sizeof(h) );
+			if( h.tag == TAG_CAMERA )
+			{
+				vector<CameraRecord> cam;
+				readRecords( in, h, cam );
+				if( cam.size() != 1 ) in.fail( "has a malformed block" );
+				Camera& camera = scene->getCamera();
+				for( int k = 0; k < 9; k++ )
+					camera.m.n[k] = cam[0].rotation[k];
+				camera.normalizedHeight = cam[0].normalizedHeight;
+				camera.aspectRatio = cam[0].aspectRatio;
+				camera.eye = getVec( cam[0].eye );
+				camera.look = getVec( cam[0].look );
+				camera.u = getVec( cam[0].u );
+				camera.v = getVec( cam[0].v );
+			}
+			else if( h.tag == TAG_AMBIENT )
+			{
+				double ambient[3];
+				if( h.bytes != sizeof(ambient) ) in.fail( "has a malformed block" );
+				in.get( ambient, sizeof(ambient) );
+				scene->addAmbient( getVec( ambient ) );
+			}
+			else if( h.tag == TAG_TEXTURES )
+			{
+				for( uint32_t t = 0; t < h.count; t++ )
+				{
+					uint32_t entry[2];
+					in.get( entry, sizeof(entry) );
+					string name( entry[0], '\0' );
+					in.get( &name[0], entry[0] );
+					in.skip( padded( entry[0] ) - entry[0] );
+					maps.push_back( scene->getTexture( entry[1] ? basePath + "/" + name : name ) );
+				}
+			}
+			else if( h.tag == TAG_TRANSFORMS )
+			{
+				vector<TransformRecord> records;
+				readRecords( in, h, records );
+				for( size_t t = 0; t < records.size(); t++ )
+				{
+					int32_t parent = records[t].parent;
+					if( t == 0 )
+					{
+						if( parent != -1 ) in.fail( "has a malformed transform tree" );
+						nodes.push_back( &scene->transformRoot );
+						continue;
+					}
+					if( parent < 0 || parent >= (int32_t)t ) in.fail( "has a malformed transform tree" );
+					// As the TransformNode constructor would, from the
+					// stored composition rather than by composing again.
+					TransformNode* node = nodes[parent]->createChild( Mat4d() );
+					for( int k = 0; k < 16; k++ )
+						node->xform.n[k] = records[t].xform[k];
+					node->inverse = node->xform.inverse();
+					node->normi = node->xform.upper33().inverse().transpose();
+					nodes.push_back( node );
+				}
+			}
+			else if( h.tag == TAG_MATERIALS )
+				readRecords( in, h, materials );
+			else if( h.tag == TAG_LIGHTS )
+			{
+				vector<LightRecord> records;
+				readRecords( in, h, records );
+				for( size_t l = 0; l < records.size(); l++ )
+				{
+					const LightRecord& r = records[l];
+					Light* light;
+					if( r.type == POINT_LIGHT_RECORD )
+						light = new PointLight( scene, getVec( r.position ), getVec( r.color ),
+						                        r.constantTerm, r.linearTerm, r.quadraticTerm );
+					else if( r.type == DIRECTIONAL_LIGHT_RECORD )
+					{
+						DirectionalLight* d = new DirectionalLight( scene, getVec( r.orientation ), getVec( r.color ) );
+						d->orientation = getVec( r.orientation );
+						light = d;
+					}
+					else if( r.type == SPOT_LIGHT_RECORD )
+					{
+						SpotLight* s = new SpotLight( scene, getVec( r.orientation ), getVec( r.color ),
+						                              r.angle, getVec( r.position ), r.fallRate );
+						s->orientation = getVec( r.orientation );
+						light = s;
+					}
+					else
+						in.fail( "has a light of an unknown kind" );
+					scene->add( light );
+				}
+			}
+			else if( h.tag == TAG_OBJECTS )
+			{
+				readRecords( in, h, objectRecords );
+				for( size_t o = 0; o < objectRecords.size(); o++ )
+				{
+					const ObjectRecord& r = objectRecords[o];
+					if( r.transform < 0 || r.transform >= (int32_t)nodes.size() )
+						in.fail( "refers to a missing transform" );
+					TransformNode* node = nodes[r.transform];
+					unique_ptr<Material> mat = material( r.material );
+					Geometry* g;
+					switch( r.type )
+					{
+					case SPHERE_RECORD: g = new Sphere( scene, mat.release() ); break;
+					case BOX_RECORD: g = new Box( scene, mat.release() ); break;
+					case SQUARE_RECORD: g = new Square( scene, mat.release() ); break;
+					case CYLINDER_RECORD: g = new Cylinder( scene, mat.release() ); break;
+					case CONE_RECORD:
+						g = new Cone( scene, mat.release(), r.height, r.bottomRadius, r.topRadius, r.capped != 0 );
+						break;
+					case TRIMESH_RECORD:
+						if( r.mesh != (int32_t)meshes.size() ) in.fail( "has misnumbered meshes" );
+						meshes.push_back( new Trimesh( scene, mat.release(), node ) );
+						meshRead.push_back( false );
+						g = meshes.back();
+						break;
+					default:
+						in.fail( "has an object of an unknown kind" );
+					}
+					g->setTransform( node );
+					objects.push_back( g );
+				}
+			}
+			else if( h.tag == TAG_MESH )
+			{
+				if( h.count >= meshes.size() || meshRead[h.count] ) in.fail( "has misnumbered meshes" );
+				Trimesh* mesh = meshes[h.count];
+				meshRead[h.count] = true;
+				MeshRecord r;
+				in.get( &r, sizeof(r) );
+				size_t faceBytes = 3 * sizeof(int32_t) * (size_t)r.faces;
+				size_t materialBytes = sizeof(int32_t) * (size_t)r.materials;
+				if( h.bytes != sizeof(r) + sizeof(Vec3d) * ((size_t)r.vertices + r.normals) +
+				               padded( faceBytes ) + padded( materialBytes ) ||
+				    (r.normals && r.normals != r.vertices) || (r.materials && r.materials != r.vertices) )
+					in.fail( "has a malformed mesh" );
+
+				mesh->vertices.resize( r.vertices );
+				in.get( mesh->vertices.data(), sizeof(Vec3d) * r.vertices );
+				mesh->vertexCount = (int)r.vertices;
+				mesh->normals.resize( r.normals );
+				in.get( mesh->normals.data(), sizeof(Vec3d) * r.normals );
+				mesh->vertNorms = r.vertexNormals != 0;
+
+				mesh->faceIds.resize( 3 * (size_t)r.faces );
+				in.get( mesh->faceIds.data(), faceBytes );
+				in.skip( padded( faceBytes ) - faceBytes );
+				mesh->faceNormals.resize( r.faces );
+				for( uint32_t f = 0; f < r.faces; f++ )
+				{
+					const int* ids = &mesh->faceIds[3 * f];
+					for( int k = 0; k < 3; k++ )
+						if( ids[k] < 0 || ids[k] >= (int)r.vertices ) in.fail( "has a face with a missing vertex" );
+					// As addFace() computes it.
+					const Vec3d& a = mesh->vertices[ids[0]];
+					Vec3d normal = (mesh->vertices[ids[1]] - a) ^ (mesh->vertices[ids[2]] - a);
+					normal.normalize();
+					mesh->faceNormals[f] = normal;
+				}
+
+				vector<int32_t> materialIndices( r.materials );
+				in.get( materialIndices.data(), materialBytes );
+				in.skip( padded( materialBytes ) - materialBytes );
+				for( uint32_t m = 0; m < r.materials; m++ )
+					mesh->addMaterial( material( materialIndices[m] ).release() );
+			}
+			else
+				in.skip( h.bytes );
+		}
+		for( size_t m = 0; m < meshRead.size(); m++ )
+			if( !meshRead[m] ) in.fail( "is missing a mesh" );
+	}
+	catch( ... )
+	{
+		for( size_t o = 0; o < objects.size(); o++ )
+			delete objects[o];
+		delete scene;
+		throw;
+	}
+
+	for( size_t o = 0; o < objects.size(); o++ )
+		scene->add( objects[o] );
+	return scene;
+}
@@ -0,0 +1,53 @@
+//
+// BinaryScene.h
+//
+// A compiled form of .ray scenes that loads without tokenizing anything.
+// The file is a fixed header followed by blocks: the camera, the ambient
+// light, texture names, the transform tree, a table of materials, the
+// lights, the objects, and one block of contiguous arrays per mesh, read
+// straight into the mesh.
+//
+// Every value is stored as the parser left it in memory, so a compiled
+// scene renders exactly like its source.
+//
+
+#ifndef __BINARYSCENE_H__
+#define __BINARYSCENE_H__
+
+#include <string>
+
+#include "ParserException.h"
+
+class Scene;
+class TextureCache;
+class SceneLoader;
+
+// Files start with these eight bytes; loaders tell the formats apart by
+// them, not by the file name.
+extern const char BINARY_SCENE_MAGIC[8];
+
+// Bumped whenever a block's layout changes.  Readers reject other
+// versions, and skip blocks with tags they don't know.
+const unsigned BINARY_SCENE_VERSION = 1;
+
+class BinaryScene
+{
+public:
+	// Whether the file starts with BINARY_SCENE_MAGIC.
+	static bool isBinary( const std::string& filename );
+
+	// Writes scene, which was parsed from a file in basePath, to filename.
+	// Textures under basePath are stored relative to it.  Throws
+	// ParserException if the file can't be written.
+	static void write( const Scene& scene, const std::string& basePath, const std::string& filename );
+
+	// Loads a scene written by write(); relative texture names are looked
+	// up in basePath.  Throws ParserException for files that are not
+	// binary scenes, are of another version or are cut short, and
+	// TextureMapException like the parser does.  A loader is handed the
+	// scene as it is read, as by the parser.
+	static Scene* read( const std::string& filename, const std::string& basePath, TextureCache* textures = 0,
+	                    SceneLoader* loader = 0 );
+};
+
+#endif // __BINARYSCENE_H__
@@ -4,12 +4,15 @@
 #include <fstream>
 #include <sstream>
 #include <memory>
+#include <thread>
+#include <algorithm>
 
 #include "Parser.h"
 #include "Tokenizer.h"
 #include "../scene/scene.h"
 #include "../scene/material.h"
 #include "../ui/TraceUI.h"
+#include "../fileio/meshfile.h"
 extern TraceUI* traceUI;
 
 using namespace std;
@@ -18,17 +21,19 @@ Scene* Parser::parseScene()
 {
   _tokenizer.Read(SBT_RAYTRACER);
 
-  auto_ptr<Token> versionNumber( _tokenizer.Read(SCALAR) );
+  Token versionNumber( _tokenizer.Read(SCALAR) );
 
-  if( versionNumber->value() > 1.1 )
+  if( versionNumber.value() > 1.1 )
   {
     ostringstream ost;
-    ost << "SBT-raytracer version number " << versionNumber->value() << 
+    ost << "SBT-raytracer version number " << versionNumber.value() << 
       " too high; only able to parse v1.1 and below.";
     throw ParserException( ost.str() );
   }
 
   Scene* scene = new Scene;
+  if( _textures ) scene->setTextureCache( _textures );
+  scene->setLoader( _loader );
   auto_ptr<Material> mat( new Material );
 
   for( ;; )
@@ -548,7 +553,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
-  list<Vec3d> faces;
+  vector<int> faces;                // three vertex indices per triangle
 
   char* error;
   for( ;; )
@@ -592,10 +597,14 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NORMALS:
+      {
         _tokenizer.Read( NORMALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        vector<Vec3d> normals;
+        if( parseBulkVec3dList( normals ) )
+          tmesh->addNormals( normals );
+        else if( RPAREN != _tokenizer.Peek()->kind() )
         {
           tmesh->addNormal( parseVec3d() );
           for( ;; )
@@ -610,12 +619,13 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( RPAREN );
         _tokenizer.Read( SEMICOLON );
         break;
+      }
 
       case FACES:
         _tokenizer.Read( FACES );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        if( !parseBulkFaces( faces ) && RPAREN != _tokenizer.Peek()->kind() )
         {
           parseFaces( faces );
           for( ;; )
@@ -631,11 +641,32 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( SEMICOLON );
         break;
 
+      case MESH_FILE:
+      {
+        // An OBJ or PLY file, relative to the scene like texture maps
+        _tokenizer.Read( MESH_FILE );
+        _tokenizer.Read( EQUALS );
+        string filename = _basePath;
+        filename.append( "/" );
+        filename.append( parseIdent() );
+        _tokenizer.CondRead( SEMICOLON );
+
+        MeshData data;
+        readMeshFile( filename, data, traceUI ? traceUI->getThreads() : 0 );
+        if( !tmesh->addMesh( data.vertices, data.normals, data.faces ) )
+          throw ParserException( "Bad face in mesh file " + filename );
+        break;
+      }
+
       case POLYPOINTS:
+      {
         _tokenizer.Read( POLYPOINTS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        vector<Vec3d> points;
+        if( parseBulkVec3dList( points ) )
+          tmesh->addVertices( points );
+        else if( RPAREN != _tokenizer.Peek()->kind() )
         {
           tmesh->addVertex( parseVec3d() );
           for( ;; )
@@ -650,7 +681,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( RPAREN );
         _tokenizer.Read( SEMICOLON );
         break;
-
+      }
 
       case RBRACE:
       {
@@ -658,13 +689,13 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
 
         // Now add all the faces into the trimesh, since hopefully
         // the vertices have been parsed out
-        for( list<Vec3d>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
+        for( size_t f = 0; f < faces.size(); f += 3 )
         {
-          if( !tmesh->addFace( (*vitr)[0], (*vitr)[1], (*vitr)[2] ) )
+          if( !tmesh->addFace( faces[f], faces[f+1], faces[f+2] ) )
           {
             ostringstream oss;
-            oss << "Bad face in trimesh: (" << (*vitr)[0] << ", " << (*vitr)[1] << 
-              ", " << (*vitr)[2] << ")";
+            oss << "Bad face in trimesh: (" << faces[f] << ", " << faces[f+1] << 
+              ", " << faces[f+2] << ")";
             throw ParserException( oss.str() );
           }
         }
@@ -685,7 +716,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
-void Parser::parseFaces( list< Vec3d >& faces )
+void Parser::parseFaces( vector<int>& faces )
 {
   list< double > points = parseScalarList();
 
@@ -695,16 +726,229 @@ void Parser::parseFaces( list< Vec3d >& faces )
      throw SyntaxErrorException( "Faces must have at least 3 vertices.", _tokenizer );
 
   list<double>::const_iterator i = points.begin();
-  double a = (*i++);
-  double b = (*i++);
+  int a = (int)(*i++);
+  int b = (int)(*i++);
   while( i != points.end() )
   {
-    double c = (*i++);
-    faces.push_back( Vec3d( a, b, c ) );
+    int c = (int)(*i++);
+    faces.push_back( a );
+    faces.push_back( b );
+    faces.push_back( c );
     b = c;
   }
 }
 
+// Lists with at least this much text skip the tokenizer.  They are
+// split into pieces about this big, at commas between tuples, and the
+// pieces are parsed in parallel.
+static const size_t bulkListBytes = 64 << 10;
+
+// Where a list's pieces are, once grouped into one chunk per thread.
+// Chunk i runs from begins[i] up to the comma before begins[i+1], or
+// up to the closing paren, and holds tuples firstTuple[i] onward.
+struct BulkList
+{
+  const char* close;
+  vector<const char*> begins;
+  vector<size_t> firstTuple;        // one more than begins: the total
+};
+
+static inline bool isBulkSpace( char c ) { return ' ' == c || (c >= '\t' && c <= '\r'); }
+
+// Scans the list whose '(' has just been read, up to its closing
+// paren.  Only lists of parenthesized numbers qualify; comments,
+// identifiers and deeper nesting are left to the tokenizer.
+static bool scanBulkList( const char* first, const char* last, BulkList& list )
+{
+  vector<const char*> begins( 1, first );
+  vector<size_t> firstTuple( 1, 0 );
+  size_t tuples = 1;
+  int depth = 1;
+
+  const char* p = first;
+  for( ; p != last; ++p )
+  {
+    char c = *p;
+    if( (c >= '0' && c <= '9') || '.' == c || '-' == c || 'e' == c || isBulkSpace( c ) )
+      continue;
+    if( '(' == c )
+    {
+      if( ++depth > 2 ) return false;
+    }
+    else if( ')' == c )
+    {
+      if( --depth == 0 ) break;
+    }
+    else if( ',' == c )
+    {
+      if( depth == 1 && size_t( p - begins.back() ) >= bulkListBytes )
+      {
+        begins.push_back( p + 1 );
+        firstTuple.push_back( tuples );
+      }
+      if( depth == 1 ) tuples++;
+    }
+    else
+      return false;
+  }
+  if( p == last || size_t( p - first ) < bulkListBytes )
+    return false;
+
+  int nThreads = traceUI ? traceUI->getThreads() : 0;
+  if( nThreads <= 0 ) nThreads = max( 1, (int)thread::hardware_concurrency() );
+  size_t pieces = begins.size();
+  size_t nChunks = min( (size_t)nThreads, pieces );
+
+  list.close = p;
+  list.begins.clear();
+  list.firstTuple.clear();
+  for( size_t i = 0; i < nChunks; i++ )
+  {
+    list.begins.push_back( begins[ pieces * i / nChunks ] );
+    list.firstTuple.push_back( firstTuple[ pieces * i / nChunks ] );
+  }
+  list.firstTuple.push_back( tuples );
+  return true;
+}
+
+// Runs job( 0 ) .. job( n - 1 ) concurrently, the first on this thread
+template< class Job >
+static void runChunks( size_t n, const Job& job )
+{
+  vector<thread> threads;
+  for( size_t i = 1; i < n; i++ )
+    threads.push_back( thread( job, i ) );
+  job( 0 );
+  for( size_t i = 0; i < threads.size(); i++ )
+    threads[i].join();
+}
+
+// The tokens a chunk is made of, read as the tokenizer would read them
+static inline bool bulkPunct( const char*& p, const char* end, char c )
+{
+  while( p != end && isBulkSpace( *p ) ) p++;
+  if( p == end || c != *p ) return false;
+  p++;
+  return true;
+}
+
+static inline bool bulkScalar( const char*& p, const char* end, double& value )
+{
+  while( p != end && isBulkSpace( *p ) ) p++;
+  if( p == end || !((*p >= '0' && *p <= '9') || '.' == *p || '-' == *p) ) return false;
+  value = Tokenizer::ScanScalar( p, end, p );
+  return true;
+}
+
+static inline bool bulkEnd( const char* p, const char* end )
+{
+  while( p != end && isBulkSpace( *p ) ) p++;
+  return p == end;
+}
+
+// Exactly count tuples (x, y, z), separated by commas, into out
+static bool parseVec3dChunk( const char* p, const char* end, Vec3d* out, size_t count )
+{
+  for( size_t i = 0; i < count; i++ )
+  {
+    if( i && !bulkPunct( p, end, ',' ) ) return false;
+    Vec3d& v = out[i];
+    if( !bulkPunct( p, end, '(' ) || !bulkScalar( p, end, v[0] ) ||
+        !bulkPunct( p, end, ',' ) || !bulkScalar( p, end, v[1] ) ||
+        !bulkPunct( p, end, ',' ) || !bulkScalar( p, end, v[2] ) ||
+        !bulkPunct( p, end, ')' ) )
+      return false;
+  }
+  return bulkEnd( p, end );
+}
+
+// Polygons of three or more vertex indices, as fans of triangles
+static bool parseFacesChunk( const char* p, const char* end, size_t count, vector<int>& faces )
+{
+  for( size_t i = 0; i < count; i++ )
+  {
+    if( i && !bulkPunct( p, end, ',' ) ) return false;
+    if( !bulkPunct( p, end, '(' ) ) return false;
+    double a, b, c;
+    if( !bulkScalar( p, end, a ) || !bulkPunct( p, end, ',' ) ||
+        !bulkScalar( p, end, b ) || !bulkPunct( p, end, ',' ) ||
+        !bulkScalar( p, end, c ) )
+      return false;
+    for( ;; )
+    {
+      faces.push_back( (int)a );
+      faces.push_back( (int)b );
+      faces.push_back( (int)c );
+      if( bulkPunct( p, end, ')' ) ) break;
+      b = c;
+      if( !bulkPunct( p, end, ',' ) || !bulkScalar( p, end, c ) ) return false;
+    }
+  }
+  return bulkEnd( p, end );
+}
+
+static inline const char* chunkEnd( const BulkList& list, size_t i )
+{
+  return i + 1 < list.begins.size() ? list.begins[i + 1] - 1 : list.close;
+}
+
+bool Parser::parseBulkVec3dList( vector<Vec3d>& list )
+{
+  const char *first, *last;
+  BulkList bulk;
+  if( !_tokenizer.PeekText( first, last ) || !scanBulkList( first, last, bulk ) )
+    return false;
+
+  // Each chunk knows which tuples it holds, so it fills in its own
+  // part of the list.
+  size_t nChunks = bulk.begins.size();
+  vector<char> ok( nChunks );
+  list.resize( bulk.firstTuple.back() );
+  runChunks( nChunks, [&]( size_t i ) {
+    ok[i] = parseVec3dChunk( bulk.begins[i], chunkEnd( bulk, i ),
+      &list[ bulk.firstTuple[i] ], bulk.firstTuple[i + 1] - bulk.firstTuple[i] );
+  } );
+
+  if( find( ok.begin(), ok.end(), 0 ) != ok.end() )
+  {
+    list.clear();
+    return false;
+  }
+  _tokenizer.SkipTo( bulk.close );
+  return true;
+}
+
+bool Parser::parseBulkFaces( vector<int>& faces )
+{
+  const char *first, *last;
+  BulkList bulk;
+  if( !_tokenizer.PeekText( first, last ) || !scanBulkList( first, last, bulk ) )
+    return false;
+
+  // Polygons make any number of triangles, so the chunks' faces are
+  // only gathered up afterwards.
+  size_t nChunks = bulk.begins.size();
+  vector<char> ok( nChunks );
+  vector< vector<int> > chunkFaces( nChunks );
+  runChunks( nChunks, [&]( size_t i ) {
+    size_t count = bulk.firstTuple[i + 1] - bulk.firstTuple[i];
+    chunkFaces[i].reserve( 3 * count );
+    ok[i] = parseFacesChunk( bulk.begins[i], chunkEnd( bulk, i ), count, chunkFaces[i] );
+  } );
+
+  if( find( ok.begin(), ok.end(), 0 ) != ok.end() )
+    return false;
+
+  size_t total = faces.size();
+  for( size_t i = 0; i < nChunks; i++ )
+    total += chunkFaces[i].size();
+  faces.reserve( total );
+  for( size_t i = 0; i < nChunks; i++ )
+    faces.insert( faces.end(), chunkFaces[i].begin(), chunkFaces[i].end() );
+  _tokenizer.SkipTo( bulk.close );
+  return true;
+}
+
 // Ambient lights are a bit special in that we don't actually
 // create a separate Light for each ambient light; instead
 // we simply sum all the ambient intensities and put them in
@@ -958,16 +1202,16 @@ string Parser::parseIdentExpression()
 
 double Parser::parseScalar()
 {
-  auto_ptr<Token> scalar( _tokenizer.Read( SCALAR ) );
+  Token scalar( _tokenizer.Read( SCALAR ) );
 
-  return scalar->value();
+  return scalar.value();
 }
 
 string Parser::parseIdent()
 {
-  auto_ptr<Token> scalar( _tokenizer.Read( IDENT ) );
+  Token scalar( _tokenizer.Read( IDENT ) );
 
-  return scalar->ident();
+  return scalar.ident();
 }
 
 
@@ -1013,34 +1257,34 @@ bool Parser::parseBoolean()
 Vec3d Parser::parseVec3d()
 {
   _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
+  Token value1( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
+  Token value2( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
+  Token value3( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( RPAREN );
 
-  return Vec3d( value1->value(), 
-    value2->value(), 
-    value3->value() );
+  return Vec3d( value1.value(), 
+    value2.value(), 
+    value3.value() );
 }
 
 Vec4d Parser::parseVec4d()
 {
   _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
+  Token value1( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
+  Token value2( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
+  Token value3( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value4( _tokenizer.Read( SCALAR ) );
+  Token value4( _tokenizer.Read( SCALAR ) );
   _tokenizer.Read( RPAREN );
 
-  return Vec4d( value1->value(), 
-    value2->value(), 
-    value3->value(),
-    value4->value() );
+  return Vec4d( value1.value(), 
+    value2.value(), 
+    value3.value(),
+    value4.value() );
 }
 
 Material* Parser::parseMaterial( Scene* scene, const Material& parent )
@@ -1103,7 +1347,7 @@ Material* Parser::parseMaterial( Scene* scene, const Material& parent )
 
       case NAME:
          _tokenizer.Read(NAME);
-         name = (_tokenizer.Read(IDENT))->ident();
+         name = _tokenizer.Read(IDENT).ident();
          _tokenizer.Read( SEMICOLON );
          break;
 
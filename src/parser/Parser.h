@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "ParserException.h"
 #include "Tokenizer.h"
@@ -42,8 +43,12 @@ class Parser
   public:
     // We need the path for referencing files from the
     // base file.
-    Parser( Tokenizer& tokenizer, string basePath )
-      : _tokenizer( tokenizer ), _basePath( basePath )
+    // Texture maps go into the scene's own cache unless another one is
+    // given to share.  A loader is handed the scene as it is read.
+    Parser( Tokenizer& tokenizer, string basePath, TextureCache* textures = 0,
+            SceneLoader* loader = 0 )
+      : _tokenizer( tokenizer ), _basePath( basePath ), _textures( textures ),
+        _loader( loader )
       { }
 
     // Parse the top-level scene
@@ -72,7 +77,14 @@ private:
     void      parseCylinder(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseCone(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat);
-    void      parseFaces( std::list< Vec3d >& faces );
+    void      parseFaces( std::vector<int>& faces );
+
+    // Fast paths for the long lists in trimeshes, taken just after the
+    // list's '(' is read.  They return false, having read nothing, when
+    // the list is short or isn't plain numbers; the tokens then show
+    // where any syntax error is.
+    bool      parseBulkVec3dList( std::vector<Vec3d>& list );
+    bool      parseBulkFaces( std::vector<int>& faces );
 
     // Parse transforms
     void parseTranslate(Scene* scene, TransformNode* transform, const Material& mat);
@@ -107,6 +119,8 @@ private:
     Tokenizer& _tokenizer;
     mmap materials;
     std::string _basePath;
+    TextureCache* _textures;
+    SceneLoader* _loader;
 };
 
 #endif
@@ -4,6 +4,7 @@
 #include "Token.h"
 
 #include <map>
+#include <vector>
 #include <sstream>
 
 #include <iostream>
@@ -75,6 +76,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ NORMALS ]           = "normals";
     tokenNames[ MATERIALS ]         = "materials";
     tokenNames[ FACES ]             = "faces";
+    tokenNames[ MESH_FILE ]         = "file";
     tokenNames[ TRANSLATE ]         = "translate";
     tokenNames[ SCALE ]             = "scale";
     tokenNames[ ROTATE ]            = "rotate";
@@ -113,11 +115,9 @@ string getNameForToken( const SYMBOL kind )
       reservedWords["regular17gon"] = SEVENTEENGON;
    to the list below.
 */
-SYMBOL lookupReservedWord(const string& ident) {
-  static std::map<string, SYMBOL> reservedWords;
+static std::map<string, SYMBOL> makeReservedWords() {
+  std::map<string, SYMBOL> reservedWords;
 
-  if( reservedWords.empty() )
-  {
     reservedWords["ambient_light"] = AMBIENT_LIGHT;
     reservedWords["ambient"] = AMBIENT;
     reservedWords["aspectratio"] = ASPECTRATIO;
@@ -138,6 +138,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["faces"] = FACES;
     reservedWords["false"] = SYMFALSE;
     reservedWords["fall_rate"] = FALL_RATE;
+    reservedWords["file"] = MESH_FILE;
     reservedWords["fov"] = FOV;
     reservedWords["gennormals"] = GENNORMALS;
     reservedWords["height"] = HEIGHT;
@@ -172,20 +173,45 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["updir"] = UPDIR;
     reservedWords["viewdir"] = VIEWDIR;
 
-  }
+  return reservedWords;
+}
 
-  // search ReservedWords table
-  std::map<string, SYMBOL>::const_iterator itr = 
-    reservedWords.find( ident );
-  if( itr == reservedWords.end() )
-    return UNKNOWN;
-  else
-    return (*itr).second;
+SYMBOL lookupReservedWord(const string& ident) {
+  return lookupReservedWord( ident.data(), ident.size() );
+}
+
+// The words are searched in a sorted array rather than in the map itself,
+// so that identifiers can be looked up where they are in the source
+// without being copied into a string first.
+SYMBOL lookupReservedWord(const char* name, size_t length) {
+  typedef std::pair<string, SYMBOL> Word;
+  static const std::map<string, SYMBOL> reservedWords = makeReservedWords();
+  static const std::vector<Word> sorted( reservedWords.begin(), reservedWords.end() );
+
+  size_t lo = 0, hi = sorted.size();
+  while( lo < hi )
+  {
+    size_t mid = (lo + hi) / 2;
+    int cmp = sorted[mid].first.compare( 0, string::npos, name, length );
+    if( cmp == 0 )
+      return sorted[mid].second;
+    if( cmp < 0 )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return UNKNOWN;
 }
 
 string Token::toString() const
 {
-  return getNameForToken( kind() );
+  ostringstream oss;
+  oss << getNameForToken( kind() );
+  if( IDENT == kind() )
+    oss << ": \"" << ident() << "\"";
+  else if( SCALAR == kind() )
+    oss << ": " << value();
+  return oss.str();
 }
 
 void Token::Print( ostream& out ) const {
@@ -195,16 +221,3 @@ void Token::Print( ostream& out ) const {
 void Token::Print( ) const {
   Print( std::cout );
 }
-
-string IdentToken::toString( ) const {
-  ostringstream oss( Token::toString() );
-  oss << ": \"" << _ident << "\"";
-  return oss.str();
-}
-
-string ScalarToken::toString( ) const {
-  ostringstream oss( Token::toString() );
-  oss << ": " << _value;
-  return oss.str();
-}
- 
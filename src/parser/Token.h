@@ -7,6 +7,7 @@
 #define __TOKEN_H__
 
 #include <string>
+#include <cstddef>
 #include <iostream>
 #include <map>
 
@@ -74,6 +75,7 @@ enum SYMBOL {
   POLYPOINTS, NORMALS,			// keywords affecting polygons
   MATERIALS, FACES,
   GENNORMALS,
+  MESH_FILE,
 
   TRANSLATE, SCALE,			// Transforms
   ROTATE, TRANSFORM,
@@ -90,54 +92,47 @@ enum SYMBOL {
 // Helper functions
 string getNameForToken( const SYMBOL kind );
 SYMBOL lookupReservedWord( const string& name );
+SYMBOL lookupReservedWord( const char* name, size_t length );
 
+// Tokens are small values.  An identifier's text is not copied; it points
+// into the Tokenizer's buffer, so tokens must not outlive their tokenizer.
 class Token {
   public:
-    Token(SYMBOL kind) : _kind( kind ) { }
+    Token(SYMBOL kind = UNKNOWN)
+      : _kind( kind ), _length( 0 ) { _value = 0.0; }
+    explicit Token(double value)
+      : _kind( SCALAR ), _length( 0 ) { _value = value; }
+    Token(const char* ident, size_t length)
+      : _kind( IDENT ), _length( (unsigned)length ) { _text = ident; }
 
     SYMBOL kind() const { return _kind; }
 
     // Note that these errors should not ever be encountered at runtime,
     // and signify parser bugs of some kind.
-    virtual std::string ident() const   
-      { throw ParserFatalException("not an IdentToken"); return std::string(); }
-    virtual double value() const   
-      { throw ParserFatalException("not a ScalarToken"); return 0.0; }
-
-
-    // Utility functions
-    virtual void Print(std::ostream& out) const;
-    virtual void Print() const;
-    virtual string toString() const;
-
-	virtual ~Token() {}
-  protected:
-    const SYMBOL _kind;
-};
-
-class IdentToken : public Token {
-  public:
-    IdentToken(std::string ident) : Token(IDENT), _ident( ident ) { 
+    std::string ident() const
+    {
+      if( IDENT != _kind ) throw ParserFatalException("not an IdentToken");
+      return std::string( _text, _length );
+    }
+    double value() const
+    {
+      if( SCALAR != _kind ) throw ParserFatalException("not a ScalarToken");
+      return _value;
     }
 
-    std::string ident() const { return _ident; }
-
-    string toString() const;
-
-  protected:
-    const std::string _ident;
-};
-
-class ScalarToken : public Token {
-  public:
-    ScalarToken(double value) : Token(SCALAR), _value( value ) { }
-    
-    double value() const { return _value; }
 
+    // Utility functions
+    void Print(std::ostream& out) const;
+    void Print() const;
     string toString() const;
 
   protected:
-    const double _value;
+    SYMBOL _kind;
+    unsigned _length;           // of an identifier's text
+    union {
+      double _value;
+      const char* _text;
+    };
 };
 
 
@@ -4,6 +4,7 @@
 #include <map>
 #include <sstream>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../fileio/buffer.h"
 #include "Tokenizer.h"
@@ -33,75 +34,99 @@
 // simplifies the scanner part, since we don't have to open it and
 // error check to see if it exists.  We assume that the caller (which
 // will be the main() function) sets up everything and passes us a VALID
-// file pointer.
+// file pointer.  The rest of the stream is read in before scanning.
 //
 
 Tokenizer::Tokenizer(istream& fp, bool printTokens) 
-  : buffer( fp, false, false )
+  : buffer( fp )
 { 
+    Init( printTokens );
+}
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Tokenizer::Tokenizer(const string&) constructor
+//
+//   Scans a file by name, which lets the buffer map it instead of
+// copying it.  If it can't be opened, the tokenizer sees an empty file;
+// callers check isOpen().
+//
+
+Tokenizer::Tokenizer(const string& filename, bool printTokens)
+  : buffer( filename )
+{
+    Init( printTokens );
+}
+
+void Tokenizer::Init(bool printTokens) {
+    Pos = buffer.begin();
+    End = buffer.end();
+    LineStart = Pos;
+    LineNumber = 1;
+    HasUnGetToken = false;
+    TokenLineStart = Pos;
+    TokenLine = 1;
     TokenColumn = 0;
-    CurrentCh = ' ';
-    UnGetToken = NULL;
     _printTokens = printTokens;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// repeatedly scan tokens in and throw them away.  Useful if this is the
+// repeatedly scan tokens and throw them away.  Useful if this is the
 // last phase to be executed
 // 
 void Tokenizer::ScanProgram() {
-    while (Get()->kind() != EOFSYM) ;
+    while (Get().kind() != EOFSYM) ;
 }
 
 
-auto_ptr<Token> Tokenizer::Get() {
-  return auto_ptr<Token>(GetNext());
-}
-
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Get() method
+// Token Tokenizer::Get() method
 //
 // Advance through the source to find the next token. Returns peeked token,
 // if there is one.
 //
 
-Token* Tokenizer::GetNext() {
-  Token* T = NULL;
-
+Token Tokenizer::Get() {
   // First check to see if there is an UnGetToken. If there is, use it.
-  if (UnGetToken != NULL) {
-    T = UnGetToken;
-    UnGetToken = NULL;
-    return T;
+  if (HasUnGetToken) {
+    HasUnGetToken = false;
+    return UnGetToken;
   }
+  return GetNext();
+}
 
-  // Otherwise, crank up the scanner and get a new token.
+// The <ctype.h> classes, without the locale lookups and without
+// the undefined behavior for negative chars.
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+static inline bool isAlpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+static inline bool isSpace(char c) { return ' ' == c || (c >= '\t' && c <= '\r'); }
 
-  // Get rid of any whitespace
-  SkipWhiteSpace();
+Token Tokenizer::GetNext() {
+  // Get rid of any whitespace; numeric arrays often have none at all
+  if (Pos != End && (isSpace(*Pos) || '/' == *Pos))
+    SkipWhiteSpace();
 
-  // test for end of file
-  if (buffer.isEOF()) {
-    T = new Token(EOFSYM);
+  // Save the starting position of the symbol, so that nicer error
+  // messages can be produced.
+  MarkToken(Pos);
 
-  } else {
-    
-    // Save the starting position of the symbol in a variable,
-    // so that nicer error messages can be produced.
-    TokenColumn = buffer.CurColumn();
-    
+  Token T( EOFSYM );
+
+  // test for end of file
+  if (Pos != End) {
     // Check kind of current character
+    char CurrentCh = *Pos;
     
     // Note that _'s are now allowed in identifiers.
-    if (isalpha(CurrentCh) || '_' == CurrentCh) {
+    if (isDigit(CurrentCh) || '-' == CurrentCh || '.' == CurrentCh) {
+      T = GetScalar();
+    } else if (isAlpha(CurrentCh) || '_' == CurrentCh) {
       // grab identifier or reserved word
       T = GetIdent();
     } else if ( '"' == CurrentCh)  {
       T = GetQuotedIdent(); 
-    } else if (isdigit(CurrentCh) || '-' == CurrentCh || '.' == CurrentCh) {
-      T = GetScalar();
     } else { 
       //
       // Check for other tokens
@@ -110,199 +135,284 @@ Token* Tokenizer::GetNext() {
       T = GetPunct();
     }
   }
-  
-  if (T == NULL) {
-    throw ParserFatalException("didn't get a token");
-  }
 
   if (_printTokens) {
     std::cout << "Token read: ";
-    T->Print();
+    T.Print();
     std::cout << std::endl;
   }
 
   return T;
 }
 
+void Tokenizer::MarkToken(const char* start) {
+  TokenLineStart = LineStart;
+  TokenLine = LineNumber;
+  TokenColumn = (int)(start - LineStart);
+}
+
 //////////////////////////////////////////////////////////////////////////
 //
 // Skips spaces, tabs, newlines, and comments
 //
 void Tokenizer::SkipWhiteSpace() {
-  while (isspace(CurrentCh)) {
-    GetCh();
-  }
-
-  if( '/' == CurrentCh )  // Look for comments
-  {
-    GetCh();
-    if( '/' == CurrentCh )
-    {
-      // Throw out everything until the end of the line
-      while( '\n' != CurrentCh )
-      {
-        GetCh();
+  while (true) {
+    while (Pos != End && isSpace(*Pos)) {
+      if ('\n' == *Pos) {
+        LineStart = Pos + 1;
+        LineNumber++;
       }
+      Pos++;
     }
-    else if ( '*' == CurrentCh )
-    {
-      int startLine = CurLine();
-      while( true )
-      {
-        GetCh();
-        if( '*' == CurrentCh )
-        {
-          GetCh();
-          if( CondReadCh( '/' ) )
-            break;
-          else if ( buffer.isEOF() )
-          {
-            std::ostringstream ost;
-            ost << "Unterminated comment in line ";
-            ost << startLine;
-            throw SyntaxErrorException( ost.str(), *this );
-          }
-        }
-        else if ( buffer.isEOF() )
-        {
+
+    if (Pos == End || '/' != *Pos)  // Look for comments
+      return;
+
+    // Errors point at the start of the comment
+    MarkToken(Pos);
+    if (Pos + 1 != End && '/' == Pos[1]) {
+      // Throw out everything until the end of the line
+      while (Pos != End && '\n' != *Pos)
+        Pos++;
+    } else if (Pos + 1 != End && '*' == Pos[1]) {
+      int startLine = LineNumber;
+      for (Pos += 2; ; Pos++) {
+        if (End - Pos < 2) {
           std::ostringstream ost;
           ost << "Unterminated comment in line ";
           ost << startLine;
           throw SyntaxErrorException( ost.str(), *this );
         }
+        if ('*' == Pos[0] && '/' == Pos[1])
+          break;
+        if ('\n' == *Pos) {
+          LineStart = Pos + 1;
+          LineNumber++;
+        }
       }
+      Pos += 2;
+    } else {
+      throw SyntaxErrorException( "unexpected character: '/'", *this );
     }
-    else
-    {
-      std::ostringstream ost;
-      ost << "unexpected character: '" << CurrentCh << "'";
-	  throw SyntaxErrorException( ost.str(), *this );
-    }
-
-    SkipWhiteSpace();  // We may need to throw out
-                       //  more white space/comments
-                       // This is admittedly tail recursion...
   }
 }
 
-Token* Tokenizer::GetQuotedIdent() {
-  GetCh();   // Throw out beginning '"'
-
-  std::ostringstream ident;
-  while ( '"' != CurrentCh ) {
-    if( '\n' == CurrentCh )
-      throw SyntaxErrorException( "Unterminated string constant", *this );
+Token Tokenizer::GetQuotedIdent() {
+  const char* start = ++Pos;   // Throw out beginning '"'
 
-    ident << CurrentCh;
-    GetCh();
+  while (Pos != End && '"' != *Pos) {
+    if ('\n' == *Pos)
+      break;
+    Pos++;
   }
-  GetCh();
-  return new IdentToken( ident.str() );
+  if (Pos == End || '"' != *Pos)
+    throw SyntaxErrorException( "Unterminated string constant", *this );
+
+  Token T( start, Pos - start );
+  Pos++;
+  return T;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetIdent method
+// Token Tokenizer::GetIdent method
 //
 //   GetIdent scans an identifier-like token.  It returns an
 //   identifier or a reserved word token.
 //
 
-Token* Tokenizer::GetIdent() {
+Token Tokenizer::GetIdent() {
   // an IDENTIFIER or a RESERVED WORD token
-  std::ostringstream ident;
-  while (isalnum(CurrentCh) || '_' == CurrentCh || '-' == CurrentCh) { 
-    // While we still have something that can
-    ident << CurrentCh;
-    GetCh();
-  }
-  return SearchReserved(ident.str());
+  const char* start = Pos;
+  while (Pos != End && (isAlpha(*Pos) || isDigit(*Pos) || '_' == *Pos || '-' == *Pos))
+    Pos++;
+
+  SYMBOL tokSymbol = lookupReservedWord( start, Pos - start );
+  if( UNKNOWN == tokSymbol )
+    return Token( start, Pos - start );
+  return Token( tokSymbol );
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetInt method
+// double parseScalar(const char*, const char*, const char*&) helper
 //
-//   GetInt scans an integer.  It returns an integer token.
+//   Scans the number starting at first, which runs as long as there are
+// characters that can be part of one, and converts it the way atof()
+// would, without copying it anywhere.  Numbers with at most 15
+// significant digits and a small exponent are exact in a double, as is
+// the power of ten, so one multiplication or division rounds them
+// correctly; that covers nearly every number in a scene file.  Anything
+// else goes to strtod().  Mesh files are read with it too, so it also
+// takes the '+' signs and 'E's that exporters write.
 //
 
-Token* Tokenizer::GetScalar() {
-  // an INTEGER token
-  string ret( "" );
-  while (isdigit(CurrentCh) || '-' == CurrentCh || '.' == CurrentCh || 'e' == CurrentCh ) {
-    ret += CurrentCh;
-    GetCh();
+static inline bool isScalarChar(char c) {
+  return isDigit(c) || '-' == c || '+' == c || '.' == c || 'e' == c || 'E' == c;
+}
+
+static const double powersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double slowParseScalar(const char* first, const char* end, const char*& last) {
+  last = first;
+  while (last != end && isScalarChar(*last))
+    last++;
+
+  char small[64];
+  size_t n = last - first;
+  if (n < sizeof(small)) {
+    memcpy(small, first, n);
+    small[n] = '\0';
+    return strtod(small, NULL);
+  }
+  return strtod(string(first, last).c_str(), NULL);
+}
+
+static double parseScalar(const char* first, const char* end, const char*& last) {
+  const char* p = first;
+  bool negative = (p != end && '-' == *p);
+  if (p != end && ('-' == *p || '+' == *p)) p++;
+
+  unsigned long long mantissa = 0;
+  int significant = 0;            // digits, not counting leading zeros
+  int exponent = 0;
+  bool digits = false;
+  for (; p != end && isDigit(*p); p++) {
+    digits = true;
+    if (mantissa != 0 || '0' != *p) significant++;
+    if (significant > 15) return slowParseScalar(first, end, last);
+    mantissa = mantissa * 10 + (*p - '0');
+  }
+  if (p != end && '.' == *p) {
+    for (p++; p != end && isDigit(*p); p++) {
+      digits = true;
+      if (mantissa != 0 || '0' != *p) significant++;
+      if (significant > 15) return slowParseScalar(first, end, last);
+      mantissa = mantissa * 10 + (*p - '0');
+      exponent--;
+    }
   }
-  return new ScalarToken( atof( ret.c_str() ) );
+  if (!digits) return slowParseScalar(first, end, last);
+
+  if (p != end && ('e' == *p || 'E' == *p)) {
+    p++;
+    bool negativeExponent = (p != end && '-' == *p);
+    if (p != end && ('-' == *p || '+' == *p)) p++;
+    if (p == end || !isDigit(*p)) return slowParseScalar(first, end, last);
+    int e = 0;
+    for (; p != end && isDigit(*p) && e < 1000; p++)
+      e = e * 10 + (*p - '0');
+    exponent += negativeExponent ? -e : e;
+  }
+  // Whatever else there is, such as a second '-', is left to strtod()
+  if ((p != end && isScalarChar(*p)) || exponent < -22 || exponent > 22)
+    return slowParseScalar(first, end, last);
+
+  last = p;
+  double value = (double)mantissa;
+  value = exponent < 0 ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+  return negative ? -value : value;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetPunct() method
+// Token Tokenizer::GetScalar method
 //
-//   Gets a punctuation token from input stream and returns it.
+//   GetScalar scans a number.  It returns a scalar token.
 //
 
-Token* Tokenizer::GetPunct() {
-  Token* T;
+Token Tokenizer::GetScalar() {
+  return Token( parseScalar( Pos, End, Pos ) );
+}
 
-  switch (CurrentCh) {
-  case '(':  GetCh(); T = new Token(LPAREN);     break;
-  case ')':  GetCh(); T = new Token(RPAREN);     break;
-  case '{':  GetCh(); T = new Token(LBRACE);     break;
-  case '}':  GetCh(); T = new Token(RBRACE);     break;
-  case ',':  GetCh(); T = new Token(COMMA);      break;
-  case '=':  GetCh(); T = new Token(EQUALS);     break;
-  case ';':  GetCh(); T = new Token(SEMICOLON);  break;
+double Tokenizer::ScanScalar(const char* first, const char* end, const char*& last) {
+  return parseScalar( first, end, last );
+}
 
-  default:
-    std::ostringstream ost;
-    ost << "unexpected character: '" << CurrentCh << "'";
-    throw SyntaxErrorException(ost.str(), *this);
-  }
+//////////////////////////////////////////////////////////////////////////
+//
+// PeekText() and SkipTo() methods
+//
+//   These let the parser read big numeric lists straight out of the
+// buffer.  SkipTo() keeps the line count right for later errors.
+//
 
-  return T;
+bool Tokenizer::PeekText(const char*& first, const char*& last) const {
+  if (HasUnGetToken)
+    return false;
+  first = Pos;
+  last = End;
+  return true;
+}
+
+void Tokenizer::SkipTo(const char* pos) {
+  while (const char* eol = (const char*)memchr( Pos, '\n', pos - Pos )) {
+    LineStart = eol + 1;
+    LineNumber++;
+    Pos = eol + 1;
+  }
+  Pos = pos;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// void Tokenizer::UnGet(Token*) method
+// Token Tokenizer::GetPunct() method
+//
+//   Gets a punctuation token from input stream and returns it.
 //
-//   UnGet returns the last read token to the input, where it will be
-//   returned for the next Get call.  At most 1 token can be pushed back
-//   at a time this way and this token is pointed to by the pointer
-//   TokenToUnGet.  TokenToUnGet must be non null.
 
-void Tokenizer::UnGet(Token* TokenToUnGet) {
-  if (UnGetToken != NULL) {
-    throw ParserFatalException("trying to UnGet more than one token");
+Token Tokenizer::GetPunct() {
+  SYMBOL kind;
+
+  switch (*Pos) {
+  case '(':  kind = LPAREN;     break;
+  case ')':  kind = RPAREN;     break;
+  case '{':  kind = LBRACE;     break;
+  case '}':  kind = RBRACE;     break;
+  case ',':  kind = COMMA;      break;
+  case '=':  kind = EQUALS;     break;
+  case ';':  kind = SEMICOLON;  break;
+
+  default:
+    std::ostringstream ost;
+    ost << "unexpected character: '" << *Pos << "'";
+    throw SyntaxErrorException(ost.str(), *this);
   }
-  UnGetToken = TokenToUnGet;
+
+  Pos++;
+  return Token(kind);
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Peek() method
+// const Token* Tokenizer::Peek() method
 //
-//   Peek reads the next token and pushes it back on the token stream
+//   Peek reads the next token and pushes it back on the token stream,
+//   where it will be returned for the next Get call.  The token stays
+//   valid until the next call to Peek.
 //
 
 const Token* Tokenizer::Peek() {
-  Token* T = GetNext();
-  UnGet(T);
-  return T;
+  if (!HasUnGetToken) {
+    UnGetToken = GetNext();
+    HasUnGetToken = true;
+  }
+  return &UnGetToken;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Read(SYMBOL) method
+// Token Tokenizer::Read(SYMBOL) method
 //
 //   Read gets the next token and checks that it's of the expected type.
 //
 
-auto_ptr<Token> Tokenizer::Read(SYMBOL kind) {
-  auto_ptr<Token> T( Get() );
-  if (T->kind() != kind) {
+Token Tokenizer::Read(SYMBOL kind) {
+  Token T( Get() );
+  if (T.kind() != kind) {
     string msg( getNameForToken( kind ) );
     msg.append( " expected" );
     throw SyntaxErrorException(msg, *this);
@@ -322,53 +432,7 @@ auto_ptr<Token> Tokenizer::Read(SYMBOL kind) {
 bool Tokenizer::CondRead(SYMBOL kind) {
   const Token* T = Peek();
   if (T->kind() == kind) {
-    Get( );
-    return true;
-  } else {
-    return false;
-  }
-}
-
-//////////////////////////////////////////////////////////////////////////
-//
-// Token* Tokenizer::SearchReserved(const string&) private method
-//
-//   SearchReserved() maps a character string to an IdentToken or one of
-// several possible reserved word tokens, using a binary search on the
-// ReservedWords structure.
-//
-
-//
-// The list of all the Reserved words and their associated symbols,
-// in alphabetical order so this can be searched using binary search.
-//
-
-typedef std::map<string, SYMBOL> ReservedWordsMap;
-
-Token* Tokenizer::SearchReserved(const string& ident) const {
-  SYMBOL tokSymbol = lookupReservedWord( ident );
-  if( UNKNOWN == tokSymbol )
-  {
-    return new IdentToken( ident );
-  }
-  else
-  {
-    return new Token( tokSymbol );
-  }
-}
-
-//////////////////////////////////////////////////////////////////////////
-//
-// bool Tokenizer::CondReadCh(char) private method
-//
-//   CondReadCh checks to see if the CurrentCh is the same as the argument.
-// If so, CondReadCh eats that character (by calling GetCh())
-// and returns true.  If not, just return false.
-//
-
-bool Tokenizer::CondReadCh(char c) {
-  if (c == CurrentCh) {
-    GetCh();
+    HasUnGetToken = false;
     return true;
   } else {
     return false;
@@ -13,7 +13,6 @@
 
 using std::string;
 using std::istream;
-using std::auto_ptr;
 
 
 /*
@@ -33,25 +32,43 @@ class Tokenizer {
   public:
     Tokenizer(istream& fp, bool printTokens);
 
+    // Scans filename, which is memory-mapped rather than read.  Check
+    // isOpen() before parsing.
+    Tokenizer(const string& filename, bool printTokens);
+    bool isOpen() const { return buffer.isOpen(); }
+
     // destructively read & return the next token, skipping over whitespace
-    auto_ptr<Token> Get();
+    Token Get();
 
     // non-destructively get the next token, pushing it back to be read again
     const Token* Peek();
 
     // Get() the next token, and check that it's of the expected SYMBOL type
-    auto_ptr<Token> Read(SYMBOL expected);
+    Token Read(SYMBOL expected);
 
     // read the next token only if it matches the expected token type.
     // Return whether it matches.
     bool CondRead(SYMBOL expected);
 
-    // display the current source line onto the screen.
-    void PrintLine( ostream& out) const { buffer.PrintLine(out); }
+    // display the current token's source line onto the screen.
+    void PrintLine( ostream& out) const { buffer.PrintLine(out, TokenLineStart); }
 
     // return the column number/line number of the current token.
     int CurColumn() const { return TokenColumn; }
-    int CurLine() const { return buffer.CurLine(); }
+    int CurLine() const { return TokenLine; }
+
+    // For the parser's bulk readers, which scan long numeric lists
+    // themselves: the text that hasn't been tokenized yet.  Returns false
+    // if a token has been peeked, since it would be lost.
+    bool PeekText(const char*& first, const char*& last) const;
+
+    // Move past the text up to pos, which PeekText() handed out
+    void SkipTo(const char* pos);
+
+    // Convert the number at first exactly as a SCALAR token would be;
+    // last is set to just past it.  The caller checks there is a number
+    // there at all; anything else converts to 0.
+    static double ScanScalar(const char* first, const char* end, const char*& last);
 
     // Repeatedly scan tokens and throw them away.  Useful if this is the
     // last phase to be executed
@@ -60,33 +77,35 @@ class Tokenizer {
 protected:
     // private methods:
 
-    // push the argument token back onto the scanner's token stream;
-    // it will be returned by the next Get/Peek/Read/CondRead call
-    Token* GetNext();
-    void UnGet(Token* t);
-
-    Token* SearchReserved(const string&) const; // Convert ident string into token
+    void Init(bool printTokens);
+    Token GetNext();
 
-    void GetCh() { CurrentCh = buffer.GetCh(); }
-    bool CondReadCh(char expected);        // consume a character, if it matches
+    // Make the token starting at start the current one, for error messages
+    void MarkToken(const char* start);
 
-    void SkipWhiteSpace();        // skip spaces, tabs, newlines
+    void SkipWhiteSpace();        // skip spaces, tabs, newlines, comments
 
-    Token* GetPunct();            // scan punctuation token
-    Token* GetScalar();           // scan integer token
-    Token* GetIdent();            // scan identifier token
-    Token* GetQuotedIdent();
+    Token GetPunct();             // scan punctuation token
+    Token GetScalar();            // scan numeric token
+    Token GetIdent();             // scan identifier token
+    Token GetQuotedIdent();
 
 
     // private data:
 
-    Buffer buffer;                // The file buffer
-    char CurrentCh;               // The current character in the current line
+    Buffer buffer;                // The whole source text
+    const char* Pos;              // The next character to scan
+    const char* End;
+
+    const char* LineStart;        // The line Pos is on
+    int LineNumber;
 
-    Token* UnGetToken;            // The token that has been "ungot"
+    Token UnGetToken;             // The token that has been "ungot"
+    bool HasUnGetToken;
 
-    int TokenColumn;              // The column where the last read token starts,
-                                  // for generating error messages
+    const char* TokenLineStart;   // Where the last read token starts,
+    int TokenLine;                // for generating error messages
+    int TokenColumn;
 
     bool _printTokens;            // printing flag
 };
@@ -0,0 +1,68 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <cstdint>
+
+using namespace std;
+
+MemoryArena::MemoryArena(size_t _blockSize)
+	: blockSize(_blockSize), next(nullptr), left(0), used(0), reserved(0)
+{
+}
+
+MemoryArena::~MemoryArena()
+{
+	release();
+}
+
+void* MemoryArena::allocate(size_t bytes, size_t align)
+{
+	size_t pad = (align - (uintptr_t)next % align) % align;
+	if (next == nullptr || pad + bytes > left)
+	{
+		// Requests bigger than a quarter block get a block of their own, so
+		// they don't waste the rest of the current one.
+		size_t size = bytes + align > blockSize / 4 ? bytes + align : blockSize;
+		char* block = (char*)malloc(size);
+		if (block == nullptr) throw bad_alloc();
+		blocks.push_back(block);
+		reserved += size;
+		if (size != blockSize)
+		{
+			char* p = block + (align - (uintptr_t)block % align) % align;
+			used += bytes;
+			return p;
+		}
+		next = block;
+		left = size;
+		pad = (align - (uintptr_t)next % align) % align;
+	}
+	char* p = next + pad;
+	next += pad + bytes;
+	left -= pad + bytes;
+	used += bytes;
+	return p;
+}
+
+void MemoryArena::adopt(MemoryArena& other)
+{
+	blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+	used += other.used;
+	reserved += other.reserved;
+	other.blocks.clear();
+	other.next = nullptr;
+	other.left = 0;
+	other.used = 0;
+	other.reserved = 0;
+}
+
+void MemoryArena::release()
+{
+	for (size_t b = 0; b < blocks.size(); b++)
+		free(blocks[b]);
+	blocks.clear();
+	next = nullptr;
+	left = 0;
+	used = 0;
+	reserved = 0;
+}
@@ -0,0 +1,70 @@
+//
+// arena.h
+//
+// A bump allocator for data that is built once and then thrown away all
+// together, such as the kd-trees of a scene.  Nothing allocated from an
+// arena is freed or destroyed on its own; release() hands every block back
+// at once, however many objects were made from them.
+//
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+class MemoryArena
+{
+public:
+	explicit MemoryArena(size_t blockSize = 64 * 1024);
+	~MemoryArena();
+
+	// Not thread-safe: one thread fills an arena at a time.  Blocks are
+	// first touched by that thread, so on a NUMA machine they land on its
+	// node.
+	void* allocate(size_t bytes, size_t align);
+
+	template <typename T>
+	T* create()
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+		return new (allocate(sizeof(T), alignof(T))) T();
+	}
+
+	// n default-constructed Ts; null for n == 0.
+	template <typename T>
+	T* createArray(size_t n)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+		if (n == 0) return nullptr;
+		T* array = (T*)allocate(n * sizeof(T), alignof(T));
+		for (size_t i = 0; i < n; i++) new (array + i) T();
+		return array;
+	}
+
+	// Frees every block.  Whatever was allocated is gone.
+	void release();
+
+	// Takes over other's blocks, which stay where they are, so that what
+	// was allocated from other now lives as long as this arena.  Lets
+	// threads fill arenas of their own and hand them to one owner.
+	void adopt(MemoryArena& other);
+
+	size_t bytesUsed() const { return used; }
+	size_t bytesReserved() const { return reserved; }
+	int blockCount() const { return (int)blocks.size(); }
+
+private:
+	MemoryArena(const MemoryArena&);
+	MemoryArena& operator=(const MemoryArena&);
+
+	size_t blockSize;
+	std::vector<char*> blocks;
+	char* next;					// free space in the last block
+	size_t left;
+	size_t used, reserved;
+};
+
+#endif // __ARENA_H__
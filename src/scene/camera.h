@@ -21,6 +21,8 @@ public:
 	const Vec3d& getU() const			{ return u; }
 	const Vec3d& getV() const			{ return v; }
 private:
+    friend class BinaryScene;
+
     Mat3d m;                     // rotation matrix
     double normalizedHeight;    // dimensions of image place at unit dist from eye
     double aspectRatio;
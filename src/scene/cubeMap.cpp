@@ -1,75 +1,36 @@
 #include "cubeMap.h"
 #include "ray.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace std;
 
 Vec3d CubeMap::getColor(ray r) const {
 
-	int axis, front, left, right, top, bottom;
+	int axis, front;
 	double u,v;
 	Vec3d dir = r.getDirection();
 	
 	if (fabs(dir[0]) > fabs(dir[1]))
 		if (fabs(dir[0]) > fabs(dir[2])) {
 			axis = 0;
-			bottom = 3;
-			top = 2;
-			if (dir[0] > 0.0) {
-				front = 0;
-				left = 4;
-				right = 5;
-			}
-			else {
-				front = 1;
-				left = 5;
-				right = 4;
-			}
+			front = dir[0] > 0.0 ? 0 : 1;
 		}
 		else {
 			axis = 2;
-			bottom = 3;
-			top = 2;
-			if (dir[2] > 0.0) {
-				front = 5;
-				left = 0;
-				right = 1;
-			}
-			else {
-				front = 4;
-				left = 1;
-				right = 0;
-			}
+			front = dir[2] > 0.0 ? 5 : 4;
 		}
 	else
 		if (fabs(dir[1]) > fabs(dir[2])) {
 			axis = 1;
-			left = 1;
-			right = 0;
-			if (dir[1] > 0.0) {
-				front = 2;
-				bottom = 4;
-				top = 5;
-			}
-			else {
-				front = 3;
-				bottom = 5;
-				top = 4;
-			}
+			front = dir[1] > 0.0 ? 2 : 3;
 		}
 		else {
 			axis = 2;
-			bottom = 3;
-			top = 2;
-			if (dir[2] > 0.0) {
-				front = 5;
-				left = 0;
-				right = 1;
-			}
-			else {
-				front = 4;
-				left = 1;
-				right = 0;
-			}
+			front = dir[2] > 0.0 ? 5 : 4;
 		}
 
 	if (axis == 0) {
@@ -91,9 +52,42 @@ Vec3d CubeMap::getColor(ray r) const {
 	u = (u + 1.0)/2.0;
 	v = (v + 1.0)/2.0;
 
-	int filterwidth = traceUI->getFilterWidth();
-	// r.type() != ray::VISIBILITY || 
-//	if (filterwidth == 1) return tMap[front]->getMappedValue(Vec2d(u, v));
+	// The filter was applied ahead of time, so this is a single texel.
+	const TextureMap* map = filtered[front] ? filtered[front] : tMap[front];
+	int x = floor(0.5 + u * (map->getWidth() - 1));
+	int y = floor(0.5 + v * (map->getHeight() - 1));
+	return map->getPixelAt(x, y);
+}
+
+// Which faces border each face, and on which side, as getColor picks
+// them: the axis the face is on, whether it is the positive side of it,
+// and its left, right, top and bottom neighbours.
+struct FaceLayout
+{
+	int axis;
+	bool positive;
+	int left, right, top, bottom;
+};
+
+static const FaceLayout faceLayouts[6] = {
+	{ 0, true,  4, 5, 2, 3 },
+	{ 0, false, 5, 4, 2, 3 },
+	{ 1, true,  1, 0, 5, 4 },
+	{ 1, false, 1, 0, 4, 5 },
+	{ 2, false, 1, 0, 2, 3 },
+	{ 2, true,  0, 1, 2, 3 }
+};
+
+// The filterwidth x filterwidth tent filter around (u, v) on face front,
+// continuing onto the neighbouring faces past its edges.
+Vec3d CubeMap::filter(int front, double u, double v, int filterwidth) const {
+
+	const FaceLayout& layout = faceLayouts[front];
+	int axis = layout.axis;
+	bool positive = layout.positive;
+	int left = layout.left, right = layout.right;
+	int top = layout.top, bottom = layout.bottom;
+
 	int fw = (filterwidth + 1)/2 - 1;
 	int rm = filterwidth - fw;
 	int width = tMap[front]->getWidth();
@@ -122,7 +116,7 @@ Vec3d CubeMap::getColor(ray r) const {
 			if (yindex < 0) {
 				theMap = bottom;
 				if (axis == 0)
-					if (dir[0] > 0) {
+					if (positive) {
 						yindex = height - 1 - xindex;
 						xindex = width + jj;
 					}
@@ -131,13 +125,13 @@ Vec3d CubeMap::getColor(ray r) const {
 						xindex = -1 - jj;
 					}
 				else if (axis == 1)
-					if (dir[1] > 0) yindex = height + jj;
+					if (positive) yindex = height + jj;
 					else {
 						yindex = -1 - jj;
 						xindex = width - 1 - xindex;
 					}
 				else if (axis == 2)
-					if (dir[2] > 0) {
+					if (positive) {
 						yindex = -1 - jj;
 						xindex = width - 1 - xindex;
 					}
@@ -146,7 +140,7 @@ Vec3d CubeMap::getColor(ray r) const {
 			else if (yindex >= height) {
 				theMap = top;
 				if (axis == 0)
-					if (dir[0] > 0) {
+					if (positive) {
 						yindex = xindex;
 						xindex = width - jj;
 					}
@@ -155,13 +149,13 @@ Vec3d CubeMap::getColor(ray r) const {
 						xindex = jj - 1;
 					}
 				else if (axis == 1)
-					if (dir[1] > 0)  {
+					if (positive)  {
 						yindex = height - jj;
 						xindex = width - 1 - xindex;
 					}
 					else yindex = jj - 1;
 				else if (axis == 2)
-					if (dir[2] > 0) {
+					if (positive) {
 						yindex =  height - jj;
 						xindex = width - 1 - xindex;
 					}
@@ -171,7 +165,7 @@ Vec3d CubeMap::getColor(ray r) const {
 				theMap = left;
 				if (axis == 0  || axis == 2) xindex = width + ii;
 				else if (axis == 1)
-					if (dir[1] > 0)  {
+					if (positive)  {
 						xindex = width - 1 - yindex;
 						yindex = height + ii;
 					}
@@ -184,7 +178,7 @@ Vec3d CubeMap::getColor(ray r) const {
 				theMap = right;
 				if (axis == 0  || axis == 2) xindex = ii - 1;
 				else if (axis == 1)
-					if (dir[1] > 0)  {
+					if (positive)  {
 						xindex = yindex;
 						yindex = height - ii;
 					}
@@ -206,3 +200,36 @@ Vec3d CubeMap::getColor(ray r) const {
 	thePixel /= correct;
 	return thePixel;
 }
+
+void CubeMap::setFilterWidth(int filterwidth, int nThreads) {
+	filterwidth = max(1, filterwidth);
+	if (filterwidth == filterWidth) return;
+	clearFiltered();
+	if (filterwidth == 1) return;
+	for (int f = 0; f < 6; f++) if (!tMap[f]) return;
+
+	// The filter of every texel centre of every face, at 16 bits.  Rows
+	// are shared out between threads: wide filters on large faces are
+	// expensive, though only once per filter width.
+	nThreads = max(1, nThreads);
+	for (int f = 0; f < 6; f++) {
+		int width = tMap[f]->getWidth();
+		int height = tMap[f]->getHeight();
+		std::vector<unsigned short> texels(width * height * 3);
+		std::atomic<int> nextRow(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nThreads; t++)
+			threads.push_back(std::thread([&]() {
+				for (int y; (y = nextRow++) < height; )
+					for (int x = 0; x < width; x++) {
+						Vec3d c = filter(f, x / max(1.0, width - 1.0), y / max(1.0, height - 1.0), filterwidth);
+						for (int k = 0; k < 3; k++)
+							texels[(y * width + x) * 3 + k] = (unsigned short)floor(0.5 + 65535.0 * min(1.0, max(0.0, c[k])));
+					}
+			}));
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].join();
+		filtered[f] = new TextureMap("filtered cube map face", width, height, &texels[0]);
+	}
+	filterWidth = filterwidth;
+}
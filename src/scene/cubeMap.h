@@ -7,39 +7,42 @@ class CubeMap {
 	TextureMap* tMap[6];
 	int* kernel;
 
-public:
-	CubeMap() : kernel(0) { 
-		for (int i = 0; i < 6; i++) tMap[i] = 0;
-	}
+	// The faces with the filter applied, made by setFilterWidth(); null
+	// when the filter width is 1.
+	TextureMap* filtered[6];
+	int filterWidth;
 
-	void setXposMap(TextureMap* m) {
-		if(tMap[0] && tMap[0] != m) delete(tMap[0]);
-		if (tMap[0] != m) tMap[0] = m;
-	}
-	void setXnegMap(TextureMap* m) {
-		if(tMap[1] && tMap[1] != m) delete(tMap[1]);
-		if (tMap[1] != m) tMap[1] = m;
-	}
-	void setYposMap(TextureMap* m) {
-		if(tMap[2] && tMap[2] != m) delete(tMap[2]);
-		if (tMap[2] != m) tMap[2] = m;
-	}
-	void setYnegMap(TextureMap* m) {
-		if(tMap[3] && tMap[3] != m) delete(tMap[3]);
-		if (tMap[3] != m) tMap[3] = m;
+	void setMap(int face, TextureMap* m) {
+		if(tMap[face] && tMap[face] != m) delete(tMap[face]);
+		if (tMap[face] != m) { tMap[face] = m; clearFiltered(); }
 	}
-	void setZposMap(TextureMap* m) {
-		if(tMap[4] && tMap[4] != m) delete(tMap[4]);
-		if (tMap[4] != m) tMap[4] = m;
+	void clearFiltered() {
+		for (int i = 0; i < 6; i++) { delete filtered[i]; filtered[i] = 0; }
+		filterWidth = 1;
 	}
-	void setZnegMap(TextureMap* m) {
-		if(tMap[5] && tMap[5] != m) delete(tMap[5]);
-		if (tMap[5] != m) tMap[5] = m;
+	Vec3d filter(int front, double u, double v, int filterwidth) const;
+
+public:
+	CubeMap() : kernel(0), filterWidth(1) { 
+		for (int i = 0; i < 6; i++) { tMap[i] = 0; filtered[i] = 0; }
 	}
 
+	void setXposMap(TextureMap* m) { setMap(0, m); }
+	void setXnegMap(TextureMap* m) { setMap(1, m); }
+	void setYposMap(TextureMap* m) { setMap(2, m); }
+	void setYnegMap(TextureMap* m) { setMap(3, m); }
+	void setZposMap(TextureMap* m) { setMap(4, m); }
+	void setZnegMap(TextureMap* m) { setMap(5, m); }
+
+	// Prefilters the faces for a filterwidth x filterwidth texel tent
+	// filter, if they aren't already, on nThreads threads.  Must not run
+	// while rays are traced.
+	void setFilterWidth(int filterwidth, int nThreads);
+
 	Vec3d getColor(ray r) const;
 
 	~CubeMap() {
+		clearFiltered();
 		for (int i = 0; i < 6; i++) if (tMap[i]) { delete tMap[i]; tMap[i] = 0; }
 		if (kernel) delete[] kernel;
 	}
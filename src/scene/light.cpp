@@ -4,6 +4,21 @@
 
 using namespace std;
 
+ray Light::shadowRay(const Vec3d& p) const
+{
+  Vec3d shadowDirection = getDirection(p);
+  shadowDirection.normalize();
+  return ray(p, shadowDirection, ray::SHADOW);
+}
+
+Vec3d Light::shadowAttenuation(const ray& r, const Vec3d& p) const
+{
+  ray shadow = shadowRay(p);
+  isect i;
+  bool blocked = this->getScene()->intersect(shadow, i);
+  return shadowFromHit(shadow, blocked ? &i : 0);
+}
+
 double DirectionalLight::distanceAttenuation(const Vec3d& P) const
 {
   // distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -11,14 +26,9 @@ double DirectionalLight::distanceAttenuation(const Vec3d& P) const
 }
 
 
-Vec3d DirectionalLight::shadowAttenuation(const ray& r, const Vec3d& p) const
+Vec3d DirectionalLight::shadowFromHit(const ray& shadowRay, const isect* hit) const
 {
-  // YOUR CODE HERE:
-  Vec3d shadowDirection = getDirection(p);
-  shadowDirection.normalize();
-  isect i;
-  ray shadowRay(p, shadowDirection, ray::SHADOW);
-  if (this->getScene()->intersect(shadowRay, i))
+  if (hit)
   {
     return Vec3d(0,0,0);
   }
@@ -64,16 +74,12 @@ Vec3d PointLight::getDirection(const Vec3d& P) const
 }
 
 
-Vec3d PointLight::shadowAttenuation(const ray& r, const Vec3d& p) const
+Vec3d PointLight::shadowFromHit(const ray& shadowRay, const isect* hit) const
 {
-  // YOUR CODE HERE:
-  // You should implement shadow-handling code here.
-  Vec3d shadowDirection = (position-p);
-  shadowDirection.normalize();
-  isect i;
-  ray shadowRay(p, shadowDirection, ray::SHADOW);
-  if (this->getScene()->intersect(shadowRay, i))
+  const Vec3d& p = shadowRay.p;
+  if (hit)
   {
+    const isect& i = *hit;
     double lightDistance = (position-p).length2();
     Vec3d Qpoint = shadowRay.at(i.t);
     double distanceSq = (Qpoint - p).length2();
@@ -110,16 +116,13 @@ Vec3d SpotLight::getDirection(const Vec3d& P) const
 }
 
 
-Vec3d SpotLight::shadowAttenuation(const ray& r, const Vec3d& p) const
+Vec3d SpotLight::shadowFromHit(const ray& shadowRay, const isect* hit) const
 {
-  // YOUR CODE HERE:
-  // You should implement shadow-handling code here.
-  Vec3d shadowDirection = (position-p);
-  shadowDirection.normalize();
-  isect i;
-  ray shadowRay(p, shadowDirection, ray::SHADOW);
-  if (this->getScene()->intersect(shadowRay, i))
+  const Vec3d& p = shadowRay.p;
+  Vec3d shadowDirection = shadowRay.d;
+  if (hit)
   {
+    const isect& i = *hit;
     double lightDistance = (position-p).length2();
     Vec3d Qpoint = shadowRay.at(i.t);
     double distanceSq = (Qpoint - p).length2();
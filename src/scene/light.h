@@ -14,7 +14,14 @@ class Light
 	: public SceneElement
 {
 public:
-	virtual Vec3d shadowAttenuation(const ray& r, const Vec3d& pos) const = 0;
+	// Shadowing is split in two so that batched renderers can trace the
+	// shadow rays themselves: shadowRay() aims a ray from pos at the light
+	// and shadowFromHit() turns whatever it hit first (null for nothing)
+	// into the light's color as seen from pos.  shadowAttenuation() does
+	// both in one go.
+	ray shadowRay(const Vec3d& pos) const;
+	virtual Vec3d shadowFromHit(const ray& shadow, const isect* hit) const = 0;
+	Vec3d shadowAttenuation(const ray& r, const Vec3d& pos) const;
 	virtual double distanceAttenuation(const Vec3d& P) const = 0;
 	virtual Vec3d getColor() const = 0;
 	virtual Vec3d getDirection (const Vec3d& P) const = 0;
@@ -22,6 +29,8 @@ public:
 protected:
 	Light(Scene *scene, const Vec3d& col) : SceneElement(scene), color(col) {}
 
+	friend class BinaryScene;
+
 	Vec3d color;
 
 public:
@@ -35,12 +44,14 @@ class DirectionalLight
 public:
 	DirectionalLight(Scene *scene, const Vec3d& orien, const Vec3d& color)
 		: Light(scene, color), orientation(orien) { orientation.normalize(); }
-	virtual Vec3d shadowAttenuation(const ray& r, const Vec3d& pos) const;
+	virtual Vec3d shadowFromHit(const ray& shadow, const isect* hit) const;
 	virtual double distanceAttenuation(const Vec3d& P) const;
 	virtual Vec3d getColor() const;
 	virtual Vec3d getDirection(const Vec3d& P) const;
 
 protected:
+	friend class BinaryScene;
+
 	Vec3d 		orientation;
 
 public:
@@ -54,12 +65,14 @@ class SpotLight
 public:
 	SpotLight(Scene *scene, const Vec3d& orien, const Vec3d& color, const double atten_angle, const Vec3d& position, const double fallRate)
 		: Light(scene, color), orientation(orien), atten_angle(atten_angle), position(position), fallRate(fallRate) { orientation.normalize(); }
-	virtual Vec3d shadowAttenuation(const ray& r, const Vec3d& pos) const;
+	virtual Vec3d shadowFromHit(const ray& shadow, const isect* hit) const;
 	virtual double distanceAttenuation(const Vec3d& P) const;
 	virtual Vec3d getColor() const;
 	virtual Vec3d getDirection(const Vec3d& P) const;
 
 protected:
+	friend class BinaryScene;
+
 	Vec3d 		orientation;
 	Vec3d		position;
 	double		atten_angle;
@@ -83,7 +96,7 @@ public:
 		quadraticTerm(quadraticAttenuationTerm) 
 		{}
 
-	virtual Vec3d shadowAttenuation(const ray& r, const Vec3d& pos) const;
+	virtual Vec3d shadowFromHit(const ray& shadow, const isect* hit) const;
 	virtual double distanceAttenuation(const Vec3d& P) const;
 	virtual Vec3d getColor() const;
 	virtual Vec3d getDirection(const Vec3d& P) const;
@@ -96,6 +109,8 @@ public:
 	}
 
 protected:
+	friend class BinaryScene;
+
 	Vec3d position;
 
 	// These three values are the a, b, and c in the distance
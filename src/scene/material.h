@@ -9,57 +9,16 @@
 
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
+#include "texture.h"
 #include <string>
 
 class Scene;
 class ray;
 class isect;
+class Light;
 
 using std::string;
 
-/* The TextureMap class can be used to store a texture map,
-   which consists of a bitmap and various accessors to
-   it.  To implement basic texture mapping, you'll want to 
-   fill in the getMappedValue function to implement basic 
-   texture mapping.
-*/
-class TextureMap {
-    public:
-       TextureMap( string filename );
-
-       // Return the mapped value; here the coordinate
-       // is assumed to be within the parametrization space:
-       // [0, 1] x [0, 1]
-       // (i.e., {(u, v): 0 <= u <= 1 and 0 <= v <= 1}
-       Vec3d getMappedValue( const Vec2d& coord ) const;
-
-       // Retrieve the value stored in a physical location
-       // (with integer coordinates) in the bitmap.
-       // Should be called from getMappedValue in order to
-       // do bilinear interpolation.
-       Vec3d getPixelAt( int x, int y ) const;
-
-	   int getWidth() const { return width; }
-	   int getHeight() const { return height; }
-
-	  ~TextureMap() { if (data) delete[] data; }
-
-protected:
-       string filename;
-       int width;
-       int height;
-       unsigned char* data;
-};
-
-class TextureMapException {
-	public:
-		TextureMapException( string errorMsg ) : _errorMsg( errorMsg ) {}
-		string message() { return _errorMsg; }
-
-	private:
-		string _errorMsg;
-};
-
 /*
 MaterialParameter is a helper class for a material;
 it stores either a constant value (in a 3-vector) 
@@ -151,6 +110,8 @@ public:
 	bool mapped() const { return _textureMap != 0; }
 
 private:
+    friend class BinaryScene;
+
     Vec3d _value;
     TextureMap* _textureMap;
 };
@@ -176,7 +137,17 @@ public:
         : _ke( e ), _ka( a ), _ks( s ), _kd( d ), _kr( r ), _kt( t ), 
           _shininess( Vec3d(sh,sh,sh) ), _index( Vec3d(in,in,in) ) { setBools(); }
 
-	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i ) const;
+	// eye is where specular highlights are seen from: the camera of the
+	// frame being rendered.
+	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i, const Vec3d& eye ) const;
+
+	// The pieces shade() is made of, for renderers that gather the light
+	// contributions themselves: the emissive + ambient term, whether the
+	// lights matter at all, and the contribution of a single light.
+	Vec3d shadeEmissive( Scene *scene, const isect& i ) const;
+	bool litByLights( const isect& i ) const;
+	Vec3d shadeLight( Scene *scene, const ray& r, const isect& i,
+	                  const Light* light, const Vec3d& lightIntensity, const Vec3d& eye ) const;
 
 
     
@@ -247,6 +218,8 @@ public:
 	bool Both() const { return _both; }
 
 private:
+    friend class BinaryScene;
+
     MaterialParameter _ke;                    // emissive
     MaterialParameter _ka;                    // ambient
     MaterialParameter _ks;                    // specular
@@ -10,6 +10,9 @@
 // who the hell cares if my identifiers are longer than 255 characters:
 #pragma warning(disable : 4786)
 
+#include <new>
+#include <type_traits>
+
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 #include "material.h"
@@ -58,42 +61,24 @@ class isect
 {
 public:
     isect() : obj( NULL ), t( 0.0 ), N(), material(0) {}
-	isect(const isect& other)
-	{
-		obj = other.obj;
-		t = other.t;
-		N = other.N;
-		bary = other.bary;
-		uvCoordinates = other.uvCoordinates;
-		if (other.material) material = new Material(*other.material);
-		else material = 0;
-	}
-
-	~isect() { delete material; }
-    
+	isect(const isect& other) { copy(other); }
+
     isect& operator = (const isect& other) {
-        if( this != &other ) {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-			bary = other.bary;
-            uvCoordinates = other.uvCoordinates;
-			if( other.material ) {
-                if( material ) *material = *other.material;
-                else material = new Material(*other.material );
-            }
-            else {
-                delete material;
-                material = 0;
-            }
-        }
+        if( this != &other ) copy(other);
         return *this;
     }
 
     void setObject(const SceneObject *o) { obj = o; }
     void setT(double tt) { t = tt; }
     void setN(const Vec3d& n) { N = n; }
-    void setMaterial(const Material& m)  { if(material) *material = m; else material = new Material(m); }
+    // The material is referenced, not copied, so it has to outlive the
+    // isect; object materials do.
+    void setMaterial(const Material& m)  { material = &m; }
+    // Storage for a material made up for this hit alone (interpolated
+    // per-vertex materials), held inline so that no hit allocates.
+    // The storage is raw so that the many isects that never need it don't
+    // pay for constructing a Material.
+    Material& ownMaterial() { material = new (localStorage) Material(); return *local(); }
     void setUVCoordinates( const Vec2d& coords ) { uvCoordinates = coords; }
     void setBary(const Vec3d& weights) { bary = weights; }
     void setBary(const double alpha, const double beta, const double gamma)
@@ -106,9 +91,29 @@ public:
     Vec3d N;
     Vec2d uvCoordinates;
     Vec3d bary;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    const Material *material;   // the object's material, ownMaterial(), or 0
+                                // to fall back on obj->getMaterial()
+
+private:
+    void copy(const isect& other)
+    {
+        obj = other.obj;
+        t = other.t;
+        N = other.N;
+        bary = other.bary;
+        uvCoordinates = other.uvCoordinates;
+        if( other.material == other.local() )
+            material = new (localStorage) Material(*other.local());
+        else material = other.material;
+    }
+
+    Material* local() { return reinterpret_cast<Material*>(localStorage); }
+    const Material* local() const { return reinterpret_cast<const Material*>(localStorage); }
+
+    // Never destroyed explicitly, which is fine as long as this holds.
+    static_assert(std::is_trivially_destructible<Material>::value,
+                  "isect reuses Material storage without destroying it");
+    alignas(Material) unsigned char localStorage[sizeof(Material)];
 };
 
 const double RAY_EPSILON = 0.00000001;
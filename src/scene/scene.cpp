@@ -1,11 +1,15 @@
 #include <cmath>
 #include <limits>
 #include <stack>
+#include <chrono>
 
 #include "scene.h"
 #include "light.h"
 #include "../ui/TraceUI.h"
 #include "../SceneObjects/trimesh.h"
+#include "../threading/ThreadPool.h"
+#include "../threading/Numa.h"
+#include "sceneLoader.h"
 
 using namespace std;
 
@@ -50,94 +54,126 @@ bool Geometry::hasBoundingBoxCapability() const {
 Scene::~Scene() {
     giter g;
     liter l;
-    tmap::iterator t;
+    // A scene that failed to load may still have tasks working on it.
+    if (loader) loader->wait();
+    clearKdTree();
     for( g = objects.begin(); g != objects.end(); ++g ) delete (*g);
     for( l = lights.begin(); l != lights.end(); ++l ) delete (*l);
-    for( t = textureCache.begin(); t != textureCache.end(); t++ ) delete (*t).second;
 }
 
-void Scene::intersectKdTree(ray& r, isect& i, KdTree<Geometry>* currentNode, bool& have_one, double tMin, double tMax) const
+KdTree<Geometry*>* Scene::localKdTree() const
 {
-	stack<StackElement> kdTreeStack;
-	struct StackElement rootElement = StackElement(currentNode, tMin, tMax);
-	kdTreeStack.push(rootElement);
-	while (!kdTreeStack.empty())
+	size_t node = NumaTopology::currentNode();
+	if (node < kdReplicas.size() && kdReplicas[node]) return kdReplicas[node];
+	return kdtreeRoot;
+}
+
+void Scene::clearKdReplicas()
+{
+	for (size_t n = 0; n < kdReplicaArenas.size(); n++)
+		delete kdReplicaArenas[n];
+	kdReplicaArenas.clear();
+	kdReplicas.clear();
+	for (cgiter g = boundedobjects.begin(); g != boundedobjects.end(); ++g)
+		if ((*g)->isTrimesh())
+			((Trimesh*)(*g))->kdReplicas.clear();
+	kdReplicaSource = nullptr;
+}
+
+void Scene::clearKdTree()
+{
+	clearKdReplicas();
+	kdtreeRoot = nullptr;
+	for (cgiter g = boundedobjects.begin(); g != boundedobjects.end(); ++g)
+		if ((*g)->isTrimesh())
+			((Trimesh*)(*g))->kdtreeRoot = nullptr;
+	kdArena.release();
+}
+
+size_t Scene::kdReplicaBytes() const
+{
+	size_t bytes = 0;
+	for (size_t n = 0; n < kdReplicaArenas.size(); n++)
+		bytes += kdReplicaArenas[n]->bytesReserved();
+	return bytes;
+}
+
+void Scene::prepareKdReplicas(int nNodes)
+{
+	if (kdReplicaSource == kdtreeRoot && (int)kdReplicas.size() == nNodes) return;
+	clearKdReplicas();
+	if (kdtreeRoot == nullptr) return;
+	kdReplicaSource = kdtreeRoot;
+	kdReplicas.assign(nNodes, nullptr);
+	for (int n = 0; n < nNodes; n++)
+		kdReplicaArenas.push_back(new MemoryArena());
+	for (cgiter g = boundedobjects.begin(); g != boundedobjects.end(); ++g)
+		if ((*g)->isTrimesh())
+			((Trimesh*)(*g))->kdReplicas.assign(nNodes, nullptr);
+}
+
+void Scene::replicateKdTree(int node)
+{
+	if (node >= (int)kdReplicas.size() || kdReplicas[node]) return;
+	MemoryArena& arena = *kdReplicaArenas[node];
+	kdReplicas[node] = cloneKdTree(kdtreeRoot, arena);
+	for (cgiter g = boundedobjects.begin(); g != boundedobjects.end(); ++g)
 	{
-		struct StackElement currElem = kdTreeStack.top();
-		kdTreeStack.pop();
-		if ((currElem.currNode->left == nullptr) && (currElem.currNode->right == nullptr))
-		{
-			// cout<<"LEAF NODE REACHED\n";
-			for (cgiter obj = currElem.currNode->objectsVector.begin(); obj != currElem.currNode->objectsVector.end(); obj++)
-			{
-				isect cur;
-				if ((*obj)->isTrimesh())
-				{
-					Trimesh* triMesh = (Trimesh*)(*obj);
-					double tTriMin,tTriMax;
-					tTriMin = tTriMax = 0.0;
-					bool triMeshHit = triMesh->kdtreeRoot->bb.intersect(r, tTriMin, tTriMax);
-					intersectKdTree(r, i, triMesh->kdtreeRoot, have_one, tTriMin, tTriMax);
-				}
-				else
-				{
-					if ((*obj)->intersect(r,cur))
-					{
-						if (!have_one || cur.t < i.t) {
-							i = cur;
-							have_one = true;
-						}
-					}
-				}
-			}
-		}
-		else
+		if (!(*g)->isTrimesh()) continue;
+		Trimesh* triMesh = (Trimesh*)(*g);
+		triMesh->kdReplicas[node] = cloneKdTree(triMesh->kdtreeRoot, arena);
+	}
+}
+
+// Keeps the closest hit among the objects of the leaves visited.
+struct ClosestHit
+{
+	ray& r;
+	isect& i;
+	bool& have_one;
+
+	ClosestHit(ray& _r, isect& _i, bool& _have_one) : r(_r), i(_i), have_one(_have_one) {}
+
+	void operator()(Geometry* obj)
+	{
+		isect cur;
+		if (obj->intersect(r, cur))
 		{
-			KdTree<Geometry> *nearNode,*farNode;
-			if (r.p[currElem.currNode->dimension] < currElem.currNode->splittingBB.getMin()[currElem.currNode->dimension])
-			{
-				nearNode = currElem.currNode->left;
-				farNode = currElem.currNode->right;
-			}
-			else
-			{
-				nearNode = currElem.currNode->right;
-				farNode = currElem.currNode->left;
-			}
-			double tStar = ((currElem.currNode->splittingBB.getMin()[currElem.currNode->dimension] - r.p[currElem.currNode->dimension])/r.d[currElem.currNode->dimension]);
-			if (tStar > currElem.tMax || tStar < 0)
-			{
-				kdTreeStack.push(StackElement(nearNode, tMin, tMax));
-				//intersectKdTree(r, i, nearNode, have_one, tMin, tMax);
-			}
-			else if (tStar < currElem.tMin)
-			{
-				kdTreeStack.push(StackElement(farNode, tMin, tMax));
-				// intersectKdTree(r, i, farNode, have_one, tMin, tMax);
-			}
-			else if (currElem.tMin <= tStar && tStar <= currElem.tMax)
-			{
-				kdTreeStack.push(StackElement(nearNode, tMin, tStar));
-				kdTreeStack.push(StackElement(farNode, tStar, tMax));
-				// intersectKdTree(r, i, nearNode, have_one, tMin, tStar);
-				// intersectKdTree(r, i, farNode, have_one, tStar, tMax);
+			if (!have_one || cur.t < i.t) {
+				i = cur;
+				have_one = true;
 			}
 		}
-
 	}
-	return;
+
+	bool hitBy(double t) const { return have_one && i.t <= t; }
+};
+
+void Scene::intersectKdTree(ray& r, isect& i, const KdTree<Geometry*>* currentNode, bool& have_one, double tMin, double tMax) const
+{
+	ClosestHit visit(r, i, have_one);
+	traverseKdTree(currentNode, r, tMin, tMax, visit);
+}
+
+static thread_local unsigned long long tlRaysCast = 0;
+
+unsigned long long Scene::raysCast()
+{
+	return tlRaysCast;
 }
 
 // Get any intersection with an object.  Return information about the 
 // intersection through the reference parameter.
 bool Scene::intersect(ray& r, isect& i) const {
 	bool have_one = false;
+	tlRaysCast++;
 	if (this->useKdTree && this->kdtreeRoot != nullptr)
 	{
 		double tMin,tMax;
 		tMin = tMax = 0.0;
-		bool sceneHit = this->kdtreeRoot->bb.intersect(r, tMin, tMax);
-		intersectKdTree(r, i, this->kdtreeRoot, have_one, tMin, tMax);
+		KdTree<Geometry*>* root = localKdTree();
+		bool sceneHit = root->bb.intersect(r, tMin, tMax);
+		intersectKdTree(r, i, root, have_one, tMin, tMax);
 	}
 	else
 	{
@@ -158,30 +194,37 @@ bool Scene::intersect(ray& r, isect& i) const {
 	return have_one;
 }
 
+void Scene::add( Geometry* obj ) {
+	obj->ComputeBoundingBox();
+	sceneBounds.merge(obj->getBoundingBox());
+	objects.push_back(obj);
+	if (obj->hasBoundingBoxCapability())
+	{
+		boundedobjects.push_back(obj);
+	}
+	if (loader) loader->objectAdded(this, obj);
+}
+
 TextureMap* Scene::getTexture(string name) {
-	tmap::const_iterator itr = textureCache.find(name);
-	if(itr == textureCache.end()) {
-		textureCache[name] = new TextureMap(name);
-		return textureCache[name];
-	} else return (*itr).second;
+	return loader ? loader->texture(*textures, name) : textures->get(name);
 }
 
-void Scene::printKdTree(KdTree<Geometry>* root) {
-	vector<KdTree<Geometry>*> currentLevel;
-	vector<KdTree<Geometry>*> nextLevel;
+void Scene::printKdTree(KdTree<Geometry*>* root) {
+	vector<KdTree<Geometry*>*> currentLevel;
+	vector<KdTree<Geometry*>*> nextLevel;
 	nextLevel.push_back(root);
 	int levelNo = 0;
 	while (nextLevel.size() > 0)
 	{
 		cout << "Level : "<<levelNo << "\n";
 		currentLevel = nextLevel;
-		nextLevel = vector<KdTree<Geometry>*>();
+		nextLevel = vector<KdTree<Geometry*>*>();
 		for (int i = 0; i < currentLevel.size(); i++)
 		{
 			cout << currentLevel[i]->noOfObjects()<<"("<<currentLevel[i]->bb.area()<<")\t";
 			// for (int j = 0; j < currentLevel[i]->noOfObjects(); j++)
 			// {
-			// 	cout<<currentLevel[i]->objectsVector[j]->objectID<<",";
+			// 	cout<<currentLevel[i]->objects[j]->objectID<<",";
 			// }
 			// cout<<")"<<currentLevel[i]->bb.getMin() <<" "<<currentLevel[i]->bb.getMax()<<"\t";
 			if (i % 2 == 1)
@@ -202,219 +245,75 @@ void Scene::printKdTree(KdTree<Geometry>* root) {
 	}
 }
 
-bool yzPlaneCompareFunction(pair<Geometry*, int> first, pair<Geometry*, int> second)
+// Bounding boxes of what the kd-trees hold: scene objects know their own,
+// mesh triangles are looked up in their mesh.
+struct GeometryBounds
 {
-	BoundingBox firstBB = first.first->getBoundingBox();
-	BoundingBox secondBB = second.first->getBoundingBox();
-	double firstX = firstBB.getMin()[0];
-	double secondX = secondBB.getMin()[0];
-	if (first.second == 1)
-	{
-		firstX = firstBB.getMax()[0];
-	}
-	if (second.second == 1)
-	{
-		secondX = secondBB.getMax()[0];
-	}
-	if (firstX == secondX)
-	{
-		if (first.second < second.second)
-		{
-			return true;
-		}
-		else if (first.second > second.second)
-		{
-			return false;
-		}
-		else
-		{
-			true;
-		}
-	}
-	return (firstX < secondX);
-}
+	BoundingBox operator()(Geometry* g) const { return g->getBoundingBox(); }
+};
 
-bool xzPlaneCompareFunction(pair<Geometry*, int> first, pair<Geometry*, int> second)
+struct TriangleBounds
 {
-	BoundingBox firstBB = first.first->getBoundingBox();
-	BoundingBox secondBB = second.first->getBoundingBox();
-	double firstY = firstBB.getMin()[1];
-	double secondY = secondBB.getMin()[1];
-	if (first.second == 1)
-	{
-		firstY = firstBB.getMax()[1];
-	}
-	if (second.second == 1)
-	{
-		secondY = secondBB.getMax()[1];
-	}
-	if (firstY == secondY)
-	{
-		if (first.second < second.second)
-		{
-			return true;
-		}
-		else if (first.second > second.second)
-		{
-			return false;
-		}
-		else
-		{
-			true;
-		}
-	}
-	return (firstY < secondY);
-}
+	const Trimesh* mesh;
+	explicit TriangleBounds(const Trimesh* m) : mesh(m) {}
+	BoundingBox operator()(int face) const { return mesh->faceBounds(face); }
+};
 
-bool xyPlaneCompareFunction(pair<Geometry*, int> first, pair<Geometry*, int> second)
+// Orders (object, 0 = min / 1 = max) box planes along one axis, min
+// planes first where they coincide.
+template <typename T, typename Bounds>
+struct PlaneOrder
 {
-	BoundingBox firstBB = first.first->getBoundingBox();
-	BoundingBox secondBB = second.first->getBoundingBox();
-	double firstZ = firstBB.getMin()[2];
-	double secondZ = secondBB.getMin()[2];
-	if (first.second == 1)
-	{
-		firstZ = firstBB.getMax()[2];
-	}
-	if (second.second == 1)
-	{
-		secondZ = secondBB.getMax()[2];
-	}
-	if (firstZ == secondZ)
+	int axis;
+	const Bounds& boundsOf;
+
+	PlaneOrder(int _axis, const Bounds& _boundsOf) : axis(_axis), boundsOf(_boundsOf) {}
+
+	bool operator()(const pair<T, int>& first, const pair<T, int>& second) const
 	{
-		if (first.second < second.second)
-		{
-			return true;
-		}
-		else if (first.second > second.second)
-		{
-			return false;
-		}
-		else
-		{
-			true;
-		}
+		BoundingBox firstBB = boundsOf(first.first);
+		BoundingBox secondBB = boundsOf(second.first);
+		double firstX = first.second == 1 ? firstBB.getMax()[axis] : firstBB.getMin()[axis];
+		double secondX = second.second == 1 ? secondBB.getMax()[axis] : secondBB.getMin()[axis];
+		if (firstX == secondX && first.second != second.second)
+			return first.second < second.second;
+		return (firstX < secondX);
 	}
-	return (firstZ < secondZ);
-}
+};
 
-// bool yzPlaneCompareFunction(Geometry* first, Geometry* second)
-// {
-// 	BoundingBox firstBB = first->getBoundingBox();
-// 	BoundingBox secondBB = second->getBoundingBox();
-// 	double firstX = firstBB.getMin()[0];
-// 	double secondX = secondBB.getMin()[0];
-// 	return (firstX < secondX);
-// }
-
-// bool xzPlaneCompareFunction(Geometry* first, Geometry* second)
-// {
-// 	BoundingBox firstBB = first->getBoundingBox();
-// 	BoundingBox secondBB = second->getBoundingBox();
-// 	double firstY = firstBB.getMin()[1];
-// 	double secondY = secondBB.getMin()[1];
-// 	return (firstY < secondY);
-// }
-
-// bool xyPlaneCompareFunction(Geometry* first, Geometry* second)
-// {
-// 	BoundingBox firstBB = first->getBoundingBox();
-// 	BoundingBox secondBB = second->getBoundingBox();
-// 	double firstZ = firstBB.getMin()[2];
-// 	double secondZ = secondBB.getMin()[2];
-// 	return (firstZ < secondZ);
-// }
+// Costs of stepping through a node and of testing one object, which
+// buildKdNode() weighs splits with and kdTreeCost() sums.
+static const double kdTraversalCost = 15;
+static const double kdIntersectCost = 80 * kdTraversalCost;
 
-void Scene::buildKdTree(int depth, int leafSize) {
-	this->kdTreeDepth = depth;
-	this->kdTreeLeafSize = leafSize;
-	this->kdtreeRoot = new KdTree<Geometry>(true);
-	for (auto objIter = beginObjects(); objIter != endObjects(); objIter++)
+template <typename T>
+static void addPlanes(vector<vector<pair<T, int>>>& orderedPlanes, T obj)
+{
+	for (int dimen = 0; dimen < 3; dimen++)
 	{
-		// !(*objIter)->isTrimesh() && 
-		if ((*objIter)->hasBoundingBoxCapability())
-		{
-			kdtreeRoot->objectsVector.push_back(*objIter);
-		}
-		// else if ((*objIter)->isTrimesh() && (*objIter)->hasBoundingBoxCapability())
-		// {
-		// 	Trimesh *triMesh = (Trimesh*)(*objIter);
-		// 	for (int i = 0; i < triMesh->faces.size(); i++)
-		// 	{
-		// 		kdtreeRoot->objectsVector.push_back(triMesh->faces[i]);
-		// 	}
-		// }
+		orderedPlanes[dimen].push_back(pair<T, int>(obj, 0));
+		orderedPlanes[dimen].push_back(pair<T, int>(obj, 1));
 	}
-	// cout<<"Number of Objects: "<<kdtreeRoot->noOfObjects()<<endl;
-	kdtreeRoot->bb = this->bounds();
-    std::vector<pair<Geometry*, int>> yzPlaneOrder;
-    std::vector<pair<Geometry*, int>> xzPlaneOrder;
-    std::vector<pair<Geometry*, int>> xyPlaneOrder;
-    for(int i = 0; i < kdtreeRoot->noOfObjects(); i++) {
-        yzPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 0));
-        yzPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 1));
-        xzPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 0));
-        xzPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 1));
-        xyPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 0));
-		xyPlaneOrder.push_back(pair<Geometry*, int>(kdtreeRoot->objectsVector[i], 1));
-    }
-
-    vector<vector<pair<Geometry*, int>>> orderedPlanes;
-    orderedPlanes.push_back(yzPlaneOrder);
-    orderedPlanes.push_back(xzPlaneOrder);
-    orderedPlanes.push_back(xyPlaneOrder);
-
-    // cout << "X Order\n";
-    // for(auto ii : yzPlaneOrder ) {
-    //   cout << "Min: "<<ii->getBoundingBox().getMin() << "\n";
-    //   cout << "Max: "<<ii->getBoundingBox().getMax() << "\n";
-    // }
-    // cout << "Y Order\n";
-    // for(auto ii : xzPlaneOrder ) {
-    //   cout << "Min: "<<ii->getBoundingBox().getMin() << "\n";
-    //   cout << "Max: "<<ii->getBoundingBox().getMax() << "\n";
-    // }
-    // cout << "Z Order\n";
-    // for(auto ii : xyPlaneOrder ) {
-    //   cout << "Min: "<<ii->getBoundingBox().getMin() << "\n";
-    //   cout << "Max: "<<ii->getBoundingBox().getMax() << "\n";
-    // }
-    // cout<<"Scene BB : "<<this->kdtreeRoot->bb.getMin() << "||" << this->kdtreeRoot->bb.getMax()<<endl;
-	buildMainKdTree(kdtreeRoot, depth, leafSize, orderedPlanes);
-	// cout<<"MAIN KD TREE"<<endl;
-	// printKdTree(this->kdtreeRoot);
-	// cout<<"END MAIN KD TREE"<<endl;
 }
 
-void Scene::buildMainKdTree(KdTree<Geometry>* kdNode, int depth, int leafSize, vector<vector<pair<Geometry*,int>>> orderedPlanes)
+// Splits kdNode, which holds objs, at the plane with the lowest surface
+// area heuristic cost and recurses until depth runs out or a node holds
+// at most leafSize objects.  Nodes come from arena, and only the leaves
+// keep their objects, in arena too.
+template <typename T, typename Bounds>
+static void buildKdNode(KdTree<T>* kdNode, const vector<T>& objs, int depth, int leafSize, vector<vector<pair<T,int>>> orderedPlanes, const Bounds& boundsOf, MemoryArena& arena)
 {
-	sort(orderedPlanes[0].begin(), orderedPlanes[0].end(), yzPlaneCompareFunction);
-	sort(orderedPlanes[1].begin(), orderedPlanes[1].end(), xzPlaneCompareFunction);
-	sort(orderedPlanes[2].begin(), orderedPlanes[2].end(), xyPlaneCompareFunction);
 	if (depth == 0)
 	{
+		kdNode->setObjects(objs, arena);
 		return;
 	}
-	else
-	{
-		for (int i = 0; i<kdNode->noOfObjects(); i++)
-		{
-			if (kdNode->objectsVector[i]->isTrimesh())
-			{
-				Trimesh *triMesh = (Trimesh*)(kdNode->objectsVector[i]);
-				if (!triMesh->kdTreeBuilt())
-				{
-					buildTrimeshKdTree(triMesh, this->kdTreeDepth, this->kdTreeLeafSize);
-				}
-			}
-		}
-	}
-	// cout<<"SIZE X: "<<orderedPlanes[0].size()<<endl;
-	// cout<<"SIZE Y: "<<orderedPlanes[1].size()<<endl;
-	// cout<<"SIZE Z: "<<orderedPlanes[2].size()<<endl;
+	for (int dimen = 0; dimen < 3; dimen++)
+		sort(orderedPlanes[dimen].begin(), orderedPlanes[dimen].end(), PlaneOrder<T, Bounds>(dimen, boundsOf));
+
 	double finalCost = numeric_limits<double>::max();
-	double tTime = 15;
-	double iTime = 80 * tTime;
+	double tTime = kdTraversalCost;
+	double iTime = kdIntersectCost;
 	double totalArea = kdNode->bb.area();
 	int finalDimension;
 	Vec3d finalPoint;
@@ -424,18 +323,18 @@ void Scene::buildMainKdTree(KdTree<Geometry>* kdNode, int depth, int leafSize, v
 		double rightObjects = 0;
 		double leftArea = 0;
 		double leftObjects = 0;
-		for (vector<pair<Geometry*,int>>::const_iterator ii = orderedPlanes[dimen].begin(); ii != orderedPlanes[dimen].end(); ii++)
+		for (typename vector<pair<T,int>>::const_iterator ii = orderedPlanes[dimen].begin(); ii != orderedPlanes[dimen].end(); ii++)
 		{
-			BoundingBox iBoundingBox = (*ii).first->getBoundingBox();
+			BoundingBox iBoundingBox = boundsOf((*ii).first);
 			if ((*ii).second == 0)
 			{
 				rightArea  = rightArea + iBoundingBox.area();
 				rightObjects++;
 			}
 		}
-		for (vector<pair<Geometry*,int>>::const_iterator ii = orderedPlanes[dimen].begin(); ii != orderedPlanes[dimen].end(); ii++)
+		for (typename vector<pair<T,int>>::const_iterator ii = orderedPlanes[dimen].begin(); ii != orderedPlanes[dimen].end(); ii++)
 		{
-			BoundingBox iBoundingBox = (*ii).first->getBoundingBox();
+			BoundingBox iBoundingBox = boundsOf((*ii).first);
 			if ((*ii).second == 0)
 			{
 				leftObjects++;
@@ -459,19 +358,11 @@ void Scene::buildMainKdTree(KdTree<Geometry>* kdNode, int depth, int leafSize, v
 			}
 		}
 	}
-	// cout << "Final Cost : " << finalCost << "\n";
-	// cout << "Final Dimension : "<<finalDimension<<" \n";
-	// cout << "Final Point : "<<finalPoint<<"\n";
-	KdTree<Geometry>* leftChild = new KdTree<Geometry>();
-	KdTree<Geometry>* rightChild = new KdTree<Geometry>();
-	vector<vector<pair<Geometry*, int>>> leftOrderedPlanes(3);
-	vector<vector<pair<Geometry*, int>>> rightOrderedPlanes(3);
-	leftOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
-	leftOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
-	leftOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
-	rightOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
-	rightOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
-	rightOrderedPlanes.push_back(vector<pair<Geometry*, int>>());
+	KdTree<T>* leftChild = arena.create<KdTree<T> >();
+	KdTree<T>* rightChild = arena.create<KdTree<T> >();
+	vector<T> leftObjects, rightObjects;
+	vector<vector<pair<T, int>>> leftOrderedPlanes(3);
+	vector<vector<pair<T, int>>> rightOrderedPlanes(3);
 
 	kdNode->splittingPlane[finalDimension] = finalPoint[finalDimension];
 	kdNode->dimension = finalDimension;
@@ -481,122 +372,212 @@ void Scene::buildMainKdTree(KdTree<Geometry>* kdNode, int depth, int leafSize, v
 	maxPoint[finalDimension] = finalPoint[finalDimension];
 	kdNode->splittingBB = BoundingBox(minPoint, maxPoint);
 
-	for (vector<Geometry*>::const_iterator ii = kdNode->objectsVector.begin(); ii != kdNode->objectsVector.end(); ii++)
+	for (typename vector<T>::const_iterator ii = objs.begin(); ii != objs.end(); ii++)
 	{
-		BoundingBox iBoundingBox = (*ii)->getBoundingBox();
+		BoundingBox iBoundingBox = boundsOf(*ii);
 		if (iBoundingBox.getMin()[finalDimension] < finalPoint[finalDimension] && iBoundingBox.getMax()[finalDimension] < finalPoint[finalDimension])
 		{
-			leftChild->objectsVector.push_back(*ii);
+			leftObjects.push_back(*ii);
 			leftChild->bb.merge(iBoundingBox);
-			leftOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii, 1));
-			leftOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii, 1));
-			leftOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii, 1));
+			addPlanes(leftOrderedPlanes, *ii);
 		}
 		else if (iBoundingBox.getMin()[finalDimension] > finalPoint[finalDimension])
 		{
-			rightChild->objectsVector.push_back(*ii);
+			rightObjects.push_back(*ii);
 			rightChild->bb.merge(iBoundingBox);
-			rightOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii,1));
-			rightOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii,1));
-			rightOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii,1));
+			addPlanes(rightOrderedPlanes, *ii);
 		}
 		else
 		{
-			leftChild->objectsVector.push_back(*ii);
+			leftObjects.push_back(*ii);
 			leftChild->bb.merge(iBoundingBox);
-			rightChild->objectsVector.push_back(*ii);
+			rightObjects.push_back(*ii);
 			rightChild->bb.merge(iBoundingBox);
-			leftOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii, 1));
-			leftOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii, 1));
-			leftOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii, 0));
-			leftOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii, 1));
-			rightOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[0].push_back(pair<Geometry*, int>(*ii,1));
-			rightOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[1].push_back(pair<Geometry*, int>(*ii,1));
-			rightOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii,0));
-			rightOrderedPlanes[2].push_back(pair<Geometry*, int>(*ii,1));
+			addPlanes(leftOrderedPlanes, *ii);
+			addPlanes(rightOrderedPlanes, *ii);
 		}
 	}
 	kdNode->setLeft(leftChild);
 	kdNode->setRight(rightChild);
-	if (kdNode->getLeft()->noOfObjects() > leafSize)
+	if ((int)leftObjects.size() > leafSize)
 	{
-		buildMainKdTree(kdNode->left, depth-1, leafSize, leftOrderedPlanes);
+		buildKdNode(kdNode->left, leftObjects, depth-1, leafSize, leftOrderedPlanes, boundsOf, arena);
 	}
 	else
 	{
-		for (int i = 0; i<kdNode->getLeft()->noOfObjects(); i++)
-		{
-			if (kdNode->getLeft()->objectsVector[i]->isTrimesh())
-			{
-				Trimesh *triMesh = (Trimesh*)(kdNode->getLeft()->objectsVector[i]);
-				if (!triMesh->kdTreeBuilt())
-				{
-					buildTrimeshKdTree(triMesh, this->kdTreeDepth, this->kdTreeLeafSize);
-				}
-			}
-		}
+		leftChild->setObjects(leftObjects, arena);
 	}
-	if (kdNode->getRight()->noOfObjects() > leafSize)
+	if ((int)rightObjects.size() > leafSize)
 	{
-		buildMainKdTree(kdNode->right, depth-1, leafSize, rightOrderedPlanes);
+		buildKdNode(kdNode->right, rightObjects, depth-1, leafSize, rightOrderedPlanes, boundsOf, arena);
 	}
 	else
 	{
-		for (int i = 0; i<kdNode->getRight()->noOfObjects(); i++)
+		rightChild->setObjects(rightObjects, arena);
+	}
+}
+
+void Scene::buildKdTree(int depth, int leafSize) {
+	// A rebuild replaces every tree, the meshes' included.
+	clearKdTree();
+	// Meshes carry their own tree over their triangles.
+	for (auto objIter = beginBoundedObjects(); objIter != endBoundedObjects(); objIter++)
+		if ((*objIter)->isTrimesh())
+			buildTrimeshKdTree(*objIter, depth, leafSize, kdArena);
+	buildObjectKdTree(depth, leafSize);
+}
+
+// Only needs the objects' bounds, not the meshes' trees.
+void Scene::buildObjectKdTree(int depth, int leafSize) {
+	depth = min(depth, KD_MAX_DEPTH);
+	this->kdTreeDepth = depth;
+	this->kdTreeLeafSize = leafSize;
+	this->kdtreeRoot = objectKdTree(depth, leafSize, kdArena);
+}
+
+KdTree<Geometry*>* Scene::objectKdTree(int depth, int leafSize, MemoryArena& arena) const {
+	KdTree<Geometry*>* root = arena.create<KdTree<Geometry*> >();
+	root->isRoot = true;
+	vector<Geometry*> bounded;
+	vector<vector<pair<Geometry*, int>>> orderedPlanes(3);
+	for (auto objIter = beginObjects(); objIter != endObjects(); objIter++)
+	{
+		if ((*objIter)->hasBoundingBoxCapability())
 		{
-			if (kdNode->getRight()->objectsVector[i]->isTrimesh())
-			{
-				Trimesh *triMesh = (Trimesh*)(kdNode->getRight()->objectsVector[i]);
-				if (!triMesh->kdTreeBuilt())
-				{
-					buildTrimeshKdTree(triMesh, this->kdTreeDepth, this->kdTreeLeafSize);
-				}
-			}
+			bounded.push_back(*objIter);
+			addPlanes(orderedPlanes, *objIter);
 		}
 	}
+	root->bb = this->bounds();
+	buildKdNode(root, bounded, depth, leafSize, orderedPlanes, GeometryBounds(), arena);
+	return root;
 }
 
-void Scene::buildTrimeshKdTree(Geometry* triM, int depth, int leafSize)
+// Built in the mesh's local space, where Trimesh::intersectLocal walks it.
+static KdTree<int>* trimeshKdTree(Trimesh* triMesh, int depth, int leafSize, MemoryArena& arena)
 {
+	KdTree<int>* root = arena.create<KdTree<int> >();
+	root->isRoot = true;
+	vector<int> faces;
+	vector<vector<pair<int, int>>> orderedPlanes(3);
+	for (int f = 0; f < triMesh->numFaces(); f++)
+	{
+		faces.push_back(f);
+		addPlanes(orderedPlanes, f);
+	}
+	root->bb = triMesh->ComputeLocalBoundingBox();
+	buildKdNode(root, faces, depth, leafSize, orderedPlanes, TriangleBounds(triMesh), arena);
+	return root;
+}
+
+void Scene::buildTrimeshKdTree(Geometry* triM, int depth, int leafSize, MemoryArena& arena)
+{
+	depth = min(depth, KD_MAX_DEPTH);
 	Trimesh *triMesh = (Trimesh*)(triM);
-	triMesh->kdtreeRoot = new KdTree<Geometry>(true);
-	for (int i = 0; i < triMesh->faces.size(); i++)
+	triMesh->kdtreeRoot = trimeshKdTree(triMesh, depth, leafSize, arena);
+}
+
+// Surface area heuristic cost of the tree under node, for a ray known to
+// hit the root's box.  A ray reaches a node only by crossing its cell,
+// the part of the root's box on its side of every split above it.
+template <typename T, typename ObjectCost>
+static double kdTreeCost(const KdTree<T>* node, BoundingBox cell, double rootArea, const ObjectCost& objectCost)
+{
+	double share = rootArea > 0 ? cell.area() / rootArea : 1.0;
+	if (node->left == nullptr)
+	{
+		double cost = 0;
+		for (int o = 0; o < node->nObjects; o++)
+			cost += objectCost(node->objects[o]);
+		return share * cost;
+	}
+	int axis = node->dimension;
+	double split = max(cell.getMin()[axis], min(cell.getMax()[axis], node->splittingPlane[axis]));
+	BoundingBox leftCell = cell, rightCell = cell;
+	Vec3d leftMax = cell.getMax(), rightMin = cell.getMin();
+	leftMax[axis] = split;
+	rightMin[axis] = split;
+	leftCell.setMax(leftMax);
+	rightCell.setMin(rightMin);
+	return share * kdTraversalCost + kdTreeCost(node->left, leftCell, rootArea, objectCost)
+		+ kdTreeCost(node->right, rightCell, rootArea, objectCost);
+}
+
+template <typename T, typename ObjectCost>
+static double kdTreeCost(const KdTree<T>* root, const ObjectCost& objectCost)
+{
+	BoundingBox cell = root->bb;
+	return kdTreeCost(root, cell, cell.area(), objectCost);
+}
+
+struct TriangleCost
+{
+	double operator()(int) const { return kdIntersectCost; }
+};
+
+// Meshes cost as much as their own trees, anything else one test.
+struct ObjectCost
+{
+	const map<const Geometry*, double>& meshCosts;
+	explicit ObjectCost(const map<const Geometry*, double>& costs) : meshCosts(costs) {}
+	double operator()(Geometry* g) const
 	{
-		triMesh->kdtreeRoot->objectsVector.push_back(triMesh->faces[i]);
+		map<const Geometry*, double>::const_iterator found = meshCosts.find(g);
+		return found == meshCosts.end() ? kdIntersectCost : found->second;
 	}
-	// cout<<"Number of Objects: "<<kdtreeRoot->noOfObjects()<<endl;
-	triMesh->kdtreeRoot->bb = triMesh->getBoundingBox();
-    std::vector<pair<Geometry*, int>> yzPlaneOrder;
-    std::vector<pair<Geometry*, int>> xzPlaneOrder;
-    std::vector<pair<Geometry*, int>> xyPlaneOrder;
-    for(int i = 0; i < triMesh->kdtreeRoot->noOfObjects(); i++) {
-        yzPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 0));
-        yzPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 1));
-        xzPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 0));
-        xzPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 1));
-        xyPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 0));
-        xyPlaneOrder.push_back(pair<Geometry*, int>(triMesh->kdtreeRoot->objectsVector[i], 1));
-    }
-    sort(yzPlaneOrder.begin(), yzPlaneOrder.end(), yzPlaneCompareFunction);
-    sort(xzPlaneOrder.begin(), xzPlaneOrder.end(), xzPlaneCompareFunction);
-    sort(xyPlaneOrder.begin(), xyPlaneOrder.end(), xyPlaneCompareFunction);
-
-    vector<vector<pair<Geometry*, int>>> orderedPlanes;
-    orderedPlanes.push_back(yzPlaneOrder);
-    orderedPlanes.push_back(xzPlaneOrder);
-    orderedPlanes.push_back(xyPlaneOrder);
-	buildMainKdTree(triMesh->kdtreeRoot, depth, leafSize, orderedPlanes);
-	// cout<<"START TRIMESH TREE"<<endl;
-	// printKdTree(triMesh->kdtreeRoot);
-	// cout<<"END TRIMESH TREE"<<endl;
+};
+
+KdTreeSet* Scene::buildKdTrees(int depth, int leafSize, int nThreads) const
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	unique_ptr<KdTreeSet> trees(new KdTreeSet);
+	depth = min(depth, KD_MAX_DEPTH);
+	trees->depth = depth;
+	trees->leafSize = leafSize;
+
+	// As in loading, each mesh's tree goes into an arena of its own on a
+	// worker, while this thread builds the tree over the objects.
+	for (cgiter g = boundedobjects.begin(); g != boundedobjects.end(); ++g)
+		if ((*g)->isTrimesh())
+			trees->meshRoots.push_back(make_pair((Trimesh*)(*g), (KdTree<int>*)nullptr));
+	vector<unique_ptr<MemoryArena> > meshArenas(trees->meshRoots.size());
+	{
+		ThreadPool pool(nThreads);
+		for (size_t m = 0; m < trees->meshRoots.size(); m++)
+		{
+			KdTreeSet* set = trees.get();
+			MemoryArena* arena = new MemoryArena;
+			meshArenas[m].reset(arena);
+			pool.submit([set, m, arena, depth, leafSize] {
+				set->meshRoots[m].second = trimeshKdTree(set->meshRoots[m].first, depth, leafSize, *arena);
+			});
+		}
+		trees->root = objectKdTree(depth, leafSize, trees->arena);
+		pool.wait();
+	}
+	for (size_t m = 0; m < meshArenas.size(); m++)
+		trees->arena.adopt(*meshArenas[m]);
+
+	map<const Geometry*, double> meshCosts;
+	for (size_t m = 0; m < trees->meshRoots.size(); m++)
+	{
+		const KdTree<int>* meshRoot = trees->meshRoots[m].second;
+		meshCosts[trees->meshRoots[m].first] = kdTreeCost(meshRoot, TriangleCost());
+	}
+	trees->sahCost = kdTreeCost(trees->root, ObjectCost(meshCosts)) / kdIntersectCost;
+	trees->buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return trees.release();
+}
+
+void Scene::installKdTrees(KdTreeSet& trees)
+{
+	clearKdTree();
+	kdTreeDepth = trees.depth;
+	kdTreeLeafSize = trees.leafSize;
+	kdtreeRoot = trees.root;
+	for (size_t m = 0; m < trees.meshRoots.size(); m++)
+		trees.meshRoots[m].first->kdtreeRoot = trees.meshRoots[m].second;
+	kdArena.adopt(trees.arena);
+	trees.root = nullptr;
+	trees.meshRoots.clear();
 }
@@ -20,20 +20,29 @@
 #include "material.h"
 #include "camera.h"
 #include "bbox.h"
+#include "arena.h"
 
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 
 class Light;
 class Scene;
-
+class SceneLoader;
+class Trimesh;
+
+// A kd-tree over T, which is whatever identifies an object to the tree's
+// owner: Geometry* for the scene, a triangle index for a Trimesh.  Nodes
+// and their object lists live in a MemoryArena owned by the Scene, and
+// go away with it; nothing here is freed node by node.  Only leaves have
+// an object list.
 template <typename T>
 class KdTree {
 public:
   KdTree<T>* left;
   KdTree<T>* right;
   bool isRoot;
-  std::vector<T*>objectsVector;
+  T* objects;
+  int nObjects;
   BoundingBox bb;
   Vec3d splittingPlane;
   BoundingBox splittingBB;
@@ -42,19 +51,14 @@ public:
     isRoot = false;
     left = nullptr;
     right = nullptr;
-    dimension = 4;
-    splittingPlane = Vec3d(0.0, 0.0, 0.0);
-  }
-  KdTree(bool _isRoot){
-    isRoot = _isRoot;
-    left = nullptr;
-    right = nullptr;
+    objects = nullptr;
+    nObjects = 0;
     dimension = 4;
     splittingPlane = Vec3d(0.0, 0.0, 0.0);
   }
   void setSplittingPlane(Vec3d _splitPlane)
   {
-	  splittingPlane = new Vec3d(_splitPlane);
+	  splittingPlane = _splitPlane;
   }
   Vec3d getSplittingPlane()
   {
@@ -88,13 +92,16 @@ public:
   {
     right = _right;
   }
-  void addObject(T* _obj)
+  // Copies objs into the arena as this node's object list.
+  void setObjects(const std::vector<T>& objs, MemoryArena& arena)
   {
-    objectsVector.push_back(_obj);
+    nObjects = (int)objs.size();
+    objects = arena.createArray<T>(objs.size());
+    std::copy(objs.begin(), objs.end(), objects);
   }
-  T* getObject(int i)
+  T getObject(int i)
   {
-    return objectsVector[i];
+    return objects[i];
   }
   KdTree<T>* getLeft()
   {
@@ -110,10 +117,27 @@ public:
   }
   int noOfObjects()
   {
-    return objectsVector.size();
+    return nObjects;
   }
 };
 
+// Deep copy of a kd-tree into arena.  The nodes are allocated by the
+// calling thread, so a thread pinned to a NUMA node gets a copy in that
+// node's memory.  The objects themselves are shared, only the tree and
+// its object lists are duplicated.
+template <typename T>
+KdTree<T>* cloneKdTree(const KdTree<T>* node, MemoryArena& arena)
+{
+  if (node == nullptr) return nullptr;
+  KdTree<T>* copy = arena.create<KdTree<T> >();
+  *copy = *node;
+  copy->objects = arena.createArray<T>(node->nObjects);
+  std::copy(node->objects, node->objects + node->nObjects, copy->objects);
+  copy->left = cloneKdTree(node->left, arena);
+  copy->right = cloneKdTree(node->right, arena);
+  return copy;
+}
+
 class SceneElement {
 
 public:
@@ -143,6 +167,8 @@ protected:
   // information about parent & children
   TransformNode *parent;
   std::vector<TransformNode*> children;
+
+  friend class BinaryScene;
     
  public:
   typedef std::vector<TransformNode*>::iterator          child_iter;
@@ -256,6 +282,7 @@ public:
   virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
   void setTransform(TransformNode *transform) { this->transform = transform; };
+  const TransformNode* getTransform() const { return transform; }
     
  Geometry(Scene *scene) : SceneElement( scene ) {
   objectID = idGen;
@@ -310,6 +337,23 @@ protected:
   Material* material;
 };
 
+// A whole set of kd-trees for a scene, built by Scene::buildKdTrees()
+// beside the trees the scene is using.  Nothing here is walked until
+// Scene::installKdTrees() swaps it in.
+struct KdTreeSet
+{
+  int depth;
+  int leafSize;
+  KdTree<Geometry*>* root;
+  std::vector<std::pair<Trimesh*, KdTree<int>*> > meshRoots;
+  MemoryArena arena;		// all the nodes and object lists above
+  double buildSeconds;
+  // Expected cost of tracing a ray through the trees by the surface area
+  // heuristic, in ray-triangle tests.  Each mesh in a leaf of the scene's
+  // tree costs what its own tree does.
+  double sahCost;
+};
+
 class Scene {
 
 public:
@@ -324,32 +368,31 @@ public:
   bool useKdTree;
   bool backFaceCulling;
   bool smoothShading;
-  KdTree<Geometry>* kdtreeRoot;
+  KdTree<Geometry*>* kdtreeRoot;
 
   Scene() : transformRoot(), objects(), lights() {
     kdTreeDepth = 0;
     kdTreeLeafSize = 0;
     useKdTree = false;
     kdtreeRoot = nullptr;
+    kdReplicaSource = nullptr;
+    textures = &ownTextures;
+    loader = nullptr;
     backFaceCulling = false;
     smoothShading = false;
   }
   virtual ~Scene();
 
-  void add( Geometry* obj ) {
-    obj->ComputeBoundingBox();
-    sceneBounds.merge(obj->getBoundingBox());
-    objects.push_back(obj);
-    if (obj->hasBoundingBoxCapability())
-    {
-      boundedobjects.push_back(obj);
-    }
-  }
+  void add( Geometry* obj );
   void add(Light* light) { lights.push_back(light); }
 
   bool intersect(ray& r, isect& i) const;
-  void intersectKdTree(ray& r, isect& i, KdTree<Geometry>* currentNode, bool& have_one, double tMin, double tMax) const;
-  bool intersectKdTreeMain(ray& r, isect& i) const;
+  // Number of rays the calling thread has intersected so far.
+  static unsigned long long raysCast();
+  // The kd-tree the calling thread should walk: its node's replica if
+  // one was made, otherwise the original.
+  KdTree<Geometry*>* localKdTree() const;
+  void intersectKdTree(ray& r, isect& i, const KdTree<Geometry*>* currentNode, bool& have_one, double tMin, double tMax) const;
 
   std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
   std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -364,8 +407,14 @@ public:
 
   // For efficiency reasons, we'll store texture maps in a cache
   // in the Scene.  This makes sure they get deleted when the scene
-  // is destroyed.
+  // is destroyed.  Batch rendering instead points several scenes at one
+  // longer-lived cache, which then owns the maps.
   TextureMap* getTexture( string name );
+  void setTextureCache( TextureCache* cache ) { textures = cache; }
+
+  // While a scene is being read, its loader is told about each texture
+  // and object as they come, and starts work on them; see SceneLoader.
+  void setLoader( SceneLoader* l ) { loader = l; }
 
   // These two functions are for handling ambient light; in the Phong model,
   // the "ambient" light is considered a property of the _scene_ as a whole
@@ -378,9 +427,35 @@ public:
   const BoundingBox& bounds() const { return sceneBounds; }
 
   void buildKdTree(int depth, int leafSize);
-  void buildTrimeshKdTree(Geometry* triMesh, int depth, int leafSize);
-  void buildMainKdTree(KdTree<Geometry>* kdtree, int depth, int leafSize, std::vector<std::vector<std::pair<Geometry*, int>>> orderedPlanes);
-  void printKdTree(KdTree<Geometry>* root);
+  // The two halves of buildKdTree(), which loading runs as separate
+  // tasks: a mesh's tree, and the tree over the objects.  They allocate
+  // from arena, so meshes can be built on several threads, each into an
+  // arena of its own that adoptKdArena() then hands to the scene.
+  void buildTrimeshKdTree(Geometry* triMesh, int depth, int leafSize, MemoryArena& arena);
+  void buildObjectKdTree(int depth, int leafSize);
+  void adoptKdArena(MemoryArena& arena) { kdArena.adopt(arena); }
+  // Drops the scene's and the meshes' kd-trees and their replicas,
+  // releasing their arenas.
+  void clearKdTree();
+  // Rebuilds for new tree parameters without disturbing renders:
+  // buildKdTrees() only reads the scene, with the meshes' trees built on
+  // nThreads threads, and installKdTrees() must wait until nothing is
+  // tracing.  installKdTrees() empties trees, which the caller deletes.
+  KdTreeSet* buildKdTrees(int depth, int leafSize, int nThreads) const;
+  void installKdTrees(KdTreeSet& trees);
+  void printKdTree(KdTree<Geometry*>* root);
+
+  // Memory held by the kd-trees: the scene's and its meshes' trees, and
+  // all of their NUMA replicas together.
+  const MemoryArena& kdTreeArena() const { return kdArena; }
+  size_t kdReplicaBytes() const;
+
+  // NUMA replication of the (read-only while rendering) kd-trees.
+  // prepareKdReplicas() sizes the tables and must run first; then each
+  // node's replicateKdTree() should run on a thread bound to that node.
+  void prepareKdReplicas(int nNodes);
+  void replicateKdTree(int node);
+  void clearKdReplicas();
 
  private:
   std::vector<Geometry*> objects;
@@ -393,8 +468,18 @@ public:
   // (used as the I_a in the Phong shading model)
   Vec3d ambientIntensity;
 
-  typedef std::map< std::string, TextureMap* > tmap;
-  tmap textureCache;
+  TextureCache ownTextures;
+  TextureCache* textures;
+  SceneLoader* loader;
+
+  KdTree<Geometry*>* objectKdTree(int depth, int leafSize, MemoryArena& arena) const;
+
+  // Every tree node and object list of kdtreeRoot and the meshes' trees.
+  MemoryArena kdArena;
+
+  std::vector<KdTree<Geometry*>*> kdReplicas;
+  std::vector<MemoryArena*> kdReplicaArenas;	// one per node, holding its copies
+  KdTree<Geometry*>* kdReplicaSource;	// the tree the replicas were copied from
 	
   // Each object in the scene, provided that it has hasBoundingBoxCapability(),
   // must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
@@ -406,9 +491,15 @@ public:
   mutable std::vector<std::pair<ray*, isect*> > intersectCache;
 };
 
+// Traversal pushes at most one more node than it pops per level, so a
+// fixed stack of this size covers any tree buildKdTree makes.
+const int KD_STACK_SIZE = 64;
+const int KD_MAX_DEPTH = KD_STACK_SIZE - 2;
+
+template <typename T>
 struct  StackElement
 {
-  KdTree<Geometry>* currNode;
+  const KdTree<T>* currNode;
   double tMin;
   double tMax;
   StackElement () {
@@ -416,7 +507,7 @@ struct  StackElement
     tMin = 0.0;
     tMax = 0.0;
   }
-  StackElement (KdTree<Geometry>* _currentNode, double _tMin, double _tMax)
+  StackElement (const KdTree<T>* _currentNode, double _tMin, double _tMax)
   {
     currNode = _currentNode;
     tMin = _tMin;
@@ -424,4 +515,61 @@ struct  StackElement
   }
 };
 
+// Walks the leaves of a kd-tree that r passes through, front to back, and
+// calls visit(object) for every object of every leaf reached.  Once a leaf
+// is done, visit.hitBy(t) says whether it already has a hit no farther
+// than t, the end of that leaf's span of the ray; if so nothing in a later
+// leaf can be closer, and the walk stops.  The scene and each Trimesh
+// share this; they differ only in what a leaf holds.
+template <typename T, typename Visit>
+void traverseKdTree(const KdTree<T>* root, const ray& r, double tMin, double tMax, Visit& visit)
+{
+	// On the C++ stack rather than in a std::stack, which would allocate
+	// for every ray.
+	StackElement<T> kdTreeStack[KD_STACK_SIZE];
+	int top = 0;
+	kdTreeStack[top++] = StackElement<T>(root, tMin, tMax);
+	while (top > 0)
+	{
+		StackElement<T> currElem = kdTreeStack[--top];
+		const KdTree<T>* node = currElem.currNode;
+		if ((node->left == nullptr) && (node->right == nullptr))
+		{
+			for (const T* obj = node->objects; obj != node->objects + node->nObjects; obj++)
+				visit(*obj);
+			if (visit.hitBy(currElem.tMax)) return;
+		}
+		else
+		{
+			const KdTree<T> *nearNode,*farNode;
+			int dim = node->dimension;
+			if (r.p[dim] < node->splittingBB.getMin()[dim])
+			{
+				nearNode = node->left;
+				farNode = node->right;
+			}
+			else
+			{
+				nearNode = node->right;
+				farNode = node->left;
+			}
+			double tStar = ((node->splittingBB.getMin()[dim] - r.p[dim])/r.d[dim]);
+			if (tStar > currElem.tMax || tStar < 0)
+			{
+				kdTreeStack[top++] = StackElement<T>(nearNode, currElem.tMin, currElem.tMax);
+			}
+			else if (tStar < currElem.tMin)
+			{
+				kdTreeStack[top++] = StackElement<T>(farNode, currElem.tMin, currElem.tMax);
+			}
+			else if (currElem.tMin <= tStar && tStar <= currElem.tMax)
+			{
+				// The far child goes first so that the near one pops first.
+				kdTreeStack[top++] = StackElement<T>(farNode, tStar, currElem.tMax);
+				kdTreeStack[top++] = StackElement<T>(nearNode, currElem.tMin, tStar);
+			}
+		}
+	}
+}
+
 #endif // __SCENE_H__
@@ -0,0 +1,86 @@
+#include "sceneLoader.h"
+
+#include "scene.h"
+#include "texture.h"
+#include "../SceneObjects/trimesh.h"
+
+using namespace std;
+
+SceneLoader::SceneLoader(int nThreads, int _meshPrecision, bool _kdTree, int _kdDepth, int _kdLeafSize,
+	LoadProgress* _progress)
+	: meshPrecision(_meshPrecision), kdTree(_kdTree), kdDepth(_kdDepth), kdLeafSize(_kdLeafSize),
+	  progress(_progress), pool(nThreads)
+{
+}
+
+SceneLoader::~SceneLoader()
+{
+	pool.wait();
+}
+
+void SceneLoader::run(const function<void()>& task)
+{
+	if (progress) progress->tasks++;
+	pool.submit([this, task] {
+		try { task(); }
+		catch (...)
+		{
+			lock_guard<mutex> guard(lock);
+			if (!error) error = current_exception();
+		}
+		if (progress) progress->tasksDone++;
+	});
+}
+
+// The map goes into the scene's materials right away; only its texels
+// have to wait for the decoder.
+TextureMap* SceneLoader::texture(TextureCache& cache, const string& name)
+{
+	function<void()> load;
+	TextureMap* map = cache.request(name, load);
+	if (load) run(load);
+	return map;
+}
+
+// Readers add a mesh once it is complete, so its work can start now.
+void SceneLoader::objectAdded(Scene* scene, Geometry* obj)
+{
+	if (!obj->isTrimesh()) return;
+	Trimesh* mesh = (Trimesh*)obj;
+	run([this, scene, mesh] {
+		// Before the kd-tree, which is built over the compacted positions.
+		if (meshPrecision != Trimesh::DOUBLE)
+			mesh->compact((Trimesh::Precision)meshPrecision);
+		if (!kdTree) return;
+		unique_ptr<MemoryArena> arena(new MemoryArena);
+		scene->buildTrimeshKdTree(mesh, kdDepth, kdLeafSize, *arena);
+		lock_guard<mutex> guard(lock);
+		meshArenas.push_back(move(arena));
+	});
+}
+
+void SceneLoader::finish(Scene* scene)
+{
+	scene->setLoader(nullptr);
+	if (progress) progress->reading = false;
+	if (kdTree)
+	{
+		try { scene->buildObjectKdTree(kdDepth, kdLeafSize); }
+		catch (...)
+		{
+			pool.wait();
+			throw;
+		}
+	}
+	pool.wait();
+
+	for (size_t a = 0; a < meshArenas.size(); a++)
+		scene->adoptKdArena(*meshArenas[a]);
+	meshArenas.clear();
+	if (error)
+	{
+		exception_ptr e = error;
+		error = nullptr;
+		rethrow_exception(e);
+	}
+}
@@ -0,0 +1,84 @@
+//
+// sceneLoader.h
+//
+// Overlaps the slow parts of loading a scene with reading its file.  As
+// the reader goes, each texture it names is decoded, and each trimesh is
+// compacted and gets its kd-tree, on a pool of worker threads.  The tree
+// over the scene's objects only needs their bounds, so it is built as
+// soon as the reader is done, while the meshes may still be working on
+// theirs.
+//
+
+#ifndef __SCENELOADER_H__
+#define __SCENELOADER_H__
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <functional>
+
+#include "../threading/ThreadPool.h"
+#include "arena.h"
+
+class Scene;
+class Geometry;
+class TextureMap;
+class TextureCache;
+
+// How far a load has got, for showing while it runs on another thread.
+struct LoadProgress
+{
+	LoadProgress() : reading(true), tasks(0), tasksDone(0) {}
+
+	std::atomic<bool> reading;		// until the reader returns
+	std::atomic<int> tasks;			// textures and meshes queued so far
+	std::atomic<int> tasksDone;
+};
+
+class SceneLoader
+{
+public:
+	// meshPrecision is a Trimesh::Precision.  Without kdTree no trees are
+	// built, only the meshes compacted.  progress, if given, is kept up to
+	// date as the load goes.
+	SceneLoader(int nThreads, int meshPrecision, bool kdTree, int kdDepth, int kdLeafSize,
+		LoadProgress* progress = 0);
+	~SceneLoader();
+
+	// Called by a Scene given this loader with Scene::setLoader().
+	TextureMap* texture(TextureCache& cache, const std::string& name);
+	void objectAdded(Scene* scene, Geometry* obj);
+
+	// Once the reader has returned scene: builds the tree over its objects
+	// on this thread, waits for the other tasks and hands their trees to
+	// the scene.  Rethrows the first exception a task threw, such as a
+	// TextureMapException.
+	void finish(Scene* scene);
+
+	// Waits for the tasks without looking at how they went.
+	void wait() { pool.wait(); }
+
+private:
+	SceneLoader(const SceneLoader&);
+	SceneLoader& operator=(const SceneLoader&);
+
+	// Queues task; its exception, if it is the first, is kept for finish().
+	void run(const std::function<void()>& task);
+
+	int meshPrecision;
+	bool kdTree;
+	int kdDepth;
+	int kdLeafSize;
+	LoadProgress* progress;
+
+	std::mutex lock;
+	std::vector<std::unique_ptr<MemoryArena> > meshArenas;
+	std::exception_ptr error;
+
+	ThreadPool pool;			// last, so it is stopped before the rest goes
+};
+
+#endif // __SCENELOADER_H__
@@ -0,0 +1,428 @@
+#include "texture.h"
+
+#include "../fileio/bitmap.h"
+#include "../fileio/pngimage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static const size_t TILE_BYTES = sizeof(TextureTile);
+
+// A quarter of a gigabyte of texels unless the UI asks otherwise.
+TileCache::TileCache() : budgetBytes(256 << 20), tileLoads(0) {}
+
+TileCache& TileCache::instance()
+{
+	static TileCache cache;
+	return cache;
+}
+
+void TileCache::setBudget( size_t bytes )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	// Always room for a few tiles, or two threads sampling different
+	// tiles would keep evicting each other's.
+	budgetBytes = max( bytes, 16 * TILE_BYTES );
+	evictOverBudget();
+}
+
+size_t TileCache::residentBytes() const
+{
+	std::lock_guard<std::mutex> guard( lock );
+	return index.size() * TILE_BYTES;
+}
+
+std::shared_ptr<const TextureTile> TileCache::get( const TextureMap* map, int level, int tile )
+{
+	Key key = { map, level, tile };
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		std::map<Key, LruList::iterator>::iterator found = index.find( key );
+		if (found != index.end())
+		{
+			lru.splice( lru.begin(), lru, found->second );
+			return found->second->second;
+		}
+	}
+
+	// Read outside the lock so that other threads' hits aren't held up
+	// behind the disk.
+	std::shared_ptr<TextureTile> loaded( new TextureTile );
+	map->readTile( level, tile, *loaded );
+	tileLoads++;
+
+	std::lock_guard<std::mutex> guard( lock );
+	std::map<Key, LruList::iterator>::iterator found = index.find( key );
+	if (found != index.end())
+	{
+		// Another thread loaded it meanwhile.
+		lru.splice( lru.begin(), lru, found->second );
+		return found->second->second;
+	}
+	lru.push_front( make_pair( key, std::shared_ptr<const TextureTile>( loaded ) ) );
+	index[key] = lru.begin();
+	evictOverBudget();
+	return loaded;
+}
+
+void TileCache::forget( const TextureMap* map )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	for (LruList::iterator t = lru.begin(); t != lru.end(); )
+	{
+		if (t->first.map == map)
+		{
+			index.erase( t->first );
+			t = lru.erase( t );
+		}
+		else ++t;
+	}
+}
+
+void TileCache::evictOverBudget()
+{
+	while (!lru.empty() && index.size() * TILE_BYTES > budgetBytes)
+	{
+		index.erase( lru.back().first );
+		lru.pop_back();
+	}
+}
+
+TextureCache::~TextureCache()
+{
+	for (std::map<string, TextureMap*>::iterator t = maps.begin(); t != maps.end(); ++t)
+		delete t->second;
+	for (size_t t = 0; t < failed.size(); t++)
+		delete failed[t];
+}
+
+TextureMap* TextureCache::get( const string& name )
+{
+	std::unique_lock<std::mutex> guard( lock );
+	std::map<string, TextureMap*>::iterator itr = maps.find( name );
+	while (itr != maps.end() && pending.count( itr->second ))
+	{
+		decoded.wait( guard );
+		itr = maps.find( name );
+	}
+	if (itr != maps.end()) return itr->second;
+	TextureMap* map = new TextureMap( name );
+	maps[name] = map;
+	return map;
+}
+
+TextureMap* TextureCache::request( const string& name, std::function<void()>& load )
+{
+	std::lock_guard<std::mutex> guard( lock );
+	std::map<string, TextureMap*>::iterator itr = maps.find( name );
+	if (itr != maps.end())
+	{
+		// Someone else's request; the caller still has to wait for it.
+		TextureMap* map = itr->second;
+		if (pending.count( map )) load = [this, map] { waitFor( map ); };
+		return map;
+	}
+	TextureMap* map = new TextureMap( name, TextureMap::Deferred() );
+	maps[name] = map;
+	pending.insert( map );
+	load = [this, map] { decode( map ); };
+	return map;
+}
+
+void TextureCache::decode( TextureMap* map )
+{
+	try { map->load(); }
+	catch (...)
+	{
+		std::lock_guard<std::mutex> guard( lock );
+		maps.erase( map->name() );
+		failed.push_back( map );
+		pending.erase( map );
+		decoded.notify_all();
+		throw;
+	}
+	std::lock_guard<std::mutex> guard( lock );
+	pending.erase( map );
+	decoded.notify_all();
+}
+
+void TextureCache::waitFor( TextureMap* map )
+{
+	std::unique_lock<std::mutex> guard( lock );
+	decoded.wait( guard, [this, map] { return !pending.count( map ); } );
+	if (find( failed.begin(), failed.end(), map ) != failed.end())
+		throw TextureMapException( "Unable to load texture map '" + map->name() + "'." );
+}
+
+static std::atomic<unsigned> textureSerials( 1 );
+
+TextureMap::TextureMap( string filename ) : filename( filename ), width( 0 ), height( 0 ), backing( 0 ), readFailed( false ) {
+	serial = textureSerials++;
+	load();
+}
+
+TextureMap::TextureMap( string filename, Deferred ) : filename( filename ), width( 0 ), height( 0 ), backing( 0 ), readFailed( false ) {
+	serial = textureSerials++;
+}
+
+void TextureMap::load() {
+	unsigned char* data = NULL;
+	int start = (int) filename.find_last_of('.');
+	int end = (int) filename.size() - 1;
+	if (start >= 0 && start < end) {
+		string ext = filename.substr(start, end);
+		if (!ext.compare(".png")) {
+			png_cleanup(1);
+			if (!png_init(filename.c_str(), width, height)) {
+				double gamma = 2.2;
+				int channels, rowBytes;
+				unsigned char* indata = png_get_image(gamma, channels, rowBytes);
+				// Flipped to bottom-up RGB, like readBMP returns.
+				data = new unsigned char[width * height * 3];
+				for (int j = 0; j < height; j++)
+					for (int i = 0; i < width; i++)
+						for (int k = 0; k < 3; k++)
+							*(data + k + 3 * (i + j * width)) = *(indata + min(k, channels - 1) + i * channels + (height - j - 1) * rowBytes);
+				png_cleanup(1);
+			}
+		}
+		else
+			if (!ext.compare(".bmp")) data = readBMP(filename.c_str(), width, height);
+	}
+	if (data == NULL) {
+		width = 0;
+		height = 0;
+		string error("Unable to load texture map '");
+		error.append(filename);
+		error.append("'.");
+		throw TextureMapException(error);
+	}
+
+	try { build( data ); }
+	catch (...) { delete[] data; throw; }
+	delete[] data;
+}
+
+TextureMap::TextureMap( string name, int w, int h, const unsigned char* rgb )
+	: filename( name ), width( w ), height( h ), backing( 0 ), readFailed( false )
+{
+	serial = textureSerials++;
+	build( rgb );
+}
+
+TextureMap::TextureMap( string name, int w, int h, const unsigned short* rgb )
+	: filename( name ), width( w ), height( h ), backing( 0 ), readFailed( false )
+{
+	serial = textureSerials++;
+	build( rgb );
+}
+
+void TextureMap::build( const unsigned char* rgb )
+{
+	// Widened to 16 bits once, so the mip levels are filtered without
+	// losing precision and sampling needs no per-texel conversion.
+	std::vector<unsigned short> data( width * height * 3 );
+	for (int n = 0; n < width * height * 3; n++)
+		data[n] = rgb[n] * 257;
+	build( &data[0] );
+}
+
+void TextureMap::build( const unsigned short* rgb )
+{
+	backing = tmpfile();
+	if (backing == NULL)
+		throw TextureMapException("Unable to create the tile file for texture map '" + filename + "'.");
+	writeLevels( rgb );
+}
+
+TextureMap::~TextureMap()
+{
+	TileCache::instance().forget( this );
+	if (backing) fclose( backing );
+}
+
+// Writes data and each of its halvings, down to a single texel, to the
+// backing file, one tile after the other.
+void TextureMap::writeLevels( const unsigned short* data )
+{
+	const int T = TEXTURE_TILE_SIZE;
+	const int S = TEXTURE_TILE_STRIDE;
+	const unsigned short* level = data;
+	int w = width;
+	int h = height;
+	long offset = 0;
+	TextureTile tile;
+	for (;;)
+	{
+		MipLevel m;
+		m.width = w;
+		m.height = h;
+		m.tilesX = (w + T - 1) / T;
+		m.tilesY = (h + T - 1) / T;
+		m.offset = offset;
+		for (int ty = 0; ty < m.tilesY; ty++)
+			for (int tx = 0; tx < m.tilesX; tx++)
+			{
+				for (int j = 0; j < S; j++)
+					for (int i = 0; i < S; i++)
+					{
+						int x = min( tx * T + i, w - 1 );
+						int y = min( ty * T + j, h - 1 );
+						unsigned short* texel = tile.texels + (j * S + i) * 4;
+						for (int k = 0; k < 3; k++)
+							texel[k] = level[(y * w + x) * 3 + k];
+						texel[3] = 65535;
+					}
+				fwrite( &tile, TILE_BYTES, 1, backing );
+			}
+		offset += (long)m.tilesX * m.tilesY * TILE_BYTES;
+		mips.push_back( m );
+		if (w == 1 && h == 1) break;
+
+		// 2x2 box filter into the next level.
+		int nw = max( 1, w / 2 );
+		int nh = max( 1, h / 2 );
+		unsigned short* next = new unsigned short[nw * nh * 3];
+		for (int y = 0; y < nh; y++)
+			for (int x = 0; x < nw; x++)
+			{
+				int x0 = min( 2 * x, w - 1 ), x1 = min( 2 * x + 1, w - 1 );
+				int y0 = min( 2 * y, h - 1 ), y1 = min( 2 * y + 1, h - 1 );
+				for (int k = 0; k < 3; k++)
+					next[(y * nw + x) * 3 + k] = (unsigned short)((level[(y0 * w + x0) * 3 + k] + level[(y0 * w + x1) * 3 + k] +
+					                                               level[(y1 * w + x0) * 3 + k] + level[(y1 * w + x1) * 3 + k] + 2) / 4);
+			}
+		if (level != data) delete[] level;
+		level = next;
+		w = nw;
+		h = nh;
+	}
+	if (level != data) delete[] level;
+	fflush( backing );
+}
+
+void TextureMap::readTile( int level, int tile, TextureTile& out ) const
+{
+	off_t at = mips[level].offset + (off_t)tile * TILE_BYTES;
+	if (pread( fileno( backing ), &out, TILE_BYTES, at ) == (ssize_t)TILE_BYTES) return;
+
+	// This runs on render threads, where there is no one to throw to, so
+	// the tile shows white and the first failure is reported.
+	memset( &out, 255, TILE_BYTES );
+	if (!readFailed.exchange( true ))
+		fprintf( stderr, "Unable to read the tile file of texture map '%s'; missing tiles show white.\n",
+			filename.c_str() );
+}
+
+const TextureTile* TextureMap::tile( int level, int tile ) const
+{
+	// Lookups mostly land in the tiles the thread used last; only moving
+	// to another tile goes through the cache and its lock.  Trilinear
+	// lookups alternate between two adjacent levels, hence one slot for
+	// even and one for odd levels.
+	struct LastTile
+	{
+		unsigned serial;
+		int level, tile;
+		std::shared_ptr<const TextureTile> texels;
+	};
+	static thread_local LastTile last[2];
+	LastTile& slot = last[level & 1];
+	if (slot.serial != serial || slot.level != level || slot.tile != tile)
+	{
+		slot.texels = TileCache::instance().get( this, level, tile );
+		slot.serial = serial;
+		slot.level = level;
+		slot.tile = tile;
+	}
+	return slot.texels.get();
+}
+
+Vec3d TextureMap::getPixelAt( int level, int x, int y ) const
+{
+	const int T = TEXTURE_TILE_SIZE;
+	level = max( 0, min( level, levels() - 1 ) );
+	const MipLevel& m = mips[level];
+	x = max( 0, min( x, m.width - 1 ) );
+	y = max( 0, min( y, m.height - 1 ) );
+
+	const unsigned short* texel = tile( level, (y / T) * m.tilesX + x / T )->texels
+		+ ((y % T) * TEXTURE_TILE_STRIDE + x % T) * 4;
+	return Vec3d(texel[0] / 65535.0,
+		texel[1] / 65535.0,
+		texel[2] / 65535.0);
+}
+
+// Texel centres are at half-integer coordinates; (u, v) outside the unit
+// square is clamped to the edge texels.
+void TextureMap::bilinear( int level, double u, double v, float rgba[4] ) const
+{
+	const int T = TEXTURE_TILE_SIZE;
+	const int S = TEXTURE_TILE_STRIDE;
+	const MipLevel& m = mips[level];
+	double x = max( 0.0, min( u * m.width - 0.5, m.width - 1.0 ) );
+	double y = max( 0.0, min( v * m.height - 0.5, m.height - 1.0 ) );
+	int x0 = (int)x;
+	int y0 = (int)y;
+	float fx = (float)(x - x0);
+	float fy = (float)(y - y0);
+
+	// The tile's border makes (x0+1, y0+1) part of the same tile.
+	const unsigned short* row0 = tile( level, (y0 / T) * m.tilesX + x0 / T )->texels
+		+ ((y0 % T) * S + x0 % T) * 4;
+	const unsigned short* row1 = row0 + S * 4;
+
+#ifdef __SSE2__
+	// Each row's two texels are one load, widened to two float vectors.
+	__m128i zero = _mm_setzero_si128();
+	__m128i r0 = _mm_loadu_si128( (const __m128i*)row0 );
+	__m128i r1 = _mm_loadu_si128( (const __m128i*)row1 );
+	__m128 t00 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( r0, zero ) );
+	__m128 t10 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( r0, zero ) );
+	__m128 t01 = _mm_cvtepi32_ps( _mm_unpacklo_epi16( r1, zero ) );
+	__m128 t11 = _mm_cvtepi32_ps( _mm_unpackhi_epi16( r1, zero ) );
+	__m128 wx = _mm_set1_ps( fx );
+	__m128 wy = _mm_set1_ps( fy );
+	__m128 bottom = _mm_add_ps( t00, _mm_mul_ps( _mm_sub_ps( t10, t00 ), wx ) );
+	__m128 top = _mm_add_ps( t01, _mm_mul_ps( _mm_sub_ps( t11, t01 ), wx ) );
+	__m128 value = _mm_add_ps( bottom, _mm_mul_ps( _mm_sub_ps( top, bottom ), wy ) );
+	_mm_storeu_ps( rgba, _mm_mul_ps( value, _mm_set1_ps( 1.0f / 65535.0f ) ) );
+#else
+	for (int k = 0; k < 4; k++)
+	{
+		float bottom = row0[k] + (row0[k + 4] - (float)row0[k]) * fx;
+		float top = row1[k] + (row1[k + 4] - (float)row1[k]) * fx;
+		rgba[k] = (bottom + (top - bottom) * fy) * (1.0f / 65535.0f);
+	}
+#endif
+}
+
+Vec3d TextureMap::sample( double u, double v ) const
+{
+	float rgba[4];
+	bilinear( 0, u, v, rgba );
+	return Vec3d( rgba[0], rgba[1], rgba[2] );
+}
+
+Vec3d TextureMap::sample( double u, double v, double lod ) const
+{
+	lod = max( 0.0, min( lod, levels() - 1.0 ) );
+	int level = (int)lod;
+	float f = (float)(lod - level);
+	float a[4];
+	bilinear( level, u, v, a );
+	if (f > 0)
+	{
+		float b[4];
+		bilinear( level + 1, u, v, b );
+		for (int k = 0; k < 3; k++)
+			a[k] += (b[k] - a[k]) * f;
+	}
+	return Vec3d( a[0], a[1], a[2] );
+}
@@ -0,0 +1,223 @@
+//
+// texture.h
+//
+// Texture maps and the caches that hold them.  A TextureMap is decoded
+// once, mip-mapped, and cut into tiles that are written to a backing
+// file; the TileCache then keeps only the tiles that are actually being
+// sampled in memory, up to a budget.
+//
+
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include "../vecmath/vec.h"
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <set>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+
+using std::string;
+
+class TextureMap;
+
+// Width and height, in texels, of the blocks textures are loaded and
+// evicted in.  Tiles at the right and top edges of a level are padded by
+// repeating the last texel.
+const int TEXTURE_TILE_SIZE = 64;
+
+// Each tile also stores the first column and row of its right and upper
+// neighbours, so the 2x2 texels a bilinear lookup needs are always in one
+// tile.
+const int TEXTURE_TILE_STRIDE = TEXTURE_TILE_SIZE + 1;
+
+// Texels are 16-bit RGBA, alpha unused: eight bytes, so that two
+// neighbours in a row are a single 16-byte load.
+struct TextureTile
+{
+	unsigned short texels[TEXTURE_TILE_STRIDE * TEXTURE_TILE_STRIDE * 4];
+};
+
+// The resident tiles of every TextureMap in the process.  When they take
+// more than the budget, the least recently used ones are dropped; they
+// are read back from their texture's backing file if sampled again.
+// Lookups may come from any number of render threads at once.
+class TileCache
+{
+public:
+	static TileCache& instance();
+
+	void setBudget( size_t bytes );
+	size_t budget() const { return budgetBytes; }
+	size_t residentBytes() const;
+	unsigned long long loads() const { return tileLoads; }
+
+	// Tile number tile of mip level level of map, loading it if needed.
+	// The returned pointer keeps the tile alive even if it is evicted
+	// while the caller still reads it.
+	std::shared_ptr<const TextureTile> get( const TextureMap* map, int level, int tile );
+
+	// Drops every resident tile of map, which is going away.
+	void forget( const TextureMap* map );
+
+private:
+	TileCache();
+	TileCache( const TileCache& );
+	TileCache& operator=( const TileCache& );
+
+	struct Key
+	{
+		const TextureMap* map;
+		int level;
+		int tile;
+		bool operator<( const Key& k ) const
+		{
+			if (map != k.map) return map < k.map;
+			if (level != k.level) return level < k.level;
+			return tile < k.tile;
+		}
+	};
+	typedef std::list< std::pair< Key, std::shared_ptr<const TextureTile> > > LruList;
+
+	void evictOverBudget();
+
+	mutable std::mutex lock;
+	LruList lru;				// most recently used first
+	std::map<Key, LruList::iterator> index;
+	size_t budgetBytes;
+	std::atomic<unsigned long long> tileLoads;
+};
+
+/* The TextureMap class can be used to store a texture map,
+   which consists of a bitmap and various accessors to
+   it.  getMappedValue is what materials sample textures
+   with.
+*/
+class TextureMap {
+    public:
+       TextureMap( string filename );
+
+       // A texture made from width x height bottom-up RGB bytes in memory;
+       // name is only used in messages.
+       TextureMap( string name, int width, int height, const unsigned char* rgb );
+
+       // The same from 16-bit channels, for images computed at more than
+       // 8 bits of precision.
+       TextureMap( string name, int width, int height, const unsigned short* rgb );
+
+       // Return the mapped value; here the coordinate
+       // is assumed to be within the parametrization space:
+       // [0, 1] x [0, 1]
+       // (i.e., {(u, v): 0 <= u <= 1 and 0 <= v <= 1}
+       Vec3d getMappedValue( const Vec2d& coord ) const { return sample( coord[0], coord[1] ); }
+
+       // Bilinear filtering of the full resolution texture at (u, v).
+       Vec3d sample( double u, double v ) const;
+
+       // Trilinear filtering: bilinear in the two mip levels around lod,
+       // which is log2 of the footprint in full resolution texels.
+       Vec3d sample( double u, double v, double lod ) const;
+
+       // Retrieve the value stored in a physical location
+       // (with integer coordinates) in the bitmap.
+       Vec3d getPixelAt( int x, int y ) const { return getPixelAt( 0, x, y ); }
+
+       // The same in mip level level, which is half the size of the one
+       // before it.  Coordinates outside the level are clamped to it.
+       Vec3d getPixelAt( int level, int x, int y ) const;
+
+	   const string& name() const { return filename; }
+	   int getWidth() const { return width; }
+	   int getHeight() const { return height; }
+	   int levels() const { return (int)mips.size(); }
+	   int levelWidth( int level ) const { return mips[level].width; }
+	   int levelHeight( int level ) const { return mips[level].height; }
+
+	  ~TextureMap();
+
+protected:
+	friend class TileCache;
+	friend class TextureCache;
+
+	// A map whose file is only read when load() is called, for
+	// TextureCache::request().
+	struct Deferred {};
+	TextureMap( string filename, Deferred );
+	void load();
+
+	struct MipLevel
+	{
+		int width, height;
+		int tilesX, tilesY;
+		long offset;			// of its first tile in the backing file
+	};
+
+	void build( const unsigned char* rgb );
+	void build( const unsigned short* rgb );
+	void writeLevels( const unsigned short* data );
+	void readTile( int level, int tile, TextureTile& out ) const;
+
+	// The tile through the thread's recently used tiles; valid until the
+	// thread asks for two more tiles of mip levels of the same parity.
+	const TextureTile* tile( int level, int tile ) const;
+	void bilinear( int level, double u, double v, float rgba[4] ) const;
+
+       string filename;
+       int width;
+       int height;
+	std::vector<MipLevel> mips;
+	FILE* backing;
+	unsigned serial;			// unique for the life of the process
+	mutable std::atomic<bool> readFailed;	// reported once, not per tile
+};
+
+// Texture maps by file name, so that a file used by several materials (or
+// several scenes of a batch) is only loaded once.  Lookups are serialized;
+// files can be decoded on other threads through request().
+class TextureCache {
+public:
+	TextureCache() {}
+	~TextureCache();
+
+	// Decodes the file on first use; throws TextureMapException like
+	// the TextureMap constructor does.  Waits for a map that is still
+	// being decoded for a request().
+	TextureMap* get( const string& name );
+	int size() const { return (int)maps.size(); }
+
+	// Like get(), but leaves the decoding to load, which can be run on
+	// any thread, and throws there instead.  The map isn't usable until
+	// load has returned.  A map that fails to load is dropped from the
+	// cache (though not deleted until the cache is).
+	TextureMap* request( const string& name, std::function<void()>& load );
+
+private:
+	TextureCache( const TextureCache& );
+	TextureCache& operator=( const TextureCache& );
+
+	void decode( TextureMap* map );
+	void waitFor( TextureMap* map );
+
+	std::mutex lock;
+	std::map<string, TextureMap*> maps;
+	std::set<TextureMap*> pending;		// requested, still being decoded
+	std::vector<TextureMap*> failed;
+	std::condition_variable decoded;	// something left pending
+};
+
+class TextureMapException {
+	public:
+		TextureMapException( string errorMsg ) : _errorMsg( errorMsg ) {}
+		string message() { return _errorMsg; }
+
+	private:
+		string _errorMsg;
+};
+
+#endif // __TEXTURE_H__
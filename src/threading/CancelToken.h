@@ -0,0 +1,47 @@
+//
+// CancelToken.h
+//
+// Cooperative cancellation for long-running renders.  Workers poll
+// cancelled() between units of work; the token trips either when someone
+// calls cancel() or when its deadline (if any) passes.
+//
+
+#ifndef __CANCELTOKEN_H__
+#define __CANCELTOKEN_H__
+
+#include <atomic>
+#include <chrono>
+
+class CancelToken
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	CancelToken() : flag(false), hasDeadline(false) {}
+
+	void cancel() { flag = true; }
+
+	void setDeadline(Clock::time_point when)
+	{
+		deadline = when;
+		hasDeadline = true;
+	}
+
+	bool cancelled() const
+	{
+		if (flag.load(std::memory_order_relaxed)) return true;
+		if (hasDeadline && Clock::now() >= deadline)
+		{
+			flag = true;
+			return true;
+		}
+		return false;
+	}
+
+private:
+	mutable std::atomic<bool> flag;
+	bool hasDeadline;
+	Clock::time_point deadline;
+};
+
+#endif // __CANCELTOKEN_H__
@@ -0,0 +1,116 @@
+#include "Numa.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+
+static thread_local int boundNode = 0;
+
+// Parses the kernel's cpulist format, e.g. "0-7,16-23".
+static vector<int> parseCpuList(const string& text)
+{
+	vector<int> cpus;
+	stringstream ss(text);
+	string range;
+	while (getline(ss, range, ','))
+	{
+		int lo, hi;
+		char dash;
+		stringstream rs(range);
+		if (!(rs >> lo)) continue;
+		hi = lo;
+		if (rs >> dash >> hi) {}
+		for (int c = lo; c <= hi; c++)
+			cpus.push_back(c);
+	}
+	return cpus;
+}
+
+NumaTopology::NumaTopology()
+{
+	for (int node = 0; ; node++)
+	{
+		ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+		if (!in) break;
+		string text;
+		getline(in, text);
+		vector<int> cpus = parseCpuList(text);
+		// Memory-only nodes have no CPUs to run on.
+		if (!cpus.empty()) nodeCpus.push_back(cpus);
+	}
+
+	if (nodeCpus.empty())
+	{
+		vector<int> all;
+		int n = max(1u, thread::hardware_concurrency());
+		for (int c = 0; c < n; c++)
+			all.push_back(c);
+		nodeCpus.push_back(all);
+	}
+}
+
+const NumaTopology& NumaTopology::get()
+{
+	static NumaTopology topology;
+	return topology;
+}
+
+vector<ThreadPlacement> NumaTopology::place(int nThreads) const
+{
+	int totalCpus = 0;
+	for (int n = 0; n < nodeCount(); n++)
+		totalCpus += (int)nodeCpus[n].size();
+
+	vector<ThreadPlacement> placement;
+	int assigned = 0;
+	int cpusBefore = 0;
+	for (int n = 0; n < nodeCount(); n++)
+	{
+		cpusBefore += (int)nodeCpus[n].size();
+		// Threads up to this node's share of the running CPU total.
+		int upTo = (int)((long long)nThreads * cpusBefore / totalCpus);
+		const vector<int>& cpus = nodeCpus[n];
+		for (int k = 0; assigned < upTo; k++, assigned++)
+		{
+			// Oversubscribed nodes keep their threads node-local but let
+			// the scheduler balance them across the node's CPUs.
+			int cpu = nThreads <= totalCpus ? cpus[k % cpus.size()] : -1;
+			placement.push_back(ThreadPlacement(n, cpu));
+		}
+	}
+	return placement;
+}
+
+bool NumaTopology::bind(const ThreadPlacement& p)
+{
+	boundNode = p.node;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (p.cpu >= 0)
+		CPU_SET(p.cpu, &set);
+	else
+	{
+		const vector<int>& cpus = get().cpus(p.node);
+		for (size_t i = 0; i < cpus.size(); i++)
+			CPU_SET(cpus[i], &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+int NumaTopology::currentNode()
+{
+	return boundNode;
+}
@@ -0,0 +1,48 @@
+//
+// Numa.h
+//
+// Discovers the machine's NUMA nodes and pins render threads to them, so
+// that memory a thread first touches (framebuffer rows, kd-tree replicas)
+// ends up on the node that later reads it.
+//
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <vector>
+
+struct ThreadPlacement
+{
+	int node;
+	int cpu;	// -1 leaves the thread free to float within the node
+
+	ThreadPlacement() : node(0), cpu(-1) {}
+	ThreadPlacement(int n, int c) : node(n), cpu(c) {}
+};
+
+class NumaTopology
+{
+public:
+	// Read once from /sys/devices/system/node; a machine without that
+	// information is treated as a single node holding every CPU.
+	static const NumaTopology& get();
+
+	int nodeCount() const { return (int)nodeCpus.size(); }
+	const std::vector<int>& cpus(int node) const { return nodeCpus[node]; }
+
+	// Spreads nThreads over the nodes in contiguous blocks proportional to
+	// each node's CPU count, one CPU per thread where there are enough.
+	std::vector<ThreadPlacement> place(int nThreads) const;
+
+	// Pins the calling thread and records its node for currentNode().
+	static bool bind(const ThreadPlacement& p);
+	// Node the calling thread was bound to, 0 if it never was.
+	static int currentNode();
+
+private:
+	NumaTopology();
+
+	std::vector<std::vector<int> > nodeCpus;
+};
+
+#endif // __NUMA_H__
@@ -0,0 +1,63 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(int nThreads)
+	: pending(0), stopping(false)
+{
+	if (nThreads < 1) nThreads = 1;
+	for (int i = 0; i < nThreads; i++)
+		threads.push_back(thread(workerThread, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+		taskCond.notify_all();
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+void ThreadPool::submit(const function<void()>& task)
+{
+	lock_guard<mutex> guard(lock);
+	tasks.push_back(task);
+	pending++;
+	taskCond.notify_one();
+}
+
+void ThreadPool::runOnAll(const function<void(int)>& fn)
+{
+	for (int i = 0; i < size(); i++)
+		submit(bind(fn, i));
+	wait();
+}
+
+void ThreadPool::wait()
+{
+	unique_lock<mutex> guard(lock);
+	idleCond.wait(guard, [this] { return pending == 0; });
+}
+
+void ThreadPool::workerThread(ThreadPool* pool)
+{
+	for (;;)
+	{
+		function<void()> task;
+		{
+			unique_lock<mutex> guard(pool->lock);
+			pool->taskCond.wait(guard, [pool] { return pool->stopping || !pool->tasks.empty(); });
+			if (pool->tasks.empty()) return;
+			task = pool->tasks.front();
+			pool->tasks.pop_front();
+		}
+		task();
+		{
+			lock_guard<mutex> guard(pool->lock);
+			if (--pool->pending == 0) pool->idleCond.notify_all();
+		}
+	}
+}
@@ -0,0 +1,47 @@
+//
+// ThreadPool.h
+//
+// A fixed set of threads that outlive any one render.  Batch and animation
+// rendering hand it one job after another instead of starting and joining
+// a fresh set of threads per image.
+//
+
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(int nThreads);
+	~ThreadPool();
+
+	int size() const { return (int)threads.size(); }
+
+	// Queues a task for whichever thread is free first.
+	void submit(const std::function<void()>& task);
+	// Runs fn(0) .. fn(size()-1) as separate tasks and waits for all of
+	// them.  Render loops use the index for bindRenderThread().
+	void runOnAll(const std::function<void(int)>& fn);
+	// Blocks until every task submitted so far has finished.
+	void wait();
+
+private:
+	static void workerThread(ThreadPool* pool);
+
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()> > tasks;
+	std::mutex lock;
+	std::condition_variable taskCond;	// a task was queued, or shutting down
+	std::condition_variable idleCond;	// pending dropped to zero
+	int pending;						// queued plus running
+	bool stopping;
+};
+
+#endif // __THREADPOOL_H__
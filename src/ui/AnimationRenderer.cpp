@@ -0,0 +1,303 @@
+#include "AnimationRenderer.h"
+#include "../scene/scene.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+
+#include <stdio.h>
+
+using namespace std;
+
+AnimationRenderer::AnimationRenderer(RayTracer* tracer, int nThreads)
+	: raytracer(tracer), pool(nThreads), nFrames(0), width(0), height(0),
+	  tiles(0), framesStarted(0), writerStop(false)
+{
+	for (int s = 0; s < NUM_SLOTS; s++)
+	{
+		slots[s].frame = -1;
+		slots[s].nextTile = slots[s].tilesDone = 0;
+	}
+}
+
+AnimationRenderer::~AnimationRenderer()
+{
+	// The scene belongs to raytracer; the slots only borrowed it.
+	for (int s = 0; s < NUM_SLOTS; s++)
+		slots[s].tracer.useScene(0);
+}
+
+bool AnimationRenderer::readKeyframes(const char* path, ostream& err)
+{
+	ifstream in(path);
+	if (!in)
+	{
+		err << "unable to read keyframes " << path << endl;
+		return false;
+	}
+
+	string text;
+	int line = 0;
+	bool ok = true;
+	while (getline(in, text))
+	{
+		line++;
+		istringstream words(text);
+		string first;
+		if (!(words >> first) || first[0] == '#') continue;
+
+		Keyframe key;
+		char* end;
+		key.time = strtod(first.c_str(), &end);
+		if (*end || (!keys.empty() && key.time <= keys.back().time))
+		{
+			err << path << ":" << line << ": expected a time after the previous keyframe's" << endl;
+			ok = false;
+			continue;
+		}
+		string option;
+		while (words >> option)
+		{
+			size_t eq = option.find('=');
+			if (eq == string::npos || !key.camera.parse(option.substr(0, eq), option.substr(eq + 1)))
+			{
+				err << path << ":" << line << ": bad option '" << option << "'" << endl;
+				ok = false;
+			}
+		}
+		if (!key.camera.hasEye || !key.camera.hasQuat)
+		{
+			err << path << ":" << line << ": a keyframe needs both eye and quat" << endl;
+			ok = false;
+			continue;
+		}
+		keys.push_back(key);
+	}
+	if (ok && keys.empty())
+	{
+		err << path << ": no keyframes" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+// Shortest-arc spherical interpolation between unit quaternions.
+static Vec4d slerp(const Vec4d& a, const Vec4d& b, double t)
+{
+	double d = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+	double s = 1.0;
+	if (d < 0.0)
+	{
+		d = -d;
+		s = -1.0;
+	}
+	double wa, wb;
+	if (d > 0.9995)
+	{
+		// Nearly parallel; plain lerp is accurate and avoids sin(0).
+		wa = 1.0 - t;
+		wb = t;
+	}
+	else
+	{
+		double theta = acos(d);
+		wa = sin((1.0 - t) * theta) / sin(theta);
+		wb = sin(t * theta) / sin(theta);
+	}
+	wb *= s;
+	Vec4d q(wa*a[0] + wb*b[0], wa*a[1] + wb*b[1], wa*a[2] + wb*b[2], wa*a[3] + wb*b[3]);
+	q.normalize();
+	return q;
+}
+
+Camera AnimationRenderer::cameraAt(double t) const
+{
+	size_t k = 0;
+	while (k + 2 < keys.size() && t > keys[k + 1].time)
+		k++;
+
+	Camera camera = raytracer->scene->getCamera();
+	if (keys.size() == 1)
+	{
+		keys[0].camera.apply(camera);
+		return camera;
+	}
+
+	const CameraSettings& a = keys[k].camera;
+	const CameraSettings& b = keys[k + 1].camera;
+	double u = (t - keys[k].time) / (keys[k + 1].time - keys[k].time);
+	u = max(0.0, min(1.0, u));
+
+	CameraSettings c;
+	c.hasEye = c.hasQuat = true;
+	c.eye = (1.0 - u) * a.eye + u * b.eye;
+	c.quat = slerp(a.quat, b.quat, u);
+	if (a.hasFov && b.hasFov)
+	{
+		c.fov = (1.0 - u) * a.fov + u * b.fov;
+		c.hasFov = true;
+	}
+	else if (a.hasFov || b.hasFov)
+	{
+		c.fov = a.hasFov ? a.fov : b.fov;
+		c.hasFov = true;
+	}
+	c.apply(camera);
+	return camera;
+}
+
+string AnimationRenderer::frameName(int frame) const
+{
+	string p = pattern;
+	if (p.find('%') == string::npos)
+	{
+		size_t slash = p.find_last_of("\\/");
+		size_t dot = p.find_last_of('.');
+		if (dot == string::npos || (slash != string::npos && slash > dot))
+			dot = p.size();
+		p.insert(dot, "%04d");
+	}
+	char name[4096];
+	snprintf(name, sizeof(name), p.c_str(), frame);
+	return name;
+}
+
+// Hands out tiles from the oldest frame that still has unclaimed ones,
+// starting the next frame in a free slot when there is none.
+bool AnimationRenderer::nextTile(FrameSlot*& slot, int& tile)
+{
+	unique_lock<mutex> guard(lock);
+	for (;;)
+	{
+		FrameSlot* best = 0;
+		FrameSlot* freeSlot = 0;
+		for (int s = 0; s < NUM_SLOTS; s++)
+		{
+			FrameSlot& f = slots[s];
+			if (f.frame < 0)
+			{
+				if (!freeSlot) freeSlot = &f;
+			}
+			else if (f.nextTile < tiles && (!best || f.frame < best->frame))
+				best = &f;
+		}
+		if (best)
+		{
+			slot = best;
+			tile = best->nextTile++;
+			return true;
+		}
+		if (framesStarted >= nFrames) return false;
+		if (!freeSlot)
+		{
+			// Every slot is being set up, finishing or waiting for the writer.
+			slotFreed.wait(guard);
+			continue;
+		}
+
+		// Claim the slot, with no tiles to hand out yet, and set it up
+		// without holding the lock: traceSetup allocates and clears the
+		// whole framebuffer.
+		int f = framesStarted++;
+		freeSlot->frame = f;
+		freeSlot->nextTile = tiles;
+		freeSlot->tilesDone = 0;
+		guard.unlock();
+
+		double t0 = keys.front().time, t1 = keys.back().time;
+		double t = nFrames > 1 ? t0 + (t1 - t0) * f / (nFrames - 1) : t0;
+		freeSlot->camera = cameraAt(t);
+		freeSlot->tracer.traceSetup(width, height);
+
+		guard.lock();
+		freeSlot->nextTile = 0;
+		slotFreed.notify_all();
+	}
+}
+
+void AnimationRenderer::tileDone(FrameSlot* slot)
+{
+	lock_guard<mutex> guard(lock);
+	if (++slot->tilesDone == tiles)
+	{
+		toWrite.push_back(slot);
+		frameDone.notify_one();
+	}
+}
+
+void AnimationRenderer::renderLoop(int index)
+{
+	raytracer->bindRenderThread(index, pool.size());
+	FrameSlot* slot;
+	int tile;
+	while (nextTile(slot, tile))
+	{
+		slot->tracer.traceTile(tile);
+		tileDone(slot);
+	}
+}
+
+void AnimationRenderer::writerThread(AnimationRenderer* anim)
+{
+	for (;;)
+	{
+		FrameSlot* slot;
+		{
+			unique_lock<mutex> guard(anim->lock);
+			anim->frameDone.wait(guard, [anim] { return anim->writerStop || !anim->toWrite.empty(); });
+			if (anim->toWrite.empty()) return;
+			slot = anim->toWrite.front();
+			anim->toWrite.pop_front();
+		}
+		// Quantized and encoded here, off the render threads.
+		bool written = slot->tracer.writeImage(anim->frameName(slot->frame).c_str(), 1);
+		{
+			lock_guard<mutex> guard(anim->lock);
+			if (!written) anim->failed.push_back(slot->frame);
+			slot->frame = -1;
+			anim->slotFreed.notify_all();
+		}
+	}
+}
+
+bool AnimationRenderer::render(int frames, int w, const string& outPattern, ostream& out)
+{
+	if (!raytracer->sceneLoaded() || keys.empty()) return false;
+
+	nFrames = max(1, frames);
+	pattern = outPattern;
+	width = w;
+	height = (int)(width / raytracer->aspectRatio() + 0.5);
+	for (int s = 0; s < NUM_SLOTS; s++)
+	{
+		slots[s].tracer.useScene(raytracer->scene);
+		slots[s].tracer.setCamera(&slots[s].camera);
+	}
+	slots[0].tracer.traceSetup(width, height);
+	tiles = slots[0].tracer.numTiles();
+	framesStarted = 0;
+	writerStop = false;
+	failed.clear();
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	thread writer(writerThread, this);
+	pool.runOnAll([this](int index) { renderLoop(index); });
+	{
+		lock_guard<mutex> guard(lock);
+		writerStop = true;
+		frameDone.notify_all();
+	}
+	writer.join();
+
+	double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	sort(failed.begin(), failed.end());
+	for (size_t k = 0; k < failed.size(); k++)
+		out << frameName(failed[k]) << ": unable to write" << endl;
+	out << nFrames << " frames, " << failed.size() << " failed, "
+		<< t / nFrames << " s per frame, total time = " << t << endl;
+	return failed.empty();
+}
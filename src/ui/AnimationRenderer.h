@@ -0,0 +1,87 @@
+//
+// AnimationRenderer.h
+//
+// Renders a camera animation over one loaded scene.  The camera's eye and
+// field of view are interpolated linearly between keyframes and its look
+// quaternion spherically.  Frames overlap: threads that run out of tiles
+// in one frame move on to the next while the last tiles of the previous
+// one finish, and finished frames are written out by a separate thread.
+//
+// A keyframe file has one keyframe per line,
+//
+//     <time>  eye=x,y,z  quat=a,b,c,d  [fov=<degrees>]
+//
+// in increasing time order; '#' starts a comment line.
+//
+
+#ifndef __ANIMATIONRENDERER_H__
+#define __ANIMATIONRENDERER_H__
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "BatchRenderer.h"
+#include "../scene/camera.h"
+#include "../RayTracer.h"
+
+class AnimationRenderer
+{
+public:
+	AnimationRenderer(RayTracer* tracer, int nThreads);
+	~AnimationRenderer();
+
+	bool readKeyframes(const char* path, std::ostream& err);
+	// Renders nFrames evenly spaced frames from the first keyframe to the
+	// last.  outPattern is a printf pattern such as "out%03d.bmp"; without
+	// a '%' the frame number goes before the extension.  False if any
+	// frame couldn't be written.
+	bool render(int nFrames, int width, const std::string& outPattern, std::ostream& out);
+
+private:
+	struct Keyframe
+	{
+		double time;
+		CameraSettings camera;
+	};
+
+	// Up to this many frames are in flight at once: rendering, finishing
+	// their last tiles, or waiting to be written.
+	static const int NUM_SLOTS = 3;
+	struct FrameSlot
+	{
+		RayTracer tracer;
+		Camera camera;
+		int frame;			// -1 when free
+		int nextTile;
+		int tilesDone;
+	};
+
+	Camera cameraAt(double t) const;
+	std::string frameName(int frame) const;
+	bool nextTile(FrameSlot*& slot, int& tile);
+	void tileDone(FrameSlot* slot);
+	void renderLoop(int index);
+	static void writerThread(AnimationRenderer* anim);
+
+	RayTracer* raytracer;
+	ThreadPool pool;
+	std::vector<Keyframe> keys;
+
+	FrameSlot slots[NUM_SLOTS];
+	int nFrames, width, height, tiles;
+	int framesStarted;
+	std::string pattern;
+
+	std::mutex lock;
+	std::condition_variable slotFreed;	// or a new frame has tiles to hand out
+	std::condition_variable frameDone;
+	std::deque<FrameSlot*> toWrite;
+	bool writerStop;
+	std::vector<int> failed;		// frames that couldn't be written
+};
+
+#endif // __ANIMATIONRENDERER_H__
@@ -0,0 +1,194 @@
+#include "BatchRenderer.h"
+#include "TraceUI.h"
+#include "../RayTracer.h"
+#include "../scene/scene.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+BatchRenderer::BatchRenderer(RayTracer* tracer, TraceUI* ui, int nThreads)
+	: raytracer(tracer), traceUI(ui), pool(nThreads), scenesParsed(0)
+{
+}
+
+BatchRenderer::~BatchRenderer()
+{
+	raytracer->useScene(0);
+	for (map<string, Scene*>::iterator s = scenes.begin(); s != scenes.end(); ++s)
+		delete s->second;
+}
+
+// Reads comma-separated numbers into v[0..n-1].
+static bool parseNumbers(const string& text, double* v, int n)
+{
+	const char* p = text.c_str();
+	for (int i = 0; i < n; i++)
+	{
+		char* end;
+		v[i] = strtod(p, &end);
+		if (end == p) return false;
+		p = end;
+		if (i < n - 1)
+		{
+			if (*p != ',') return false;
+			p++;
+		}
+	}
+	return *p == 0;
+}
+
+bool CameraSettings::parse(const string& key, const string& value)
+{
+	double v[4];
+	if (key == "eye" && parseNumbers(value, v, 3))
+	{
+		eye = Vec3d(v[0], v[1], v[2]);
+		return hasEye = true;
+	}
+	if (key == "quat" && parseNumbers(value, v, 4))
+	{
+		quat = Vec4d(v[0], v[1], v[2], v[3]);
+		return hasQuat = true;
+	}
+	if (key == "fov" && parseNumbers(value, v, 1))
+	{
+		fov = v[0];
+		return hasFov = true;
+	}
+	return false;
+}
+
+void CameraSettings::apply(Camera& camera) const
+{
+	if (hasEye) camera.setEye(eye);
+	if (hasQuat) camera.setLook(quat[0], quat[1], quat[2], quat[3]);
+	if (hasFov) camera.setFOV(fov);
+}
+
+bool BatchRenderer::readManifest(const char* path, ostream& err)
+{
+	ifstream in(path);
+	if (!in)
+	{
+		err << "unable to read manifest " << path << endl;
+		return false;
+	}
+
+	string text;
+	int line = 0;
+	bool ok = true;
+	while (getline(in, text))
+	{
+		line++;
+		istringstream words(text);
+		BatchJob job;
+		job.line = line;
+		if (!(words >> job.scene) || job.scene[0] == '#') continue;
+		if (!(words >> job.output))
+		{
+			err << path << ":" << line << ": expected an output file" << endl;
+			ok = false;
+			continue;
+		}
+
+		string option;
+		while (words >> option)
+		{
+			size_t eq = option.find('=');
+			string key = option.substr(0, eq);
+			string value = eq == string::npos ? "" : option.substr(eq + 1);
+			bool good;
+			if (key == "w")
+				good = (job.width = atoi(value.c_str())) > 0;
+			else if (key == "r")
+				good = (job.depth = atoi(value.c_str())) >= 0 && !value.empty();
+			else
+				good = job.camera.parse(key, value);
+
+			if (!good)
+			{
+				err << path << ":" << line << ": bad option '" << option << "'" << endl;
+				ok = false;
+			}
+		}
+		jobs.push_back(job);
+	}
+	return ok;
+}
+
+// Scenes are parsed, and their kd-trees built, the first time a job asks
+// for them.  All of them decode textures into the one shared cache.
+Scene* BatchRenderer::sceneFor(const string& path)
+{
+	map<string, Scene*>::iterator s = scenes.find(path);
+	if (s != scenes.end()) return s->second;
+
+	Scene* scene = raytracer->parseScene(path.c_str(), &textures);
+	scenes[path] = scene;
+	if (scene) scenesParsed++;
+	return scene;
+}
+
+bool BatchRenderer::render(const BatchJob& job)
+{
+	Scene* scene = sceneFor(job.scene);
+	if (!scene) return false;
+
+	// Camera overrides only last for this job; the cached scene keeps its own.
+	Camera saved = scene->getCamera();
+	Camera& camera = scene->getCamera();
+	job.camera.apply(camera);
+
+	int savedDepth = traceUI->getDepth();
+	if (job.depth >= 0) traceUI->setDepth(job.depth);
+
+	raytracer->useScene(scene);
+	int width = job.width > 0 ? job.width : traceUI->getSize();
+	int height = (int)(width / raytracer->aspectRatio() + 0.5);
+	raytracer->traceSetup(width, height);
+
+	RayTracer* tracer = raytracer;
+	int nThreads = pool.size();
+	pool.runOnAll([tracer, nThreads](int index) {
+		tracer->bindRenderThread(index, nThreads);
+		while (tracer->traceNextTile())
+			;
+	});
+
+	bool written = raytracer->writeImage(job.output.c_str(), nThreads);
+
+	traceUI->setDepth(savedDepth);
+	camera = saved;
+	return written;
+}
+
+int BatchRenderer::run(ostream& out)
+{
+	int failed = 0;
+	chrono::steady_clock::time_point batchStart = chrono::steady_clock::now();
+	for (size_t j = 0; j < jobs.size(); j++)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool ok = render(jobs[j]);
+		double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (ok)
+			out << jobs[j].output << ": " << t << " s" << endl;
+		else
+		{
+			out << jobs[j].output << ": failed (line " << jobs[j].line << ")" << endl;
+			failed++;
+		}
+	}
+	double total = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+	out << jobs.size() << " jobs, " << failed << " failed, "
+		<< scenesParsed << " scenes parsed, " << textures.size() << " textures decoded, "
+		<< "total time = " << total << endl;
+	return failed;
+}
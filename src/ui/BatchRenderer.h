@@ -0,0 +1,84 @@
+//
+// BatchRenderer.h
+//
+// Renders a list of jobs from a manifest in one process.  Parsed scenes
+// (with their kd-trees) and decoded textures are cached across jobs, and
+// every job renders on the same thread pool.
+//
+// Manifest lines look like
+//
+//     scene.ray  out.bmp  [w=<width>] [r=<depth>] [eye=x,y,z] [quat=a,b,c,d] [fov=<degrees>]
+//
+// Blank lines and lines starting with '#' are skipped.  Options left out
+// fall back to the command line settings and the scene's own camera.
+//
+
+#ifndef __BATCHRENDERER_H__
+#define __BATCHRENDERER_H__
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../vecmath/vec.h"
+#include "../scene/material.h"
+#include "../threading/ThreadPool.h"
+
+class RayTracer;
+class TraceUI;
+class Scene;
+class Camera;
+
+// eye=x,y,z quat=a,b,c,d fov=<degrees>, each optional.  Shared with the
+// animation keyframes, which use the same syntax.
+struct CameraSettings
+{
+	bool hasEye, hasQuat, hasFov;
+	Vec3d eye;
+	Vec4d quat;
+	double fov;
+
+	CameraSettings() : hasEye(false), hasQuat(false), hasFov(false), fov(0) {}
+
+	// Returns false if key is not a camera setting or value is malformed.
+	bool parse(const std::string& key, const std::string& value);
+	void apply(Camera& camera) const;
+};
+
+struct BatchJob
+{
+	std::string scene;
+	std::string output;
+	int width;			// 0 keeps the command line width
+	int depth;			// -1 keeps the command line depth
+	CameraSettings camera;
+	int line;
+
+	BatchJob() : width(0), depth(-1), line(0) {}
+};
+
+class BatchRenderer
+{
+public:
+	BatchRenderer(RayTracer* tracer, TraceUI* ui, int nThreads);
+	~BatchRenderer();
+
+	bool readManifest(const char* path, std::ostream& err);
+	// Renders every job in order; returns the number that failed.
+	int run(std::ostream& out);
+
+private:
+	Scene* sceneFor(const std::string& path);
+	bool render(const BatchJob& job);
+
+	RayTracer* raytracer;
+	TraceUI* traceUI;
+	ThreadPool pool;
+	TextureCache textures;
+	std::map<std::string, Scene*> scenes;	// null for scenes that failed to load
+	std::vector<BatchJob> jobs;
+	int scenesParsed;
+};
+
+#endif // __BATCHRENDERER_H__
@@ -0,0 +1,383 @@
+#include "Benchmark.h"
+#include "TraceUI.h"
+#include "../RayTracer.h"
+#include "../scene/scene.h"
+#include "../scene/texture.h"
+#include "../scene/arena.h"
+#include "../threading/Numa.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <new>
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+// A hardware event counter for this process and every thread it starts
+// after the counter was opened.  Containers and locked-down kernels often
+// refuse these, in which case the counter just reports -1.
+class PerfCounter
+{
+public:
+	PerfCounter(unsigned type, unsigned long long config) : fd(-1)
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+	~PerfCounter()
+	{
+#ifdef __linux__
+		if (fd >= 0) close(fd);
+#endif
+	}
+
+	void start()
+	{
+#ifdef __linux__
+		if (fd < 0) return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	double stop()
+	{
+#ifdef __linux__
+		if (fd < 0) return -1;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		unsigned long long count;
+		if (read(fd, &count, sizeof(count)) != sizeof(count)) return -1;
+		return (double)count;
+#else
+		return -1;
+#endif
+	}
+
+private:
+	int fd;
+};
+
+thread_local unsigned long long Benchmark::heapAllocations = 0;
+
+// Replacing the global allocator is the only way to see allocations made
+// deep inside the renderer (and the standard library on its behalf).  The
+// array forms and the deletes default to these.
+void* operator new(size_t size)
+{
+	Benchmark::heapAllocations++;
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+Benchmark::Benchmark(RayTracer* tracer, TraceUI* ui, int w, int h, int threads, int r)
+	: raytracer(tracer), traceUI(ui), width(w), height(h),
+	  nThreads(max(1, threads)), reps(max(1, r)), raysCast(0),
+	  threadAllocations(0)
+{
+}
+
+void Benchmark::renderThread(Benchmark* bench, int index)
+{
+	bench->raytracer->bindRenderThread(index, bench->nThreads);
+	unsigned long long before = Scene::raysCast();
+	while (bench->raytracer->traceNextTile())
+		;
+	bench->raysCast += Scene::raysCast() - before;
+	// A fresh thread, so its count is this frame's alone.
+	bench->threadAllocations += heapAllocations;
+}
+
+// One frame, setup included: with NUMA placement traceSetup() is where the
+// framebuffer is first touched and the kd-trees are replicated.  Every
+// render thread is a fresh thread so no placement leaks between runs.
+double Benchmark::renderOnce()
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	raytracer->traceSetup(width, height);
+
+	vector<thread> threads;
+	for (int i = 0; i < nThreads; i++)
+		threads.push_back(thread(renderThread, this, i));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+Benchmark::Timing Benchmark::measure()
+{
+	// The first frame warms caches and builds replicas; don't count it.
+	renderOnce();
+
+#ifdef __linux__
+	PerfCounter cacheMisses(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	PerfCounter l1Misses(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+	PerfCounter cacheMisses(0, 0), l1Misses(0, 0);
+#endif
+	raysCast = 0;
+	threadAllocations = 0;
+	unsigned long long allocations = heapAllocations;
+	cacheMisses.start();
+	l1Misses.start();
+
+	vector<double> times;
+	for (int i = 0; i < reps; i++)
+		times.push_back(renderOnce());
+
+	double misses = cacheMisses.stop();
+	double l1 = l1Misses.stop();
+	allocations = heapAllocations - allocations + threadAllocations;
+	sort(times.begin(), times.end());
+
+	Timing t;
+	t.best = times.front();
+	t.median = times[times.size() / 2];
+	t.rays = double(raysCast) / reps;
+	t.cacheMisses = misses < 0 ? -1 : misses / reps;
+	t.l1Misses = l1 < 0 ? -1 : l1 / reps;
+	t.allocations = double(allocations) / reps;
+	return t;
+}
+
+void Benchmark::header(ostream& out, const char* title)
+{
+	out << endl << title << endl;
+	out << left << setw(12) << "config" << right
+		<< setw(11) << "best ms" << setw(11) << "median ms"
+		<< setw(10) << "Mrays/s" << setw(14) << "LLC miss/ray"
+		<< setw(14) << "L1d miss/ray" << setw(12) << "allocs/ray" << endl;
+}
+
+void Benchmark::report(ostream& out, const char* name, const Timing& t)
+{
+	out << left << setw(12) << name << right << fixed
+		<< setprecision(2)
+		<< setw(11) << t.best * 1000.0
+		<< setw(11) << t.median * 1000.0
+		<< setw(10) << t.rays / t.median / 1.0e6
+		<< setprecision(3);
+	if (t.cacheMisses < 0) out << setw(14) << "n/a";
+	else out << setw(14) << t.cacheMisses / t.rays;
+	if (t.l1Misses < 0) out << setw(14) << "n/a";
+	else out << setw(14) << t.l1Misses / t.rays;
+	out << setw(12) << t.allocations / t.rays;
+	out << endl;
+}
+
+// Frame timings include thread start-up and per-tile buffers, so the
+// intersection path is also checked on its own: one camera ray per pixel
+// through Scene::intersect, on this thread, should allocate nothing.
+void Benchmark::checkAllocations(ostream& out)
+{
+	Scene* scene = raytracer->scene;
+	unsigned long long before = heapAllocations;
+	int hits = 0;
+	for (int j = 0; j < height; j++)
+		for (int i = 0; i < width; i++)
+		{
+			ray r(Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY);
+			raytracer->camera().rayThrough(double(i)/double(width), double(j)/double(height), r);
+			isect hit;
+			if (scene->intersect(r, hit))
+			{
+				hit.getMaterial();
+				hits++;
+			}
+		}
+	unsigned long long allocations = heapAllocations - before;
+	out << endl << "Intersection: " << width * height << " camera rays, " << hits << " hits, "
+		<< allocations << " heap allocations" << endl;
+}
+
+// What the kd-trees take, and tearing them down and rebuilding them reps
+// times as a reload does; the arena should be the same size every time.
+void Benchmark::kdTreeMemory(ostream& out)
+{
+	Scene* scene = raytracer->scene;
+	if (scene->kdtreeRoot == nullptr)
+	{
+		out << endl << "kd-trees: not built" << endl;
+		return;
+	}
+	const MemoryArena& arena = scene->kdTreeArena();
+	out << endl << "kd-trees: " << arena.bytesUsed() / 1024 << " KB used, "
+		<< arena.bytesReserved() / 1024 << " KB in " << arena.blockCount() << " blocks, "
+		<< scene->kdReplicaBytes() / 1024 << " KB of NUMA replicas" << endl;
+
+	size_t reserved = arena.bytesReserved();
+	size_t largest = reserved;
+	vector<double> teardown, build;
+	for (int n = 0; n < reps; n++)
+	{
+		chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+		scene->clearKdTree();
+		chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+		scene->buildKdTree(scene->kdTreeDepth, scene->kdTreeLeafSize);
+		chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+		teardown.push_back(chrono::duration<double, milli>(t1 - t0).count());
+		build.push_back(chrono::duration<double, milli>(t2 - t1).count());
+		largest = max(largest, arena.bytesReserved());
+	}
+	sort(teardown.begin(), teardown.end());
+	sort(build.begin(), build.end());
+	out << "rebuild x" << reps << ": teardown " << setprecision(3) << teardown[reps / 2]
+		<< " ms, build " << build[reps / 2] << " ms (median), arena "
+		<< (largest == reserved ? "stable" : "grew") << " at " << largest / 1024 << " KB" << endl;
+}
+
+// Texture lookups per second, on their own: a synthetic 1024x1024 texture
+// sampled along scanlines (as neighbouring rays do) and at random, on one
+// thread and on all of them.
+void Benchmark::textureLookups(ostream& out)
+{
+	const int size = 1024;
+	const int lookups = 1 << 22;
+	vector<unsigned char> rgb(size * size * 3);
+	for (int n = 0; n < size * size; n++)
+	{
+		rgb[n * 3] = (unsigned char)(n * 7);
+		rgb[n * 3 + 1] = (unsigned char)(n / size);
+		rgb[n * 3 + 2] = (unsigned char)(n * 13 + n / size);
+	}
+	TextureMap texture("benchmark", size, size, &rgb[0]);
+
+	enum { NEAREST, BILINEAR, TRILINEAR };
+	struct Pass
+	{
+		static double run(const TextureMap* t, int filter, bool coherent, int seed)
+		{
+			double sum = 0;
+			unsigned state = 12345 + seed;
+			for (int n = 0; n < lookups; n++)
+			{
+				double u, v;
+				if (coherent)
+				{
+					u = (n % size + 0.3) / size;
+					v = ((n / size + seed * 37) % size + 0.7) / size;
+				}
+				else
+				{
+					state = state * 1664525u + 1013904223u;
+					u = (state >> 8) / 16777216.0;
+					state = state * 1664525u + 1013904223u;
+					v = (state >> 8) / 16777216.0;
+				}
+				Vec3d c;
+				if (filter == NEAREST) c = t->getPixelAt((int)(u * size), (int)(v * size));
+				else if (filter == BILINEAR) c = t->sample(u, v);
+				else c = t->sample(u, v, 1.5);
+				sum += c[0];
+			}
+			return sum;
+		}
+	};
+
+	out << endl << "Texture lookups (" << size << "x" << size << ", " << lookups << " per thread)" << endl;
+	out << left << setw(20) << "filter" << right << setw(14) << "1 thread M/s"
+		<< setw(10) << nThreads << " threads M/s" << endl;
+	const char* names[] = { "nearest", "bilinear", "trilinear" };
+	double sink = 0;
+	for (int coherent = 1; coherent >= 0; coherent--)
+		for (int filter = NEAREST; filter <= TRILINEAR; filter++)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			sink += Pass::run(&texture, filter, coherent != 0, 0);
+			double one = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			vector<double> sums(nThreads);
+			vector<thread> threads;
+			start = chrono::steady_clock::now();
+			for (int i = 0; i < nThreads; i++)
+				threads.push_back(thread([&, i]() { sums[i] = Pass::run(&texture, filter, coherent != 0, i); }));
+			for (size_t i = 0; i < threads.size(); i++)
+				threads[i].join();
+			double all = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			for (int i = 0; i < nThreads; i++)
+				sink += sums[i];
+
+			string name = string(names[filter]) + (coherent ? " scanline" : " random");
+			out << left << setw(20) << name << right << fixed << setprecision(2)
+				<< setw(14) << lookups / one / 1.0e6
+				<< setw(22) << double(lookups) * nThreads / all / 1.0e6 << endl;
+		}
+	// Keeps the lookups from being optimized away.
+	if (sink == 0) out << "(all texels black)" << endl;
+}
+
+void Benchmark::run(ostream& out)
+{
+	const NumaTopology& topology = NumaTopology::get();
+	out << width << "x" << height << ", " << nThreads << " threads, "
+		<< reps << " frames per configuration" << endl;
+	out << topology.nodeCount() << " NUMA node(s):";
+	for (int n = 0; n < topology.nodeCount(); n++)
+		out << " " << topology.cpus(n).size();
+	out << " CPUs" << endl;
+
+	bool wasNuma = traceUI->numaPlacement();
+	bool wasWavefront = traceUI->wavefront();
+	bool wasSorted = traceUI->sortRays();
+
+	header(out, "Thread placement");
+	traceUI->setNumaPlacement(false);
+	Timing floating = measure();
+	report(out, "floating", floating);
+
+	traceUI->setNumaPlacement(true);
+	Timing pinned = measure();
+	report(out, "numa", pinned);
+	out << "numa speedup: " << setprecision(3) << floating.median / pinned.median << "x" << endl;
+	traceUI->setNumaPlacement(wasNuma);
+
+	header(out, "Ray ordering");
+	traceUI->setWavefront(false);
+	traceUI->setSortRays(false);
+	report(out, "recursive", measure());
+
+	traceUI->setWavefront(true);
+	Timing unsorted = measure();
+	report(out, "wavefront", unsorted);
+
+	traceUI->setSortRays(true);
+	Timing sorted = measure();
+	report(out, "sorted", sorted);
+	out << "sorting speedup: " << setprecision(3) << unsorted.median / sorted.median << "x" << endl;
+
+	traceUI->setWavefront(wasWavefront);
+	traceUI->setSortRays(wasSorted);
+
+	checkAllocations(out);
+	kdTreeMemory(out);
+	textureLookups(out);
+}
@@ -0,0 +1,60 @@
+//
+// Benchmark.h
+//
+// Renders the loaded scene repeatedly under different configurations and
+// reports how long each took, so that changes to the renderer's threading
+// and memory layout can be measured on the machine that matters.
+//
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include <iosfwd>
+#include <atomic>
+
+class RayTracer;
+class TraceUI;
+
+class Benchmark
+{
+public:
+	Benchmark(RayTracer* tracer, TraceUI* ui, int width, int height, int nThreads, int reps);
+
+	// Runs every configuration and prints one line per configuration.
+	// The buffer is left holding the last frame rendered.
+	void run(std::ostream& out);
+
+	// The operator new calls made by this thread; the benchmark replaces
+	// the global allocator to count them.  Per thread, so counting costs
+	// the renderer nothing outside -B but a private increment.
+	static thread_local unsigned long long heapAllocations;
+
+private:
+	struct Timing
+	{
+		double best, median;
+		double rays;			// per frame
+		double cacheMisses;		// per frame, -1 if not measurable
+		double l1Misses;		// per frame, -1 if not measurable
+		double allocations;		// heap allocations per frame
+	};
+
+	Timing measure();
+	void checkAllocations(std::ostream& out);
+	void kdTreeMemory(std::ostream& out);
+	void textureLookups(std::ostream& out);
+	double renderOnce();
+	void header(std::ostream& out, const char* title);
+	void report(std::ostream& out, const char* name, const Timing& t);
+	static void renderThread(Benchmark* bench, int index);
+
+	RayTracer* raytracer;
+	TraceUI* traceUI;
+	int width, height;
+	int nThreads;
+	int reps;
+	std::atomic<unsigned long long> raysCast;
+	std::atomic<unsigned long long> threadAllocations;	// render threads'
+};
+
+#endif // __BENCHMARK_H__
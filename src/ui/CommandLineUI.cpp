@@ -2,14 +2,26 @@
 #include <iostream>
 #include <time.h>
 #include <thread>
+#include <chrono>
 #include <stdarg.h>
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 
 #include "CommandLineUI.h"
-#include "../fileio/bitmap.h"
+#include "../distributed/Coordinator.h"
+#include "../distributed/Worker.h"
+#include "Benchmark.h"
+#include "BatchRenderer.h"
+#include "AnimationRenderer.h"
+#include "StreamRenderer.h"
+#include "../threading/CancelToken.h"
 
 #include "../RayTracer.h"
+#include "../SceneObjects/trimesh.h"
 
 using namespace std;
 
@@ -21,8 +33,18 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	int i;
 
 	progName=argv[0];
+	workerAddr=0;
+	manifestName=0;
+	keyframeName=0;
+	m_nFrames=24;
+	m_nLocalWorkers=0;
+	m_nListenPort=-1;
+	m_nBenchmarkReps=0;
+	m_nDeadlineMs=0;
+	m_nStreamMemory=0;
+	m_compile=false;
 
-	while( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	while( (i = getopt( argc, argv, "tr:w:d:m:k:f:h:a:n:p:W:j:NB:bsq:M:cg:DS:" )) != EOF )
 	{
 		switch( i )
 		{
@@ -33,6 +55,100 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+
+			case 'd':
+				m_nDeadlineMs = max( 1, atoi( optarg ) );
+				break;
+
+			case 'm':
+				manifestName = optarg;
+				break;
+
+			case 'k':
+				keyframeName = optarg;
+				break;
+
+			case 'f':
+				m_nFrames = max( 1, atoi( optarg ) );
+				break;
+
+			case 'a':
+				m_antiAlias = true;
+				m_nPixelSamples = atoi( optarg );
+				break;
+
+			case 'n':
+				m_nLocalWorkers = atoi( optarg );
+				break;
+
+			case 'p':
+				m_nListenPort = atoi( optarg );
+				break;
+
+			case 'W':
+				workerAddr = optarg;
+				break;
+
+			case 'j':
+				m_nThreads = max( 1, atoi( optarg ) );
+				break;
+
+			case 'N':
+				m_numaPlacement = true;
+				break;
+
+			case 'B':
+				m_nBenchmarkReps = max( 1, atoi( optarg ) );
+				break;
+
+			case 'b':
+				m_wavefront = true;
+				break;
+
+			case 's':
+				m_wavefront = true;
+				m_sortRays = true;
+				break;
+
+			case 'q':
+				if( !strcmp( optarg, "float" ) )
+					m_nMeshPrecision = Trimesh::FLOAT;
+				else if( !strcmp( optarg, "quant" ) )
+					m_nMeshPrecision = Trimesh::QUANTIZED;
+				else
+				{
+					std::cerr << "Unknown mesh precision: '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'M':
+				m_nTextureBudget = max( 1, atoi( optarg ) );
+				break;
+
+			case 'c':
+				m_compile = true;
+				break;
+
+			case 'g':
+				m_gamma = atof( optarg );
+				if( m_gamma <= 0.0 )
+				{
+					std::cerr << "Gamma must be positive." << std::endl;
+					usage();
+					exit(1);
+				}
+				break;
+
+			case 'D':
+				m_dither = true;
+				break;
+
+			case 'S':
+				m_nStreamMemory = max( 1, atoi( optarg ) );
+				break;
+
 			default:
 			// Oops; unknown argument
 			std::cerr << "Invalid argument: '" << i << "'." << std::endl;
@@ -41,6 +157,19 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 		}
 	}
 
+	// Streaming renders one plain image; the other modes need all of it.
+	if( m_nStreamMemory > 0 && ( manifestName || keyframeName || workerAddr || m_compile
+		|| m_nDeadlineMs > 0 || m_nBenchmarkReps > 0 || m_nLocalWorkers > 0 || m_nListenPort >= 0 ) )
+	{
+		std::cerr << "-S can't be combined with -m, -k, -W, -c, -d, -B, -n or -p." << std::endl;
+		usage();
+		exit(1);
+	}
+
+	// Workers get the scene and output size from the coordinator, and
+	// batch jobs from the manifest.
+	if( workerAddr || manifestName ) return;
+
 	if( optind >= argc-1 )
 	{
 		std::cerr << "no input and/or output name." << std::endl;
@@ -51,23 +180,161 @@ CommandLineUI::CommandLineUI( int argc, char* const* argv )
 	imgName = argv[optind+1];
 }
 
-void CommandLineUI::renderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer)
+void CommandLineUI::renderThread(RayTracer* rayTracer, int index, int nThreads)
+{
+	rayTracer->bindRenderThread(index, nThreads);
+	while (rayTracer->traceNextTile())
+		;
+}
+
+void CommandLineUI::budgetedThread(RayTracer* rayTracer, int index, int nThreads)
+{
+	rayTracer->bindRenderThread(index, nThreads);
+	while (rayTracer->traceNextBudgetedTile())
+		;
+}
+
+// Renders until the image is finished or the deadline passes, whichever
+// comes first; whatever pass was in progress is simply left partly done.
+void CommandLineUI::renderBudgeted( std::chrono::steady_clock::time_point start )
 {
-	int start = threadNo*noOfCols;
-	int end = start + noOfCols;
-	int count = 0;
-	for (int y = 0; y < height; y++)
+	CancelToken token;
+	token.setDeadline( start + std::chrono::milliseconds( m_nDeadlineMs ) );
+	raytracer->beginBudgetedRender( &token );
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < m_nThreads; i++)
+		threads.push_back(std::thread(budgetedThread, raytracer, i, m_nThreads));
+	budgetedThread(raytracer, 0, m_nThreads);
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	static const char* passNames[] = { "none", "preview", "one sample per pixel", "refinement" };
+	int done = raytracer->budgetPassesDone();
+	std::cout << "deadline " << m_nDeadlineMs << " ms: completed " << passNames[done]
+		<< ( token.cancelled() ? "" : " (finished early)" ) << ", "
+		<< raytracer->budgetTilesRefined() << " tiles refined" << std::endl;
+}
+
+RenderSettings CommandLineUI::currentSettings( int width, int height ) const
+{
+	RenderSettings s;
+	char* full = realpath( rayName, 0 );
+	s.scenePath = full ? full : rayName;
+	free( full );
+	s.width = width;
+	s.height = height;
+	s.depth = m_nDepth;
+	s.antiAlias = m_antiAlias;
+	s.pixelSamples = m_nPixelSamples;
+	s.supersampleThreshold = m_nSupersampleThreshold;
+	s.kdTree = m_kdTree;
+	s.kdMaxDepth = m_nMaxDepth;
+	s.kdLeafSize = m_nLeafSize;
+	s.wavefront = m_wavefront;
+	s.sortRays = m_sortRays;
+	s.meshPrecision = m_nMeshPrecision;
+	s.textureBudget = m_nTextureBudget;
+	return s;
+}
+
+void CommandLineUI::applySettings( const RenderSettings& s )
+{
+	m_nSize = s.width;
+	m_nDepth = s.depth;
+	m_antiAlias = s.antiAlias;
+	m_nPixelSamples = s.pixelSamples;
+	m_nSupersampleThreshold = s.supersampleThreshold;
+	m_kdTree = s.kdTree;
+	m_nMaxDepth = s.kdMaxDepth;
+	m_nLeafSize = s.kdLeafSize;
+	m_wavefront = s.wavefront;
+	m_sortRays = s.sortRays;
+	m_nMeshPrecision = s.meshPrecision;
+	m_nTextureBudget = s.textureBudget;
+}
+
+int CommandLineUI::runWorker()
+{
+	string addr( workerAddr );
+	size_t colon = addr.rfind( ':' );
+	if( colon == string::npos )
 	{
-		for (int x = start; x < end; x++)
-		{
-			rayTracer->tracePixel(x, y);
-		}
+		std::cerr << "worker address must be host:port" << std::endl;
+		return 1;
+	}
+	string host = addr.substr( 0, colon );
+	int port = atoi( addr.c_str() + colon + 1 );
+
+	RenderWorker worker( raytracer, m_nThreads );
+	RenderSettings settings;
+	if( !worker.connect( host.c_str(), port, settings ) )
+	{
+		std::cerr << "unable to reach coordinator at " << addr << std::endl;
+		return 1;
+	}
+
+	applySettings( settings );
+	vector<char> path( settings.scenePath.begin(), settings.scenePath.end() );
+	path.push_back( 0 );
+	if( !raytracer->loadScene( &path[0] ) )
+	{
+		worker.fail( "unable to load " + settings.scenePath );
+		return 1;
+	}
+	raytracer->traceSetup( settings.width, settings.height );
+
+	return worker.serve() ? 0 : 1;
+}
+
+bool CommandLineUI::renderDistributed( int width, int height )
+{
+	Coordinator coordinator( raytracer, currentSettings( width, height ) );
+
+	// Without -p only local workers are expected, so stay off the network.
+	bool remote = m_nListenPort >= 0;
+	if( !coordinator.listen( remote ? "" : "127.0.0.1", remote ? m_nListenPort : 0 ) )
+	{
+		std::cerr << "unable to listen for workers" << std::endl;
+		return false;
+	}
+	if( remote )
+		std::cout << "waiting for workers on port " << coordinator.port() << std::endl;
+
+	if( m_nLocalWorkers > 0 )
+	{
+		// Split this machine's cores between the local workers.
+		int threads = max( 1, (int)std::thread::hardware_concurrency() / m_nLocalWorkers );
+		char exe[4096];
+		ssize_t n = readlink( "/proc/self/exe", exe, sizeof(exe) - 1 );
+		if( n > 0 ) exe[n] = 0;
+		else strncpy( exe, progName, sizeof(exe) );
+		if( !coordinator.spawnLocalWorkers( exe, m_nLocalWorkers, threads ) )
+			std::cerr << "unable to start local workers" << std::endl;
 	}
+
+	if( !coordinator.run( m_nThreads ) ) return false;
+
+	if( coordinator.tilesReissued() || coordinator.workersLost() )
+		std::cout << coordinator.workersLost() << " workers lost, "
+			<< coordinator.tilesReissued() << " tiles re-issued" << std::endl;
+	return true;
+}
+
+int CommandLineUI::runBatch()
+{
+	BatchRenderer batch( raytracer, this, m_nThreads );
+	if( !batch.readManifest( manifestName, std::cerr ) ) return 1;
+	return batch.run( std::cout ) ? 1 : 0;
 }
 
 int CommandLineUI::run()
 {
 	assert( raytracer != 0 );
+	if( workerAddr ) return runWorker();
+	if( manifestName ) return runBatch();
+	if( m_compile ) return raytracer->compileScene( rayName, imgName ) ? 0 : 1;
+
 	raytracer->loadScene( rayName );
 
 	if( raytracer->sceneLoaded() )
@@ -75,44 +342,69 @@ int CommandLineUI::run()
 		int width = m_nSize;
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
+		if( m_nStreamMemory > 0 )
+		{
+			// Sets up its own window of rows instead of the whole buffer.
+			StreamRenderer stream( raytracer, m_nThreads );
+			if( stream.render( width, m_nStreamMemory, imgName, std::cout ) ) return 0;
+			std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
+			return 1;
+		}
+
 		raytracer->traceSetup( width, height );
 
-		clock_t start, end;
-		start = clock();
+		// Wall time; clock() would only see this process's own CPU time,
+		// which undercounts threads and misses worker processes entirely.
+		std::chrono::steady_clock::time_point start, end;
+		start = std::chrono::steady_clock::now();
 
-		std::vector<std::thread> threads;
-		int noOfCols = ceil((double)width/(double)this->m_nThreads);
-		// cout<<"No Of Cols : "<<noOfCols<<endl;
-		for (int i = 1; i < this->m_nThreads; i++)
+		if( keyframeName )
 		{
-			threads.push_back(std::thread(renderThread, i, width, height, noOfCols, raytracer));
+			// Frames in flight each run their own traceSetup, which would
+			// rebuild the scene's NUMA kd-tree replicas under the others.
+			m_numaPlacement = false;
+			AnimationRenderer anim( raytracer, m_nThreads );
+			if( !anim.readKeyframes( keyframeName, std::cerr ) ) return 1;
+			return anim.render( m_nFrames, width, imgName, std::cout ) ? 0 : 1;
 		}
-		for( int y = 0; y < height; ++y )
+		else if( m_nBenchmarkReps > 0 )
 		{
-			for( int x = 0; x < noOfCols; ++x )
-			{
-				raytracer->tracePixel(x,y);
-			}
+			Benchmark bench( raytracer, this, width, height, m_nThreads, m_nBenchmarkReps );
+			bench.run( std::cout );
 		}
-		for (int i = 0; i < this->m_nThreads - 1; i++)
+		else if( m_nDeadlineMs > 0 )
 		{
-			threads[i].join();
+			renderBudgeted( start );
 		}
-		end=clock();
-
-		// save image
-		unsigned char* buf;
-
-		raytracer->getBuffer(buf, width, height);
+		else if( m_nLocalWorkers > 0 || m_nListenPort >= 0 )
+		{
+			if( !renderDistributed( width, height ) ) return 1;
+		}
+		else
+		{
+			std::vector<std::thread> threads;
+			for (int i = 1; i < this->m_nThreads; i++)
+			{
+				threads.push_back(std::thread(renderThread, raytracer, i, m_nThreads));
+			}
+			renderThread(raytracer, 0, m_nThreads);
+			for (int i = 0; i < this->m_nThreads - 1; i++)
+			{
+				threads[i].join();
+			}
+		}
+		end = std::chrono::steady_clock::now();
 
-		if (buf)
-			writeBMP(imgName, width, height, buf);
+		// save image, in the format its extension names
+		bool written = raytracer->writeImage(imgName, m_nThreads);
+		if (!written)
+			std::cerr << "Unable to write image '" << imgName << "'" << std::endl;
 
-		double t=(double)(end-start)/CLOCKS_PER_SEC;
+		double t = std::chrono::duration<double>(end - start).count();
 //		int totalRays = TraceUI::resetCount();
 //		std::cout << "total time = " << t << " seconds, rays traced = " << totalRays << std::endl;
 		std::cout << "total time = " << t << std::endl;
-		return 0;
+		return written ? 0 : 1;
 	}
 	else
 	{
@@ -129,6 +421,31 @@ void CommandLineUI::alert( const string& msg )
 void CommandLineUI::usage()
 {
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
+	std::cerr << "  the output is PNG or PFM (float) if named .png or .pfm, else BMP" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
+	std::cerr << "  -d <ms>     render for at most ms milliseconds, refining adaptively" << std::endl;
+	std::cerr << "  -m <file>   render every job in a batch manifest (no input/output names)" << std::endl;
+	std::cerr << "  -k <file>   render a camera animation from keyframes; output name is a" << std::endl;
+	std::cerr << "              printf pattern such as out%03d.bmp" << std::endl;
+	std::cerr << "  -f <#>      number of animation frames (default " << m_nFrames << ")" << std::endl;
+	std::cerr << "  -a <#>      adaptive anti-aliasing with up to #x# samples per pixel" << std::endl;
+	std::cerr << "  -j <#>      number of render threads (default " << m_nThreads << ")" << std::endl;
+	std::cerr << "  -b          breadth-first (wavefront) renderer, ignored with -a" << std::endl;
+	std::cerr << "  -s          wavefront renderer with sorted secondary/shadow rays" << std::endl;
+	std::cerr << "              (pays off on large scenes, costs time on small ones)" << std::endl;
+	std::cerr << "  -q <mode>   store mesh vertices as float or quant (16-bit) with" << std::endl;
+	std::cerr << "              octahedral normals" << std::endl;
+	std::cerr << "  -M <MB>     memory for texture tiles (default " << m_nTextureBudget << ")" << std::endl;
+	std::cerr << "  -g <gamma>  gamma encode the 8-bit output, e.g. 2.2 (default 1)" << std::endl;
+	std::cerr << "  -D          dither the 8-bit output instead of rounding" << std::endl;
+	std::cerr << "  -S <MB>     write the image as it renders, keeping only about MB of" << std::endl;
+	std::cerr << "              it in memory, for images too big to hold whole" << std::endl;
+	std::cerr << "  -c          compile input.ray into a binary scene at output instead" << std::endl;
+	std::cerr << "              of rendering; either kind of scene can be rendered" << std::endl;
+	std::cerr << "  -N          pin threads and keep their memory on their NUMA node" << std::endl;
+	std::cerr << "  -B <#>      benchmark: time # frames per configuration" << std::endl;
+	std::cerr << "  -n <#>      render with # local worker processes" << std::endl;
+	std::cerr << "  -p <port>   also accept workers from other machines on port" << std::endl;
+	std::cerr << "  -W <host:port>  run as a worker for the coordinator at host:port" << std::endl;
 }
@@ -7,7 +7,10 @@
 #ifndef __CommandLineUI_h__
 #define __CommandLineUI_h__
 
+#include <chrono>
+
 #include "TraceUI.h"
+#include "../distributed/Message.h"
 
 // ***********************************************************
 // from getopt.cpp
@@ -30,7 +33,28 @@ public:
 
 private:
 	void		usage();
-	static void renderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer);
+	static void renderThread(RayTracer* rayTracer, int index, int nThreads);
+	static void budgetedThread(RayTracer* rayTracer, int index, int nThreads);
+	void		renderBudgeted( std::chrono::steady_clock::time_point start );
+
+	// Distributed rendering: -n/-p make this process a coordinator,
+	// -W makes it a worker.
+	RenderSettings currentSettings( int width, int height ) const;
+	void		applySettings( const RenderSettings& s );
+	bool		renderDistributed( int width, int height );
+	int			runWorker();
+	int			runBatch();
+
+	char*	workerAddr;
+	char*	manifestName;
+	char*	keyframeName;
+	int		m_nFrames;
+	int		m_nLocalWorkers;
+	int		m_nListenPort;
+	int		m_nBenchmarkReps;
+	int		m_nDeadlineMs;
+	int		m_nStreamMemory;	// -S: MB of rows to keep, or 0 for the whole image
+	bool	m_compile;		// -c: write input.ray as a binary scene
 
 	char*	rayName;
 	char*	imgName;
@@ -92,6 +92,8 @@ void CubeMapChooser::cb_cancel(Fl_Widget* o, void* v) {
 
 void CubeMapChooser::cb_ok(Fl_Widget* o, void* v) {
 	CubeMapChooser* ch = (CubeMapChooser*)(o->parent()->user_data());
+	for (int i = 0; i < 6; i++)
+		if (ch->pendingFace[i].valid()) ch->collectFace(i);
 	int allGreen = 0;
 	//while (ch->fb[allGreen]->selection_color() == FL_GREEN) allGreen++;
 	for (int i = 0; i < 6; i++)
@@ -171,49 +173,55 @@ void CubeMapChooser::cb_znb(Fl_Widget* o, void* v) {
 	cb_ffb (o, 5);
 }
 
-void CubeMapChooser::cb_ffi(Fl_Widget* o, int i) {
-	CubeMapChooser* ch = (CubeMapChooser*)(o->parent()->user_data());
-	try { ch->cubeFace[i] = new TextureMap(ch->fi[i]->value()); }
+// Yellow until the face has been decoded.
+void CubeMapChooser::startFace(int i, const std::string& file) {
+	if (pendingFace[i].valid()) {
+		// Picked again before OK; the earlier file isn't wanted.
+		try { delete pendingFace[i].get(); }
+		catch (TextureMapException &) {}
+	}
+	pendingFace[i] = std::async(std::launch::async, [file]() { return new TextureMap(file); });
+	fb[i]->selection_color(FL_YELLOW);
+	fb[i]->value(0);
+	fb[i]->value(1);
+}
+
+bool CubeMapChooser::collectFace(int i) {
+	try { cubeFace[i] = pendingFace[i].get(); }
 	catch (TextureMapException &xcpt) {
-		ch->fb[i]->selection_color(FL_RED);
-		ch->fb[i]->value(0);
-		ch->fb[i]->value(1);
+		fb[i]->selection_color(FL_RED);
+		fb[i]->value(0);
+		fb[i]->value(1);
 		std::cerr << xcpt.message() << std::endl;
 		std::string msg("Error: could not open file: ");
-		msg.append(ch->fi[i]->value());
-		ch->caller->alert(msg);
-		return;
+		msg.append(fn[i]);
+		caller->alert(msg);
+		return false;
 	}
-	
+	fb[i]->selection_color(FL_GREEN);
+	fb[i]->value(0);
+	fb[i]->value(1);
+	return true;
+}
+
+void CubeMapChooser::cb_ffi(Fl_Widget* o, int i) {
+	CubeMapChooser* ch = (CubeMapChooser*)(o->parent()->user_data());
 	std::string fN = std::string(ch->fi[i]->value());
 	std::string pN = fN.substr(0,fN.find_last_of("/"));
 	for (int j = 0; j < 6; j++) {
-		if (ch->fb[j]->selection_color() != FL_GREEN) {
+		if (j != i && ch->fb[j]->selection_color() != FL_GREEN && !ch->pendingFace[j].valid()) {
 			ch->fi[j]->value(pN.c_str());
 			ch->fn[j] = pN;
 		}
 	}
 	ch->fi[i]->value(fN.c_str());
 	ch->fn[i] = fN;
-	ch->fb[i]->selection_color(FL_GREEN);
-	ch->fb[i]->value(0);
-	ch->fb[i]->value(1);
+	ch->startFace(i, fN);
 }
 
 void CubeMapChooser::cb_ffb(Fl_Widget* o, int i) {
 	CubeMapChooser* ch = (CubeMapChooser*)(o->parent()->user_data());
 	if (char* curPath = fl_file_chooser(ch->btnMsg[i].c_str(),  ".bmp or .png (*.{bmp,png})", ch->fn[i].c_str(), 0)) {
-		try { ch->cubeFace[i] = new TextureMap(curPath); }
-		catch (TextureMapException &xcpt) {
-			ch->fb[i]->selection_color(FL_RED);
-			ch->fb[i]->value(0);
-			ch->fb[i]->value(1);
-			std::cerr << xcpt.message() << std::endl;
-			std::string msg("Error: could not open file: ");
-			msg.append(ch->fi[i]->value());
-			ch->caller->alert(msg);
-			return;
-		}
 		std::string fN = std::string(curPath);
 		std::string pN = fN.substr(0, fN.find_last_of("/"));
 		for (int j = 0; j < 6; j++) {
@@ -223,8 +231,9 @@ void CubeMapChooser::cb_ffb(Fl_Widget* o, int i) {
 			}
 		}
 		ch->fn[i] = fN;
-		ch->fi[i]->value(curPath);
-		ch->fb[i]->selection_color(FL_GREEN);
+		ch->fi[i]->value(fN.c_str());
+		ch->startFace(i, fN);
+		return;
 	}
 	ch->fb[i]->value(0);
 	ch->fb[i]->value(1);
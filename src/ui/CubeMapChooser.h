@@ -10,6 +10,7 @@
 #include <FL/Fl_Button.H>
 #include <FL/Fl_File_Chooser.H>
 #include <string>
+#include <future>
 
 class TextureMap;
 class GraphicalUI;
@@ -23,6 +24,9 @@ class CubeMapChooser {
 	Fl_File_Input* fi[6];
 	Fl_Light_Button* fb[6];
 	TextureMap* cubeFace[6];
+	// Faces are decoded in the background from when they are picked, so
+	// the six load side by side; OK collects them.
+	std::future<TextureMap*> pendingFace[6];
 	std::string fn[6];
 	std::string btnMsg[6];
 
@@ -32,6 +36,8 @@ class CubeMapChooser {
 	static void cb_cancel(Fl_Widget* o, void* v);
 	static void cb_ffi (Fl_Widget* o, int i);
 	static void cb_ffb (Fl_Widget* o, int i);
+	void startFace(int i, const std::string& file);
+	bool collectFace(int i);
 	static void cb_xpi (Fl_Widget* o, void* v);
 	static void cb_xni (Fl_Widget* o, void* v);
 	static void cb_ypi (Fl_Widget* o, void* v);
@@ -16,6 +16,7 @@
 
 #include "GraphicalUI.h"
 #include "../RayTracer.h"
+#include "../scene/scene.h"
 #include <thread>
 
 #define MAX_INTERVAL 500
@@ -43,25 +44,175 @@ void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v)
 {
 	pUI = whoami(o);
 
-	static char* lastFile = 0;
-	char* newfile = fl_file_chooser("Open Scene?", "*.ray", NULL );
+	if (pUI->m_loading) {
+		pUI->alert("Still loading " + pUI->m_loadFile + ".");
+		return;
+	}
 
-	if (newfile != NULL) {
-		char buf[256];
+	char* newfile = fl_file_chooser("Open Scene?", "*.{ray,sbt}", NULL );
+	if (newfile != NULL)
+		pUI->startLoad(newfile);
+}
 
-		if (pUI->raytracer->loadScene(newfile)) {
-			print(buf, "Ray <%s>", newfile);
-			stopTracing();	// terminate the previous rendering
-		} else print(buf, "Ray <Not Loaded>");
+// The new scene is parsed into a Scene of its own; nothing the current
+// scene's renders or debugging view use is touched until pollLoad().
+void GraphicalUI::startLoad(const char* file)
+{
+	m_loadFile = file;
+	m_sceneLabel = m_mainWindow->label() ? m_mainWindow->label() : "";
+	m_loadProgress.reset(new LoadProgress);
+	m_loadStart = std::chrono::steady_clock::now();
+	m_loadedScene = 0;
+	m_loadDone = false;
+	m_loading = true;
+	m_loadKdDepth = m_nMaxDepth;
+	m_loadKdLeafSize = m_nLeafSize;
+	m_loadKdTree = m_kdTree;
 
-		pUI->m_mainWindow->label(buf);
-		pUI->m_debuggingWindow->m_debuggingView->setDirty();
+	RayTracer* tracer = raytracer;
+	LoadProgress* progress = m_loadProgress.get();
+	std::string fn = m_loadFile;
+	m_loadThread = std::thread([this, tracer, progress, fn] {
+		m_loadedScene = tracer->parseScene(fn.c_str(), 0, progress);
+		m_loadDone = true;
+	});
 
-		if( lastFile != 0 && strcmp(newfile, lastFile) != 0 )
-			pUI->m_debuggingWindow->m_debuggingView->resetCamera();
+	pollLoad();
+}
+
+void GraphicalUI::cb_pollLoad(void* v)
+{
+	((GraphicalUI*)v)->pollLoad();
+}
 
-		pUI->m_debuggingWindow->redraw();
+void GraphicalUI::pollLoad()
+{
+	char buf[512];
+
+	showQueuedAlerts();
+	if (!m_loadDone) {
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_loadStart;
+		print(buf, "Ray <Loading %s: %s, %d of %d textures and meshes done, %.1f s>",
+			m_loadFile.c_str(), m_loadProgress->reading ? "reading" : "building",
+			(int)m_loadProgress->tasksDone, (int)m_loadProgress->tasks, elapsed.count());
+		m_mainWindow->copy_label(buf);
+		Fl::add_timeout(0.1, cb_pollLoad, this);
+		return;
+	}
+
+	// A render still tracing the old scene is stopped, and the swap waits
+	// until cb_render() has joined its threads, and for any kd-tree build
+	// reading the old scene.
+	if (!doneTrace || m_kdBuilding) {
+		stopTracing();
+		Fl::add_timeout(0.05, cb_pollLoad, this);
+		return;
 	}
+
+	m_loadThread.join();
+	showQueuedAlerts();
+	m_loading = false;
+	m_loadProgress.reset();
+
+	// A scene that failed to load leaves the old one in place.
+	if (!m_loadedScene) {
+		m_mainWindow->copy_label(m_sceneLabel.c_str());
+		return;
+	}
+	raytracer->adoptScene(m_loadedScene);
+	m_loadedScene = 0;
+
+	print(buf, "Ray <%s>", m_loadFile.c_str());
+	m_mainWindow->copy_label(buf);
+	m_debuggingWindow->m_debuggingView->setDirty();
+
+	if (!m_sceneFile.empty() && m_sceneFile != m_loadFile)
+		m_debuggingWindow->m_debuggingView->resetCamera();
+	m_sceneFile = m_loadFile;
+
+	m_debuggingWindow->redraw();
+
+	// The scene's trees were built with the settings the load started with.
+	m_kdStatusBox->copy_label("");
+	if (m_nMaxDepth != m_loadKdDepth || m_nLeafSize != m_loadKdLeafSize || m_kdTree != m_loadKdTree)
+		scheduleKdRebuild();
+}
+
+bool GraphicalUI::kdTreesStale()
+{
+	if (!m_kdTree || !raytracer->sceneLoaded()) return false;
+	const Scene& scene = raytracer->getScene();
+	return scene.kdtreeRoot == nullptr || scene.kdTreeDepth != std::min(m_nMaxDepth, KD_MAX_DEPTH)
+		|| scene.kdTreeLeafSize != m_nLeafSize;
+}
+
+// Sliders call back on every step of a drag, so the build waits until
+// they have been still for a moment.
+void GraphicalUI::scheduleKdRebuild()
+{
+	Fl::remove_timeout(cb_startKdRebuild, this);
+	Fl::add_timeout(0.3, cb_startKdRebuild, this);
+}
+
+void GraphicalUI::cb_startKdRebuild(void* v)
+{
+	GraphicalUI* ui = (GraphicalUI*)v;
+	char buf[256];
+
+	// A build already going is checked again when it is done, and a scene
+	// still loading once it is in.
+	if (ui->m_kdBuilding || ui->m_loading || !ui->kdTreesStale()) return;
+
+	const Scene* scene = &ui->raytracer->getScene();
+	int depth = ui->m_nMaxDepth;
+	int leafSize = ui->m_nLeafSize;
+	int nThreads = ui->m_nThreads;
+	ui->m_kdBuilt = 0;
+	ui->m_kdBuildDone = false;
+	ui->m_kdBuilding = true;
+	ui->m_kdThread = std::thread([ui, scene, depth, leafSize, nThreads] {
+		ui->m_kdBuilt = scene->buildKdTrees(depth, leafSize, nThreads);
+		ui->m_kdBuildDone = true;
+	});
+
+	print(buf, "K-d tree %d/%d: building", depth, leafSize);
+	ui->m_kdStatusBox->copy_label(buf);
+	Fl::add_timeout(0.1, cb_pollKdRebuild, ui);
+}
+
+void GraphicalUI::cb_pollKdRebuild(void* v)
+{
+	((GraphicalUI*)v)->pollKdRebuild();
+}
+
+void GraphicalUI::pollKdRebuild()
+{
+	char buf[256];
+
+	if (!m_kdBuildDone) {
+		Fl::add_timeout(0.1, cb_pollKdRebuild, this);
+		return;
+	}
+	// Renders walk the old trees to the end; the new ones go in after.
+	if (!doneTrace) {
+		print(buf, "K-d tree %d/%d: built, waiting for the render", m_kdBuilt->depth, m_kdBuilt->leafSize);
+		m_kdStatusBox->copy_label(buf);
+		Fl::add_timeout(0.1, cb_pollKdRebuild, this);
+		return;
+	}
+
+	m_kdThread.join();
+	m_kdBuilding = false;
+	print(buf, "K-d tree %d/%d: %.2f s, SAH cost %.1f", m_kdBuilt->depth, m_kdBuilt->leafSize,
+		m_kdBuilt->buildSeconds, m_kdBuilt->sahCost);
+	m_kdStatusBox->copy_label(buf);
+	raytracer->installKdTrees(*m_kdBuilt);
+	delete m_kdBuilt;
+	m_kdBuilt = 0;
+
+	// The sliders may have moved on while this build ran.
+	if (kdTreesStale())
+		scheduleKdRebuild();
 }
 
 void GraphicalUI::cb_load_cubemap(Fl_Menu_* o, void* v) 
@@ -77,7 +228,7 @@ void GraphicalUI::cb_save_image(Fl_Menu_* o, void* v)
 {
 	pUI = whoami(o);
 
-	char* savefile = fl_file_chooser("Save Image?", "*.bmp", "save.bmp" );
+	char* savefile = fl_file_chooser("Save Image?", "*.{bmp,png,pfm}", "save.bmp" );
 	if (savefile != NULL) {
 		pUI->m_traceGlWindow->saveImage(savefile);
 	}
@@ -191,6 +342,7 @@ void GraphicalUI::cb_kdTreeCheckButton(Fl_Widget* o, void* v)
 	pUI->getRayTracer()->setUseKdTree(pUI->m_kdTree);
 	if (pUI->m_kdTree)
 	{
+		pUI->scheduleKdRebuild();
 		pUI->m_treeDepthSlider->activate();
 		pUI->m_leafSizeSlider->activate();
 	}
@@ -204,11 +356,13 @@ void GraphicalUI::cb_kdTreeCheckButton(Fl_Widget* o, void* v)
 void GraphicalUI::cb_maxDepthSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->m_nMaxDepth=int( ((Fl_Slider *)o)->value() );
+	((GraphicalUI*)(o->user_data()))->scheduleKdRebuild();
 }
 
 void GraphicalUI::cb_leafSizeSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->m_nLeafSize=int( ((Fl_Slider *)o)->value() );
+	((GraphicalUI*)(o->user_data()))->scheduleKdRebuild();
 }
 
 void GraphicalUI::cb_cubeMapCheckButton(Fl_Widget* o, void* v)
@@ -266,29 +420,22 @@ void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 	  }
 }
 
-void GraphicalUI::renderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer)
+void GraphicalUI::renderThread(RayTracer* rayTracer, int index, int nThreads)
 {
-	int start = threadNo*noOfCols;
-	int end = start + noOfCols;
-	int count = 0;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = start; x < end; x++)
-		{
-			if (stopTrace) break;
-			rayTracer->tracePixel(x, y);
-		}
-		if (stopTrace) break;
-	}
+	rayTracer->bindRenderThread(index, nThreads);
+	while (!stopTrace && rayTracer->traceNextTile())
+		;
 }
 
 void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 	char buffer[256];
 
 	pUI = (GraphicalUI*)(o->user_data());
-	doneTrace = stopTrace = false;
 	if (pUI->raytracer->sceneLoaded())
 	  {
+		// Only a render that starts is waited for by pollLoad() and
+		// pollKdRebuild().
+		doneTrace = stopTrace = false;
 		int width = pUI->getSize();
 		int height = (int)(width / pUI->raytracer->aspectRatio() + 0.5);
 		int origPixels = width * height;
@@ -296,12 +443,13 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		pUI->m_traceGlWindow->show();
 		pUI->raytracer->traceSetup(width, height);
 
+		// Worker threads and this one pull tiles from the same queue; when
+		// anti-aliasing is on each tile supersamples its own edges, so there
+		// is no second pass.
 		std::vector<std::thread> threads;
-		int noOfCols = ceil((double)width/(double)pUI->m_nThreads);
-		// cout<<"No Of Cols : "<<noOfCols<<endl;
 		for (int i = 1; i < pUI->m_nThreads; i++)
 		{
-			threads.push_back(std::thread(renderThread, i, width, height, noOfCols, pUI->getRayTracer()));
+			threads.push_back(std::thread(renderThread, pUI->getRayTracer(), i, pUI->m_nThreads));
 		}
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -313,178 +461,34 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v) {
 		clock_t tEnd, tStart = clock();
 		now = prev = clock();
 		clock_t intervalMS = pUI->refreshInterval * 100;
-		for (int y = 0; y < height; y++)
+		while (!stopTrace && pUI->raytracer->traceNextTile())
 		  {
-		    for (int x = 0; x < noOfCols; x++)
-		      {
-			if (stopTrace) break;
 			// check for input and refresh view every so often while tracing
 			now = clock();
 			if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
 			  {
 			    prev = now;
-			    // sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-			    // pUI->m_traceGlWindow->label(buffer);
 			    pUI->m_traceGlWindow->refresh();
 			    Fl::check();
 			    if (Fl::damage()) { Fl::flush(); }
 			  }
-			// look for input and refresh window
-			pUI->raytracer->tracePixel(x, y);
 			pUI->m_debuggingWindow->m_debuggingView->setDirty();
-		      }
-		    if (stopTrace) break;
 		  }
-		doneTrace = true;
-		stopTrace = false;
-		// Restore the window label
 		for (int i = 0; i < pUI->m_nThreads - 1; i++)
 		{
 			threads[i].join();
 		}
+		doneTrace = true;
+		stopTrace = false;
+		pUI->showQueuedAlerts();
 		end = std::chrono::system_clock::now();
 		std::chrono::duration<double> elapsed_seconds = end-start;
 		sprintf(buffer, "%f MS To RENDER ", elapsed_seconds.count() * 1000);
 		pUI->m_traceGlWindow->label(buffer);
 		pUI->m_traceGlWindow->refresh();
-		if(pUI->m_antiAlias)
-		{
-			doAntiAliasing(pUI);
-		}
 	  }
 }
 
-void GraphicalUI::antiAliasRenderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer)
-{
-	int start = threadNo*noOfCols;
-	int end = start + noOfCols;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = start; x < end; x++)
-		{
-			if (stopTrace) break;
-			if(pUI->raytracer->filteredBuf[(y*width + x)] == 255)
-			{
-				// cout<<"Here"<<endl;
-				pUI->raytracer->tracePixelAntiAlias(x, y);
-			}
-			if (stopTrace) break;
-		}
-		if (stopTrace) break;
-	}
-}
-
-void GraphicalUI::doAntiAliasing(GraphicalUI* pUI)
-{
-	clock_t now, prev;
-	now = prev = clock();
-	clock_t intervalMS = pUI->refreshInterval * 100;
-	doneTrace = stopTrace = false;
-	unsigned char* buf;
-
-	char buffer[256];
-	const char *old_label = pUI->m_traceGlWindow->label();
-	sprintf(buffer, "ANTI ALIASING START %s ", old_label);
-	pUI->m_traceGlWindow->label(buffer);
-	pUI->m_traceGlWindow->refresh();
-
-
-	int width, height;
-
-	pUI->raytracer->getBuffer(buf, width, height);
-	pUI->raytracer->filteredBuf = new unsigned char[width * height];
-	applyFilter(buf, width, height, pUI->raytracer->filteredBuf, pUI->m_nSupersampleThreshold);
-
-	std::vector<std::thread> aaThreads;
-	int noOfCols = ceil((double)width/(double)pUI->m_nThreads);
-	for (int i = 1; i < pUI->m_nThreads; i++)
-	{
-		aaThreads.push_back(std::thread(antiAliasRenderThread, i, width, height, noOfCols, pUI->getRayTracer()));
-	}
-	// Do edge detection on filteredBuf
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < noOfCols; x++)
-		{
-			if (stopTrace) break;
-			if(pUI->raytracer->filteredBuf[(y*width + x)] == 255)
-			{
-				pUI->raytracer->tracePixelAntiAlias(x, y);
-				now = clock();
-				if ((now - prev)/CLOCKS_PER_SEC * 1000 >= intervalMS)
-			  	{
-				    prev = now;
-				    pUI->m_traceGlWindow->refresh();
-				    Fl::check();
-				    if (Fl::damage()) { Fl::flush(); }
-			  	}
-			}
-
-		}
-		if (stopTrace) break;
-	}
-	for (int i = 0; i < pUI->m_nThreads - 1; i++)
-	{
-		aaThreads[i].join();
-	}
-	doneTrace = true;
-	stopTrace = false;
-	sprintf(buffer, "ANTI ALIASING DONE %s ", old_label);
-	pUI->m_traceGlWindow->label(buffer);
-	pUI->m_traceGlWindow->refresh();
-}
-
-void GraphicalUI::applyFilter( const unsigned char* sourceBuffer,
-		int srcBufferWidth, int srcBufferHeight,
-		unsigned char* destBuffer, int cutOff)
-{
-	unsigned char*	grayImage;
-	grayImage = new unsigned char[srcBufferWidth*srcBufferHeight];
-	for (int imageRow = 0; imageRow < srcBufferHeight; imageRow++)
-	{
-		for (int imageCol = 0; imageCol < srcBufferWidth; imageCol++)
-		{
-			double gray = 0.299*sourceBuffer[3 * (imageRow*srcBufferWidth + imageCol) + 0] + 0.587*sourceBuffer[3 * (imageRow*srcBufferWidth + imageCol) + 1] + 0.114*sourceBuffer[3 * (imageRow*srcBufferWidth + imageCol) + 2];
-			grayImage[imageRow*srcBufferWidth + imageCol] = gray;
-		}
-	}
-
-	int knlWidth, knlHeight;
-	knlWidth = knlHeight = 3;
-	int offset = 128;
-	int filterKernel[9] = { 0, 1, 0, 1, -4, 1, 0, 1, 0 };
-	for (int pixelRow = 0; pixelRow < srcBufferHeight; pixelRow++)
-	{
-		for (int pixelColumn = 0; pixelColumn < srcBufferWidth; pixelColumn++)
-		{
-			double sum = 0;
-			for (int filterRow = 0; filterRow < knlWidth; filterRow++)
-			{
-				for (int filterColumn = 0; filterColumn < knlHeight; filterColumn++)
-				{
-					int tempPixelRow = pixelRow - knlHeight/2 + filterRow;
-					int tempPixelColumn = pixelColumn - knlWidth/2 + filterColumn;
-					if (tempPixelRow < 0 || tempPixelColumn < 0 || tempPixelRow>srcBufferHeight || tempPixelColumn>srcBufferWidth)
-					{
-						continue;
-					}
-					sum = sum + filterKernel[knlWidth * filterRow + filterColumn] * grayImage[(tempPixelRow*srcBufferWidth + tempPixelColumn)];
-				}
-			}
-			// sum = sum / 1 + offset;
-			if (sum > cutOff)
-			{
-				sum = 255;
-			}
-			else
-			{
-				sum = 0;
-			}
-			destBuffer[(pixelRow*srcBufferWidth + pixelColumn)] = sum;
-		}
-	}
-}
-
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
 {
 	pUI = (GraphicalUI*)(o->user_data());
@@ -497,14 +501,45 @@ int GraphicalUI::run()
 
 	m_mainWindow->show();
 
-	return Fl::run();
+	int result = Fl::run();
+
+	// A load still going when the windows closed is let finish, since its
+	// threads use the tracer, and then thrown away.
+	if (m_loadThread.joinable()) {
+		m_loadThread.join();
+		delete m_loadedScene;
+		m_loadedScene = 0;
+	}
+	if (m_kdThread.joinable()) {
+		m_kdThread.join();
+		delete m_kdBuilt;
+		m_kdBuilt = 0;
+	}
+	return result;
 }
 
 void GraphicalUI::alert( const string& msg )
 {
+	// Dialogs can only be opened from the FLTK thread.
+	if (std::this_thread::get_id() != m_uiThread) {
+		std::lock_guard<std::mutex> guard(m_alertLock);
+		m_queuedAlerts.push_back(msg);
+		return;
+	}
 	fl_alert( "%s", msg.c_str() );
 }
 
+void GraphicalUI::showQueuedAlerts()
+{
+	std::vector<std::string> queued;
+	{
+		std::lock_guard<std::mutex> guard(m_alertLock);
+		queued.swap(m_queuedAlerts);
+	}
+	for (size_t i = 0; i < queued.size(); i++)
+		fl_alert( "%s", queued[i].c_str() );
+}
+
 void GraphicalUI::setRayTracer(RayTracer *tracer)
 {
 	// printf("In setRayTracer()\n");
@@ -536,7 +571,9 @@ void GraphicalUI::stopTracing()
 	stopTrace = true;
 }
 
-GraphicalUI::GraphicalUI() : refreshInterval(10) {
+GraphicalUI::GraphicalUI() : refreshInterval(10), m_loadedScene(0), m_loadDone(false),
+	m_loading(false), m_kdBuilt(0), m_kdBuildDone(false), m_kdBuilding(false),
+	m_uiThread(std::this_thread::get_id()) {
 	// init.
 	m_mainWindow = new Fl_Window(100, 40, 450, 459, "Ray <Not Loaded>");
 	m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
@@ -704,6 +741,12 @@ GraphicalUI::GraphicalUI() : refreshInterval(10) {
 	m_leafSizeSlider->align(FL_ALIGN_RIGHT);
 	m_leafSizeSlider->callback(cb_leafSizeSlides);
 
+	// build time and cost of the last kd-tree rebuild
+	m_kdStatusBox = new Fl_Box(110, 330, 330, 20);
+	m_kdStatusBox->labelfont(FL_COURIER);
+	m_kdStatusBox->labelsize(12);
+	m_kdStatusBox->align(FL_ALIGN_LEFT | FL_ALIGN_INSIDE);
+
 	// set up Cube Map checkbox
 	m_cubeMapCheckButton = new Fl_Check_Button(10, 350, 100, 20, "CubeMap");
 	m_cubeMapCheckButton->user_data((void*)(this));
@@ -13,12 +13,22 @@
 #include <FL/Fl_Value_Slider.H>
 #include <FL/Fl_Check_Button.H>
 #include <FL/Fl_Button.H>
+#include <FL/Fl_Box.H>
 #include <FL/Fl_File_Chooser.H>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "TraceUI.h"
 #include "TraceGLWindow.h"
 #include "debuggingWindow.h"
 #include "CubeMapChooser.h"
+#include "../scene/sceneLoader.h"
 
 class ModelerView;
 
@@ -58,6 +68,8 @@ public:
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
 
+	Fl_Box*				m_kdStatusBox;
+
 	CubeMapChooser*     m_cubeMapChooser;
 
 	TraceGLWindow*		m_traceGlWindow;
@@ -78,6 +90,48 @@ private:
 
 	clock_t refreshInterval;
 
+	// A scene loads on a thread of its own while the current one can
+	// still be looked at and rendered; pollLoad() shows how it is going
+	// and swaps it in once no render is using the old scene.
+	void startLoad(const char* file);
+	void pollLoad();
+	static void cb_pollLoad(void* v);
+
+	// Alerts raised off the FLTK thread wait here to be shown.
+	void showQueuedAlerts();
+
+	std::thread			m_loadThread;
+	std::string			m_loadFile;
+	std::string			m_sceneFile;
+	std::string			m_sceneLabel;
+	std::unique_ptr<LoadProgress> m_loadProgress;
+	std::chrono::steady_clock::time_point m_loadStart;
+	Scene*				m_loadedScene;
+	std::atomic<bool>	m_loadDone;
+	bool				m_loading;
+
+	int					m_loadKdDepth;
+	int					m_loadKdLeafSize;
+	bool				m_loadKdTree;
+
+	// New kd-tree parameters get new trees, built on a thread of their own
+	// while renders keep walking the old ones; pollKdRebuild() swaps them
+	// in between renders.
+	bool kdTreesStale();
+	void scheduleKdRebuild();
+	static void cb_startKdRebuild(void* v);
+	void pollKdRebuild();
+	static void cb_pollKdRebuild(void* v);
+
+	std::thread			m_kdThread;
+	KdTreeSet*			m_kdBuilt;
+	std::atomic<bool>	m_kdBuildDone;
+	bool				m_kdBuilding;
+
+	std::thread::id		m_uiThread;
+	std::mutex			m_alertLock;
+	std::vector<std::string> m_queuedAlerts;
+
 	// static class members
 	static Fl_Menu_Item menuitems[];
 
@@ -100,7 +154,7 @@ private:
 	static void cb_threadsSlides(Fl_Widget* o, void* v);
 
 	static void cb_render(Fl_Widget* o, void* v);
-	static void renderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer);
+	static void renderThread(RayTracer* rayTracer, int index, int nThreads);
 	static void cb_stop(Fl_Widget* o, void* v);
 	
 	static void cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v);
@@ -118,12 +172,6 @@ private:
 	static void cb_cubeMapCheckButton(Fl_Widget* o, void* v);
 	static void cb_filterWidthSlides(Fl_Widget* o, void* v);
 
-	static void doAntiAliasing(GraphicalUI* pUI);
-	static void antiAliasRenderThread(int threadNo, int width, int height, int noOfCols, RayTracer* rayTracer);
-	static void applyFilter(const unsigned char* sourceBuffer,
-		int srcBufferWidth, int srcBufferHeight,
-		unsigned char* destBuffer, int cutOff);
-
 	static bool stopTrace;
 	static bool doneTrace;
 	static GraphicalUI* pUI;
@@ -0,0 +1,131 @@
+#include "StreamRenderer.h"
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+StreamRenderer::StreamRenderer(RayTracer* tracer, int nThreads)
+	: raytracer(tracer), pool(nThreads), width(0), height(0), tilesX(0), tilesY(0),
+	  window(0), nextRow(0), nextColumn(0), rowsWritten(0)
+{
+}
+
+void StreamRenderer::tileRowSpan(int first, int last, int& y0, int& y1) const
+{
+	const int T = RayTracer::TILE_SIZE;
+	if (writer.topRowFirst())
+	{
+		y0 = (tilesY - last) * T;
+		y1 = min((tilesY - first) * T, height);
+	}
+	else
+	{
+		y0 = first * T;
+		y1 = min(last * T, height);
+	}
+}
+
+// Hands out the tiles of each row in turn, waiting while the row would
+// land on one the writer hasn't finished with.
+bool StreamRenderer::nextTile(int& tile, int& slot)
+{
+	unique_lock<mutex> guard(lock);
+	rowFreed.wait(guard, [this] { return nextRow >= tilesY || nextRow < rowsWritten + window; });
+	if (nextRow >= tilesY) return false;
+
+	int row = writer.topRowFirst() ? tilesY - 1 - nextRow : nextRow;
+	tile = row * tilesX + nextColumn;
+	slot = nextRow % window;
+	if (++nextColumn == tilesX)
+	{
+		nextColumn = 0;
+		nextRow++;
+	}
+	return true;
+}
+
+void StreamRenderer::tileDone(int slot)
+{
+	lock_guard<mutex> guard(lock);
+	if (++tilesDone[slot] == tilesX)
+		rowDone.notify_one();
+}
+
+void StreamRenderer::renderLoop(int index)
+{
+	raytracer->bindRenderThread(index, pool.size());
+	int tile, slot;
+	while (nextTile(tile, slot))
+	{
+		raytracer->traceTile(tile);
+		tileDone(slot);
+	}
+}
+
+// Writes every finished row of tiles that is next in the file at once,
+// then frees their slots.
+void StreamRenderer::writerThread(StreamRenderer* stream)
+{
+	for (;;)
+	{
+		int first, last;
+		{
+			unique_lock<mutex> guard(stream->lock);
+			if (stream->rowsWritten >= stream->tilesY) return;
+			stream->rowDone.wait(guard, [stream] {
+				return stream->tilesDone[stream->rowsWritten % stream->window] == stream->tilesX;
+			});
+			first = last = stream->rowsWritten;
+			while (last < stream->tilesY && last < first + stream->window
+				&& stream->tilesDone[last % stream->window] == stream->tilesX)
+				last++;
+		}
+
+		int y0, y1;
+		stream->tileRowSpan(first, last, y0, y1);
+		stream->raytracer->writeRows(stream->writer, y0, y1, stream->pool.size());
+
+		{
+			lock_guard<mutex> guard(stream->lock);
+			for (int r = first; r < last; r++)
+				stream->tilesDone[r % stream->window] = 0;
+			stream->rowsWritten = last;
+			stream->rowFreed.notify_all();
+		}
+	}
+}
+
+bool StreamRenderer::render(int w, int memoryMB, const string& output, ostream& out)
+{
+	if (!raytracer->sceneLoaded()) return false;
+
+	const int T = RayTracer::TILE_SIZE;
+	width = w;
+	height = (int)(width / raytracer->aspectRatio() + 0.5);
+	tilesX = (width + T - 1) / T;
+	tilesY = (height + T - 1) / T;
+	if (!writer.open(output.c_str(), width, height, pool.size())) return false;
+
+	// A resident pixel is its framebuffer entry plus its quantized bytes.
+	size_t rowBytes = (size_t)width * T * (Framebuffer::BYTES_PER_PIXEL + 3);
+	size_t budget = (size_t)memoryMB << 20;
+	window = (int)max<size_t>(2, budget / max<size_t>(1, rowBytes));
+	window = max(1, min(window, tilesY));
+	raytracer->traceSetup(width, height, window * T);
+
+	nextRow = nextColumn = rowsWritten = 0;
+	tilesDone.assign(window, 0);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	thread writing(writerThread, this);
+	pool.runOnAll([this](int index) { renderLoop(index); });
+	writing.join();
+	bool ok = writer.close();
+
+	double t = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	out << width << "x" << height << " in rows of " << window * T << ", "
+		<< window * rowBytes / 1048576.0 << " MB resident, total time = " << t << endl;
+	return ok;
+}
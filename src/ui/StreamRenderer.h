@@ -0,0 +1,60 @@
+//
+// StreamRenderer.h
+//
+// Renders images too big to keep in memory, such as posters, straight
+// into their file.  Tiles are handed out a row of tiles at a time, in the
+// order the file stores its rows, and a separate thread writes each row
+// of tiles out as soon as its last tile is done.  Only a window of tile
+// rows is resident; threads that get a whole window ahead of the writer
+// wait for it, so memory stays bounded however large the image is.
+//
+
+#ifndef __STREAMRENDERER_H__
+#define __STREAMRENDERER_H__
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "../RayTracer.h"
+#include "../fileio/imagefile.h"
+#include "../threading/ThreadPool.h"
+
+class StreamRenderer
+{
+public:
+	StreamRenderer(RayTracer* tracer, int nThreads);
+
+	// Renders the loaded scene width pixels wide into output, in the
+	// format its extension names, keeping about memoryMB of rows
+	// resident (but always at least two rows of tiles).  False if the
+	// image can't be written.
+	bool render(int width, int memoryMB, const std::string& output, std::ostream& out);
+
+private:
+	bool nextTile(int& tile, int& slot);
+	void tileDone(int slot);
+	void renderLoop(int index);
+	static void writerThread(StreamRenderer* stream);
+
+	// Image rows of tile rows first..last-1, counted in file order.
+	void tileRowSpan(int first, int last, int& y0, int& y1) const;
+
+	RayTracer* raytracer;
+	ThreadPool pool;
+	ImageWriter writer;
+	int width, height;
+	int tilesX, tilesY;
+	int window;						// resident rows of tiles
+
+	std::mutex lock;
+	std::condition_variable rowFreed;
+	std::condition_variable rowDone;
+	int nextRow, nextColumn;		// the next tile to hand out, in file order
+	int rowsWritten;
+	std::vector<int> tilesDone;		// per resident row, by file row % window
+};
+
+#endif // __STREAMRENDERER_H__
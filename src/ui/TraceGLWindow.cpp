@@ -7,7 +7,6 @@
 #include "../RayTracer.h"
 #include "GraphicalUI.h"
 
-#include "../fileio/bitmap.h"
 
 extern bool debugMode;
 extern TraceUI* traceUI;
@@ -94,6 +93,7 @@ void TraceGLWindow::draw()
 
 void TraceGLWindow::refresh()
 {
+	if (raytracer) raytracer->quantize(traceUI->getThreads());
 	redraw();
 }
 
@@ -114,13 +114,8 @@ void TraceGLWindow::resizeWindow(int width, int height)
 
 void TraceGLWindow::saveImage(char *iname)
 {
-	unsigned char* buf;
-
-	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	// raytracer->setBuffer();
-	// this->refresh();
-	if (buf)
-		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
+	if (!raytracer->writeImage(iname, traceUI->getThreads()))
+		traceUI->alert(std::string("Unable to write image '") + iname + "'");
 }
 
 void TraceGLWindow::setRayTracer(RayTracer *tracer)
@@ -24,7 +24,11 @@ public:
                     m_nThreads(8), m_bfCulling(true), m_antiAlias(false),
                     m_kdTree(true), m_usingCubeMap(false), m_gotCubeMap(false),
                     m_nMaxDepth(15), m_nLeafSize(10), m_nPixelSamples(3),
-                    m_nSupersampleThreshold(180), m_antiAliasWhite(false)
+                    m_nSupersampleThreshold(16), m_antiAliasWhite(false),
+                    m_numaPlacement(false), m_wavefront(false),
+                    m_sortRays(false), m_nMeshPrecision(0),
+                    m_nTextureBudget(256), m_gamma(1.0),
+                    m_dither(false)
                     {}
 	virtual int	run() = 0;
 
@@ -35,6 +39,10 @@ public:
 	virtual void setRayTracer( RayTracer* r ) { raytracer = r; }
 	void setCubeMap(bool b) { m_gotCubeMap = b; }
 	void useCubeMap(bool b) { m_usingCubeMap = b; }
+	void setNumaPlacement(bool b) { m_numaPlacement = b; }
+	void setWavefront(bool b) { m_wavefront = b; }
+	void setSortRays(bool b) { m_sortRays = b; }
+	void setDepth(int d) { m_nDepth = d; }
 
 	// accessors:
 	int	getDepth() const { return m_nDepth; }
@@ -56,6 +64,13 @@ public:
 	bool	displayDebugInfo() const { return m_displayDebuggingInfo; }
 	bool	usingCubeMap() const { return m_usingCubeMap; }
 	bool	gotCubeMap() const { return m_gotCubeMap; }
+	bool	numaPlacement() const { return m_numaPlacement; }
+	bool	wavefront() const { return m_wavefront; }
+	bool	sortRays() const { return m_sortRays; }
+	int	meshPrecision() const { return m_nMeshPrecision; }
+	int	textureBudget() const { return m_nTextureBudget; }
+	double	gamma() const { return m_gamma; }
+	bool	dither() const { return m_dither; }
 
 	static bool m_debug;
 	bool m_kdTree; // Using k-d Trees
@@ -64,7 +79,7 @@ public:
 	bool m_usingCubeMap;  // render with cubemap
 	bool m_gotCubeMap;  // cubemap defined
 	int m_nPixelSamples; // Pixel Samples for anti aliasing
-	int m_nSupersampleThreshold; // Supersample threshold for antialiasing
+	int m_nSupersampleThreshold; // Luminance std. deviation (0-255) that triggers supersampling
 
 protected:
 	RayTracer*	raytracer;
@@ -76,6 +91,13 @@ protected:
 	int m_nThreads; // Number of threads
 	bool m_antiAlias; // Using anti aliasing
 	bool m_antiAliasWhite; // Using anti aliasing
+	bool m_numaPlacement; // Pin render threads and keep their memory node-local
+	bool m_wavefront; // Breadth-first wavefront renderer instead of traceRay
+	bool m_sortRays; // Sort secondary and shadow ray queues for coherence
+	int m_nMeshPrecision; // Trimesh::Precision meshes are stored at after parsing
+	int m_nTextureBudget; // Megabytes of texture tiles kept in memory
+	double m_gamma; // Output levels are linear^(1/gamma)
+	bool m_dither; // Ordered dither when quantizing to 8 bits
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
@@ -355,18 +355,18 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glNewList( displayList, GL_COMPILE );
 
 		glBegin( GL_TRIANGLES );
-		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
+		for( int f = 0; f < numFaces(); ++f )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = faceIds[3*f];
+			const int vert2 = faceIds[3*f+1];
+			const int vert3 = faceIds[3*f+2];
 
-			if( normals.empty() )
-			{
-				const Vec3d& a = vertices[vert1];
-				const Vec3d& b = vertices[vert2];
-				const Vec3d& c = vertices[vert3];
+			const Vec3d a = vertex(vert1);
+			const Vec3d b = vertex(vert2);
+			const Vec3d c = vertex(vert3);
 
+			if( !hasVertexNormals() )
+			{
 				Vec3d cv=(b - a) ^ (c - a);
 
 				// there exists some bad triangles such that two vertices coincide
@@ -375,23 +375,23 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 					glNormal3dv( cv.getPointer() );
 			}
 
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert1].getPointer() );
+			if( hasVertexNormals() )
+				glNormal3dv( vertexNormal(vert1).getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
-			glVertex3dv( vertices[vert1].getPointer() );
+				setGLMaterial( *materials[vert1], this );
+			glVertex3dv( a.getPointer() );
 
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert2].getPointer() );
+			if( hasVertexNormals() )
+				glNormal3dv( vertexNormal(vert2).getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
-			glVertex3dv( vertices[vert2].getPointer() );
+				setGLMaterial( *materials[vert2], this );
+			glVertex3dv( b.getPointer() );
 
-			if( ! normals.empty() )
-				glNormal3dv( normals[vert3].getPointer() );
+			if( hasVertexNormals() )
+				glNormal3dv( vertexNormal(vert3).getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
-			glVertex3dv( vertices[vert3].getPointer() );
+				setGLMaterial( *materials[vert3], this );
+			glVertex3dv( c.getPointer() );
 		}
 		glEnd();
 